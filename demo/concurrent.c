@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Stress test for concurrent image productions.
+
+   Usage:  demo/concurrent [threads [images_per_thread [directory]]]
+
+   Produces an image of the directory serially and then lets the given
+   number of threads produce images_per_thread images each, all at the
+   same time. Every image has to be byte for byte equal to the serial one.
+   This gets done with and without hardlink recognition and with and
+   without zisofs filters.
+   If no directory is given, then a small tree with hardlinks gets created
+   in $TMPDIR or /tmp and removed afterwards.
+
+   Exit value is 0 if all images match, 1 if some differ, 2 on failure.
+
+   Data races do not necessarily spoil the images of a particular run.
+   "make check-tsan" builds this program with ThreadSanitizer and fails
+   if any race gets reported.
+*/
+
+#define LIBISOFS_WITHOUT_LIBBURN yes
+#include "libisofs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define Concurrent_fixed_timE 1000000000
+#define Concurrent_max_pathS  64
+#define Concurrent_dir_sizE   1024
+
+
+struct concurrent_job {
+    char *src;
+    int hardlinks;
+    int filters;
+    int images;
+
+    /* The images of the job, each of size len */
+    char **out;
+    size_t *len;
+    int ret;
+};
+
+
+/* Set the timestamps which are not controlled by the write options and
+   add zisofs filters if desired.
+*/
+static
+int concurrent_prepare_dir(IsoDir *dir, int filters)
+{
+    int ret;
+    IsoDirIter *iter = NULL;
+    IsoNode *node;
+
+    iso_node_set_mtime((IsoNode *) dir, Concurrent_fixed_timE);
+    iso_node_set_atime((IsoNode *) dir, Concurrent_fixed_timE);
+    iso_node_set_ctime((IsoNode *) dir, Concurrent_fixed_timE);
+    ret = iso_dir_get_children(dir, &iter);
+    if (ret < 0)
+        return ret;
+    while (iso_dir_iter_next(iter, &node) == 1) {
+        iso_node_set_atime(node, Concurrent_fixed_timE);
+        iso_node_set_ctime(node, Concurrent_fixed_timE);
+        if (iso_node_get_type(node) == LIBISO_DIR) {
+            ret = concurrent_prepare_dir((IsoDir *) node, filters);
+            if (ret < 0)
+                goto ex;
+        } else if (filters && iso_node_get_type(node) == LIBISO_FILE) {
+            ret = iso_file_add_zisofs_filter((IsoFile *) node, 0);
+            if (ret < 0)
+                goto ex;
+        }
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    iso_dir_iter_free(iter);
+    return ret;
+}
+
+
+/* Produce one image in memory */
+static
+int concurrent_produce(struct concurrent_job *job, char **out, size_t *len)
+{
+    int ret;
+    IsoImage *image = NULL;
+    IsoWriteOpts *opts = NULL;
+    struct burn_source *burn_src = NULL;
+    uint8_t guid[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    unsigned char buf[2048];
+    size_t buf_size = 1024 * 1024;
+    char *new_out;
+
+    *out = NULL;
+    *len = 0;
+    ret = iso_image_new("CONCURRENT", &image);
+    if (ret < 0)
+        goto ex;
+    iso_tree_set_follow_symlinks(image, 0);
+    iso_tree_set_ignore_hidden(image, 0);
+    ret = iso_tree_add_dir_rec(image, iso_image_get_root(image), job->src);
+    if (ret < 0)
+        goto ex;
+    ret = concurrent_prepare_dir(iso_image_get_root(image), job->filters);
+    if (ret < 0)
+        goto ex;
+
+    ret = iso_write_opts_new(&opts, 0);
+    if (ret < 0)
+        goto ex;
+    iso_write_opts_set_iso_level(opts, 3);
+    iso_write_opts_set_rockridge(opts, 1);
+    iso_write_opts_set_joliet(opts, 1);
+    iso_write_opts_set_iso1999(opts, 1);
+    iso_write_opts_set_hfsplus(opts, 1);
+    iso_write_opts_set_aaip(opts, 1);
+    iso_write_opts_set_hardlinks(opts, job->hardlinks);
+    iso_write_opts_set_record_md5(opts, 1, 1);
+    iso_write_opts_set_replace_timestamps(opts, 1);
+    iso_write_opts_set_default_timestamp(opts, Concurrent_fixed_timE);
+    iso_write_opts_set_always_gmt(opts, 1);
+    iso_write_opts_set_pvd_times(opts, Concurrent_fixed_timE,
+                                 Concurrent_fixed_timE, 0, 0,
+                                 "2001090901464000");
+    iso_write_opts_set_gpt_guid(opts, guid, 1);
+
+    ret = iso_image_create_burn_source(image, opts, &burn_src);
+    if (ret < 0)
+        goto ex;
+    *out = malloc(buf_size);
+    if (*out == NULL) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    while (burn_src->read_xt(burn_src, buf, 2048) == 2048) {
+        if (*len + 2048 > buf_size) {
+            new_out = realloc(*out, buf_size * 2);
+            if (new_out == NULL) {
+                ret = ISO_OUT_OF_MEM; goto ex;
+            }
+            *out = new_out;
+            buf_size *= 2;
+        }
+        memcpy(*out + *len, buf, 2048);
+        *len += 2048;
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (burn_src != NULL) {
+        burn_src->free_data(burn_src);
+        free(burn_src);
+    }
+    if (opts != NULL)
+        iso_write_opts_free(opts);
+    if (image != NULL)
+        iso_image_unref(image);
+    if (ret < 0 && *out != NULL) {
+        free(*out);
+        *out = NULL;
+    }
+    return ret;
+}
+
+
+static
+void *concurrent_thread(void *arg)
+{
+    struct concurrent_job *job = arg;
+    int i, ret;
+
+    job->ret = ISO_SUCCESS;
+    for (i = 0; i < job->images; i++) {
+        ret = concurrent_produce(job, job->out + i, job->len + i);
+        if (ret < 0) {
+            job->ret = ret;
+    break;
+        }
+    }
+    return NULL;
+}
+
+
+/* Run one variant. Return 1 if all images match, 0 if not, <0 on error */
+static
+int concurrent_variant(char *src, int threads, int images,
+                       int hardlinks, int filters)
+{
+    int ret, i, k, differ = 0, started = 0;
+    struct concurrent_job ref, *jobs = NULL;
+    pthread_t *thread_ids = NULL;
+    char *ref_out = NULL;
+    size_t ref_len = 0;
+
+    memset(&ref, 0, sizeof(ref));
+    ref.src = src;
+    ref.hardlinks = hardlinks;
+    ref.filters = filters;
+    ret = concurrent_produce(&ref, &ref_out, &ref_len);
+    if (ret < 0) {
+        fprintf(stderr, "Serial production failed: 0x%x\n",
+                (unsigned int) ret);
+        goto ex;
+    }
+
+    jobs = calloc(threads, sizeof(struct concurrent_job));
+    thread_ids = calloc(threads, sizeof(pthread_t));
+    if (jobs == NULL || thread_ids == NULL) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    for (i = 0; i < threads; i++) {
+        jobs[i].src = src;
+        jobs[i].hardlinks = hardlinks;
+        jobs[i].filters = filters;
+        jobs[i].images = images;
+        jobs[i].out = calloc(images, sizeof(char *));
+        jobs[i].len = calloc(images, sizeof(size_t));
+        if (jobs[i].out == NULL || jobs[i].len == NULL) {
+            ret = ISO_OUT_OF_MEM; goto ex;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(thread_ids + i, NULL, concurrent_thread,
+                           jobs + i) != 0) {
+            fprintf(stderr, "Cannot start thread\n");
+            ret = ISO_THREAD_ERROR; goto ex;
+        }
+        started++;
+    }
+    ret = 1;
+
+ex:;
+    for (i = 0; i < started; i++)
+        pthread_join(thread_ids[i], NULL);
+    if (jobs != NULL) {
+        for (i = 0; i < threads; i++) {
+            if (ret >= 0 && jobs[i].ret < 0) {
+                fprintf(stderr, "Concurrent production failed: 0x%x\n",
+                        (unsigned int) jobs[i].ret);
+                ret = jobs[i].ret;
+            }
+            for (k = 0; k < images && jobs[i].out != NULL; k++) {
+                if (ret >= 0 && jobs[i].out[k] != NULL &&
+                    (jobs[i].len[k] != ref_len ||
+                     memcmp(jobs[i].out[k], ref_out, ref_len) != 0)) {
+                    fprintf(stderr,
+                        "Thread %d image %d differs from serial image\n",
+                        i, k);
+                    differ++;
+                }
+                if (jobs[i].out[k] != NULL)
+                    free(jobs[i].out[k]);
+            }
+            if (jobs[i].out != NULL)
+                free(jobs[i].out);
+            if (jobs[i].len != NULL)
+                free(jobs[i].len);
+        }
+        free(jobs);
+    }
+    if (thread_ids != NULL)
+        free(thread_ids);
+    if (ref_out != NULL)
+        free(ref_out);
+    if (ret < 0)
+        return ret;
+    printf("hardlinks=%d filters=%d : %d images of %lu bytes, %d differ\n",
+           hardlinks, filters, threads * images, (unsigned long) ref_len,
+           differ);
+    return (differ == 0);
+}
+
+
+/* Create a small tree with hardlinks, a symbolic link and files of
+   various sizes. Record the paths for removal in reverse order.
+*/
+static
+int concurrent_make_tree(char *dir, char paths[][PATH_MAX], int *npaths)
+{
+    int i, j, fd;
+    char *tmp, buf[PATH_MAX];
+    ssize_t w;
+    size_t size, done;
+
+    *npaths = 0;
+    tmp = getenv("TMPDIR");
+    if (tmp == NULL || tmp[0] == 0)
+        tmp = "/tmp";
+    snprintf(dir, Concurrent_dir_sizE, "%s/libisofs_concurrent_XXXXXX", tmp);
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        snprintf(paths[*npaths], PATH_MAX, "%s/dir_%d", dir, i);
+        if (mkdir(paths[*npaths], 0755) == -1)
+            goto failed;
+        (*npaths)++;
+        for (j = 0; j < 4; j++) {
+            snprintf(paths[*npaths], PATH_MAX, "%s/dir_%d/file_%d",
+                     dir, i, j);
+            fd = open(paths[*npaths], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1)
+                goto failed;
+            (*npaths)++;
+            size = (size_t) (i * 4 + j) * 9000 + j * 7;
+            for (done = 0; done < size; done += w) {
+                memset(buf, 'a' + (i + j + done / 4096) % 26, sizeof(buf));
+                sprintf(buf, "%d %d %lu", i, j, (unsigned long) done);
+                w = write(fd, buf, size - done < sizeof(buf) ?
+                                   size - done : sizeof(buf));
+                if (w <= 0) {
+                    close(fd);
+                    goto failed;
+                }
+            }
+            close(fd);
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        snprintf(paths[*npaths], PATH_MAX, "%s/dir_%d/link_to_file_%d",
+                 dir, (i + 1) % 3, i);
+        snprintf(buf, sizeof(buf), "%s/dir_%d/file_%d", dir, i, i);
+        if (link(buf, paths[*npaths]) == -1)
+            goto failed;
+        (*npaths)++;
+    }
+    snprintf(paths[*npaths], PATH_MAX, "%s/symlink", dir);
+    if (symlink("dir_0/file_1", paths[*npaths]) == -1)
+        goto failed;
+    (*npaths)++;
+    return 1;
+failed:;
+    perror(paths[*npaths]);
+    return -1;
+}
+
+
+static
+void concurrent_remove_tree(char *dir, char paths[][PATH_MAX], int npaths)
+{
+    int i;
+
+    for (i = npaths - 1; i >= 0; i--)
+        remove(paths[i]);
+    rmdir(dir);
+}
+
+
+int main(int argc, char **argv)
+{
+    int ret, threads = 8, images = 2, hardlinks, filters, failed = 0;
+    int differ = 0, npaths = 0, made_tree = 0;
+    char *src, dir[Concurrent_dir_sizE];
+    static char paths[Concurrent_max_pathS][PATH_MAX];
+
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        images = atoi(argv[2]);
+    if (threads < 1 || images < 1 || argc > 4) {
+        fprintf(stderr,
+                "usage: %s [threads [images_per_thread [directory]]]\n",
+                argv[0]);
+        exit(2);
+    }
+    ret = iso_init();
+    if (ret < 0) {
+        fprintf(stderr, "Cannot initialize libisofs\n");
+        exit(2);
+    }
+    iso_set_msgs_severities("NEVER", "FAILURE", "");
+
+    if (argc > 3) {
+        src = argv[3];
+    } else {
+        made_tree = 1;
+        ret = concurrent_make_tree(dir, paths, &npaths);
+        if (ret < 0) {
+            failed = 1;
+            goto ex;
+        }
+        src = dir;
+    }
+
+    for (hardlinks = 0; hardlinks <= 1; hardlinks++) {
+        for (filters = 0; filters <= 1; filters++) {
+            ret = concurrent_variant(src, threads, images, hardlinks, filters);
+            if (ret == (int) ISO_ZLIB_NOT_ENABLED) {
+                printf("hardlinks=%d filters=%d : skipped, no zlib\n",
+                       hardlinks, filters);
+    continue;
+            }
+            if (ret < 0)
+                failed = 1;
+            else if (ret == 0)
+                differ = 1;
+        }
+    }
+
+ex:;
+    if (made_tree)
+        concurrent_remove_tree(dir, paths, npaths);
+    iso_finish();
+    if (failed)
+        exit(2);
+    exit(differ);
+}
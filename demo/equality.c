@@ -0,0 +1,1231 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Regression test for the optional speed-ups of libisofs.
+
+   Usage:  demo/equality [directory]
+
+   Produces an image of the directory with default settings and compares it
+   byte for byte with images which get produced with one of the options
+   which shall not change the result. They have to be equal.
+   Images with shared content of equal files are smaller. Their imported
+   trees have to be equal to the one of the default image.
+
+   Then the default image gets imported with various data sources and read
+   options. The listings of the imported trees, including the MD5 of the
+   file content, have to be equal.
+   iso_image_verify_md5() has to confirm the recorded MD5 of the image and
+   has to detect a corrupted file.
+   Finally iso_crc32_update() gets checked with pieces of the image.
+
+   If no directory is given, then a tree with hardlinks, equal files,
+   and a large directory gets created in $TMPDIR or /tmp and removed
+   afterwards. The entries of the large directory get xattr and ACL in the
+   image, which need more Continuation Area blocks than the import keeps
+   in memory by default.
+
+   Exit value is 0 if all checks pass, 1 if some fail, 2 on failure.
+*/
+
+#define LIBISOFS_WITHOUT_LIBBURN yes
+#include "libisofs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define Equality_fixed_timE 1000000000
+#define Equality_max_pathS  512
+#define Equality_dir_sizE   1024
+
+/* Sizes of the xattr values in the large directory */
+#define Equality_comment_sizE 900
+#define Equality_large_sizE   5000
+
+
+/* A variation of the default production */
+struct equality_setup {
+    char *name;
+
+    /* 0= no content filters, 1= zisofs and gzip filters */
+    int filters;
+
+    int data_threads;
+    int tree_threads;
+    int ingest_threads;
+    int zisofs_threads;
+    off_t cache_mem;
+    off_t cache_spill;
+    int compaction;
+    int dedup;
+};
+
+static struct equality_setup equality_setups[] = {
+    {.name = "data_threads=4", .data_threads = 4},
+    {.name = "filters", .filters = 1},
+    {.name = "filters cache in memory", .filters = 1, .cache_mem = 64 << 20},
+    {.name = "filters cache in file", .filters = 1, .cache_spill = 64 << 20},
+    {.name = "filters cache threads=4", .filters = 1, .data_threads = 4,
+     .cache_mem = 64 << 20},
+    {.name = "zisofs threads=4", .filters = 1, .zisofs_threads = 4},
+    {.name = "ingest_threads=4", .ingest_threads = 4},
+    {.name = "tree_threads=4", .tree_threads = 4},
+    {.name = "node compaction", .compaction = 3},
+    {.name = "content dedup", .dedup = 1},
+    {.name = "content dedup compare", .dedup = 3},
+    {.name = NULL}
+};
+
+/* A variation of the default import */
+struct equality_import {
+    char *name;
+
+    /* 0= iso_data_source_new_from_file(), 1= with iso_data_source_new_cached,
+       2= iso_data_source_new_mmap() */
+    int source;
+
+    int lazy;
+    int dir_threads;
+
+    /* 0= default, -1= none, else number of blocks.
+       See iso_read_opts_set_ce_cache(). */
+    int ce_cache;
+};
+
+static struct equality_import equality_imports[] = {
+    {.name = "cached", .source = 1},
+    {.name = "mmap", .source = 2},
+    {.name = "lazy_dirs", .lazy = 1},
+    {.name = "dir_threads=4", .dir_threads = 4},
+    {.name = "cached dir_threads", .source = 1, .dir_threads = 4},
+    {.name = "ce_cache=none", .ce_cache = -1},
+    {.name = "ce_cache=2", .ce_cache = 2},
+    {.name = "lazy_dirs ce_cache=2", .lazy = 1, .ce_cache = 2},
+    {.name = "dir_threads=4 ce_cache=none", .dir_threads = 4,
+     .ce_cache = -1},
+    {.name = "cached dir_threads ce_cache=2", .source = 1, .dir_threads = 4,
+     .ce_cache = 2},
+    {.name = NULL}
+};
+
+
+/* Give the entries of the large directory equal xattr and ACL, so that
+   their Continuation Areas get packed into shared blocks. Each seventh
+   entry gets a different value. Each fiftieth gets a value which spans
+   several blocks.
+*/
+static
+int equality_set_attrs(IsoNode *node)
+{
+    int ret, i, num_attrs = 1;
+    char *names[2], *values[2], comment[Equality_comment_sizE];
+    char large[Equality_large_sizE];
+    size_t value_lengths[2];
+    static char *acl_text =
+        "user::rw-\nuser:1000:r--\ngroup::r--\nmask::r--\nother::r--\n";
+
+    if (sscanf(iso_node_get_name(node), "entry_with_a_long_name_%d", &i) != 1)
+        return ISO_SUCCESS;
+    memset(comment, 'c', sizeof(comment));
+    if (i % 7 == 3)
+        sprintf(comment, "%d", i);
+    names[0] = "user.comment";
+    values[0] = comment;
+    value_lengths[0] = sizeof(comment);
+    if (i % 50 == 10) {
+        memset(large, 'a' + i % 26, sizeof(large));
+        names[1] = "user.large";
+        values[1] = large;
+        value_lengths[1] = sizeof(large);
+        num_attrs = 2;
+    }
+    ret = iso_node_set_attrs(node, num_attrs, names, value_lengths, values,
+                             0);
+    if (ret < 0)
+        return ret;
+    return iso_node_set_acl_text(node, acl_text, NULL, 0);
+}
+
+
+/* Set the timestamps which are not controlled by the write options, add
+   xattr and ACL, and add alternately zisofs and gzip filters if desired.
+*/
+static
+int equality_prepare_dir(IsoDir *dir, int filters, int *count)
+{
+    int ret;
+    IsoDirIter *iter = NULL;
+    IsoNode *node;
+
+    iso_node_set_mtime((IsoNode *) dir, Equality_fixed_timE);
+    iso_node_set_atime((IsoNode *) dir, Equality_fixed_timE);
+    iso_node_set_ctime((IsoNode *) dir, Equality_fixed_timE);
+    ret = iso_dir_get_children(dir, &iter);
+    if (ret < 0)
+        return ret;
+    while (iso_dir_iter_next(iter, &node) == 1) {
+        iso_node_set_atime(node, Equality_fixed_timE);
+        iso_node_set_ctime(node, Equality_fixed_timE);
+        ret = equality_set_attrs(node);
+        if (ret < 0)
+            goto ex;
+        if (iso_node_get_type(node) == LIBISO_DIR) {
+            ret = equality_prepare_dir((IsoDir *) node, filters, count);
+            if (ret < 0)
+                goto ex;
+        } else if (filters && iso_node_get_type(node) == LIBISO_FILE) {
+            if ((*count)++ % 2)
+                ret = iso_file_add_gzip_filter((IsoFile *) node, 0);
+            else
+                ret = iso_file_add_zisofs_filter((IsoFile *) node, 0);
+            if (ret < 0)
+                goto ex;
+        }
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    iso_dir_iter_free(iter);
+    return ret;
+}
+
+
+static
+int equality_set_zisofs_threads(int threads)
+{
+    int ret;
+    struct iso_zisofs_ctrl params;
+
+    memset(&params, 0, sizeof(params));
+    params.version = 2;
+    ret = iso_zisofs_get_params(&params, 0);
+    if (ret < 0)
+        return ret;
+    params.version = 2;
+    params.compression_threads = threads;
+    return iso_zisofs_set_params(&params, 0);
+}
+
+
+/* Produce one image in memory */
+static
+int equality_produce(char *src, struct equality_setup *setup,
+                     char **out, size_t *len)
+{
+    int ret, count = 0;
+    IsoImage *image = NULL;
+    IsoWriteOpts *opts = NULL;
+    struct burn_source *burn_src = NULL;
+    uint8_t guid[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    unsigned char buf[2048];
+    size_t buf_size = 1024 * 1024;
+    char *new_out;
+
+    *out = NULL;
+    *len = 0;
+    if (setup->zisofs_threads > 0) {
+        ret = equality_set_zisofs_threads(setup->zisofs_threads);
+        if (ret < 0)
+            goto ex;
+    }
+    ret = iso_set_filter_cache(setup->cache_mem, setup->cache_spill, 0);
+    if (ret < 0)
+        goto ex;
+
+    ret = iso_image_new("EQUALITY", &image);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_set_node_compaction(image, setup->compaction);
+    if (ret < 0)
+        goto ex;
+    ret = iso_tree_set_ingest_threads(image, setup->ingest_threads);
+    if (ret < 0)
+        goto ex;
+    iso_tree_set_follow_symlinks(image, 0);
+    iso_tree_set_ignore_hidden(image, 0);
+    ret = iso_tree_add_dir_rec(image, iso_image_get_root(image), src);
+    if (ret < 0)
+        goto ex;
+    ret = equality_prepare_dir(iso_image_get_root(image), setup->filters,
+                               &count);
+    if (ret < 0)
+        goto ex;
+
+    ret = iso_write_opts_new(&opts, 0);
+    if (ret < 0)
+        goto ex;
+    iso_write_opts_set_iso_level(opts, 3);
+    iso_write_opts_set_rockridge(opts, 1);
+    iso_write_opts_set_joliet(opts, 1);
+    iso_write_opts_set_iso1999(opts, 1);
+    iso_write_opts_set_hfsplus(opts, 1);
+    iso_write_opts_set_aaip(opts, 1);
+    iso_write_opts_set_hardlinks(opts, 1);
+    iso_write_opts_set_record_md5(opts, 1, 1);
+    iso_write_opts_set_replace_timestamps(opts, 1);
+    iso_write_opts_set_default_timestamp(opts, Equality_fixed_timE);
+    iso_write_opts_set_always_gmt(opts, 1);
+    iso_write_opts_set_pvd_times(opts, Equality_fixed_timE,
+                                 Equality_fixed_timE, 0, 0,
+                                 "2001090901464000");
+    iso_write_opts_set_gpt_guid(opts, guid, 1);
+    ret = iso_write_opts_set_data_threads(opts, setup->data_threads);
+    if (ret < 0)
+        goto ex;
+    ret = iso_write_opts_set_tree_threads(opts, setup->tree_threads);
+    if (ret < 0)
+        goto ex;
+    ret = iso_write_opts_set_content_dedup(opts, setup->dedup);
+    if (ret < 0)
+        goto ex;
+
+    ret = iso_image_create_burn_source(image, opts, &burn_src);
+    if (ret < 0)
+        goto ex;
+    *out = malloc(buf_size);
+    if (*out == NULL) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    while (burn_src->read_xt(burn_src, buf, 2048) == 2048) {
+        if (*len + 2048 > buf_size) {
+            new_out = realloc(*out, buf_size * 2);
+            if (new_out == NULL) {
+                ret = ISO_OUT_OF_MEM; goto ex;
+            }
+            *out = new_out;
+            buf_size *= 2;
+        }
+        memcpy(*out + *len, buf, 2048);
+        *len += 2048;
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (burn_src != NULL) {
+        burn_src->free_data(burn_src);
+        free(burn_src);
+    }
+    if (opts != NULL)
+        iso_write_opts_free(opts);
+    if (image != NULL)
+        iso_image_unref(image);
+    iso_set_filter_cache((off_t) 0, (off_t) 0, 0);
+    if (setup->zisofs_threads > 0)
+        equality_set_zisofs_threads(1);
+    if (ret < 0 && *out != NULL) {
+        free(*out);
+        *out = NULL;
+    }
+    return ret;
+}
+
+
+static
+int equality_write_file(char *path, char *data, size_t len)
+{
+    int fd;
+    ssize_t w;
+    size_t done;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    for (done = 0; done < len; done += w) {
+        w = write(fd, data + done, len - done);
+        if (w <= 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 1;
+}
+
+
+/* A growing text buffer */
+struct equality_text {
+    char *text;
+    size_t len;
+    size_t size;
+};
+
+static
+int equality_text_add(struct equality_text *t, char *line)
+{
+    size_t l;
+    char *new_text;
+
+    l = strlen(line);
+    if (t->len + l + 1 > t->size) {
+        new_text = realloc(t->text, 2 * (t->len + l + 1));
+        if (new_text == NULL)
+            return ISO_OUT_OF_MEM;
+        t->text = new_text;
+        t->size = 2 * (t->len + l + 1);
+    }
+    memcpy(t->text + t->len, line, l + 1);
+    t->len += l;
+    return 1;
+}
+
+
+/* Record the MD5 of the content which the stream delivers */
+static
+int equality_stream_md5(IsoStream *stream, char md5[16])
+{
+    int ret;
+    void *ctx = NULL;
+    char buf[2048];
+
+    ret = iso_md5_start(&ctx);
+    if (ret < 0)
+        return ret;
+    ret = iso_stream_open(stream);
+    if (ret < 0)
+        goto ex;
+    while ((ret = iso_stream_read(stream, buf, sizeof(buf))) > 0)
+        iso_md5_compute(ctx, buf, ret);
+    iso_stream_close(stream);
+ex:;
+    iso_md5_end(&ctx, md5);
+    return ret;
+}
+
+
+/* Append the names, sizes and CRC-32 of the xattr and ACL of node.
+   The attributes of namespace "isofs." depend on the layout of the image.
+*/
+static
+int equality_list_attrs(IsoNode *node, char *line, size_t size)
+{
+    int ret;
+    size_t num_attrs, *value_lengths, i, l;
+    char **names, **values;
+
+    ret = iso_node_get_attrs(node, &num_attrs, &names, &value_lengths,
+                             &values, 1);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < num_attrs; i++) {
+        if (strncmp(names[i], "isofs.", 6) == 0)
+    continue;
+        l = strlen(line);
+        snprintf(line + l, size - l, " %s=%lu/%8.8x", names[i],
+                 (unsigned long) value_lengths[i],
+                 (unsigned int) iso_crc32_update(0,
+                                          (unsigned char *) values[i],
+                                          (int) value_lengths[i], 0));
+    }
+    iso_node_get_attrs(node, &num_attrs, &names, &value_lengths, &values,
+                       1 << 15);
+    return ISO_SUCCESS;
+}
+
+
+/* Describe each node of the tree by a line of text */
+static
+int equality_list_dir(IsoDir *dir, char *path, struct equality_text *t)
+{
+    int ret, i;
+    IsoDirIter *iter = NULL;
+    IsoNode *node;
+    char *sub = NULL, line[PATH_MAX + 256], md5[16];
+
+    sub = malloc(PATH_MAX);
+    if (sub == NULL)
+        return ISO_OUT_OF_MEM;
+    ret = iso_dir_get_children(dir, &iter);
+    if (ret < 0)
+        goto ex;
+    while (iso_dir_iter_next(iter, &node) == 1) {
+        snprintf(sub, PATH_MAX, "%s/%s", path, iso_node_get_name(node));
+        snprintf(line, sizeof(line), "%s %o %d %d %lu",
+                 sub, (unsigned int) iso_node_get_mode(node),
+                 (int) iso_node_get_uid(node), (int) iso_node_get_gid(node),
+                 (unsigned long) iso_node_get_mtime(node));
+        ret = equality_text_add(t, line);
+        if (ret < 0)
+            goto ex;
+        if (iso_node_get_type(node) == LIBISO_FILE) {
+            ret = equality_stream_md5(
+                              iso_file_get_stream((IsoFile *) node), md5);
+            if (ret < 0)
+                goto ex;
+            sprintf(line, " %lu ",
+                    (unsigned long) iso_file_get_size((IsoFile *) node));
+            for (i = 0; i < 16; i++)
+                sprintf(line + strlen(line), "%2.2x",
+                        ((unsigned char *) md5)[i]);
+        } else if (iso_node_get_type(node) == LIBISO_SYMLINK) {
+            snprintf(line, sizeof(line), " -> %s",
+                     iso_symlink_get_dest((IsoSymlink *) node));
+        } else {
+            line[0] = 0;
+        }
+        ret = equality_list_attrs(node, line, sizeof(line) - 1);
+        if (ret < 0)
+            goto ex;
+        strcat(line, "\n");
+        ret = equality_text_add(t, line);
+        if (ret < 0)
+            goto ex;
+        if (iso_node_get_type(node) == LIBISO_DIR) {
+            ret = equality_list_dir((IsoDir *) node, sub, t);
+            if (ret < 0)
+                goto ex;
+        }
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (iter != NULL)
+        iso_dir_iter_free(iter);
+    free(sub);
+    return ret;
+}
+
+
+/* Import the image from the file at path and list its tree */
+static
+int equality_import_list(char *path, struct equality_import *imp,
+                         char **listing)
+{
+    int ret;
+    IsoDataSource *src = NULL, *data_src = NULL;
+    IsoReadOpts *ropts = NULL;
+    IsoReadImageFeatures *features = NULL;
+    IsoImage *image = NULL;
+    struct equality_text t;
+
+    memset(&t, 0, sizeof(t));
+    *listing = NULL;
+    if (imp->source == 2)
+        ret = iso_data_source_new_mmap(path, &data_src, 0);
+    else
+        ret = iso_data_source_new_from_file(path, &data_src);
+    if (ret < 0)
+        goto ex;
+    if (imp->source == 1) {
+        ret = iso_data_source_new_cached(data_src, 0, 0, &src, 0);
+        if (ret < 0)
+            goto ex;
+    } else {
+        src = data_src;
+        iso_data_source_ref(src);
+    }
+    ret = iso_read_opts_new(&ropts, 0);
+    if (ret < 0)
+        goto ex;
+    iso_read_opts_set_no_aaip(ropts, 0);
+    iso_read_opts_set_no_md5(ropts, 2);
+    ret = iso_read_opts_set_lazy_dirs(ropts, imp->lazy);
+    if (ret < 0)
+        goto ex;
+    ret = iso_read_opts_set_dir_threads(ropts, imp->dir_threads);
+    if (ret < 0)
+        goto ex;
+    ret = iso_read_opts_set_ce_cache(ropts, imp->ce_cache);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_new("EQUALITY", &image);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_import(image, src, ropts, &features);
+    if (ret < 0)
+        goto ex;
+    ret = equality_text_add(&t, "");
+    if (ret < 0)
+        goto ex;
+    ret = equality_list_dir(iso_image_get_root(image), "", &t);
+    if (ret < 0)
+        goto ex;
+    *listing = t.text;
+    t.text = NULL;
+    ret = ISO_SUCCESS;
+ex:;
+    if (features != NULL)
+        iso_read_image_features_destroy(features);
+    if (image != NULL)
+        iso_image_unref(image);
+    if (ropts != NULL)
+        iso_read_opts_free(ropts);
+    if (src != NULL)
+        iso_data_source_unref(src);
+    if (data_src != NULL)
+        iso_data_source_unref(data_src);
+    if (t.text != NULL)
+        free(t.text);
+    return ret;
+}
+
+
+/* Compare the listings of the imports of the image file at path with the
+   default import. Return 1 if all match, 0 if not, <0 on error
+*/
+static
+int equality_imports_check(char *path)
+{
+    int ret, i, differ = 0;
+    struct equality_import plain;
+    char *ref_listing = NULL, *listing = NULL;
+
+    memset(&plain, 0, sizeof(plain));
+    plain.name = "default";
+    ret = equality_import_list(path, &plain, &ref_listing);
+    if (ret < 0) {
+        fprintf(stderr, "Import failed: 0x%x\n", (unsigned int) ret);
+        return ret;
+    }
+    for (i = 0; equality_imports[i].name != NULL; i++) {
+        ret = equality_import_list(path, equality_imports + i, &listing);
+        if (ret < 0) {
+            fprintf(stderr, "Import with %s failed: 0x%x\n",
+                    equality_imports[i].name, (unsigned int) ret);
+            goto ex;
+        }
+        if (strcmp(listing, ref_listing) != 0) {
+            printf("import %s : listing differs\n", equality_imports[i].name);
+            differ++;
+        } else {
+            printf("import %s : %lu bytes of listing equal\n",
+                   equality_imports[i].name,
+                   (unsigned long) strlen(listing));
+        }
+        free(listing);
+        listing = NULL;
+    }
+    ret = (differ == 0);
+ex:;
+    if (ref_listing != NULL)
+        free(ref_listing);
+    if (listing != NULL)
+        free(listing);
+    return ret;
+}
+
+
+/* Import the image file at path and compare its listing with ref_path */
+static
+int equality_listing_check(char *path, char *ref_path)
+{
+    int ret;
+    struct equality_import plain;
+    char *ref_listing = NULL, *listing = NULL;
+
+    memset(&plain, 0, sizeof(plain));
+    plain.name = "default";
+    ret = equality_import_list(ref_path, &plain, &ref_listing);
+    if (ret < 0)
+        goto ex;
+    ret = equality_import_list(path, &plain, &listing);
+    if (ret < 0)
+        goto ex;
+    ret = (strcmp(listing, ref_listing) == 0);
+ex:;
+    if (ref_listing != NULL)
+        free(ref_listing);
+    if (listing != NULL)
+        free(listing);
+    return ret;
+}
+
+
+/* Produce all setups and compare them with the default production.
+   Return 1 if all match, 0 if not, <0 on error
+*/
+static
+int equality_setups_check(char *src, char *ref_path, char *tmp_path)
+{
+    int ret, i, filters, differ = 0;
+    struct equality_setup plain;
+    char *ref_out[2] = {NULL, NULL}, *out = NULL;
+    size_t ref_len[2] = {0, 0}, len;
+
+    for (filters = 0; filters <= 1; filters++) {
+        memset(&plain, 0, sizeof(plain));
+        plain.name = "default";
+        plain.filters = filters;
+        ret = equality_produce(src, &plain, ref_out + filters,
+                               ref_len + filters);
+        if (ret == (int) ISO_ZLIB_NOT_ENABLED && filters) {
+            ref_out[1] = NULL;
+    break;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Default production failed: 0x%x\n",
+                    (unsigned int) ret);
+            goto ex;
+        }
+    }
+    ret = equality_write_file(ref_path, ref_out[0], ref_len[0]);
+    if (ret < 0)
+        goto ex;
+
+    for (i = 0; equality_setups[i].name != NULL; i++) {
+        filters = equality_setups[i].filters;
+        if (filters && ref_out[1] == NULL) {
+            printf("write %s : skipped, no zlib\n", equality_setups[i].name);
+    continue;
+        }
+        ret = equality_produce(src, equality_setups + i, &out, &len);
+        if (ret < 0) {
+            fprintf(stderr, "Production with %s failed: 0x%x\n",
+                    equality_setups[i].name, (unsigned int) ret);
+            goto ex;
+        }
+        if (equality_setups[i].dedup) {
+            /* Shared extents make a different image with the same tree */
+            ret = equality_write_file(tmp_path, out, len);
+            if (ret < 0)
+                goto ex;
+            ret = equality_listing_check(tmp_path, ref_path);
+            if (ret < 0)
+                goto ex;
+            if (ret == 0 || len >= ref_len[0]) {
+                printf("write %s : %lu bytes, tree differs or not smaller\n",
+                       equality_setups[i].name, (unsigned long) len);
+                differ++;
+            } else {
+                printf("write %s : %lu bytes, tree equal\n",
+                       equality_setups[i].name, (unsigned long) len);
+            }
+        } else if (len != ref_len[filters] ||
+                   memcmp(out, ref_out[filters], len) != 0) {
+            printf("write %s : image differs from default\n",
+                   equality_setups[i].name);
+            differ++;
+        } else {
+            printf("write %s : %lu bytes equal\n", equality_setups[i].name,
+                   (unsigned long) len);
+        }
+        free(out);
+        out = NULL;
+    }
+    ret = (differ == 0);
+ex:;
+    for (filters = 0; filters <= 1; filters++)
+        if (ref_out[filters] != NULL)
+            free(ref_out[filters]);
+    if (out != NULL)
+        free(out);
+    return ret;
+}
+
+
+struct equality_verify {
+    IsoFile *corrupted;
+    int events[7];
+    int wrong_file;
+};
+
+static
+int equality_verify_report(void *handle, int event, IsoFile *file,
+                           off_t done_bytes, off_t total_bytes)
+{
+    struct equality_verify *v = handle;
+
+    if (event >= 0 && event <= 6)
+        v->events[event]++;
+    if (event >= 2 && event <= 3 && file != v->corrupted)
+        v->wrong_file++;
+    return 1;
+}
+
+
+/* Import the image file at path and verify its MD5 checksums.
+   If corrupt_path is not NULL, then expect mismatch of this file and of
+   the session.
+   Return 1 if the outcome is as expected, 0 if not, <0 on error
+*/
+static
+int equality_verify_md5(char *path, char *corrupt_path, int threads)
+{
+    int ret, expected;
+    IsoDataSource *src = NULL;
+    IsoReadOpts *ropts = NULL;
+    IsoReadImageFeatures *features = NULL;
+    IsoImage *image = NULL;
+    IsoNode *node = NULL;
+    struct equality_verify v;
+
+    memset(&v, 0, sizeof(v));
+    ret = iso_data_source_new_from_file(path, &src);
+    if (ret < 0)
+        goto ex;
+    ret = iso_read_opts_new(&ropts, 0);
+    if (ret < 0)
+        goto ex;
+    iso_read_opts_set_no_aaip(ropts, 0);
+    iso_read_opts_set_no_md5(ropts, 2);
+    ret = iso_image_new("EQUALITY", &image);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_import(image, src, ropts, &features);
+    if (ret < 0)
+        goto ex;
+    if (corrupt_path != NULL) {
+        ret = iso_tree_path_to_node(image, corrupt_path, &node);
+        if (ret <= 0 || iso_node_get_type(node) != LIBISO_FILE) {
+            ret = ISO_NODE_DOESNT_EXIST;
+            goto ex;
+        }
+        v.corrupted = (IsoFile *) node;
+    }
+    ret = iso_image_verify_md5(image, src, threads, equality_verify_report,
+                               &v, 1);
+    if (ret < 0)
+        goto ex;
+    if (corrupt_path == NULL)
+        expected = (ret == 1 && v.events[1] > 0 && v.events[2] == 0 &&
+                    v.events[3] == 0 && v.events[4] == 1);
+    else
+        expected = (ret == 0 && v.events[2] == 1 && v.events[3] == 0 &&
+                    v.wrong_file == 0 && v.events[5] == 1);
+    printf("verify %s threads=%d : %d files match, %d mismatch, session %s\n",
+           corrupt_path == NULL ? "intact" : "corrupted", threads,
+           v.events[1], v.events[2],
+           v.events[4] ? "matches" : v.events[5] ? "mismatch" : "unread");
+    ret = expected;
+ex:;
+    if (features != NULL)
+        iso_read_image_features_destroy(features);
+    if (image != NULL)
+        iso_image_unref(image);
+    if (ropts != NULL)
+        iso_read_opts_free(ropts);
+    if (src != NULL)
+        iso_data_source_unref(src);
+    return ret;
+}
+
+
+/* Copy the image file at path to corrupt_file with one byte of the data file
+   at corrupt_path altered
+*/
+static
+int equality_corrupt(char *path, char *corrupt_path, char *corrupt_file)
+{
+    int ret, fd = -1, num_sections = 0;
+    IsoDataSource *src = NULL;
+    IsoReadOpts *ropts = NULL;
+    IsoReadImageFeatures *features = NULL;
+    IsoImage *image = NULL;
+    IsoNode *node;
+    struct iso_file_section *sections = NULL;
+    struct stat stbuf;
+    char *data = NULL;
+    off_t pos;
+
+    ret = iso_data_source_new_from_file(path, &src);
+    if (ret < 0)
+        goto ex;
+    ret = iso_read_opts_new(&ropts, 0);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_new("EQUALITY", &image);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_import(image, src, ropts, &features);
+    if (ret < 0)
+        goto ex;
+    ret = iso_tree_path_to_node(image, corrupt_path, &node);
+    if (ret <= 0 || iso_node_get_type(node) != LIBISO_FILE) {
+        ret = ISO_NODE_DOESNT_EXIST;
+        goto ex;
+    }
+    ret = iso_file_get_old_image_sections((IsoFile *) node, &num_sections,
+                                          &sections, 0);
+    if (ret <= 0 || num_sections < 1 || sections[0].size < 2) {
+        ret = ISO_NODE_DOESNT_EXIST;
+        goto ex;
+    }
+    pos = ((off_t) sections[0].block) * 2048 + sections[0].size / 2;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &stbuf) == -1 || pos >= stbuf.st_size) {
+        ret = ISO_FILE_ERROR;
+        goto ex;
+    }
+    data = malloc(stbuf.st_size);
+    if (data == NULL) {
+        ret = ISO_OUT_OF_MEM;
+        goto ex;
+    }
+    if (read(fd, data, stbuf.st_size) != stbuf.st_size) {
+        ret = ISO_FILE_ERROR;
+        goto ex;
+    }
+    data[pos] ^= 0xff;
+    ret = equality_write_file(corrupt_file, data, stbuf.st_size);
+ex:;
+    if (fd != -1)
+        close(fd);
+    if (data != NULL)
+        free(data);
+    if (sections != NULL)
+        free(sections);
+    if (features != NULL)
+        iso_read_image_features_destroy(features);
+    if (image != NULL)
+        iso_image_unref(image);
+    if (ropts != NULL)
+        iso_read_opts_free(ropts);
+    if (src != NULL)
+        iso_data_source_unref(src);
+    return ret;
+}
+
+
+static
+int equality_verify_check(char *ref_path, char *tmp_path)
+{
+    int ret, threads, differ = 0;
+    char *corrupt_path = "/dir_1/file_3";
+
+    for (threads = 0; threads <= 4; threads += 4) {
+        ret = equality_verify_md5(ref_path, NULL, threads);
+        if (ret < 0)
+            return ret;
+        if (ret == 0)
+            differ++;
+    }
+    ret = equality_corrupt(ref_path, corrupt_path, tmp_path);
+    if (ret < 0)
+        return ret;
+    for (threads = 0; threads <= 4; threads += 4) {
+        ret = equality_verify_md5(tmp_path, corrupt_path, threads);
+        if (ret < 0)
+            return ret;
+        if (ret == 0)
+            differ++;
+    }
+    return (differ == 0);
+}
+
+
+/* CRC-32 bit by bit as of the definition */
+static
+uint32_t equality_crc32_bitwise(unsigned char *data, size_t count)
+{
+    uint32_t crc = 0xffffffff;
+    size_t i;
+    int j;
+
+    for (i = 0; i < count; i++) {
+        crc ^= data[i];
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+    }
+    return ~crc;
+}
+
+
+/* Check iso_crc32_update() with the check value of the CRC-32 and with
+   pieces of various sizes of the image file at path.
+*/
+static
+int equality_crc32_check(char *path)
+{
+    int fd, step;
+    uint32_t crc, ref_crc;
+    unsigned char *data = NULL;
+    struct stat stbuf;
+    size_t done, todo;
+    static int steps[] = {1, 3, 7, 8, 9, 2048, 4093, 65536, 0};
+
+    crc = iso_crc32_update(0, (unsigned char *) "123456789", 9, 0);
+    if (crc != 0xcbf43926) {
+        printf("crc32 : check value 0x%8.8x instead of 0xcbf43926\n",
+               (unsigned int) crc);
+        return 0;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &stbuf) == -1) {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    data = malloc(stbuf.st_size);
+    if (data == NULL || read(fd, data, stbuf.st_size) != stbuf.st_size) {
+        close(fd);
+        if (data != NULL)
+            free(data);
+        return -1;
+    }
+    close(fd);
+
+    ref_crc = equality_crc32_bitwise(data, stbuf.st_size);
+    for (step = 0; steps[step] > 0; step++) {
+        crc = 0;
+        for (done = 0; done < (size_t) stbuf.st_size; done += todo) {
+            /* Vary the sizes and the alignment of the pieces */
+            todo = steps[step] + done % 5;
+            if (todo > stbuf.st_size - done)
+                todo = stbuf.st_size - done;
+            crc = iso_crc32_update(crc, data + done, (int) todo, 0);
+        }
+        if (crc != ref_crc) {
+            printf("crc32 : pieces of %d bytes give 0x%8.8x, not 0x%8.8x\n",
+                   steps[step], (unsigned int) crc, (unsigned int) ref_crc);
+            free(data);
+            return 0;
+        }
+    }
+    printf("crc32 : %lu bytes in pieces of various sizes match\n",
+           (unsigned long) stbuf.st_size);
+    free(data);
+    return 1;
+}
+
+
+/* Write a file with size bytes. If seed is not 0, then the bytes are
+   pseudo random and thus hardly compressible.
+*/
+static
+int equality_make_file(char *path, size_t size, int fill, uint32_t seed)
+{
+    int fd, i;
+    char buf[4096];
+    ssize_t w;
+    size_t done;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    for (done = 0; done < size; done += w) {
+        if (seed) {
+            for (i = 0; i < (int) sizeof(buf); i++) {
+                seed = seed * 1103515245 + 12345;
+                buf[i] = (char) (seed >> 16);
+            }
+        } else {
+            memset(buf, 'a' + (fill + done / 4096) % 26, sizeof(buf));
+            sprintf(buf, "%d %lu", fill, (unsigned long) done);
+        }
+        w = write(fd, buf, size - done < sizeof(buf) ?
+                           size - done : sizeof(buf));
+        if (w <= 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 1;
+}
+
+
+/* Create a tree with files of various sizes, files of equal content,
+   hardlinks, a symbolic link, and a large directory.
+   Record the paths for removal in reverse order.
+*/
+static
+int equality_make_tree(char *dir, char paths[][PATH_MAX], int *npaths)
+{
+    int i, j;
+    char *tmp, buf[PATH_MAX];
+
+    *npaths = 0;
+    tmp = getenv("TMPDIR");
+    if (tmp == NULL || tmp[0] == 0)
+        tmp = "/tmp";
+    snprintf(dir, Equality_dir_sizE, "%s/libisofs_equality_XXXXXX", tmp);
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        snprintf(paths[*npaths], PATH_MAX, "%s/dir_%d", dir, i);
+        if (mkdir(paths[*npaths], 0755) == -1)
+            goto failed;
+        (*npaths)++;
+        for (j = 0; j < 5; j++) {
+            snprintf(paths[*npaths], PATH_MAX, "%s/dir_%d/file_%d",
+                     dir, i, j);
+            if (equality_make_file(paths[*npaths],
+                                   (size_t) (i * 5 + j) * 21000 + j * 7,
+                                   i * 5 + j, (uint32_t) (j == 4 ? i + 1 : 0))
+                < 0)
+                goto failed;
+            (*npaths)++;
+        }
+    }
+
+    /* Files with equal content but no hardlinks */
+    for (i = 0; i < 3; i++) {
+        snprintf(paths[*npaths], PATH_MAX, "%s/dir_%d/copy_of_file_3",
+                 dir, i);
+        if (equality_make_file(paths[*npaths], (size_t) 3 * 21000 + 3 * 7,
+                               3, (uint32_t) 0) < 0)
+            goto failed;
+        (*npaths)++;
+    }
+
+    /* A directory with many entries */
+    snprintf(paths[*npaths], PATH_MAX, "%s/large_directory", dir);
+    if (mkdir(paths[*npaths], 0755) == -1)
+        goto failed;
+    (*npaths)++;
+    for (i = 0; i < 400; i++) {
+        snprintf(paths[*npaths], PATH_MAX,
+                 "%s/large_directory/entry_with_a_long_name_%3.3d.txt",
+                 dir, i);
+        if (equality_make_file(paths[*npaths], (size_t) (i % 7) * 300, i,
+                               (uint32_t) 0) < 0)
+            goto failed;
+        (*npaths)++;
+    }
+
+    for (i = 0; i < 3; i++) {
+        snprintf(paths[*npaths], PATH_MAX, "%s/dir_%d/link_to_file_%d",
+                 dir, (i + 1) % 3, i);
+        snprintf(buf, sizeof(buf), "%s/dir_%d/file_%d", dir, i, i);
+        if (link(buf, paths[*npaths]) == -1)
+            goto failed;
+        (*npaths)++;
+    }
+    snprintf(paths[*npaths], PATH_MAX, "%s/symlink", dir);
+    if (symlink("dir_0/file_1", paths[*npaths]) == -1)
+        goto failed;
+    (*npaths)++;
+    return 1;
+failed:;
+    perror(paths[*npaths]);
+    return -1;
+}
+
+
+static
+void equality_remove_tree(char *dir, char paths[][PATH_MAX], int npaths)
+{
+    int i;
+
+    for (i = npaths - 1; i >= 0; i--)
+        remove(paths[i]);
+    rmdir(dir);
+}
+
+
+/* Create an empty temporary file for an image */
+static
+int equality_temp_file(char *path)
+{
+    int fd;
+    char *tmp;
+
+    tmp = getenv("TMPDIR");
+    if (tmp == NULL || tmp[0] == 0)
+        tmp = "/tmp";
+    snprintf(path, Equality_dir_sizE, "%s/libisofs_equality_XXXXXX", tmp);
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        path[0] = 0;
+        return -1;
+    }
+    close(fd);
+    return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    int ret, failed = 0, differ = 0, npaths = 0, made_tree = 0;
+    char *src, dir[Equality_dir_sizE];
+    char ref_path[Equality_dir_sizE], tmp_path[Equality_dir_sizE];
+    static char paths[Equality_max_pathS][PATH_MAX];
+
+    ref_path[0] = tmp_path[0] = 0;
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [directory]\n", argv[0]);
+        exit(2);
+    }
+    ret = iso_init();
+    if (ret < 0) {
+        fprintf(stderr, "Cannot initialize libisofs\n");
+        exit(2);
+    }
+    iso_set_msgs_severities("NEVER", "FAILURE", "");
+
+    if (argc > 1) {
+        src = argv[1];
+    } else {
+        made_tree = 1;
+        ret = equality_make_tree(dir, paths, &npaths);
+        if (ret < 0) {
+            failed = 1;
+            goto ex;
+        }
+        src = dir;
+    }
+    if (equality_temp_file(ref_path) < 0) {
+        failed = 1;
+        goto ex;
+    }
+    if (equality_temp_file(tmp_path) < 0) {
+        failed = 1;
+        goto ex;
+    }
+
+    ret = equality_setups_check(src, ref_path, tmp_path);
+    if (ret < 0) {
+        failed = 1;
+        goto ex;
+    }
+    if (ret == 0)
+        differ = 1;
+    ret = equality_imports_check(ref_path);
+    if (ret < 0) {
+        failed = 1;
+        goto ex;
+    }
+    if (ret == 0)
+        differ = 1;
+    ret = equality_verify_check(ref_path, tmp_path);
+    if (ret < 0) {
+        fprintf(stderr, "MD5 verification failed: 0x%x\n",
+                (unsigned int) ret);
+        failed = 1;
+        goto ex;
+    }
+    if (ret == 0)
+        differ = 1;
+    ret = equality_crc32_check(ref_path);
+    if (ret < 0) {
+        failed = 1;
+        goto ex;
+    }
+    if (ret == 0)
+        differ = 1;
+
+ex:;
+    if (made_tree)
+        equality_remove_tree(dir, paths, npaths);
+    if (ref_path[0])
+        unlink(ref_path);
+    if (tmp_path[0])
+        unlink(tmp_path);
+    iso_finish();
+    if (failed)
+        exit(2);
+    exit(differ);
+}
+
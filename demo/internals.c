@@ -0,0 +1,1242 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Tests of internal functions of libisofs against their simple reference
+   implementations.
+
+   Usage:  demo/internals
+
+   - The compiled exclude matcher has to give the same results as the loop
+     over all excludes with fnmatch().
+   - iso_md5_compute_multi() has to give the same MD5 as iso_md5_compute()
+     with each engine the CPU can run and with 1 to 8 contexts in lockstep.
+   - iso_node_compact() has to let nodes with equal names or equal AAIP
+     strings share them, also with clones. A node which gets a new name or
+     new attributes has to get its own string without changing the others.
+   - Several iterators of the same and of other directories, among them
+     find iterators, have to return the expected nodes while nodes get taken
+     or removed through them or from outside.
+   - The block index of iso_tree_get_node_of_block() has to find the same
+     nodes and next blocks as the walk through the tree of an imported image,
+     also after files and directories got added, moved or removed.
+
+   A temporary image file gets created in $TMPDIR or /tmp.
+   The random inputs stem from a fixed seed, so that each run tests the same.
+   Exit value is 0 if all checks pass, 1 if some fail, 2 on failure.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#define LIBISOFS_WITHOUT_LIBBURN yes
+#include "libisofs.h"
+#include "ecma119.h"
+#include "md5.h"
+#include "node.h"
+#include "tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+/* Pseudo random numbers which are the same on every run */
+static uint32_t internals_seed = 1;
+
+static
+uint32_t internals_random(void)
+{
+    internals_seed ^= internals_seed << 13;
+    internals_seed ^= internals_seed >> 17;
+    internals_seed ^= internals_seed << 5;
+    return internals_seed;
+}
+
+
+/* ------------------------------ Excludes -------------------------------- */
+
+#define Internals_path_sizE 4096
+
+/* Components of the paths and literal excludes */
+static char *internals_names[] = {
+    "a", "b", "ab", "a.c", "b.c", ".c", ".a.c", "x.tar.gz", "tar.gz", ".gz",
+    "a.b.c", "c", "*", "[a]", "a?b", "a\\b", "..", "a.", NULL
+};
+
+/* Wildcard excludes. Each gets tried relative and with a leading '/'. */
+static char *internals_globs[] = {
+    "*.c", "*.gz", "*.tar.gz", "*b.c", "*.b.c", "*..c", "*.", "*c",
+    "a*", "?.c", "?", "*", ".*", "[ab]", "[ab].c", "[!a]*", "[.]c",
+    "a\\.c", "\\*", "\\[a]", "a\\?b", "*/*.c", "a/*", "*/b/*", "[ab]/*.c",
+    "a/[!b]*", "*/*/*", "x.tar.*", "*.tar.g?", NULL
+};
+
+static
+int internals_count(char **list)
+{
+    int n;
+
+    for (n = 0; list[n] != NULL; n++);
+    return n;
+}
+
+/* A path of depth components below the root */
+static
+void internals_make_path(char *path, int depth)
+{
+    int i, nnames;
+    char *name;
+
+    nnames = internals_count(internals_names);
+    path[0] = 0;
+    for (i = 0; i < depth; i++) {
+        name = internals_names[internals_random() % nnames];
+        if (strlen(path) + strlen(name) + 2 > Internals_path_sizE)
+    break;
+        strcat(path, "/");
+        strcat(path, name);
+    }
+}
+
+/* An exclude of one of the kinds which the matcher sorts apart */
+static
+void internals_make_exclude(char *pattern)
+{
+    char *glob;
+
+    switch (internals_random() % 5) {
+    case 0:
+        /* Absolute literal */
+        internals_make_path(pattern, 1 + internals_random() % 3);
+    break; case 1:
+        /* Relative literal */
+        internals_make_path(pattern, 1 + internals_random() % 2);
+        memmove(pattern, pattern + 1, strlen(pattern));
+    break; case 2: case 3:
+        /* Relative glob, which may be of the form "*.ext" */
+        glob = internals_globs[internals_random() %
+                               internals_count(internals_globs)];
+        strcpy(pattern, glob);
+    break; default:
+        /* Absolute glob */
+        glob = internals_globs[internals_random() %
+                               internals_count(internals_globs)];
+        pattern[0] = '/';
+        strcpy(pattern + 1, glob);
+    }
+}
+
+/* Compare the matcher with the fnmatch() loop for many random paths */
+static
+int internals_compare_excludes(IsoImage *image, char *what, int *paths)
+{
+    int i, ret, ref_ret, depth;
+    char *path;
+
+    path = malloc(Internals_path_sizE);
+    if (path == NULL)
+        return ISO_OUT_OF_MEM;
+    for (i = 0; i < 2000; i++) {
+        /* Mostly short paths, some longer than the tails which the matcher
+           keeps on the stack */
+        if (i % 100 == 99)
+            depth = 65 + internals_random() % 40;
+        else
+            depth = 1 + internals_random() % 5;
+        internals_make_path(path, depth);
+        ret = iso_tree_check_excludes(image, path, 0);
+        ref_ret = iso_tree_check_excludes(image, path, 1);
+        if (ret != ref_ret) {
+            printf("excludes %s : %s gives %d instead of %d\n",
+                   what, path, ret, ref_ret);
+            free(path);
+            return 0;
+        }
+        (*paths)++;
+    }
+    free(path);
+    return 1;
+}
+
+static
+int internals_excludes(void)
+{
+    int ret, i, j, n = 0, paths = 0, nglobs;
+    IsoImage *image = NULL;
+    char pattern[256], *patterns[64];
+
+    memset(patterns, 0, sizeof(patterns));
+    ret = iso_image_new("INTERNALS", &image);
+    if (ret < 0)
+        return ret;
+
+    /* Each wildcard exclude alone, relative and absolute */
+    nglobs = internals_count(internals_globs);
+    for (i = 0; i < 2 * nglobs; i++) {
+        pattern[0] = '/';
+        strcpy(pattern + 1, internals_globs[i / 2]);
+        ret = iso_tree_add_exclude(image, pattern + (i % 2 == 0));
+        if (ret < 0)
+            goto ex;
+        ret = internals_compare_excludes(image, pattern + (i % 2 == 0),
+                                         &paths);
+        if (ret <= 0)
+            goto ex;
+        iso_tree_remove_exclude(image, pattern + (i % 2 == 0));
+    }
+
+    /* Random sets which grow and shrink. Removal rebuilds the matcher. */
+    for (i = 0; i < 400; i++) {
+        if (n < 64 && (n == 0 || internals_random() % 3 != 0)) {
+            internals_make_exclude(pattern);
+            patterns[n] = strdup(pattern);
+            if (patterns[n] == NULL)
+                {ret = ISO_OUT_OF_MEM; goto ex;}
+            ret = iso_tree_add_exclude(image, patterns[n]);
+            if (ret < 0)
+                goto ex;
+            n++;
+            sprintf(pattern, "with %d added", n);
+        } else {
+            j = internals_random() % n;
+            iso_tree_remove_exclude(image, patterns[j]);
+            free(patterns[j]);
+            patterns[j] = patterns[--n];
+            patterns[n] = NULL;
+            sprintf(pattern, "with %d after removal", n);
+        }
+        if (i % 20 != 19)
+    continue;
+        ret = internals_compare_excludes(image, pattern, &paths);
+        if (ret <= 0)
+            goto ex;
+    }
+    printf("excludes : %d paths match\n", paths);
+    ret = 1;
+ex:;
+    for (i = 0; i < n; i++)
+        free(patterns[i]);
+    iso_image_unref(image);
+    return ret;
+}
+
+
+/* ------------------------------ MD5 engines ----------------------------- */
+
+/* The test suite of RFC 1321 */
+static char *internals_md5_suite[][2] = {
+    {"", "d41d8cd98f00b204e9800998ecf8427e"},
+    {"a", "0cc175b9c0f1b6a831c399e269772661"},
+    {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+    {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+    {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+    {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+     "d174ab98d277d9f5a5611c2c9f419d9f"},
+    {"1234567890123456789012345678901234567890"
+     "1234567890123456789012345678901234567890",
+     "57edf4a22be3c955ac49da2e2107b67a"},
+    {NULL, NULL}
+};
+
+#define Internals_md5_max_lenS 5000
+
+static
+void internals_md5_hex(char md5[16], char hex[33])
+{
+    int i;
+
+    for (i = 0; i < 16; i++)
+        sprintf(hex + 2 * i, "%2.2x", ((unsigned char *) md5)[i]);
+}
+
+/* Hash the RFC 1321 messages in lanes lockstep lanes */
+static
+int internals_md5_suite_check(char *engine_name, int lanes, int *count)
+{
+    int ret, k, n, datalen[8];
+    void *ctx[8];
+    char *data[8], md5[16], hex[33];
+
+    for (n = 0; internals_md5_suite[n][0] != NULL; n++);
+    memset(ctx, 0, sizeof(ctx));
+    for (k = 0; k < lanes; k++) {
+        ret = iso_md5_start(&ctx[k]);
+        if (ret < 0)
+            goto ex;
+        data[k] = internals_md5_suite[(k + lanes) % n][0];
+        datalen[k] = strlen(data[k]);
+    }
+    ret = iso_md5_compute_multi(ctx, data, datalen, lanes);
+    if (ret < 0)
+        goto ex;
+    for (k = 0; k < lanes; k++) {
+        iso_md5_end(&ctx[k], md5);
+        internals_md5_hex(md5, hex);
+        if (strcmp(hex, internals_md5_suite[(k + lanes) % n][1]) != 0) {
+            printf("md5 %s : lanes=%d gives %s for \"%s\"\n",
+                   engine_name, lanes, hex, data[k]);
+            ret = 0; goto ex;
+        }
+        (*count)++;
+    }
+    ret = 1;
+ex:;
+    for (k = 0; k < lanes; k++)
+        if (ctx[k] != NULL)
+            iso_md5_end(&ctx[k], md5);
+    return ret;
+}
+
+/* A random piece size, at most rest */
+static
+int internals_md5_piece(int rest)
+{
+    int piece;
+
+    /* Mostly pieces of a few blocks, sometimes long runs */
+    if (internals_random() % 4 == 0)
+        piece = internals_random() % Internals_md5_max_lenS;
+    else
+        piece = internals_random() % 700;
+    return piece < rest ? piece : rest;
+}
+
+/* Hash random messages of unequal lengths in random pieces. A context may
+   get more than one piece per call.
+*/
+static
+int internals_md5_random_check(char *engine_name, int lanes, int *count)
+{
+    int ret, k, i, n, n2, len[8], pos[8], datalen[16], datalen2[8], piece;
+    void *ctx[8], *ref_ctx = NULL, *call_ctx[16], *ctx2[8];
+    char *msg[8], *data[16], *data2[8], md5[16], ref_md5[16];
+
+    memset(ctx, 0, sizeof(ctx));
+    memset(msg, 0, sizeof(msg));
+    for (k = 0; k < lanes; k++) {
+        ret = iso_md5_start(&ctx[k]);
+        if (ret < 0)
+            goto ex;
+        len[k] = internals_random() % Internals_md5_max_lenS;
+        pos[k] = 0;
+        msg[k] = malloc(len[k] + 1);
+        if (msg[k] == NULL)
+            {ret = ISO_OUT_OF_MEM; goto ex;}
+        for (i = 0; i < len[k]; i++)
+            msg[k][i] = internals_random() & 0xff;
+    }
+    while (1) {
+        /* Up to two pieces per context, the second ones after all first
+           ones */
+        n = n2 = 0;
+        for (k = 0; k < lanes; k++) {
+            piece = internals_md5_piece(len[k] - pos[k]);
+            if (piece > 0 || internals_random() % 2) {
+                call_ctx[n] = ctx[k];
+                data[n] = msg[k] + pos[k];
+                datalen[n] = piece;
+                pos[k] += piece;
+                n++;
+            }
+            if (internals_random() % 3 == 0) {
+                piece = internals_md5_piece(len[k] - pos[k]);
+                ctx2[n2] = ctx[k];
+                data2[n2] = msg[k] + pos[k];
+                datalen2[n2] = piece;
+                pos[k] += piece;
+                n2++;
+            }
+        }
+        for (i = 0; i < n2; i++) {
+            call_ctx[n] = ctx2[i];
+            data[n] = data2[i];
+            datalen[n] = datalen2[i];
+            n++;
+        }
+        if (n > 0) {
+            ret = iso_md5_compute_multi(call_ctx, data, datalen, n);
+            if (ret < 0)
+                goto ex;
+        }
+        for (k = 0; k < lanes; k++)
+            if (pos[k] < len[k])
+        break;
+        if (k == lanes)
+    break;
+    }
+    for (k = 0; k < lanes; k++) {
+        iso_md5_end(&ctx[k], md5);
+        ret = iso_md5_start(&ref_ctx);
+        if (ret < 0)
+            goto ex;
+        iso_md5_compute(ref_ctx, msg[k], len[k]);
+        iso_md5_end(&ref_ctx, ref_md5);
+        if (memcmp(md5, ref_md5, 16) != 0) {
+            printf("md5 %s : lanes=%d differs for %d bytes\n",
+                   engine_name, lanes, len[k]);
+            ret = 0; goto ex;
+        }
+        (*count)++;
+    }
+    ret = 1;
+ex:;
+    for (k = 0; k < lanes; k++) {
+        if (ctx[k] != NULL)
+            iso_md5_end(&ctx[k], md5);
+        if (msg[k] != NULL)
+            free(msg[k]);
+    }
+    return ret;
+}
+
+static
+int internals_md5(void)
+{
+    int ret, engine, lanes, i, count;
+    static char *engine_names[] = {"", "scalar", "sse2", "avx2"};
+
+    for (engine = 1; engine <= 3; engine++) {
+        if (iso_md5_multi_set_engine(engine) < 0) {
+            printf("md5 %s : not available\n", engine_names[engine]);
+    continue;
+        }
+        count = 0;
+        for (lanes = 1; lanes <= 8; lanes++) {
+            ret = internals_md5_suite_check(engine_names[engine], lanes,
+                                            &count);
+            if (ret <= 0)
+                goto ex;
+            for (i = 0; i < 20; i++) {
+                ret = internals_md5_random_check(engine_names[engine], lanes,
+                                                 &count);
+                if (ret <= 0)
+                    goto ex;
+            }
+        }
+        printf("md5 %s : %d messages match\n", engine_names[engine], count);
+    }
+    ret = 1;
+ex:;
+    iso_md5_multi_set_engine(0);
+    return ret;
+}
+
+
+/* ------------------------- Shared names and AAIP ------------------------ */
+
+static char *internals_acl_text =
+    "user::rwx\nuser:1000:r-x\ngroup::r-x\nmask::r-x\nother::r--\n";
+
+/* @return the AAIP string of node, or NULL */
+static
+void *internals_aaip(IsoNode *node)
+{
+    void *data = NULL;
+
+    if (iso_node_get_xinfo(node, aaip_xinfo_func, &data) != 1)
+        return NULL;
+    return data;
+}
+
+/* Give node the xattr "user.long" with a value of size bytes of fill, and
+   "user.name" with the value name
+*/
+static
+int internals_set_xattr(IsoNode *node, size_t size, int fill, char *name)
+{
+    int ret;
+    char *names[2], *values[2];
+    size_t value_lengths[2];
+
+    names[0] = "user.long";
+    values[0] = malloc(size);
+    if (values[0] == NULL)
+        return ISO_OUT_OF_MEM;
+    memset(values[0], fill, size);
+    value_lengths[0] = size;
+    names[1] = "user.name";
+    values[1] = name;
+    value_lengths[1] = strlen(name);
+    ret = iso_node_set_attrs(node, 2, names, value_lengths, values, 0);
+    free(values[0]);
+    return ret;
+}
+
+/* Check the value of "user.name" */
+static
+int internals_check_xattr(IsoNode *node, char *name)
+{
+    int ret;
+    size_t value_length;
+    char *value = NULL;
+
+    ret = iso_node_lookup_attr(node, "user.name", &value_length, &value, 0);
+    if (ret != 1)
+        return 0;
+    ret = (value_length == strlen(name) && memcmp(value, name,
+                                                  value_length) == 0);
+    free(value);
+    return ret;
+}
+
+static
+int internals_pools(void)
+{
+    int ret, i, j;
+    IsoImage *image = NULL;
+    IsoDir *root, *dirs[8], *clone;
+    static int groups[7] = {0, 0, 0, 0, 1, 1, 2};
+    IsoNode *node, *files[2];
+    char name[16];
+
+    ret = iso_image_new("INTERNALS", &image);
+    if (ret < 0)
+        return ret;
+    root = iso_image_get_root(image);
+
+    /* dirs[0] to dirs[3] get equal xattr, dirs[4] and dirs[5] equal xattr
+       and an ACL, dirs[6] another xattr value, dirs[7] none.
+       The files in dirs[0] and dirs[1] have equal names.
+    */
+    for (i = 0; i < 8; i++) {
+        sprintf(name, "dir_%d", i);
+        ret = iso_tree_add_new_dir(root, name, &dirs[i]);
+        if (ret < 0)
+            goto ex;
+        if (i < 6)
+            ret = internals_set_xattr((IsoNode *) dirs[i], 3000, 'x',
+                                      "equal");
+        else if (i == 6)
+            ret = internals_set_xattr((IsoNode *) dirs[i], 3000, 'y',
+                                      "equal");
+        if (ret < 0)
+            goto ex;
+        if (i == 4 || i == 5) {
+            ret = iso_node_set_acl_text((IsoNode *) dirs[i],
+                                        internals_acl_text, NULL, 0);
+            if (ret < 0)
+                goto ex;
+        }
+        if (i < 2) {
+            ret = iso_tree_add_new_dir(dirs[i], "same_name",
+                                       (IsoDir **) &files[i]);
+            if (ret < 0)
+                goto ex;
+            iso_node_compact(files[i], 1);
+        }
+        iso_node_compact((IsoNode *) dirs[i], 3);
+    }
+
+    ret = 0;
+    for (i = 0; i < 7; i++) {
+        if (internals_aaip((IsoNode *) dirs[i]) == NULL ||
+            !(((IsoNode *) dirs[i])->pooled & 2)) {
+            printf("pools : dir_%d has no shared AAIP string\n", i);
+            goto ex;
+        }
+    }
+    for (i = 0; i < 7; i++) {
+        for (j = i + 1; j < 7; j++) {
+            if ((internals_aaip((IsoNode *) dirs[i]) ==
+                 internals_aaip((IsoNode *) dirs[j])) !=
+                (groups[i] == groups[j])) {
+                printf("pools : dir_%d and dir_%d %s the AAIP string\n",
+                       i, j, groups[i] == groups[j] ? "do not share" :
+                                                      "share");
+                goto ex;
+            }
+        }
+    }
+    if (internals_aaip((IsoNode *) dirs[7]) != NULL ||
+        ((IsoNode *) dirs[7])->pooled & 2) {
+        printf("pools : dir_%d got an AAIP string\n", 7);
+        goto ex;
+    }
+    if (iso_node_get_name(files[0]) != iso_node_get_name(files[1])) {
+        printf("pools : equal names are not shared\n");
+        goto ex;
+    }
+
+    /* A clone shares the string */
+    ret = iso_tree_clone((IsoNode *) dirs[0], root, "clone", &node, 0);
+    if (ret < 0)
+        goto ex;
+    clone = (IsoDir *) node;
+    ret = 0;
+    if (internals_aaip(node) != internals_aaip((IsoNode *) dirs[0]) ||
+        !(node->pooled & 2)) {
+        printf("pools : clone does not share the AAIP string\n");
+        goto ex;
+    }
+
+    /* New attributes or a new name replace only the string of the node */
+    ret = internals_set_xattr((IsoNode *) dirs[1], 3000, 'x', "changed");
+    if (ret < 0)
+        goto ex;
+    ret = iso_node_set_acl_text((IsoNode *) dirs[5], NULL, NULL, 0);
+    if (ret < 0)
+        goto ex;
+    ret = iso_node_set_name(files[1], "other_name");
+    if (ret < 0)
+        goto ex;
+    ret = 0;
+    if (((IsoNode *) dirs[1])->pooled & 2 ||
+        internals_aaip((IsoNode *) dirs[1]) ==
+                                     internals_aaip((IsoNode *) dirs[0]) ||
+        !internals_check_xattr((IsoNode *) dirs[1], "changed")) {
+        printf("pools : dir_1 did not get its own AAIP string\n");
+        goto ex;
+    }
+    if (((IsoNode *) dirs[5])->pooled & 2 ||
+        internals_aaip((IsoNode *) dirs[5]) ==
+                                     internals_aaip((IsoNode *) dirs[4])) {
+        printf("pools : dir_5 did not get its own AAIP string\n");
+        goto ex;
+    }
+    for (i = 0; i < 7; i++) {
+        if (i == 1)
+    continue;
+        if (!internals_check_xattr((IsoNode *) dirs[i], "equal")) {
+            printf("pools : xattr of dir_%d changed\n", i);
+            goto ex;
+        }
+    }
+    if (!internals_check_xattr((IsoNode *) clone, "equal") ||
+        internals_aaip((IsoNode *) clone) !=
+                                     internals_aaip((IsoNode *) dirs[2])) {
+        printf("pools : xattr of the clone changed\n");
+        goto ex;
+    }
+    if (strcmp(iso_node_get_name(files[0]), "same_name") != 0 ||
+        files[1]->pooled & 1) {
+        printf("pools : the shared name changed\n");
+        goto ex;
+    }
+    printf("pools : strings shared and replaced as expected\n");
+    ret = 1;
+ex:;
+    iso_image_unref(image);
+    return ret;
+}
+
+
+/* ------------------------ Iterators and removals ------------------------ */
+
+/* The nodes of the test tree in pre-order */
+struct internals_tree_node {
+    IsoNode *node;
+    int parent;
+    int is_dir;
+    int present;
+};
+
+#define Internals_tree_nodeS 128
+#define Internals_iterS      8
+
+/* An iterator and its model */
+struct internals_iter {
+    IsoDirIter *iter;
+
+    /* The index of the directory, -1 for the root */
+    int dir;
+    int find;
+
+    /* The index of the node which was returned last, -1 if none */
+    int last;
+
+    /* Whether the iterator may take its last node */
+    int may_take;
+};
+
+static
+int internals_add_tree_node(struct internals_tree_node *tree, int *count,
+                            IsoDir *parent, int parent_index, char *name,
+                            int is_dir)
+{
+    int ret;
+    IsoNode *node;
+
+    if (is_dir)
+        ret = iso_tree_add_new_dir(parent, name, (IsoDir **) &node);
+    else
+        ret = iso_tree_add_new_symlink(parent, name, "target",
+                                       (IsoSymlink **) &node);
+    if (ret < 0)
+        return ret;
+    tree[*count].node = node;
+    tree[*count].parent = parent_index;
+    tree[*count].is_dir = is_dir;
+    tree[*count].present = 1;
+    (*count)++;
+    return ISO_SUCCESS;
+}
+
+/* Build "/a" with 20 children, of which each fifth is a directory with 4
+   children, and "/b" with 10 children.
+*/
+static
+int internals_build_tree(IsoDir *root, struct internals_tree_node *tree,
+                         int *count)
+{
+    int ret, i, j, d, sub, n;
+    char name[16];
+
+    *count = 0;
+    for (d = 0; d < 2; d++) {
+        ret = internals_add_tree_node(tree, count, root, -1, d ? "b" : "a",
+                                      1);
+        if (ret < 0)
+            return ret;
+        n = *count - 1;
+        for (i = 0; i < (d ? 10 : 20); i++) {
+            sprintf(name, "n%2.2d", i);
+            ret = internals_add_tree_node(tree, count,
+                                          (IsoDir *) tree[n].node, n, name,
+                                          i % 5 == 0);
+            if (ret < 0)
+                return ret;
+            if (i % 5 != 0)
+        continue;
+            sub = *count - 1;
+            for (j = 0; j < 4; j++) {
+                sprintf(name, "m%d", j);
+                ret = internals_add_tree_node(tree, count,
+                                              (IsoDir *) tree[sub].node, sub,
+                                              name, 0);
+                if (ret < 0)
+                    return ret;
+            }
+        }
+    }
+    return ISO_SUCCESS;
+}
+
+static
+int internals_is_below(struct internals_tree_node *tree, int i, int dir)
+{
+    for (i = tree[i].parent; i >= 0; i = tree[i].parent)
+        if (i == dir)
+            return 1;
+    return (dir == -1);
+}
+
+/* The node which the iterator has to return next, -1 if none.
+   Removed nodes stay in tree, so the successor of a removed node is the
+   one of its predecessor.
+*/
+static
+int internals_iter_expect(struct internals_tree_node *tree, int count,
+                          struct internals_iter *it)
+{
+    int i;
+
+    for (i = it->last + 1; i < count; i++) {
+        if (!tree[i].present)
+    continue;
+        if (it->find ? internals_is_below(tree, i, it->dir) :
+                       tree[i].parent == it->dir)
+            return i;
+    }
+    return -1;
+}
+
+static
+int internals_iter_start(IsoDir *root, struct internals_tree_node *tree,
+                         int count, struct internals_iter *it)
+{
+    int ret;
+    IsoDir *dir;
+    IsoFindCondition *cond;
+
+    /* A plain iterator of "/a", "/a/n05" or "/b", or a find iterator of
+       "/" or "/a"
+    */
+    switch (internals_random() % 5) {
+    case 0:
+        it->dir = 0; it->find = 0;
+    break; case 1:
+        it->dir = 10; it->find = 0;
+    break; case 2:
+        it->dir = 37; it->find = 0;
+    break; case 3:
+        it->dir = -1; it->find = 1;
+    break; default:
+        it->dir = 0; it->find = 1;
+    }
+    it->last = -1;
+    it->may_take = 0;
+    dir = it->dir < 0 ? root : (IsoDir *) tree[it->dir].node;
+    if (it->find) {
+        cond = iso_new_find_conditions_name("*");
+        if (cond == NULL)
+            return ISO_OUT_OF_MEM;
+        ret = iso_dir_find_children(dir, cond, &(it->iter));
+    } else {
+        ret = iso_dir_get_children(dir, &(it->iter));
+    }
+    return ret;
+}
+
+/* Remove node i from the model */
+static
+void internals_tree_remove(struct internals_tree_node *tree, int i)
+{
+    tree[i].present = 0;
+    tree[i].node = NULL;
+}
+
+/* Run random steps of the iterators and take or remove random leaves */
+static
+int internals_iters_round(int *steps)
+{
+    int ret, i, k, count, expect, step;
+    IsoImage *image = NULL;
+    IsoDir *root;
+    IsoNode *node;
+    struct internals_tree_node tree[Internals_tree_nodeS];
+    struct internals_iter its[Internals_iterS], *it;
+
+    memset(its, 0, sizeof(its));
+    ret = iso_image_new("INTERNALS", &image);
+    if (ret < 0)
+        return ret;
+    root = iso_image_get_root(image);
+    ret = internals_build_tree(root, tree, &count);
+    if (ret < 0)
+        goto ex;
+    if (strcmp(iso_node_get_name(tree[10].node), "n05") != 0 ||
+        iso_node_get_name(tree[37].node)[0] != 'b') {
+        ret = ISO_ASSERT_FAILURE;
+        goto ex;
+    }
+    for (k = 0; k < Internals_iterS; k++) {
+        ret = internals_iter_start(root, tree, count, its + k);
+        if (ret < 0)
+            goto ex;
+    }
+
+    for (step = 0; step < 300; step++) {
+        it = its + internals_random() % Internals_iterS;
+        switch (internals_random() % 10) {
+        case 0:
+            /* Remove a leaf from outside the iterators */
+            i = internals_random() % count;
+            if (!tree[i].present || tree[i].is_dir)
+    break;
+            ret = iso_node_remove(tree[i].node);
+            if (ret < 0)
+                goto ex;
+            internals_tree_remove(tree, i);
+        break; case 1: case 2:
+            /* Take or remove the last node of an iterator */
+            if (!it->may_take || !tree[it->last].present ||
+                tree[it->last].is_dir)
+    break;
+            node = tree[it->last].node;
+            if (internals_random() % 2) {
+                ret = iso_dir_iter_remove(it->iter);
+            } else {
+                ret = iso_dir_iter_take(it->iter);
+                if (ret >= 0)
+                    iso_node_unref(node);
+            }
+            if (ret < 0)
+                goto ex;
+            internals_tree_remove(tree, it->last);
+            it->may_take = 0;
+        break; default:
+            expect = internals_iter_expect(tree, count, it);
+            ret = iso_dir_iter_next(it->iter, &node);
+            if (ret < 0)
+                goto ex;
+            if ((ret == 0) != (expect < 0) ||
+                (ret == 1 && node != tree[expect].node)) {
+                printf("iterators : %s of %s returns %s instead of %s\n",
+                       it->find ? "find" : "iterator",
+                       it->dir < 0 ? "/" :
+                                    iso_node_get_name(tree[it->dir].node),
+                       ret == 1 ? iso_node_get_name(node) : "nothing",
+                       expect >= 0 ? iso_node_get_name(tree[expect].node) :
+                                     "nothing");
+                ret = 0;
+                goto ex;
+            }
+            (*steps)++;
+            if (ret == 0) {
+                /* Replace the iterator while the others stay registered */
+                iso_dir_iter_free(it->iter);
+                it->iter = NULL;
+                ret = internals_iter_start(root, tree, count, it);
+                if (ret < 0)
+                    goto ex;
+    break;
+            }
+            it->last = expect;
+            it->may_take = 1;
+        }
+    }
+    ret = 1;
+ex:;
+    for (k = 0; k < Internals_iterS; k++)
+        if (its[k].iter != NULL)
+            iso_dir_iter_free(its[k].iter);
+    iso_image_unref(image);
+    return ret;
+}
+
+static
+int internals_iters(void)
+{
+    int ret, round, steps = 0;
+
+    for (round = 0; round < 20; round++) {
+        ret = internals_iters_round(&steps);
+        if (ret <= 0)
+            return ret;
+    }
+    printf("iterators : %d steps as expected\n", steps);
+    return 1;
+}
+
+
+/* ------------------------------ Block index ----------------------------- */
+
+/* Add a file with size bytes of content. Files with equal fill get equal
+   content.
+*/
+static
+int internals_add_file(IsoDir *dir, char *name, size_t size, int fill)
+{
+    int ret;
+    unsigned char *buf;
+    IsoStream *stream = NULL;
+
+    buf = malloc(size > 0 ? size : 1);
+    if (buf == NULL)
+        return ISO_OUT_OF_MEM;
+    memset(buf, fill, size);
+    ret = iso_memory_stream_new(buf, size, &stream);
+    if (ret < 0) {
+        free(buf);
+        return ret;
+    }
+    /* The file takes over the reference to the stream */
+    ret = iso_tree_add_new_file(dir, name, stream, NULL);
+    if (ret < 0)
+        iso_stream_unref(stream);
+    return ret;
+}
+
+/* Write an image with files of various sizes, empty files, and files with
+   equal content which share their blocks.
+*/
+static
+int internals_write_image(char *path)
+{
+    int ret, i, j, fd = -1;
+    size_t size;
+    IsoImage *image = NULL;
+    IsoDir *root, *dir;
+    IsoWriteOpts *opts = NULL;
+    struct burn_source *burn_src = NULL;
+    unsigned char buf[2048];
+    char name[16];
+
+    ret = iso_image_new("INTERNALS", &image);
+    if (ret < 0)
+        return ret;
+    root = iso_image_get_root(image);
+    for (i = 0; i < 6; i++) {
+        sprintf(name, "dir_%d", i);
+        ret = iso_tree_add_new_dir(root, name, &dir);
+        if (ret < 0)
+            goto ex;
+        for (j = 0; j < 8; j++) {
+            sprintf(name, "file_%d", j);
+            /* Each third file is empty, each fourth has the content of the
+               same file in the other directories */
+            if (j % 3 == 2)
+                size = 0;
+            else if (j % 4 == 3)
+                size = 7000;
+            else
+                size = 1 + internals_random() % 20000;
+            ret = internals_add_file(dir, name, size,
+                                     j % 4 == 3 ? j : i * 8 + j);
+            if (ret < 0)
+                goto ex;
+        }
+        if (i % 2)
+            ret = iso_tree_add_new_dir(dir, "sub", &dir);
+        if (ret < 0)
+            goto ex;
+        ret = internals_add_file(dir, "file_8", 5000, 1);
+        if (ret < 0)
+            goto ex;
+    }
+
+    ret = iso_write_opts_new(&opts, 0);
+    if (ret < 0)
+        goto ex;
+    iso_write_opts_set_rockridge(opts, 1);
+    ret = iso_write_opts_set_content_dedup(opts, 1);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_create_burn_source(image, opts, &burn_src);
+    if (ret < 0)
+        goto ex;
+    fd = open(path, O_WRONLY | O_TRUNC);
+    if (fd == -1) {
+        perror(path);
+        ret = ISO_FILE_ERROR;
+        goto ex;
+    }
+    while (burn_src->read_xt(burn_src, buf, 2048) == 2048) {
+        if (write(fd, buf, 2048) != 2048) {
+            perror(path);
+            ret = ISO_FILE_ERROR;
+            goto ex;
+        }
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (fd != -1)
+        close(fd);
+    if (burn_src != NULL) {
+        burn_src->free_data(burn_src);
+        free(burn_src);
+    }
+    if (opts != NULL)
+        iso_write_opts_free(opts);
+    iso_image_unref(image);
+    return ret;
+}
+
+/* Compare the index with the walk through the tree for all blocks up to
+   nblocks.
+*/
+static
+int internals_compare_blocks(IsoImage *image, uint32_t nblocks, char *what,
+                             int *count)
+{
+    int ret, ref_ret;
+    uint32_t block, next_above, ref_next_above;
+    IsoNode *found, *ref_found;
+
+    for (block = 0; block < nblocks; block++) {
+        found = ref_found = NULL;
+        next_above = ref_next_above = 0xffffffff;
+        ret = iso_tree_get_node_of_block(image, NULL, block, &found,
+                                         &next_above, 0);
+        if (ret < 0)
+            return ret;
+        ref_ret = iso_tree_get_node_of_block(image,
+                                             iso_image_get_root(image), block,
+                                             &ref_found, &ref_next_above, 0);
+        if (ref_ret < 0)
+            return ref_ret;
+        if (ret != ref_ret || found != ref_found ||
+            next_above != ref_next_above) {
+            printf("block index %s : block %lu gives %d %s %lu",
+                   what, (unsigned long) block,
+                   ret, found != NULL ? iso_node_get_name(found) : "-",
+                   (unsigned long) next_above);
+            printf(", walk gives %d %s %lu\n",
+                   ref_ret,
+                   ref_found != NULL ? iso_node_get_name(ref_found) : "-",
+                   (unsigned long) ref_next_above);
+            return 0;
+        }
+        (*count)++;
+    }
+    return 1;
+}
+
+static
+int internals_block_index_import(char *path, uint32_t nblocks, int lazy,
+                                 int *count)
+{
+    int ret;
+    IsoDataSource *src = NULL;
+    IsoReadOpts *ropts = NULL;
+    IsoReadImageFeatures *features = NULL;
+    IsoImage *image = NULL;
+    IsoNode *node;
+    IsoDir *dir;
+    char *what = lazy ? "lazy" : "eager";
+
+    ret = iso_data_source_new_from_file(path, &src);
+    if (ret < 0)
+        goto ex;
+    ret = iso_read_opts_new(&ropts, 0);
+    if (ret < 0)
+        goto ex;
+    iso_read_opts_set_no_md5(ropts, 2);
+    ret = iso_read_opts_set_lazy_dirs(ropts, lazy);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_new("INTERNALS", &image);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_import(image, src, ropts, &features);
+    if (ret < 0)
+        goto ex;
+
+    /* The first search with lazy directories builds the index before the
+       walk loads them */
+    ret = internals_compare_blocks(image, nblocks, what, count);
+    if (ret <= 0)
+        goto ex;
+
+    /* A removed file */
+    ret = iso_tree_path_to_node(image, "/dir_1/file_0", &node);
+    if (ret == 1)
+        ret = iso_node_remove(node);
+    if (ret <= 0)
+        goto ex;
+    ret = internals_compare_blocks(image, nblocks, what, count);
+    if (ret <= 0)
+        goto ex;
+
+    /* A file which shares its blocks with /dir_0/file_3, moved in front of
+       it, and a new directory with a new file
+    */
+    ret = iso_tree_path_to_node(image, "/dir_5/file_3", &node);
+    if (ret == 1)
+        ret = iso_node_take(node);
+    if (ret <= 0)
+        goto ex;
+    ret = iso_tree_add_new_dir(iso_image_get_root(image), "a_new_dir", &dir);
+    if (ret >= 0)
+        ret = iso_dir_add_node(dir, node, 0);
+    if (ret < 0) {
+        iso_node_unref(node);
+        goto ex;
+    }
+    ret = internals_add_file(dir, "new_file", 3000, 1);
+    if (ret < 0)
+        goto ex;
+    ret = internals_compare_blocks(image, nblocks, what, count);
+    if (ret <= 0)
+        goto ex;
+
+    /* A removed directory */
+    ret = iso_tree_path_to_node(image, "/dir_3", &node);
+    if (ret == 1)
+        ret = iso_node_remove_tree(node, NULL);
+    if (ret <= 0)
+        goto ex;
+    ret = internals_compare_blocks(image, nblocks, what, count);
+ex:;
+    if (features != NULL)
+        iso_read_image_features_destroy(features);
+    if (image != NULL)
+        iso_image_unref(image);
+    if (ropts != NULL)
+        iso_read_opts_free(ropts);
+    if (src != NULL)
+        iso_data_source_unref(src);
+    return ret;
+}
+
+static
+int internals_block_index(void)
+{
+    int ret, fd, count = 0;
+    char *tmp, path[4096];
+    struct stat stbuf;
+    uint32_t nblocks;
+
+    tmp = getenv("TMPDIR");
+    if (tmp == NULL || tmp[0] == 0)
+        tmp = "/tmp";
+    snprintf(path, sizeof(path), "%s/libisofs_internals_XXXXXX", tmp);
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return ISO_FILE_ERROR;
+    }
+    close(fd);
+    ret = internals_write_image(path);
+    if (ret < 0)
+        goto ex;
+    if (stat(path, &stbuf) == -1) {
+        ret = ISO_FILE_ERROR;
+        goto ex;
+    }
+    nblocks = stbuf.st_size / 2048 + 2;
+    ret = internals_block_index_import(path, nblocks, 0, &count);
+    if (ret <= 0)
+        goto ex;
+    ret = internals_block_index_import(path, nblocks, 1, &count);
+    if (ret <= 0)
+        goto ex;
+    printf("block index : %d lookups match\n", count);
+ex:;
+    unlink(path);
+    return ret;
+}
+
+
+/* ------------------------------------------------------------------------ */
+
+struct internals_test {
+    char *name;
+
+    /* Return 1 if all checks pass, 0 if not, <0 on error */
+    int (*func)(void);
+};
+
+static struct internals_test internals_tests[] = {
+    {"excludes", internals_excludes},
+    {"md5", internals_md5},
+    {"pools", internals_pools},
+    {"iterators", internals_iters},
+    {"block index", internals_block_index},
+    {NULL, NULL}
+};
+
+
+int main(int argc, char **argv)
+{
+    int ret, i, failed = 0, differ = 0;
+
+    if (argc > 1) {
+        fprintf(stderr, "usage: %s\n", argv[0]);
+        exit(2);
+    }
+    ret = iso_init();
+    if (ret < 0) {
+        fprintf(stderr, "Cannot initialize libisofs\n");
+        exit(2);
+    }
+    iso_set_msgs_severities("NEVER", "FAILURE", "");
+
+    for (i = 0; internals_tests[i].name != NULL; i++) {
+        ret = internals_tests[i].func();
+        if (ret < 0) {
+            fprintf(stderr, "Test %s failed: 0x%x\n", internals_tests[i].name,
+                    (unsigned int) ret);
+            failed = 1;
+        } else if (ret == 0) {
+            differ = 1;
+        }
+    }
+
+    iso_finish();
+    if (failed)
+        exit(2);
+    exit(differ);
+}
@@ -10,11 +10,15 @@
 /*
  * Synchronized ring buffer, works with a writer thread and a read thread.
  *
- * TODO #00010 : optimize ring buffer
- *  - write/read at the end of buffer requires a second mutex_lock, even if
- *    there's enough space/data at the beginning
- *  - pre-buffer for writes < BLOCK_SIZE
+ * Each side owns its position in the buffer and publishes its progress by
+ * an atomic byte counter. The mutex and the condition variables are only
+ * used when a side actually has to wait because the buffer is full or
+ * empty, or when it has to wake up a waiting side.
  *
+ * The writer may put data directly into buffer memory by
+ * iso_ring_buffer_write_reserve() and iso_ring_buffer_write_commit().
+ * The reader may take data directly from buffer memory by
+ * iso_ring_buffer_read_span() and iso_ring_buffer_read_release().
  */
 
 #ifdef HAVE_CONFIG_H
@@ -37,6 +41,13 @@
 #   define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+/* GCC and clang offer atomic builtins. Without them every access to the
+   shared counters and flags is made under the mutex.
+*/
+#ifdef __ATOMIC_SEQ_CST
+#define Libisofs_ring_atomiC yes
+#endif
+
 struct iso_ring_buffer
 {
     uint8_t *buf;
@@ -47,11 +58,16 @@ struct iso_ring_buffer
     size_t cap;
 
     /*
-     * Number of bytes available.
+     * Total number of bytes put in by the writer and taken out by the
+     * reader. Each counter is changed only by its own side. Their difference
+     * is the number of bytes available.
      */
-    size_t size;
+    size_t wcount;
+    size_t rcount;
 
-    /* position for reading and writing, offset from buf */
+    /* position for reading and writing, offset from buf.
+       Each is used only by its own side.
+     */
     size_t rpos;
     size_t wpos;
 
@@ -59,8 +75,12 @@ struct iso_ring_buffer
      * flags to report if read or writer threads ends execution
      * 0 not finished, 1 finished ok, 2 finish with error
      */
-    unsigned int rend :2;
-    unsigned int wend :2;
+    int rend;
+    int wend;
+
+    /* 1 while the reader or the writer waits for the other side */
+    int rwait;
+    int wwait;
 
     /* just for statistical purposes */
     unsigned int times_full;
@@ -71,6 +91,79 @@ struct iso_ring_buffer
     pthread_cond_t full;
 };
 
+
+/* @param flag bit0= the mutex is already locked by the caller
+*/
+static
+size_t ring_load(IsoRingBuffer *buf, size_t *pt, int flag)
+{
+#ifdef Libisofs_ring_atomiC
+    return __atomic_load_n(pt, __ATOMIC_SEQ_CST);
+#else
+    size_t value;
+
+    if (flag & 1)
+        return *pt;
+    pthread_mutex_lock(&buf->mutex);
+    value = *pt;
+    pthread_mutex_unlock(&buf->mutex);
+    return value;
+#endif
+}
+
+static
+void ring_store(IsoRingBuffer *buf, size_t *pt, size_t value)
+{
+#ifdef Libisofs_ring_atomiC
+    __atomic_store_n(pt, value, __ATOMIC_SEQ_CST);
+#else
+    pthread_mutex_lock(&buf->mutex);
+    *pt = value;
+    pthread_mutex_unlock(&buf->mutex);
+#endif
+}
+
+static
+int ring_load_flag(IsoRingBuffer *buf, int *pt)
+{
+#ifdef Libisofs_ring_atomiC
+    return __atomic_load_n(pt, __ATOMIC_SEQ_CST);
+#else
+    int value;
+
+    pthread_mutex_lock(&buf->mutex);
+    value = *pt;
+    pthread_mutex_unlock(&buf->mutex);
+    return value;
+#endif
+}
+
+/* To be called with the mutex locked */
+static
+void ring_store_flag_locked(int *pt, int value)
+{
+#ifdef Libisofs_ring_atomiC
+    __atomic_store_n(pt, value, __ATOMIC_SEQ_CST);
+#else
+    *pt = value;
+#endif
+}
+
+/* Wake up the other side if it announced to be waiting.
+   The waiting side announces itself under the mutex and then checks the
+   counter again. So either it sees the new counter value or this call sees
+   its announcement and signals after it went to sleep.
+*/
+static
+void ring_wake(IsoRingBuffer *buf, int *waiting, pthread_cond_t *cond)
+{
+    if (!ring_load_flag(buf, waiting))
+        return;
+    pthread_mutex_lock(&buf->mutex);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&buf->mutex);
+}
+
 /**
  * Create a new buffer.
  *
@@ -103,7 +196,8 @@ int iso_ring_buffer_new(size_t size, IsoRingBuffer **rbuf)
         return ISO_OUT_OF_MEM;
     }
 
-    buffer->size = 0;
+    buffer->wcount = 0;
+    buffer->rcount = 0;
     buffer->wpos = 0;
     buffer->rpos = 0;
 
@@ -111,6 +205,7 @@ int iso_ring_buffer_new(size_t size, IsoRingBuffer **rbuf)
     buffer->times_empty = 0;
 
     buffer->rend = buffer->wend = 0;
+    buffer->rwait = buffer->wwait = 0;
 
     /* init mutex and waiting queues */
     pthread_mutex_init(&buffer->mutex, NULL);
@@ -133,6 +228,144 @@ void iso_ring_buffer_free(IsoRingBuffer *buf)
     free(buf);
 }
 
+/* Number of free bytes, as seen by the writer
+   @param flag bit0= the mutex is already locked by the caller
+*/
+static
+size_t ring_free_bytes(IsoRingBuffer *buf, int flag)
+{
+    return buf->cap - (buf->wcount - ring_load(buf, &buf->rcount, flag));
+}
+
+/* Number of available bytes, as seen by the reader
+   @param flag bit0= the mutex is already locked by the caller
+*/
+static
+size_t ring_avail_bytes(IsoRingBuffer *buf, int flag)
+{
+    return ring_load(buf, &buf->wcount, flag) - buf->rcount;
+}
+
+/* Wait until at least min bytes are free.
+   @return 1 success, 0 read finished
+*/
+static
+int ring_wait_free(IsoRingBuffer *buf, size_t min)
+{
+    while (ring_free_bytes(buf, 0) < min) {
+
+        /*
+         * Note. There's only a writer, so we have no race conditions.
+         * Thus, the rend check is done here only to properly detect that
+         * the reader has been cancelled
+         */
+        if (ring_load_flag(buf, &buf->rend)) {
+            /* the read procces has been finished */
+            return 0;
+        }
+        pthread_mutex_lock(&buf->mutex);
+        ring_store_flag_locked(&buf->wwait, 1);
+        if (ring_free_bytes(buf, 1) < min && !buf->rend) {
+            buf->times_full++;
+            /* wait until space available */
+            pthread_cond_wait(&buf->full, &buf->mutex);
+        }
+        ring_store_flag_locked(&buf->wwait, 0);
+        pthread_mutex_unlock(&buf->mutex);
+    }
+    return 1;
+}
+
+/* Wait until at least one byte is available.
+   @return 1 success, 0 EOF
+*/
+static
+int ring_wait_avail(IsoRingBuffer *buf)
+{
+    while (ring_avail_bytes(buf, 0) == 0) {
+
+        /*
+         * Note. There's only a reader, so we have no race conditions.
+         * Thus, the wend check is done here just to ensure a reader detects
+         * the EOF properly if the writer has been canceled while the reader
+         * was waiting. The writer publishes its last data before wend.
+         */
+        if (ring_load_flag(buf, &buf->wend)) {
+            if (ring_avail_bytes(buf, 0) > 0)
+    continue;
+            /* the writer procces has been finished */
+            return 0; /* EOF */
+        }
+        pthread_mutex_lock(&buf->mutex);
+        ring_store_flag_locked(&buf->rwait, 1);
+        if (ring_avail_bytes(buf, 1) == 0 && !buf->wend) {
+            buf->times_empty++;
+            /* wait until data available */
+            pthread_cond_wait(&buf->empty, &buf->mutex);
+        }
+        ring_store_flag_locked(&buf->rwait, 0);
+        pthread_mutex_unlock(&buf->mutex);
+    }
+    return 1;
+}
+
+/**
+ * Obtain free buffer memory into which the writer may put data directly.
+ * It blocks until at least min bytes are free or the reader closes the
+ * buffer.
+ *
+ * @param min
+ *      Number of bytes which are needed. Must not exceed the buffer size.
+ * @param data
+ *      Will return a pointer to the free memory.
+ * @param count
+ *      Will return the number of contiguous free bytes at *data.
+ * @return
+ *      1 success, 0 read finished, 2 the free memory is split at the end of
+ *      the buffer and *count is smaller than min, < 0 error
+ */
+int iso_ring_buffer_write_reserve(IsoRingBuffer *buf, size_t min,
+                                  uint8_t **data, size_t *count)
+{
+    int ret;
+
+    if (buf == NULL || data == NULL || count == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (min > buf->cap) {
+        return ISO_WRONG_ARG_VALUE;
+    }
+    ret = ring_wait_free(buf, min > 0 ? min : 1);
+    if (ret <= 0)
+        return ret;
+    *data = buf->buf + buf->wpos;
+    *count = MIN(ring_free_bytes(buf, 0), buf->cap - buf->wpos);
+    return *count < min ? 2 : 1;
+}
+
+/**
+ * Hand over to the reader count bytes which were put into the memory
+ * obtained by iso_ring_buffer_write_reserve().
+ *
+ * @return
+ *      1 success, < 0 error
+ */
+int iso_ring_buffer_write_commit(IsoRingBuffer *buf, size_t count)
+{
+    if (buf == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (count > buf->cap - buf->wpos) {
+        return ISO_WRONG_ARG_VALUE;
+    }
+    buf->wpos = (buf->wpos + count) % (buf->cap);
+    ring_store(buf, &buf->wcount, buf->wcount + count);
+
+    /* wake up reader */
+    ring_wake(buf, &buf->rwait, &buf->empty);
+    return ISO_SUCCESS;
+}
+
 /**
  * Write count bytes into buffer. It blocks until all bytes where written or
  * reader close the buffer.
@@ -149,7 +382,9 @@ void iso_ring_buffer_free(IsoRingBuffer *buf)
  */
 int iso_ring_buffer_write(IsoRingBuffer *buf, uint8_t *data, size_t count)
 {
+    int ret;
     size_t len;
+    uint8_t *space;
     size_t bytes_write = 0;
 
     if (buf == NULL || data == NULL) {
@@ -157,40 +392,65 @@ int iso_ring_buffer_write(IsoRingBuffer *buf, uint8_t *data, size_t count)
     }
 
     while (bytes_write < count) {
+        ret = iso_ring_buffer_write_reserve(buf, 1, &space, &len);
+        if (ret <= 0)
+            return ret;
+        len = MIN(count - bytes_write, len);
+        memcpy(space, data + bytes_write, len);
+        bytes_write += len;
+        iso_ring_buffer_write_commit(buf, len);
+    }
+    return ISO_SUCCESS;
+}
 
-        pthread_mutex_lock(&buf->mutex);
-
-        while (buf->size == buf->cap) {
-
-            /*
-             * Note. There's only a writer, so we have no race conditions.
-             * Thus, the while(buf->size == buf->cap) is used here
-             * only to properly detect the reader has been cancelled
-             */
-
-            if (buf->rend) {
-                /* the read procces has been finished */
-                pthread_mutex_unlock(&buf->mutex);
-                return 0;
-            }
-            buf->times_full++;
-            /* wait until space available */
-            pthread_cond_wait(&buf->full, &buf->mutex);
-        }
+/**
+ * Obtain the next buffer memory which holds data for the reader.
+ * It blocks until at least one byte is available or the writer closes the
+ * buffer.
+ *
+ * @param data
+ *      Will return a pointer to the available data.
+ * @param count
+ *      Will return the number of contiguous bytes at *data.
+ * @return
+ *      1 success, 0 EOF, < 0 error
+ */
+int iso_ring_buffer_read_span(IsoRingBuffer *buf, uint8_t **data,
+                              size_t *count)
+{
+    int ret;
 
-        len = MIN(count - bytes_write, buf->cap - buf->size);
-        if (buf->wpos + len > buf->cap) {
-            len = buf->cap - buf->wpos;
-        }
-        memcpy(buf->buf + buf->wpos, data + bytes_write, len);
-        buf->wpos = (buf->wpos + len) % (buf->cap);
-        bytes_write += len;
-        buf->size += len;
+    if (buf == NULL || data == NULL || count == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    ret = ring_wait_avail(buf);
+    if (ret <= 0)
+        return ret;
+    *data = buf->buf + buf->rpos;
+    *count = MIN(ring_avail_bytes(buf, 0), buf->cap - buf->rpos);
+    return ISO_SUCCESS;
+}
 
-        /* wake up reader */
-        pthread_cond_signal(&buf->empty);
-        pthread_mutex_unlock(&buf->mutex);
+/**
+ * Give back to the writer count bytes of the memory which was obtained
+ * by iso_ring_buffer_read_span().
+ *
+ * @return
+ *      1 success, < 0 error
+ */
+int iso_ring_buffer_read_release(IsoRingBuffer *buf, size_t count)
+{
+    if (buf == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (count > buf->cap - buf->rpos) {
+        return ISO_WRONG_ARG_VALUE;
     }
+    buf->rpos = (buf->rpos + count) % (buf->cap);
+    ring_store(buf, &buf->rcount, buf->rcount + count);
+
+    /* wake up the writer */
+    ring_wake(buf, &buf->wwait, &buf->full);
     return ISO_SUCCESS;
 }
 
@@ -205,7 +465,9 @@ int iso_ring_buffer_write(IsoRingBuffer *buf, uint8_t *data, size_t count)
  */
 int iso_ring_buffer_read(IsoRingBuffer *buf, uint8_t *dest, size_t count)
 {
+    int ret;
     size_t len;
+    uint8_t *data;
     size_t bytes_read = 0;
 
     if (buf == NULL || dest == NULL) {
@@ -213,38 +475,13 @@ int iso_ring_buffer_read(IsoRingBuffer *buf, uint8_t *dest, size_t count)
     }
 
     while (bytes_read < count) {
-        pthread_mutex_lock(&buf->mutex);
-
-        while (buf->size == 0) {
-            /*
-             * Note. There's only a reader, so we have no race conditions.
-             * Thus, the while(buf->size == 0) is used here just to ensure
-             * a reader detects the EOF properly if the writer has been
-             * canceled while the reader was waiting
-             */
-
-            if (buf->wend) {
-                /* the writer procces has been finished */
-                pthread_mutex_unlock(&buf->mutex);
-                return 0; /* EOF */
-            }
-            buf->times_empty++;
-            /* wait until data available */
-            pthread_cond_wait(&buf->empty, &buf->mutex);
-        }
-
-        len = MIN(count - bytes_read, buf->size);
-        if (buf->rpos + len > buf->cap) {
-            len = buf->cap - buf->rpos;
-        }
-        memcpy(dest + bytes_read, buf->buf + buf->rpos, len);
-        buf->rpos = (buf->rpos + len) % (buf->cap);
+        ret = iso_ring_buffer_read_span(buf, &data, &len);
+        if (ret <= 0)
+            return ret;
+        len = MIN(count - bytes_read, len);
+        memcpy(dest + bytes_read, data, len);
         bytes_read += len;
-        buf->size -= len;
-
-        /* wake up the writer */
-        pthread_cond_signal(&buf->full);
-        pthread_mutex_unlock(&buf->mutex);
+        iso_ring_buffer_read_release(buf, len);
     }
     return ISO_SUCCESS;
 }
@@ -252,7 +489,7 @@ int iso_ring_buffer_read(IsoRingBuffer *buf, uint8_t *dest, size_t count)
 void iso_ring_buffer_writer_close(IsoRingBuffer *buf, int error)
 {
     pthread_mutex_lock(&buf->mutex);
-    buf->wend = error ? 2 : 1;
+    ring_store_flag_locked(&buf->wend, error ? 2 : 1);
 
     /* ensure no reader is waiting */
     pthread_cond_signal(&buf->empty);
@@ -269,7 +506,7 @@ void iso_ring_buffer_reader_close(IsoRingBuffer *buf, int error)
         return;
     }
 
-    buf->rend = error ? 2 : 1;
+    ring_store_flag_locked(&buf->rend, error ? 2 : 1);
 
     /* ensure no writer is waiting */
     pthread_cond_signal(&buf->full);
@@ -321,18 +558,16 @@ int iso_ring_buffer_get_buf_status(IsoRingBuffer *buf, size_t *size,
         return ISO_NULL_POINTER;
     }
 
-    /* get mutex */
-    pthread_mutex_lock(&buf->mutex);
     if (size) {
         *size = buf->cap;
     }
     if (free_bytes) {
-        *free_bytes = buf->cap - buf->size;
+        *free_bytes = buf->cap - (ring_load(buf, &buf->wcount, 0) -
+                                  ring_load(buf, &buf->rcount, 0));
     }
 
-    ret = (buf->rend ? 4 : 0) + (buf->wend + 1);
-
-    pthread_mutex_unlock(&buf->mutex);
+    ret = (ring_load_flag(buf, &buf->rend) ? 4 : 0) +
+          (ring_load_flag(buf, &buf->wend) + 1);
     return ret;
 }
 
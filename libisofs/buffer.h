@@ -59,6 +59,33 @@ void iso_ring_buffer_free(IsoRingBuffer *buf);
  */
 int iso_ring_buffer_write(IsoRingBuffer *buf, uint8_t *data, size_t count);
 
+/**
+ * Obtain free buffer memory into which the writer may put data directly.
+ * It blocks until at least min bytes are free or the reader closes the
+ * buffer.
+ *
+ * @param min
+ *      Number of bytes which are needed. Must not exceed the buffer size.
+ * @param data
+ *      Will return a pointer to the free memory.
+ * @param count
+ *      Will return the number of contiguous free bytes at *data.
+ * @return
+ *      1 success, 0 read finished, 2 the free memory is split at the end of
+ *      the buffer and *count is smaller than min, < 0 error
+ */
+int iso_ring_buffer_write_reserve(IsoRingBuffer *buf, size_t min,
+                                  uint8_t **data, size_t *count);
+
+/**
+ * Hand over to the reader count bytes which were put into the memory
+ * obtained by iso_ring_buffer_write_reserve().
+ *
+ * @return
+ *      1 success, < 0 error
+ */
+int iso_ring_buffer_write_commit(IsoRingBuffer *buf, size_t count);
+
 /**
  * Read count bytes from the buffer into dest. It blocks until the desired
  * bytes has been read. If the writer finishes before outputting enough
@@ -70,6 +97,30 @@ int iso_ring_buffer_write(IsoRingBuffer *buf, uint8_t *data, size_t count);
  */
 int iso_ring_buffer_read(IsoRingBuffer *buf, uint8_t *dest, size_t count);
 
+/**
+ * Obtain the next buffer memory which holds data for the reader.
+ * It blocks until at least one byte is available or the writer closes the
+ * buffer.
+ *
+ * @param data
+ *      Will return a pointer to the available data.
+ * @param count
+ *      Will return the number of contiguous bytes at *data.
+ * @return
+ *      1 success, 0 EOF, < 0 error
+ */
+int iso_ring_buffer_read_span(IsoRingBuffer *buf, uint8_t **data,
+                              size_t *count);
+
+/**
+ * Give back to the writer count bytes of the memory which was obtained
+ * by iso_ring_buffer_read_span().
+ *
+ * @return
+ *      1 success, < 0 error
+ */
+int iso_ring_buffer_read_release(IsoRingBuffer *buf, size_t count);
+
 /** Backend of API call iso_ring_buffer_get_status()
  *
  * Get the status of a ring buffer.
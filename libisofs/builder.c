@@ -264,6 +264,12 @@ int default_create_node(IsoNodeBuilder *builder, IsoImage *image,
         free(aa_string);
     }
 
+    if (image->node_compaction) {
+        ret = iso_node_compact(new, image->node_compaction);
+        if (ret < 0)
+            goto ex;
+    }
+
     *node = new;
 
     ret = ISO_SUCCESS;
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2 
+ * or later as published by the Free Software Foundation. 
+ * See COPYING file for details.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#else
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+#endif
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "libisofs.h"
+#include "crc32.h"
+
+
+/* Table driven CRC-32 with the method "slicing-by-8": Eight bytes get
+   processed by eight table lookups per step.
+   Table 0 is the classic byte-wise table. Table k tells the CRC residue of a
+   byte which is followed by k zero bytes.
+   Input words are composed byte by byte, so that the result does not
+   depend on the endianness of the machine.
+*/
+
+#define Libisofs_crc32_polY 0xedb88320
+
+static uint32_t crc32_tables[8][256];
+static pthread_once_t crc32_tables_once = PTHREAD_ONCE_INIT;
+
+
+static
+void crc32_make_tables(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? Libisofs_crc32_polY : 0);
+        crc32_tables[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = crc32_tables[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = (crc >> 8) ^ crc32_tables[0][crc & 0xff];
+            crc32_tables[j][i] = crc;
+        }
+    }
+}
+
+
+void iso_crc32_init(void)
+{
+    pthread_once(&crc32_tables_once, crc32_make_tables);
+}
+
+
+/* @param crc  The value as returned by the previous call, 0 at start
+*/
+uint32_t iso_crc32_update(uint32_t crc, unsigned char *data, int count,
+                          int flag)
+{
+    uint32_t (*t)[256] = crc32_tables;
+    unsigned char *p = data;
+    uint32_t w;
+
+    if (data == NULL || count <= 0)
+        return crc;
+    iso_crc32_init();
+
+    crc = ~crc;
+    while (count >= 8) {
+        w = crc ^ (((uint32_t) p[0])       | (((uint32_t) p[1]) << 8) |
+                   (((uint32_t) p[2]) << 16) | (((uint32_t) p[3]) << 24));
+        crc = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^
+              t[5][(w >> 16) & 0xff] ^ t[4][w >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        count -= 8;
+    }
+    while (count > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *(p++)) & 0xff];
+        count--;
+    }
+
+    return ~crc;
+}
+
+
+/* CRC-32 as of GPT and Ethernet.
+*/
+uint32_t iso_crc32_gpt(unsigned char *data, int count, int flag)
+{
+    return iso_crc32_update((uint32_t) 0, data, count, 0);
+}
+
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2 
+ * or later as published by the Free Software Foundation. 
+ * See COPYING file for details.
+ */
+
+#ifndef LIBISO_CRC32_H_
+#define LIBISO_CRC32_H_
+
+
+/* The CRC-32 computation API is in libisofs.h : iso_crc32_gpt() and
+   iso_crc32_update().
+   It is the CRC of GPT, Ethernet, zlib, PNG, ... with reflected
+   polynomial 0xedb88320, initial value 0xffffffff, and final complement.
+*/
+
+
+/* Initialize the lookup tables. This is done automatically by the API
+   calls. It may be called in advance, e.g. before starting threads.
+*/
+void iso_crc32_init(void);
+
+
+#endif /* ! LIBISO_CRC32_H_ */
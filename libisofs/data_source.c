@@ -13,13 +13,17 @@
 
 #include "libisofs.h"
 #include "util.h"
+#include "data_source.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 
 /* O_BINARY is needed for Cygwin but undefined elsewhere */
 #ifndef O_BINARY
@@ -33,6 +37,10 @@ struct file_data_src
 {
     char *path;
     int fd;
+
+    int use_mmap; /* whether to map the file into memory when opened */
+    uint8_t *map; /* NULL if not mapped */
+    off_t map_size;
 };
 
 /**
@@ -76,6 +84,27 @@ int ds_open(IsoDataSource *src)
     }
 
     data->fd = fd;
+
+    if (data->use_mmap) {
+        struct stat stbuf;
+        off_t size = -1;
+        void *map;
+
+        /* Block devices report size 0 by fstat() */
+        if (fstat(fd, &stbuf) != -1 && S_ISREG(stbuf.st_mode))
+            size = stbuf.st_size;
+        else
+            size = lseek(fd, (off_t) 0, SEEK_END);
+        /* If the file cannot be mapped, e.g. because it is too large for the
+           address space, then it gets read by pread() */
+        if (size > 0 && (off_t) (size_t) size == size) {
+            map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                data->map = map;
+                data->map_size = size;
+            }
+        }
+    }
     return ISO_SUCCESS;
 }
 
@@ -94,6 +123,12 @@ int ds_close(IsoDataSource *src)
         return ISO_FILE_NOT_OPENED;
     }
 
+    if (data->map != NULL) {
+        munmap(data->map, (size_t) data->map_size);
+        data->map = NULL;
+        data->map_size = 0;
+    }
+
     /* close can fail if fd is not valid, but that should never happen */
     ret = close(data->fd);
 
@@ -102,9 +137,12 @@ int ds_close(IsoDataSource *src)
     return ret == 0 ? ISO_SUCCESS : ISO_FILE_ERROR;
 }
 
-static int ds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
+static int ds_read_blocks(IsoDataSource *src, uint32_t lba, uint32_t count,
+                          uint8_t *buffer)
 {
     struct file_data_src *data;
+    size_t todo, done = 0;
+    ssize_t ret;
 
     if (src == NULL || src->data == NULL || buffer == NULL) {
         return ISO_NULL_POINTER;
@@ -115,19 +153,38 @@ static int ds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
         return ISO_FILE_NOT_OPENED;
     }
 
-    /* goes to requested block */
-    if (lseek(data->fd, (off_t)lba * (off_t)2048, SEEK_SET) == (off_t) -1) {
-        return ISO_FILE_SEEK_ERROR;
+    /* Blocks outside the map, e.g. because the file grew after it was
+       opened, get read by pread() */
+    if (data->map != NULL &&
+        (off_t) (lba + (off_t) count) * (off_t) 2048 <= data->map_size) {
+        memcpy(buffer, data->map + (off_t) lba * (off_t) 2048,
+               (size_t) count * 2048);
+        return ISO_SUCCESS;
     }
 
-    /* TODO #00008 : guard against partial reads. */
-    if (read(data->fd, buffer, 2048) != 2048) {
-        return ISO_FILE_READ_ERROR;
+    /* pread() does not move the file pointer. So concurrent readers do not
+       disturb each other. Partial reads get continued. */
+    todo = (size_t) count * 2048;
+    while (done < todo) {
+        ret = pread(data->fd, buffer + done, todo - done,
+                    (off_t) lba * (off_t) 2048 + (off_t) done);
+        if (ret == -1 && errno == EINTR)
+    continue;
+        if (ret == -1 && (errno == ESPIPE || errno == EINVAL))
+            return ISO_FILE_SEEK_ERROR;
+        if (ret <= 0)
+            return ISO_FILE_READ_ERROR;
+        done += ret;
     }
 
     return ISO_SUCCESS;
 }
 
+static int ds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
+{
+    return ds_read_blocks(src, lba, 1, buffer);
+}
+
 static
 void ds_free_data(IsoDataSource *src)
 {
@@ -136,6 +193,9 @@ void ds_free_data(IsoDataSource *src)
     data = (struct file_data_src*)src->data;
 
     /* close the file if needed */
+    if (data->map != NULL) {
+        munmap(data->map, (size_t) data->map_size);
+    }
     if (data->fd != -1) {
         close(data->fd);
     }
@@ -152,10 +212,13 @@ void ds_free_data(IsoDataSource *src)
  *     The path of the file
  * @param src
  *     Will be filled with the pointer to the newly created data source.
+ * @param flag
+ *     bit0= map the file into memory when the data source gets opened
  * @return
  *    1 on success, < 0 on error.
  */
-int iso_data_source_new_from_file(const char *path, IsoDataSource **src)
+static
+int ds_new(const char *path, IsoDataSource **src, int flag)
 {
     int ret;
     struct file_data_src *data;
@@ -191,7 +254,10 @@ int iso_data_source_new_from_file(const char *path, IsoDataSource **src)
     }
 
     data->fd = -1;
-    ds->version = 0;
+    data->use_mmap = flag & 1;
+    data->map = NULL;
+    data->map_size = 0;
+    ds->version = 1;
     ds->refcount = 1;
     ds->data = data;
 
@@ -199,7 +265,289 @@ int iso_data_source_new_from_file(const char *path, IsoDataSource **src)
     ds->close = ds_close;
     ds->read_block = ds_read_block;
     ds->free_data = ds_free_data;
+    ds->read_blocks = ds_read_blocks;
 
     *src = ds;
     return ISO_SUCCESS;
 }
+
+int iso_data_source_new_from_file(const char *path, IsoDataSource **src)
+{
+    return ds_new(path, src, 0);
+}
+
+int iso_data_source_new_mmap(const char *path, IsoDataSource **src,
+                             int flag)
+{
+    return ds_new(path, src, 1);
+}
+
+
+int iso_data_source_read_blocks(IsoDataSource *src, uint32_t lba,
+                                uint32_t count, uint8_t *buffer)
+{
+    int ret;
+    uint32_t i;
+
+    if (src->version >= 1 && src->read_blocks != NULL)
+        return src->read_blocks(src, lba, count, buffer);
+    for (i = 0; i < count; i++) {
+        ret = src->read_block(src, lba + i, buffer + (size_t) i * 2048);
+        if (ret < 0)
+            return ret;
+    }
+    return ISO_SUCCESS;
+}
+
+
+/* ------------------------- Caching IsoDataSource ------------------------- */
+
+/**
+ * Private data for the caching IsoDataSource
+ */
+struct cached_data_src
+{
+    IsoDataSource *src;
+
+    uint32_t chunk_blocks;
+    int num_chunks;
+
+    uint8_t *mem;            /* num_chunks * chunk_blocks * 2048 bytes */
+    uint32_t *chunk_lba;     /* first block of the chunk */
+    uint32_t *chunk_fill;    /* number of valid blocks. 0 = unused chunk */
+    uint64_t *chunk_used;    /* value of use_counter at last usage */
+    uint64_t use_counter;
+
+    /* The cache may be used by concurrent threads */
+    pthread_mutex_t mutex;
+};
+
+static
+int cds_open(IsoDataSource *src)
+{
+    struct cached_data_src *data;
+
+    data = (struct cached_data_src *) src->data;
+    return data->src->open(data->src);
+}
+
+static
+void cds_invalidate(struct cached_data_src *data)
+{
+    int i;
+
+    for (i = 0; i < data->num_chunks; i++)
+        data->chunk_fill[i] = 0;
+}
+
+static
+int cds_close(IsoDataSource *src)
+{
+    struct cached_data_src *data;
+
+    data = (struct cached_data_src *) src->data;
+    pthread_mutex_lock(&data->mutex);
+    cds_invalidate(data);
+    pthread_mutex_unlock(&data->mutex);
+    return data->src->close(data->src);
+}
+
+/* To be called under data->mutex.
+   @return index of the chunk which holds lba, or -1 on error
+*/
+static
+int cds_get_chunk(struct cached_data_src *data, uint32_t lba, int *error)
+{
+    int i, victim = 0, ret;
+    uint32_t start;
+
+    for (i = 0; i < data->num_chunks; i++) {
+        if (data->chunk_fill[i] > 0 && lba >= data->chunk_lba[i] &&
+            lba - data->chunk_lba[i] < data->chunk_fill[i])
+            goto hit;
+        if (data->chunk_used[i] < data->chunk_used[victim])
+            victim = i;
+    }
+
+    /* Cache miss: read the whole aligned chunk into the least recently
+       used one. Near the end of the medium it may fail. Then only the
+       desired block gets read.
+    */
+    i = victim;
+    start = lba - lba % data->chunk_blocks;
+    data->chunk_fill[i] = 0;
+    ret = iso_data_source_read_blocks(data->src, start, data->chunk_blocks,
+                                      data->mem + (size_t) i *
+                                                  data->chunk_blocks * 2048);
+    if (ret >= 0) {
+        data->chunk_lba[i] = start;
+        data->chunk_fill[i] = data->chunk_blocks;
+    } else {
+        ret = data->src->read_block(data->src, lba,
+                                    data->mem + (size_t) i *
+                                                data->chunk_blocks * 2048);
+        if (ret < 0) {
+            *error = ret;
+            return -1;
+        }
+        data->chunk_lba[i] = lba;
+        data->chunk_fill[i] = 1;
+    }
+hit:;
+    data->chunk_used[i] = ++(data->use_counter);
+    return i;
+}
+
+static
+int cds_read_blocks(IsoDataSource *src, uint32_t lba, uint32_t count,
+                    uint8_t *buffer)
+{
+    struct cached_data_src *data;
+    int i, ret = ISO_SUCCESS;
+    uint32_t done = 0, todo, offset;
+
+    if (src == NULL || src->data == NULL || buffer == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    data = (struct cached_data_src *) src->data;
+
+    if (count >= data->chunk_blocks) {
+        /* Large reads do not profit from the cache */
+        return iso_data_source_read_blocks(data->src, lba, count, buffer);
+    }
+
+    pthread_mutex_lock(&data->mutex);
+    while (done < count) {
+        i = cds_get_chunk(data, lba + done, &ret);
+        if (i < 0)
+    break;
+        offset = lba + done - data->chunk_lba[i];
+        todo = data->chunk_fill[i] - offset;
+        if (todo > count - done)
+            todo = count - done;
+        memcpy(buffer + (size_t) done * 2048,
+               data->mem + ((size_t) i * data->chunk_blocks + offset) * 2048,
+               (size_t) todo * 2048);
+        done += todo;
+    }
+    pthread_mutex_unlock(&data->mutex);
+    return ret;
+}
+
+static
+int cds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
+{
+    return cds_read_blocks(src, lba, 1, buffer);
+}
+
+static
+void cds_free_data(IsoDataSource *src)
+{
+    struct cached_data_src *data;
+
+    data = (struct cached_data_src *) src->data;
+    iso_data_source_unref(data->src);
+    pthread_mutex_destroy(&data->mutex);
+    free(data->mem);
+    free(data->chunk_lba);
+    free(data->chunk_fill);
+    free(data->chunk_used);
+    free(data);
+}
+
+int iso_data_source_new_cached(IsoDataSource *src, int chunk_blocks,
+                               int num_chunks, IsoDataSource **cached,
+                               int flag)
+{
+    struct cached_data_src *data = NULL;
+    IsoDataSource *ds = NULL;
+
+    if (src == NULL || cached == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (chunk_blocks == 0)
+        chunk_blocks = 32;
+    if (num_chunks == 0)
+        num_chunks = 32;
+    if (chunk_blocks < 0 || chunk_blocks > 8192 ||
+        num_chunks < 0 || num_chunks > 65536)
+        return ISO_WRONG_ARG_VALUE;
+
+    data = calloc(1, sizeof(struct cached_data_src));
+    ds = calloc(1, sizeof(IsoDataSource));
+    if (data == NULL || ds == NULL)
+        goto no_mem;
+    data->chunk_blocks = chunk_blocks;
+    data->num_chunks = num_chunks;
+    data->use_counter = 0;
+    data->mem = calloc((size_t) num_chunks * chunk_blocks, 2048);
+    data->chunk_lba = calloc(num_chunks, sizeof(uint32_t));
+    data->chunk_fill = calloc(num_chunks, sizeof(uint32_t));
+    data->chunk_used = calloc(num_chunks, sizeof(uint64_t));
+    if (data->mem == NULL || data->chunk_lba == NULL ||
+        data->chunk_fill == NULL || data->chunk_used == NULL)
+        goto no_mem;
+    if (pthread_mutex_init(&data->mutex, NULL) != 0)
+        goto no_mem;
+    data->src = src;
+    iso_data_source_ref(src);
+
+    ds->version = 1;
+    ds->refcount = 1;
+    ds->data = data;
+    ds->open = cds_open;
+    ds->close = cds_close;
+    ds->read_block = cds_read_block;
+    ds->free_data = cds_free_data;
+    ds->read_blocks = cds_read_blocks;
+
+    *cached = ds;
+    return ISO_SUCCESS;
+
+no_mem:;
+    if (data != NULL) {
+        if (data->mem != NULL)
+            free(data->mem);
+        if (data->chunk_lba != NULL)
+            free(data->chunk_lba);
+        if (data->chunk_fill != NULL)
+            free(data->chunk_fill);
+        if (data->chunk_used != NULL)
+            free(data->chunk_used);
+        free(data);
+    }
+    if (ds != NULL)
+        free(ds);
+    return ISO_OUT_OF_MEM;
+}
+
+
+int iso_data_source_map_blocks(IsoDataSource *src, uint32_t lba,
+                               uint32_t count, uint8_t **data)
+{
+    struct file_data_src *fdata;
+
+    if (src->read_block == cds_read_block)
+        return iso_data_source_map_blocks(
+                       ((struct cached_data_src *) src->data)->src,
+                       lba, count, data);
+    if (src->read_block != ds_read_block)
+        return 0;
+    fdata = (struct file_data_src *) src->data;
+    if (fdata->map == NULL)
+        return 0;
+    if ((off_t) (lba + (off_t) count) * (off_t) 2048 > fdata->map_size)
+        return 0;
+    *data = fdata->map + (off_t) lba * (off_t) 2048;
+    return 1;
+}
+
+
+int iso_data_source_concurrent_ok(IsoDataSource *src)
+{
+    if (src->read_block == cds_read_block)
+        return iso_data_source_concurrent_ok(
+                                 ((struct cached_data_src *) src->data)->src);
+    /* pread() and memory maps do not depend on a file pointer */
+    return (src->read_block == ds_read_block);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+#ifndef LIBISO_DATA_SOURCE_H_
+#define LIBISO_DATA_SOURCE_H_
+
+/**
+ * Read count consecutive blocks from the data source. This uses the method
+ * read_blocks() if the data source has one. Else read_block() gets called
+ * for each block.
+ *
+ * @return
+ *      1 on success, < 0 on error
+ */
+int iso_data_source_read_blocks(IsoDataSource *src, uint32_t lba,
+                                uint32_t count, uint8_t *buffer);
+
+/**
+ * Obtain a pointer to count consecutive blocks of a data source which
+ * was made by iso_data_source_new_mmap(), or by iso_data_source_new_cached()
+ * on top of such a data source. The memory stays valid until the data
+ * source gets closed.
+ *
+ * @return
+ *      1 = *data points to the blocks,
+ *      0 = the blocks are not mapped and have to be read
+ */
+int iso_data_source_map_blocks(IsoDataSource *src, uint32_t lba,
+                               uint32_t count, uint8_t **data);
+
+/**
+ * Tell whether the data source is known to allow concurrent calls of
+ * read_block() and read_blocks() by several threads. This is the case with
+ * the data sources of iso_data_source_new_from_file() and
+ * iso_data_source_new_mmap(), and with iso_data_source_new_cached() on top
+ * of one of them.
+ * Whether reading ahead by threads is worthwhile is a different question.
+ * iso_image_import() does not do it with memory mapped data sources.
+ *
+ * @return
+ *      1 = concurrent reading is safe, 0 = it is not known to be safe
+ */
+int iso_data_source_concurrent_ok(IsoDataSource *src);
+
+#endif /*LIBISO_DATA_SOURCE_H_*/
@@ -88,6 +88,7 @@ void ecma119_image_free(Ecma119Image *t)
         iso_image_unref(t->image);
     if (t->files != NULL)
         iso_rbtree_destroy(t->files, iso_file_src_free);
+    iso_file_src_dedup_destroy(&(t->dedup));
     if (t->ecma119_hidden_list != NULL)
         iso_filesrc_list_destroy(&(t->ecma119_hidden_list));
     if (t->buffer != NULL)
@@ -98,6 +99,13 @@ void ecma119_image_free(Ecma119Image *t)
         writer->free_data(writer);
         free(writer);
     }
+    /* Trees of ecma119_create_trees() without writer */
+    if (t->joliet_root != NULL)
+        joliet_tree_free(t);
+    if (t->iso1999_root != NULL)
+        iso1999_tree_free(t);
+    if (t->hfsp_leafs != NULL)
+        hfsplus_tree_free(t);
     if (t->input_charset != NULL)
         free(t->input_charset);
     if (t->output_charset != NULL)
@@ -112,6 +120,8 @@ void ecma119_image_free(Ecma119Image *t)
         free(t->boot_intvl_size);
     if (t->system_area_data != NULL)
         free(t->system_area_data);
+    if (t->checksum_pipe != NULL)
+        iso_md5_pipe_destroy(&(t->checksum_pipe));
     if (t->checksum_ctx != NULL) { /* dispose checksum context */
         char md5[16];
         iso_md5_end(&(t->checksum_ctx), md5);
@@ -122,6 +132,7 @@ void ecma119_image_free(Ecma119Image *t)
         free(t->writers);
     if (t->partition_root != NULL)
         ecma119_node_free(t->partition_root);
+    iso_arena_destroy(&(t->ecma119_arena));
     for (i = 0; i < ISO_HFSPLUS_BLESS_MAX; i++)
         if (t->hfsplus_blessed[i] != NULL)
             iso_node_unref(t->hfsplus_blessed[i]);
@@ -627,7 +638,8 @@ int ecma119_writer_write_vol_desc(IsoImageWriter *writer)
 }
 
 static
-int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent)
+int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent,
+                  struct iso_render_out *out)
 {
     int ret;
     uint8_t *buffer = NULL;
@@ -700,7 +712,7 @@ int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent)
 
             if ( (buf + len - buffer) > BLOCK_SIZE) {
                 /* dir doesn't fit in current block */
-                ret = iso_write(t, buffer, BLOCK_SIZE);
+                ret = iso_write_render(t, out, buffer, BLOCK_SIZE);
                 if (ret < 0) {
                     goto ex;
                 }
@@ -714,14 +726,14 @@ int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent)
     }
 
     /* write the last block */
-    ret = iso_write(t, buffer, BLOCK_SIZE);
+    ret = iso_write_render(t, out, buffer, BLOCK_SIZE);
     if (ret < 0) {
         goto ex;
     }
 
     /* write the Continuation Area if needed */
     if (info.ce_len > 0) {
-        ret = rrip_write_ce_fields(t, &info);
+        ret = rrip_write_ce_fields(t, &info, out);
     }
 
 ex:;
@@ -729,29 +741,79 @@ ex:;
     return ret;
 }
 
+struct ecma119_dir_render {
+    Ecma119Image *t;
+    Ecma119Node **dirs;
+    Ecma119Node **parents;
+    size_t count;
+    size_t max;
+};
+
 static
-int write_dirs(Ecma119Image *t, Ecma119Node *root, Ecma119Node *parent)
+void collect_dirs(struct ecma119_dir_render *r, Ecma119Node *dir,
+                  Ecma119Node *parent)
 {
-    int ret;
     size_t i;
 
-    /* write all directory entries for this dir */
-    ret = write_one_dir(t, root, parent);
-    if (ret < 0) {
-        return ret;
+    if (r->count >= r->max) {
+        /* Mismatch with calc_dir_pos() will be detected by the caller */
+        r->count++;
+        return;
     }
-
-    /* recurse */
-    for (i = 0; i < root->info.dir->nchildren; i++) {
-        Ecma119Node *child = root->info.dir->children[i];
+    r->dirs[r->count] = dir;
+    r->parents[r->count] = parent;
+    r->count++;
+    for (i = 0; i < dir->info.dir->nchildren; i++) {
+        Ecma119Node *child = dir->info.dir->children[i];
         if (child->type == ECMA119_DIR) {
-            ret = write_dirs(t, child, root);
-            if (ret < 0) {
-                return ret;
-            }
+            collect_dirs(r, child, dir);
         }
     }
-    return ISO_SUCCESS;
+}
+
+static
+int render_one_dir(void *ctx, size_t idx, struct iso_render_out *out)
+{
+    struct ecma119_dir_render *r = ctx;
+
+    return write_one_dir(r->t, r->dirs[idx], r->parents[idx], out);
+}
+
+/**
+ * Write the directories of the tree in the order of calc_dir_pos().
+ * end_block is the first block after the last directory.
+ */
+static
+int write_dirs(Ecma119Image *t, Ecma119Node *root, uint32_t end_block)
+{
+    int ret;
+    size_t i;
+    struct ecma119_dir_render r;
+    uint32_t *blocks = NULL;
+
+    memset(&r, 0, sizeof(r));
+    r.t = t;
+    r.max = t->ndirs;
+    LIBISO_ALLOC_MEM(r.dirs, Ecma119Node *, r.max);
+    LIBISO_ALLOC_MEM(r.parents, Ecma119Node *, r.max);
+    LIBISO_ALLOC_MEM(blocks, uint32_t, r.max + 1);
+
+    collect_dirs(&r, root, root);
+    if (r.count != r.max) {
+        iso_msg_submit(t->image->id, ISO_ASSERT_FAILURE, 0,
+                       "Number of directories differs from ECMA-119 layout");
+        ret = ISO_ASSERT_FAILURE; goto ex;
+    }
+    for (i = 0; i < r.count; i++)
+        blocks[i] = r.dirs[i]->info.dir->block;
+    blocks[r.count] = end_block;
+
+    ret = iso_render_dirs(t, r.count, blocks, render_one_dir, &r);
+ex:;
+    LIBISO_FREE_MEM(blocks);
+    LIBISO_FREE_MEM(r.parents);
+    LIBISO_FREE_MEM(r.dirs);
+    return ret;
 }
 
 static
@@ -897,7 +959,10 @@ int ecma119_writer_write_dirs(IsoImageWriter *writer)
     } else {
         root = t->root;
     }
-    ret = write_dirs(t, root, root);
+    if (t->eff_partition_offset > 0)
+        ret = write_dirs(t, root, t->partition_l_table_pos);
+    else
+        ret = write_dirs(t, root, t->l_path_table_pos);
     if (ret < 0) {
         return ret;
     }
@@ -1336,6 +1401,10 @@ int process_preserved_cx(IsoDir *dir, int flag)
 static
 int transplant_checksum_buffer(Ecma119Image *target, int flag)
 {
+    /* The checksum thread may still store file checksums in the buffer */
+    if (target->checksum_pipe != NULL)
+        iso_md5_pipe_sync(target->checksum_pipe);
+
     /* Transplant checksum buffer from Ecma119Image to IsoImage */
     iso_image_set_checksums(target->image, target->checksum_buffer,
                             target->checksum_range_start,
@@ -2175,6 +2244,71 @@ void issue_ucs2_warning_summary(size_t failures)
 }
 
 
+void ecma119_trees_lock(Ecma119Image *target, int flag)
+{
+    if (!target->trees_concurrent)
+        return;
+    if (flag & 1)
+        pthread_mutex_unlock(&target->tree_mutex);
+    else
+        pthread_mutex_lock(&target->tree_mutex);
+}
+
+
+struct ecma119_tree_task {
+    Ecma119Image *target;
+    int ntasks;
+    int (*create[3])(Ecma119Image *target);
+};
+
+static
+int ecma119_tree_task_run(void *ctx, size_t idx)
+{
+    struct ecma119_tree_task *task = ctx;
+
+    return task->create[idx](task->target);
+}
+
+/* Create the Joliet, ISO 9660:1999, and HFS+ trees by concurrent threads.
+   This is only done if the ECMA-119 tree has registered all file sources.
+   Else the order of registration would decide about the checksum indice.
+   The writer creation functions use the trees or create them if not done
+   here.
+*/
+static
+int ecma119_create_trees(Ecma119Image *target)
+{
+    int ret;
+    IsoWriteOpts *opts = target->opts;
+    struct ecma119_tree_task task;
+
+    if (opts->tree_threads <= 1 || opts->partition_offset > 0 ||
+        target->ecma119_omitted)
+        return ISO_SUCCESS;
+
+    task.target = target;
+    task.ntasks = 0;
+    if (opts->joliet)
+        task.create[task.ntasks++] = joliet_tree_create;
+    if (opts->iso1999)
+        task.create[task.ntasks++] = iso1999_tree_create;
+    if (opts->hfsplus || opts->fat)
+        task.create[task.ntasks++] = hfsplus_tree_create;
+    if (task.ntasks < 2)
+        return ISO_SUCCESS;
+
+    iso_msg_debug(target->image->id, "Creating %d trees concurrently...",
+                  task.ntasks);
+    pthread_mutex_init(&target->tree_mutex, NULL);
+    target->trees_concurrent = 1;
+    ret = iso_run_parallel(task.ntasks, (size_t) task.ntasks, 1,
+                           ecma119_tree_task_run, &task);
+    target->trees_concurrent = 0;
+    pthread_mutex_destroy(&target->tree_mutex);
+    return ret;
+}
+
+
 static
 void *write_function(void *arg)
 {
@@ -2521,6 +2655,7 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
         goto target_cleanup;
     }
     target->ecma119_hidden_list = NULL;
+    target->dedup = NULL;
 
     target->image = src;
     iso_image_ref(src);
@@ -2650,6 +2785,7 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
 
     target->checksum_idx_counter = 0;
     target->checksum_ctx = NULL;
+    target->checksum_pipe = NULL;
     target->checksum_counter = 0;
     target->checksum_rlsb_tag_pos = 0;
     target->checksum_sb_tag_pos = 0;
@@ -2836,6 +2972,10 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
         }
     }
 
+    ret = ecma119_create_trees(target);
+    if (ret < 0)
+        goto target_cleanup;
+
     /* create writer for Joliet structure */
     if (opts->joliet) {
         ret = joliet_writer_create(target);
@@ -3223,6 +3363,15 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
         if (ret < 0)
             goto target_cleanup;
     }
+    if (opts->md5_session_checksum || (opts->md5_file_checksums & 1)) {
+        /* Let a thread of its own compute the session checksum and the
+           checksums of the data files */
+        ret = iso_md5_pipe_new(target->checksum_ctx,
+                               &(target->checksum_pipe));
+        if (ret < 0)
+            iso_msg_debug(target->image->id,
+                  "Cannot create checksum thread. Writer thread will do it.");
+    }
 
     if (opts->apm_block_size == 0) {
         if (target->gpt_req_count)
@@ -3435,6 +3584,11 @@ int iso_image_create_burn_source(IsoImage *image, IsoWriteOpts *opts,
         return ISO_NULL_POINTER;
     }
 
+    /* The writer needs the complete tree of a lazily imported image */
+    ret = iso_image_load_lazy_dirs(image, 0);
+    if (ret < 0)
+        return ret;
+
     source = calloc(1, sizeof(struct burn_source));
     if (source == NULL) {
         return ISO_OUT_OF_MEM;
@@ -3468,27 +3622,19 @@ int iso_image_create_burn_source(IsoImage *image, IsoWriteOpts *opts,
     return ISO_SUCCESS;
 }
 
-int iso_write(Ecma119Image *target, void *buf, size_t count)
+/* Account written data for checksum, Jigdo, and progress */
+static
+int iso_write_account(Ecma119Image *target, void *buf, size_t count)
 {
     int ret;
 
-    if (target->bytes_written + (off_t) count > target->total_size) {
-        iso_msg_submit(target->image->id, ISO_ASSERT_FAILURE, 0,
-                       "ISO overwrite");
-        return ISO_ASSERT_FAILURE;
-    }
-
-    ret = iso_ring_buffer_write(target->buffer, buf, count);
-    if (ret == 0) {
-        /* reader cancelled */
-        return ISO_CANCELED;
-    }
-    if (ret < 0)
-        return ret;
     if (target->checksum_ctx != NULL) {
         /* Add to image checksum */
         target->checksum_counter += count;
-        iso_md5_compute(target->checksum_ctx, (char *) buf, (int) count);
+        if (target->checksum_pipe != NULL)
+            iso_md5_pipe_feed(target->checksum_pipe, (char *) buf, count);
+        else
+            iso_md5_compute(target->checksum_ctx, (char *) buf, (int) count);
     }
 
     ret = show_chunk_to_jte(target, buf, count);
@@ -3516,6 +3662,184 @@ int iso_write(Ecma119Image *target, void *buf, size_t count)
     return ISO_SUCCESS;
 }
 
+int iso_write(Ecma119Image *target, void *buf, size_t count)
+{
+    int ret;
+
+    if (target->bytes_written + (off_t) count > target->total_size) {
+        iso_msg_submit(target->image->id, ISO_ASSERT_FAILURE, 0,
+                       "ISO overwrite");
+        return ISO_ASSERT_FAILURE;
+    }
+
+    ret = iso_ring_buffer_write(target->buffer, buf, count);
+    if (ret == 0) {
+        /* reader cancelled */
+        return ISO_CANCELED;
+    }
+    if (ret < 0)
+        return ret;
+    return iso_write_account(target, buf, count);
+}
+
+int iso_write_reserve(Ecma119Image *target, size_t count, void **data)
+{
+    int ret;
+    size_t avail;
+
+    if (target->bytes_written + (off_t) count > target->total_size) {
+        iso_msg_submit(target->image->id, ISO_ASSERT_FAILURE, 0,
+                       "ISO overwrite");
+        return ISO_ASSERT_FAILURE;
+    }
+
+    ret = iso_ring_buffer_write_reserve(target->buffer, count,
+                                        (uint8_t **) data, &avail);
+    if (ret == 0) {
+        /* reader cancelled */
+        return ISO_CANCELED;
+    }
+    return ret;
+}
+
+int iso_write_commit(Ecma119Image *target, size_t count)
+{
+    int ret;
+    uint8_t *data;
+    size_t avail;
+
+    /* The memory stays reserved until it gets committed */
+    ret = iso_ring_buffer_write_reserve(target->buffer, count, &data, &avail);
+    if (ret == 0)
+        return ISO_CANCELED;
+    if (ret < 0)
+        return ret;
+    if (ret != 1)
+        return ISO_ASSERT_FAILURE;
+
+    /* Checksum and Jigdo see the data before the reader may take it */
+    ret = iso_write_account(target, data, count);
+    if (ret < 0)
+        return ret;
+    return iso_ring_buffer_write_commit(target->buffer, count);
+}
+
+int iso_write_render(Ecma119Image *target, struct iso_render_out *out,
+                     void *buf, size_t count)
+{
+    if (out == NULL)
+        return iso_write(target, buf, count);
+    if (out->overflow || out->used + count > out->size) {
+        out->overflow = 1;
+        return ISO_SUCCESS;
+    }
+    memcpy(out->buf + out->used, buf, count);
+    out->used += count;
+    return ISO_SUCCESS;
+}
+
+/* Memory for the directories which get rendered in one run of
+   iso_render_dirs() */
+#define ISO_RENDER_ARENA_SIZE (16 * 1024 * 1024)
+
+struct iso_render_batch {
+    int (*render)(void *ctx, size_t idx, struct iso_render_out *out);
+    void *ctx;
+    size_t first;
+    struct iso_render_out *outs;
+    int *rets;
+};
+
+static
+int iso_render_batch_one(void *ctx, size_t idx)
+{
+    struct iso_render_batch *b = ctx;
+
+    if (b->outs[idx].buf == NULL)
+        return ISO_SUCCESS;
+    /* A failure gets reported by the caller in the order of the directories */
+    b->rets[idx] = b->render(b->ctx, b->first + idx, b->outs + idx);
+    return ISO_SUCCESS;
+}
+
+int iso_render_dirs(Ecma119Image *target, size_t count, uint32_t *blocks,
+                    int (*render)(void *ctx, size_t idx,
+                                  struct iso_render_out *out),
+                    void *ctx)
+{
+    int ret;
+    size_t i, j, k, size, used, arena_size;
+    uint8_t *arena = NULL;
+    struct iso_render_out *outs = NULL;
+    int *rets = NULL;
+    struct iso_render_batch batch;
+
+    if (target->opts->tree_threads <= 1 || count < 2) {
+        for (i = 0; i < count; i++) {
+            ret = render(ctx, i, NULL);
+            if (ret < 0)
+                goto ex;
+        }
+        ret = ISO_SUCCESS; goto ex;
+    }
+
+    arena_size = ((size_t) (blocks[count] - blocks[0])) * BLOCK_SIZE;
+    if (arena_size > ISO_RENDER_ARENA_SIZE)
+        arena_size = ISO_RENDER_ARENA_SIZE;
+    LIBISO_ALLOC_MEM(arena, uint8_t, arena_size);
+    LIBISO_ALLOC_MEM(outs, struct iso_render_out, count);
+    LIBISO_ALLOC_MEM(rets, int, count);
+    batch.render = render;
+    batch.ctx = ctx;
+
+    for (i = 0; i < count; i = j) {
+        /* Assign arena memory to as many directories as possible */
+        used = 0;
+        for (j = i; j < count; j++) {
+            size = ((size_t) (blocks[j + 1] - blocks[j])) * BLOCK_SIZE;
+            if (used + size > arena_size && j > i)
+        break;
+            memset(outs + j, 0, sizeof(struct iso_render_out));
+            rets[j] = 0;
+            if (size <= arena_size) {
+                outs[j].buf = arena + used;
+                outs[j].size = size;
+                used += size;
+            }
+        }
+
+        batch.first = i;
+        batch.outs = outs + i;
+        batch.rets = rets + i;
+        ret = iso_run_parallel(target->opts->tree_threads, j - i, 1,
+                               iso_render_batch_one, &batch);
+        if (ret < 0)
+            goto ex;
+
+        /* Stream the finished blocks. Directories which did not get
+           rendered completely are written directly. A failed rendering
+           is not tried again, because this would repeat its messages. */
+        for (k = i; k < j; k++) {
+            if (rets[k] < 0) {
+                ret = rets[k]; goto ex;
+            }
+            if (rets[k] > 0 && !outs[k].overflow &&
+                outs[k].used == outs[k].size)
+                ret = iso_write(target, outs[k].buf, outs[k].used);
+            else
+                ret = render(ctx, k, NULL);
+            if (ret < 0)
+                goto ex;
+        }
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    LIBISO_FREE_MEM(rets);
+    LIBISO_FREE_MEM(outs);
+    LIBISO_FREE_MEM(arena);
+    return ret;
+}
+
 int iso_write_opts_new(IsoWriteOpts **opts, int profile)
 {
     int i;
@@ -3562,6 +3886,9 @@ int iso_write_opts_new(IsoWriteOpts **opts, int profile)
     wopts->hfsplus = 0;
     wopts->fat = 0;
     wopts->fifo_size = 1024; /* 2 MB buffer */
+    wopts->data_threads = 0;
+    wopts->tree_threads = 0;
+    wopts->content_dedup = 0;
     wopts->sort_files = 1; /* file sorting is always good */
     wopts->joliet_utf16 = 0;
     wopts->rr_reloc_dir = NULL;
@@ -4158,6 +4485,39 @@ int iso_write_opts_set_fifo_size(IsoWriteOpts *opts, size_t fifo_size)
     return ISO_SUCCESS;
 }
 
+int iso_write_opts_set_data_threads(IsoWriteOpts *opts, int num_threads)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (num_threads < 0 || num_threads > ISO_MAX_DATA_THREADS) {
+        return ISO_WRONG_ARG_VALUE;
+    }
+    opts->data_threads = num_threads;
+    return ISO_SUCCESS;
+}
+
+int iso_write_opts_set_tree_threads(IsoWriteOpts *opts, int num_threads)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (num_threads < 0 || num_threads > ISO_MAX_TREE_THREADS) {
+        return ISO_WRONG_ARG_VALUE;
+    }
+    opts->tree_threads = num_threads;
+    return ISO_SUCCESS;
+}
+
+int iso_write_opts_set_content_dedup(IsoWriteOpts *opts, int mode)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    opts->content_dedup = mode & 3;
+    return ISO_SUCCESS;
+}
+
 int iso_write_opts_get_data_start(IsoWriteOpts *opts, uint32_t *data_start,
                                   int flag)
 {
@@ -404,6 +404,28 @@ struct iso_write_opts {
      */
     size_t fifo_size;
 
+    /**
+     * Number of worker threads which read, filter and checksum the content
+     * of data files ahead of the writer thread. 0 or 1 means that the writer
+     * thread does all this work by itself.
+     */
+    int data_threads;
+
+    /**
+     * Number of threads which create the Joliet, ISO 9660:1999, and HFS+
+     * trees concurrently and convert and mangle names in parallel.
+     * 0 or 1 means that the calling thread does it.
+     */
+    int tree_threads;
+
+    /**
+     * Let files with equal content but different inode share one data
+     * extent. See iso_write_opts_set_content_dedup().
+     * bit0= enable deduplication by size and MD5
+     * bit1= confirm equality by comparing the bytes
+     */
+    int content_dedup;
+
     /**
      * This is not an option setting but a value returned after the options
      * were used to compute the layout of the image.
@@ -560,6 +582,9 @@ struct ecma119_image
     IsoImage *image;
     Ecma119Node *root;
 
+    /* Memory of the nodes and names of the ECMA-119 trees */
+    struct iso_arena *ecma119_arena;
+
     IsoWriteOpts *opts;
 
     /** Whether El Torito data will be produced */
@@ -641,6 +666,7 @@ struct ecma119_image
      * Joliet related information
      */
     JolietNode *joliet_root;
+    struct iso_arena *joliet_arena;
     size_t joliet_ndirs;
     uint32_t joliet_path_table_size;
     uint32_t joliet_l_path_table_pos;
@@ -652,6 +678,8 @@ struct ecma119_image
      * (by Vladimir Serbinenko, see libisofs/hfsplus.c)
      */
     HFSPlusNode *hfsp_leafs; 
+    /* Memory of the names in hfsp_leafs */
+    struct iso_arena *hfsp_arena;
     struct hfsplus_btree_level *hfsp_levels;
     uint32_t hfsp_nlevels; 
     uint32_t hfsp_part_start;
@@ -674,6 +702,7 @@ struct ecma119_image
      * ISO 9660:1999 related information
      */
     Iso1999Node *iso1999_root;
+    struct iso_arena *iso1999_arena;
     size_t iso1999_ndirs;
     uint32_t iso1999_path_table_size;
     uint32_t iso1999_l_path_table_pos;
@@ -755,10 +784,34 @@ struct ecma119_image
     /* tree of files sources */
     IsoRBTree *files;
 
+    /* Size and content lookup for opts->content_dedup. NULL if not used. */
+    struct iso_file_src_dedup *dedup;
+
     struct iso_filesrc_list_item *ecma119_hidden_list;
 
+    /* The ECMA-119 tree omitted some nodes of the IsoImage tree.
+       So the other trees might register file sources of their own.
+    */
+    int ecma119_omitted;
+
+    /* Number of bytes in the susp_cache of all ECMA-119 directories.
+       See ISO_SUSP_CACHE_MAX in rockridge.h.
+    */
+    size_t susp_cache_bytes;
+
+    /* Set while the Joliet, ISO 9660:1999, and HFS+ trees get created
+       concurrently. tree_mutex then guards the file source tree and the
+       reference counts of the IsoNode objects.
+    */
+    int trees_concurrent;
+    pthread_mutex_t tree_mutex;
+
     unsigned int checksum_idx_counter;
     void *checksum_ctx;
+    /* If not NULL: thread which adds the written data to checksum_ctx.
+       Call iso_md5_pipe_sync() before using checksum_ctx directly.
+    */
+    struct iso_md5_pipe *checksum_pipe;
     off_t checksum_counter;
     uint32_t checksum_rlsb_tag_pos;
     uint32_t checksum_sb_tag_pos;
@@ -1052,6 +1105,12 @@ int iso_write_partition_file(Ecma119Image *target, char *path,
 
 void issue_ucs2_warning_summary(size_t failures);
 
+/* Serialize access to data which are shared by concurrently created trees.
+   No-op if target->trees_concurrent is 0.
+   @param flag bit0= unlock rather than lock
+*/
+void ecma119_trees_lock(Ecma119Image *target, int flag);
+
 /* Tells whether ivr is a reader from imported_iso in a multi-session
    add-on situation, and thus to be kept in place.
 */
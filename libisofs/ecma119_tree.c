@@ -181,7 +181,7 @@ int create_ecma119_node(Ecma119Image *img, IsoNode *iso, Ecma119Node **node)
 {
     Ecma119Node *ecma;
 
-    ecma = calloc(1, sizeof(Ecma119Node));
+    ecma = iso_arena_alloc(img->ecma119_arena, sizeof(Ecma119Node));
     if (ecma == NULL) {
         return ISO_OUT_OF_MEM;
     }
@@ -210,7 +210,8 @@ int create_dir(Ecma119Image *img, IsoDir *iso, Ecma119Node **node)
             return ISO_OUT_OF_MEM;
     }
 
-    dir_info = calloc(1, sizeof(struct ecma119_dir_info));
+    dir_info = iso_arena_alloc(img->ecma119_arena,
+                               sizeof(struct ecma119_dir_info));
     if (dir_info == NULL) {
         if (children != NULL)
             free(children);
@@ -221,7 +222,6 @@ int create_dir(Ecma119Image *img, IsoDir *iso, Ecma119Node **node)
     if (ret < 0) {
         if (children != NULL)
             free(children);
-        free(dir_info);
         return ret;
     }
     (*node)->type = ECMA119_DIR;
@@ -358,11 +358,11 @@ void ecma119_node_free(Ecma119Node *node)
         }
         if (node->info.dir->children != NULL)
             free(node->info.dir->children);
-        free(node->info.dir);
+        if (node->info.dir->susp_cache != NULL)
+            free(node->info.dir->susp_cache);
     }
-    free(node->iso_name);
+    /* The node and its name belong to img->ecma119_arena */
     iso_node_unref(node->node);
-    free(node);
 }
 
 
@@ -551,6 +551,8 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
                     int nchildren = node->info.dir->nchildren++;
                     node->info.dir->children[nchildren] = child;
                     child->parent = node;
+                } else if (cret == 0 || hidden) {
+                    image->ecma119_omitted = 1;
                 }
                 pos = pos->next;
             }
@@ -565,8 +567,13 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
         goto ex;
     }
     if (!hidden) {
-        node->iso_name = iso_name;
-        iso_name = NULL; /* now owned by node, do not free */
+        if (iso_name != NULL) {
+            node->iso_name = iso_arena_strdup(image->ecma119_arena, iso_name);
+            if (node->iso_name == NULL) {
+                ret = ISO_OUT_OF_MEM;
+                goto ex;
+            }
+        }
         *tree = node;
         node = NULL;     /* now owned by caller, do not free */
     }
@@ -781,7 +788,7 @@ int mangle_single_dir(Ecma119Image *img, Ecma119Node *dir, int max_file_len,
                     }
                 }
                 if (ok) {
-                    char *new = strdup(tmp);
+                    char *new = iso_arena_strdup(img->ecma119_arena, tmp);
                     if (new == NULL) {
                         ret = ISO_OUT_OF_MEM;
                         goto mangle_cleanup;
@@ -793,7 +800,6 @@ int mangle_single_dir(Ecma119Image *img, Ecma119Node *dir, int max_file_len,
 #endif
 
                     iso_htable_remove_ptr(table, children[k]->iso_name, NULL);
-                    free(children[k]->iso_name);
                     children[k]->iso_name = new;
                     iso_htable_add(table, new, new);
 
@@ -897,12 +903,12 @@ int mangle_tree(Ecma119Image *img, Ecma119Node *dir, int recurse)
  * See IEEE P1282, section 4.1.5 for details
  */
 static
-int create_placeholder(Ecma119Node *parent, Ecma119Node *real,
-                       Ecma119Node **node)
+int create_placeholder(Ecma119Image *img, Ecma119Node *parent,
+                       Ecma119Node *real, Ecma119Node **node)
 {
     Ecma119Node *ret;
 
-    ret = calloc(1, sizeof(Ecma119Node));
+    ret = iso_arena_alloc(img->ecma119_arena, sizeof(Ecma119Node));
     if (ret == NULL) {
         return ISO_OUT_OF_MEM;
     }
@@ -912,11 +918,8 @@ int create_placeholder(Ecma119Node *parent, Ecma119Node *real,
      * If real is a dir, while placeholder is a file, ISO name restricctions
      * are different, what to do?
      */
-    ret->iso_name = strdup(real->iso_name);
-    if (ret->iso_name == NULL) {
-        free(ret);
-        return ISO_OUT_OF_MEM;
-    }
+    /* Names in the arena are never altered. So they may be shared. */
+    ret->iso_name = real->iso_name;
 
     /* take a ref to the IsoNode */
     ret->node = real->node;
@@ -949,7 +952,7 @@ size_t max_child_name_len(Ecma119Node *dir)
  * than 255 characters, as specified in ECMA-119, section 6.8.2.1
  */
 static
-int reparent(Ecma119Node *child, Ecma119Node *parent)
+int reparent(Ecma119Image *img, Ecma119Node *child, Ecma119Node *parent)
 {
     int ret;
     size_t i;
@@ -958,7 +961,7 @@ int reparent(Ecma119Node *child, Ecma119Node *parent)
     /* replace the child in the original parent with a placeholder */
     for (i = 0; i < child->parent->info.dir->nchildren; i++) {
         if (child->parent->info.dir->children[i] == child) {
-            ret = create_placeholder(child->parent, child, &placeholder);
+            ret = create_placeholder(img, child->parent, child, &placeholder);
             if (ret < 0) {
                 return ret;
             }
@@ -1022,7 +1025,7 @@ int reorder_tree(Ecma119Image *img, Ecma119Node *dir,
                 reloc = img->root;
             }
         }
-        ret = reparent(dir, reloc);
+        ret = reparent(img, dir, reloc);
         if (ret < 0) {
             return ret;
         }
@@ -1116,6 +1119,19 @@ int make_node_array(Ecma119Image *img, Ecma119Node *dir,
     return result;
 }
 
+/* A node of the hardlink sort array and its position in the tree */
+struct ecma119_ino_item {
+    Ecma119Node *node;
+    size_t seq;
+};
+
+/* A family of hardlink sort array items which needs a new inode number */
+struct ecma119_ino_family {
+    size_t start;
+    size_t next;
+    size_t seq; /* lowest tree position among the family members */
+};
+
 /*
  * @param flag
  *     bit0= compare stat properties and attributes 
@@ -1127,8 +1143,8 @@ int ecma119_node_cmp_flag(const void *v1, const void *v2, int flag)
     int ret;
     Ecma119Node *n1, *n2;
 
-    n1 = *((Ecma119Node **) v1);
-    n2 = *((Ecma119Node **) v2);
+    n1 = ((struct ecma119_ino_item *) v1)->node;
+    n2 = ((struct ecma119_ino_item *) v2)->node;
     if (n1 == n2)
         return 0;
 
@@ -1149,8 +1165,24 @@ int ecma119_node_cmp_nohard(const void *v1, const void *v2)
 }   
 
 static
-int family_set_ino(Ecma119Image *img, Ecma119Node **nodes, size_t family_start,
-                   size_t next_family, ino_t img_ino, ino_t prev_ino, int flag)
+int ecma119_ino_family_cmp(const void *v1, const void *v2)
+{
+    const struct ecma119_ino_family *f1 = v1, *f2 = v2;
+
+    if (f1->seq != f2->seq)
+        return (f1->seq < f2->seq ? -1 : 1);
+    return 0;
+}
+
+/*
+ * @param flag
+ *     bit0= do not hand out a new inode number but return 0 if one would
+ *           be needed
+ */
+static
+int family_set_ino(Ecma119Image *img, struct ecma119_ino_item *items,
+                   size_t family_start, size_t next_family,
+                   ino_t img_ino, ino_t prev_ino, int flag)
 {
     size_t i;
 
@@ -1167,21 +1199,43 @@ int family_set_ino(Ecma119Image *img, Ecma119Node **nodes, size_t family_start,
 
     }
     if (img_ino == 0) {
+        if (flag & 1)
+            return 0;
         img_ino = img_give_ino_number(img->image, 0);
     }
     for (i = family_start; i < next_family; i++) {
-        nodes[i]->ino = img_ino;
-        nodes[i]->nlink = next_family - family_start;
+        items[i].node->ino = img_ino;
+        items[i].node->nlink = next_family - family_start;
     }
     return 1;
 }
 
+/* Remember a family which needs a new inode number */
+static
+void family_defer_ino(struct ecma119_ino_item *items,
+                      size_t family_start, size_t next_family,
+                      struct ecma119_ino_family *fams, size_t *fam_count)
+{
+    size_t i, seq;
+
+    seq = items[family_start].seq;
+    for (i = family_start + 1; i < next_family; i++)
+        if (items[i].seq < seq)
+            seq = items[i].seq;
+    fams[*fam_count].start = family_start;
+    fams[*fam_count].next = next_family;
+    fams[*fam_count].seq = seq;
+    (*fam_count)++;
+}
+
 static
 int match_hardlinks(Ecma119Image *img, Ecma119Node *dir, int flag)
 {
     int ret;
-    size_t nodes_size = 0, node_count = 0, i, family_start;
+    size_t nodes_size = 0, node_count = 0, i, family_start, fam_count = 0;
     Ecma119Node **nodes = NULL;
+    struct ecma119_ino_item *items = NULL;
+    struct ecma119_ino_family *fams = NULL;
     unsigned int fs_id;
     dev_t dev_id;
     ino_t img_ino = 0, prev_ino = 0;
@@ -1191,17 +1245,26 @@ int match_hardlinks(Ecma119Image *img, Ecma119Node *dir, int flag)
         return ret;
     nodes_size = node_count;
     nodes = (Ecma119Node **) calloc(sizeof(Ecma119Node *), nodes_size);
-    if (nodes == NULL)
-        return ISO_OUT_OF_MEM;
+    items = calloc(sizeof(struct ecma119_ino_item), nodes_size);
+    fams = calloc(sizeof(struct ecma119_ino_family), nodes_size);
+    if (nodes == NULL || items == NULL || fams == NULL) {
+        ret = ISO_OUT_OF_MEM;
+        goto ex;
+    }
     ret = make_node_array(img, dir, nodes, nodes_size, &node_count, 0);
     if (ret < 0)
         goto ex;
+    for (i = 0; i < node_count; i++) {
+        items[i].node = nodes[i];
+        items[i].seq = i;
+    }
 
     /* Sort according to id tuples, IsoFileSrc identity, properties, xattr. */
     if (img->opts->hardlinks)
-        qsort(nodes, node_count, sizeof(Ecma119Node *), ecma119_node_cmp_hard);
+        qsort(items, node_count, sizeof(struct ecma119_ino_item),
+              ecma119_node_cmp_hard);
     else
-        qsort(nodes, node_count, sizeof(Ecma119Node *),
+        qsort(items, node_count, sizeof(struct ecma119_ino_item),
               ecma119_node_cmp_nohard);
 
     /* Hand out image inode numbers to all Ecma119Node.ino == 0 .
@@ -1209,28 +1272,46 @@ int match_hardlinks(Ecma119Image *img, Ecma119Node *dir, int flag)
        Split those image inode number families where the sort criterion
        differs.
     */
-    iso_node_get_id(nodes[0]->node, &fs_id, &dev_id, &img_ino, 1);
+    iso_node_get_id(items[0].node->node, &fs_id, &dev_id, &img_ino, 1);
     family_start = 0;
     for (i = 1; i < node_count; i++) {
-        if (nodes[i]->type != ECMA119_DIR &&
-            ecma119_node_cmp_hard(nodes + (i - 1), nodes + i) == 0) {
+        if (items[i].node->type != ECMA119_DIR &&
+            ecma119_node_cmp_hard(items + (i - 1), items + i) == 0) {
             /* Still in same ino family */
             if (img_ino == 0) { /* Just in case any member knows its img_ino */
-                iso_node_get_id(nodes[0]->node, &fs_id, &dev_id, &img_ino, 1);
+                iso_node_get_id(items[0].node->node, &fs_id, &dev_id,
+                                &img_ino, 1);
             }
     continue;
         }
-        family_set_ino(img, nodes, family_start, i, img_ino, prev_ino, 0);
+        if (family_set_ino(img, items, family_start, i, img_ino, prev_ino,
+                           1) == 0)
+            family_defer_ino(items, family_start, i, fams, &fam_count);
         prev_ino = img_ino;
-        iso_node_get_id(nodes[i]->node, &fs_id, &dev_id, &img_ino, 1);
+        iso_node_get_id(items[i].node->node, &fs_id, &dev_id, &img_ino, 1);
         family_start = i;
     }
-    family_set_ino(img, nodes, family_start, i, img_ino, prev_ino, 0);
+    if (family_set_ino(img, items, family_start, i, img_ino, prev_ino, 1) == 0)
+        family_defer_ino(items, family_start, i, fams, &fam_count);
+
+    /* The sort order of nodes without known inode number may depend on
+       their memory addresses. So new numbers get handed out in tree order.
+       This yields the same image no matter how the nodes were allocated.
+    */
+    qsort(fams, fam_count, sizeof(struct ecma119_ino_family),
+          ecma119_ino_family_cmp);
+    for (i = 0; i < fam_count; i++)
+        family_set_ino(img, items, fams[i].start, fams[i].next,
+                       (ino_t) 0, (ino_t) 0, 0);
 
     ret = ISO_SUCCESS;
 ex:;
     if (nodes != NULL)
         free((char *) nodes);
+    if (items != NULL)
+        free((char *) items);
+    if (fams != NULL)
+        free((char *) fams);
     return ret;
 }
 
@@ -1239,6 +1320,11 @@ int ecma119_tree_create(Ecma119Image *img)
     int ret;
     Ecma119Node *root;
 
+    if (img->ecma119_arena == NULL) {
+        ret = iso_arena_new(&img->ecma119_arena, 0, 0);
+        if (ret < 0)
+            return ret;
+    }
     ret = create_tree(img, (IsoNode*)img->image->root, &root, 1, 0, 0);
     if (ret <= 0) {
         if (ret == 0) {
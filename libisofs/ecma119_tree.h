@@ -46,6 +46,14 @@ struct ecma119_dir_info
      * Real parent if the dir has been reallocated. NULL otherwise.
      */
     Ecma119Node *real_parent;
+
+    /*
+     * SUSP fields of the children's directory records, as composed by
+     * rrip_calc_len() for replay by rrip_get_susp_fields() [rockridge.c].
+     */
+    uint8_t *susp_cache;
+    size_t susp_cache_len;
+    size_t susp_cache_alloc;
 };
 
 /**
@@ -66,6 +74,9 @@ struct ecma119_node
 
     uint32_t ino;
 
+    /* 1 + offset of the cached SUSP fields in parent's susp_cache, or 0 */
+    uint32_t susp_cache_pos;
+
     nlink_t nlink;
 
     /**< file, symlink, special, directory or placeholder */
@@ -96,7 +107,9 @@ int iso_filesrc_list_destroy(struct iso_filesrc_list_item **start_item);
 int ecma119_tree_create(Ecma119Image *img);
 
 /**
- * Free an Ecma119Node, and its children if node is a dir
+ * Release an Ecma119Node, and its children if node is a dir.
+ * The memory of the nodes and their names belongs to the ecma119_arena of
+ * the Ecma119Image and gets freed together with it.
  */
 void ecma119_node_free(Ecma119Node *node);
 
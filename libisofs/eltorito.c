@@ -280,6 +280,9 @@ int iso_tree_add_boot_node(IsoDir *parent, const char *name, IsoBoot **boot)
         return ret;
 
     /* find place where to insert */
+    ret = iso_dir_load_lazy(parent, 0);
+    if (ret < 0)
+        return ret;
     pos = &(parent->children);
     while (*pos != NULL && strcmp((*pos)->name, name) < 0) {
         pos = &((*pos)->next);
@@ -21,10 +21,13 @@
 #include "image.h"
 #include "stream.h"
 #include "md5.h"
+#include "eltorito.h"
+#include "filter.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 
 /* <<< */
 #include <stdio.h>
@@ -66,6 +69,365 @@ int iso_file_src_cmp(const void *n1, const void *n2)
     return ret;
 }
 
+/* ------------ Content deduplication of new data files ------------- */
+
+/* A registered data file source which may get shared by files with equal
+   content. Sources of the same size form a chain.
+*/
+struct iso_dedup_item {
+    off_t size;
+    IsoFileSrc *src;
+
+    /* 0= not computed yet, 1= md5 is valid, -1= stream cannot be read twice
+    */
+    int md5_state;
+    char md5[16];
+
+    struct iso_dedup_item *next;
+};
+
+struct iso_file_src_dedup {
+    /* off_t size -> chain of struct iso_dedup_item */
+    IsoHTable *sizes;
+
+    /* IsoStream of a duplicate -> IsoFileSrc which holds its content */
+    IsoHTable *streams;
+
+    /* Serializes the reading of file content while the trees are created
+       concurrently. See dedup_read().
+    */
+    pthread_mutex_t read_mutex;
+};
+
+/* Number of hash table slots */
+#define ISO_DEDUP_HTABLE_SIZE 4099
+
+static
+unsigned int dedup_size_hash(const void *key)
+{
+    uint64_t size;
+
+    size = *((off_t *) key);
+    return (unsigned int) (size ^ (size >> 32));
+}
+
+static
+int dedup_size_cmp(const void *a, const void *b)
+{
+    off_t s1, s2;
+
+    s1 = *((off_t *) a);
+    s2 = *((off_t *) b);
+    if (s1 == s2)
+        return 0;
+    return (s1 < s2 ? -1 : 1);
+}
+
+static
+unsigned int dedup_ptr_hash(const void *key)
+{
+    uintptr_t v;
+
+    v = (uintptr_t) key;
+    return (unsigned int) ((v >> 4) ^ (v >> 20));
+}
+
+static
+int dedup_ptr_cmp(const void *a, const void *b)
+{
+    if (a == b)
+        return 0;
+    return ((uintptr_t) a < (uintptr_t) b ? -1 : 1);
+}
+
+static
+void dedup_free_chain(void *key, void *data)
+{
+    struct iso_dedup_item *item, *next;
+
+    for (item = data; item != NULL; item = next) {
+        next = item->next;
+        free(item);
+    }
+}
+
+void iso_file_src_dedup_destroy(struct iso_file_src_dedup **dedup)
+{
+    if (*dedup == NULL)
+        return;
+    if ((*dedup)->sizes != NULL)
+        iso_htable_destroy((*dedup)->sizes, dedup_free_chain);
+    if ((*dedup)->streams != NULL)
+        iso_htable_destroy((*dedup)->streams, NULL);
+    pthread_mutex_destroy(&((*dedup)->read_mutex));
+    free(*dedup);
+    *dedup = NULL;
+}
+
+static
+int dedup_new(struct iso_file_src_dedup **dedup)
+{
+    int ret;
+    struct iso_file_src_dedup *o;
+
+    o = calloc(1, sizeof(struct iso_file_src_dedup));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    pthread_mutex_init(&(o->read_mutex), NULL);
+    ret = iso_htable_create(ISO_DEDUP_HTABLE_SIZE, dedup_size_hash,
+                            dedup_size_cmp, &(o->sizes));
+    if (ret < 0)
+        goto failure;
+    ret = iso_htable_create(ISO_DEDUP_HTABLE_SIZE, dedup_ptr_hash,
+                            dedup_ptr_cmp, &(o->streams));
+    if (ret < 0)
+        goto failure;
+    *dedup = o;
+    return ISO_SUCCESS;
+failure:;
+    iso_file_src_dedup_destroy(&o);
+    return ret;
+}
+
+/* Whether the content of file may be shared with other files.
+   Boot images are excluded because their IsoFileSrc may get patched.
+*/
+static
+int dedup_is_eligible(Ecma119Image *img, IsoFile *file, IsoFileSrc *fsrc)
+{
+    struct el_torito_boot_catalog *cat;
+    int i;
+
+    if (!(img->opts->content_dedup & 1) || fsrc->no_write)
+        return 0;
+    if (iso_stream_get_size(file->stream) <= 0)
+        return 0;
+    cat = img->image->bootcat;
+    if (cat != NULL)
+        for (i = 0; i < cat->num_bootimages; i++)
+            if (cat->bootimages[i]->image == file)
+                return 0;
+    return 1;
+}
+
+/* Compare the content of two streams byte by byte.
+   @return 1= equal, 0= different or not readable, <0 = error
+*/
+static
+int dedup_cmp_content(IsoStream *s1, IsoStream *s2)
+{
+    int ret, open1 = 0, open2 = 0;
+    char *buf1 = NULL, *buf2 = NULL;
+    size_t got1, got2;
+    off_t todo;
+
+    LIBISO_ALLOC_MEM(buf1, char, BLOCK_SIZE);
+    LIBISO_ALLOC_MEM(buf2, char, BLOCK_SIZE);
+    ret = iso_stream_open(s1);
+    if (ret < 0)
+        {ret = 0; goto ex;}
+    open1 = 1;
+    ret = iso_stream_open(s2);
+    if (ret < 0)
+        {ret = 0; goto ex;}
+    open2 = 1;
+    for (todo = iso_stream_get_size(s1); todo > 0; todo -= got1) {
+        ret = iso_stream_read_buffer(s1, buf1, BLOCK_SIZE, &got1);
+        if (ret < 0 || got1 == 0)
+            {ret = 0; goto ex;}
+        ret = iso_stream_read_buffer(s2, buf2, got1, &got2);
+        if (ret < 0 || got1 != got2 || memcmp(buf1, buf2, got1) != 0)
+            {ret = 0; goto ex;}
+    }
+    ret = 1;
+ex:;
+    if (open1)
+        iso_stream_close(s1);
+    if (open2)
+        iso_stream_close(s2);
+    LIBISO_FREE_MEM(buf1);
+    LIBISO_FREE_MEM(buf2);
+    return ret;
+}
+
+/* Read file content for the comparison of files.
+   If the trees are created concurrently, then the tree lock gets released
+   meanwhile, so that the other trees do not wait for the reading. The
+   reading itself is serialized, because the same stream may be wanted by
+   more than one tree.
+   @param flag bit0= compare the content of s1 and s2 rather than computing
+                     the MD5 of s1
+   @return as iso_stream_make_md5() or dedup_cmp_content()
+*/
+static
+int dedup_read(Ecma119Image *img, IsoStream *s1, IsoStream *s2, char md5[16],
+               int flag)
+{
+    int ret, concurrent;
+
+    concurrent = img->trees_concurrent;
+    if (concurrent) {
+        ecma119_trees_lock(img, 1);
+        pthread_mutex_lock(&(img->dedup->read_mutex));
+    }
+    /* The filter output caches have to survive for the write run */
+    iso_stream_hold_filter_cache(s1, 0);
+    if (flag & 1)
+        iso_stream_hold_filter_cache(s2, 0);
+    if (flag & 1)
+        ret = dedup_cmp_content(s1, s2);
+    else
+        ret = iso_stream_make_md5(s1, md5, 0);
+    if (ret <= 0) {
+        iso_stream_hold_filter_cache(s1, 2);
+        if (flag & 1)
+            iso_stream_hold_filter_cache(s2, 2);
+    }
+    if (concurrent) {
+        pthread_mutex_unlock(&(img->dedup->read_mutex));
+        ecma119_trees_lock(img, 0);
+    }
+    return ret;
+}
+
+/* Check whether the content source of file is already decided.
+   This has to be checked again after dedup_read(), because another tree
+   may have registered or mapped file meanwhile.
+   @return 1= *src is the mapped source of file, 0= none to be looked for,
+           2= *first is the chain of sources with the size of file
+*/
+static
+int dedup_known(Ecma119Image *img, IsoFile *file, IsoFileSrc **src,
+                struct iso_dedup_item **first)
+{
+    int ret;
+    off_t size;
+    struct iso_dedup_item *item;
+    void *data;
+
+    /* A duplicate which was already mapped by another tree */
+    ret = iso_htable_get(img->dedup->streams, file->stream, &data);
+    if (ret == 1) {
+        *src = data;
+        return 1;
+    }
+
+    size = iso_stream_get_size(file->stream);
+    ret = iso_htable_get(img->dedup->sizes, &size, &data);
+    if (ret != 1)
+        return 0;
+    *first = data;
+
+    /* Hard links get mapped by the file source tree without reading */
+    for (item = *first; item != NULL; item = item->next)
+        if (iso_stream_cmp_ino(item->src->stream, file->stream, 0) == 0)
+            return 0;
+    return 2;
+}
+
+/* Look for a registered source with the same content as file.
+   @param md5_state  Returns whether md5 got computed for file. See
+                     struct iso_dedup_item.
+   @return 1= *src is the source of a file with equal content,
+           0= none found , <0 = error
+*/
+static
+int dedup_lookup(Ecma119Image *img, IsoFile *file, IsoFileSrc **src,
+                 int *md5_state, char md5[16])
+{
+    int ret;
+    struct iso_dedup_item *first = NULL, *item;
+    char item_md5[16];
+
+    *md5_state = 0;
+    if (img->dedup == NULL) {
+        ret = dedup_new(&(img->dedup));
+        if (ret < 0)
+            return ret;
+    }
+    ret = dedup_known(img, file, src, &first);
+    if (ret != 2)
+        return ret;
+
+    ret = dedup_read(img, file->stream, NULL, md5, 0);
+    *md5_state = (ret > 0 ? 1 : -1);
+    ret = dedup_known(img, file, src, &first);
+    if (ret != 2 || *md5_state != 1)
+        return (ret == 1);
+
+    /* The chain only grows at its end and its items persist. So it may be
+       followed while the tree lock is released by dedup_read().
+    */
+    for (item = first; item != NULL; item = item->next) {
+        if (item->md5_state == 0) {
+            ret = dedup_read(img, item->src->stream, NULL, item_md5, 0);
+            if (item->md5_state == 0) {
+                item->md5_state = (ret > 0 ? 1 : -1);
+                memcpy(item->md5, item_md5, 16);
+            }
+        }
+        if (item->md5_state != 1 || memcmp(item->md5, md5, 16) != 0)
+    continue;
+        if (img->opts->content_dedup & 2) {
+            ret = dedup_read(img, item->src->stream, file->stream, NULL, 1);
+            if (ret < 0)
+                return ret;
+            if (ret == 0)
+    continue;
+        }
+        ret = dedup_known(img, file, src, &first);
+        if (ret != 2)
+            return ret;
+        ret = iso_htable_put(img->dedup->streams, file->stream, item->src);
+        if (ret < 0)
+            return ret;
+        *src = item->src;
+        iso_msg_debug(img->image->id,
+                      "Sharing data extent of equal content for file %s",
+                      file->node.name);
+        return 1;
+    }
+    ret = dedup_known(img, file, src, &first);
+    return (ret == 1);
+}
+
+/* Make a newly registered file source available as content for duplicates.
+*/
+static
+int dedup_register(Ecma119Image *img, IsoFileSrc *fsrc,
+                   int md5_state, char md5[16])
+{
+    int ret;
+    struct iso_dedup_item *item, *first = NULL;
+    void *data;
+
+    item = calloc(1, sizeof(struct iso_dedup_item));
+    if (item == NULL)
+        return ISO_OUT_OF_MEM;
+    item->size = iso_stream_get_size(fsrc->stream);
+    item->src = fsrc;
+    item->md5_state = md5_state;
+    if (md5_state == 1)
+        memcpy(item->md5, md5, 16);
+    ret = iso_htable_get(img->dedup->sizes, &(item->size), &data);
+    if (ret == 1) {
+        /* Append to the chain, so that the first source stays first */
+        first = data;
+        while (first->next != NULL)
+            first = first->next;
+        first->next = item;
+        return ISO_SUCCESS;
+    }
+    ret = iso_htable_put(img->dedup->sizes, &(item->size), item);
+    if (ret < 0) {
+        free(item);
+        return ret;
+    }
+    return ISO_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------ */
+
 int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src)
 {
     int ret, i;
@@ -73,8 +435,9 @@ int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src)
     unsigned int fs_id;
     dev_t dev_id;
     ino_t ino_id;
-    int cret, no_md5= 0;
+    int cret, no_md5= 0, dedup = 0, md5_state = 0;
     void *xipt = NULL;
+    char md5[16];
 
     if (img == NULL || file == NULL || src == NULL) {
         return ISO_NULL_POINTER;
@@ -124,8 +487,25 @@ int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src)
     fsrc->sort_weight = file->sort_weight;
     fsrc->stream = file->stream;
 
+    dedup = dedup_is_eligible(img, file, fsrc);
+    if (dedup) {
+        /* Equal content of a different file shares its IsoFileSrc */
+        ret = dedup_lookup(img, file, src, &md5_state, md5);
+        if (ret == 1) {
+            /* The content of file will not be read by the write run */
+            if (md5_state != 0)
+                iso_stream_hold_filter_cache(file->stream, 1);
+            ret = 0;
+        }
+        else if (ret == 0)
+            ret = 1;
+    } else {
+        ret = 1;
+    }
+
     /* insert the filesrc in the tree */
-    ret = iso_rbtree_insert(img->files, fsrc, (void**)src);
+    if (ret == 1)
+        ret = iso_rbtree_insert(img->files, fsrc, (void**)src);
     if (ret <= 0) {
         if (ret == 0 && (*src)->checksum_index > 0 &&
             !img->opts->will_cancel) {
@@ -141,6 +521,12 @@ int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src)
     }
     iso_stream_ref(fsrc->stream);
 
+    if (dedup) {
+        ret = dedup_register(img, fsrc, md5_state, md5);
+        if (ret < 0)
+            return ret;
+    }
+
     if ((img->opts->md5_file_checksums & 1) &&
         file->from_old_session && img->opts->appendable) {
         ret = iso_node_get_xinfo((IsoNode *) file, checksum_md5_xinfo_func,
@@ -421,18 +807,479 @@ int filesrc_read(IsoFileSrc *file, char *buf, size_t count)
 static
 int filesrc_make_md5(Ecma119Image *t, IsoFileSrc *file, char md5[16], int flag)
 {
-    return iso_stream_make_md5(file->stream, md5, 0);
+    int ret;
+
+    /* The filter output cache has to survive for the write run */
+    iso_stream_hold_filter_cache(file->stream, 0);
+    ret = iso_stream_make_md5(file->stream, md5, 0);
+    if (ret <= 0)
+        iso_stream_hold_filter_cache(file->stream, 2);
+    return ret;
+}
+
+
+/* ---------------------- Parallel reading of data files ------------------- */
+
+/* The number of blocks which a reader thread reads in one piece */
+#define ISO_FILESRC_CHUNK_BLOCKS 32
+
+/* The memory limit for data which are read ahead, per reader thread */
+#define ISO_FILESRC_PREFETCH_PER_THREAD (8 * 1024 * 1024)
+
+struct iso_filesrc_chunk {
+    struct iso_filesrc_chunk *next;
+    char *data;
+    uint32_t nblocks;  /* Number of valid blocks in data */
+    uint32_t consumed; /* Number of blocks handed out to the writer thread */
+};
+
+/* The read-ahead state of one IsoFileSrc of the filelist.
+   Members other than .file and .concurrent are protected by the mutex of
+   the iso_filesrc_prefetch.
+*/
+struct iso_filesrc_job {
+    struct iso_filesrc_prefetch *pf;
+    IsoFileSrc *file;
+
+    /* 1= may be read by a reader thread, 0= the writer thread reads it */
+    int concurrent;
+
+    /* 0= waiting, 1= taken by a reader, 2= opened, 3= done with reading */
+    int state;
+
+    /* Set by the writer thread if it does not want more data */
+    int cancel;
+
+    int pre_md5_valid;
+    char pre_md5[16];
+    int open_res;
+    int read_res;
+    void *ctx;
+    int md5_failed;
+
+    struct iso_filesrc_chunk *first;
+    struct iso_filesrc_chunk *last;
+};
+
+struct iso_filesrc_prefetch {
+    Ecma119Image *t;
+    struct iso_filesrc_job *jobs;
+    size_t njobs;
+
+    /* The next job to be taken by a reader thread */
+    size_t next_job;
+
+    /* The job which is being written by the writer thread. Its reader is
+       exempt from the memory limit, so that the writer cannot starve.
+    */
+    size_t head_job;
+
+    size_t buffered;
+    size_t max_buffered;
+    int abort;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    int nthreads;
+};
+
+
+static
+void filesrc_chunk_free(struct iso_filesrc_chunk *chunk)
+{
+    if (chunk == NULL)
+        return;
+    LIBISO_FREE_MEM(chunk->data);
+    LIBISO_FREE_MEM(chunk);
+}
+
+/* Read the content of a file into chunks, like the read loop of
+   filesrc_write_data() would do.
+*/
+static
+void filesrc_job_read(struct iso_filesrc_job *job)
+{
+    struct iso_filesrc_prefetch *pf = job->pf;
+    Ecma119Image *t = pf->t;
+    IsoFileSrc *file = job->file;
+    struct iso_filesrc_chunk *chunk;
+    int res, pre_md5_valid = 0, md5_failed = 0;
+    char pre_md5[16];
+    void *ctx = NULL;
+    off_t file_size;
+    uint32_t b, nblocks, n, valid;
+    size_t got, count;
+
+    file_size = iso_file_src_get_size(file);
+    nblocks = DIV_UP(file_size, BLOCK_SIZE);
+    if (file->checksum_index > 0 && (t->opts->md5_file_checksums & 2))
+        pre_md5_valid = filesrc_make_md5(t, file, pre_md5, 0);
+    res = filesrc_open(file);
+
+    pthread_mutex_lock(&pf->mutex);
+    job->pre_md5_valid = pre_md5_valid;
+    memcpy(job->pre_md5, pre_md5, 16);
+    job->open_res = res;
+    job->state = 2;
+    if (res < 0)
+        job->state = 3;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    if (res < 0)
+        return;
+
+    if (file->checksum_index > 0) {
+        res = iso_md5_start(&ctx);
+        if (res <= 0)
+            md5_failed = 1;
+    }
+    res = 1;
+    for (b = 0; b < nblocks; b += valid) {
+        n = nblocks - b;
+        if (n > ISO_FILESRC_CHUNK_BLOCKS)
+            n = ISO_FILESRC_CHUNK_BLOCKS;
+        count = (size_t) n * BLOCK_SIZE;
+
+        /* Wait for free memory */
+        pthread_mutex_lock(&pf->mutex);
+        while (!(pf->abort || job->cancel) && pf->buffered > 0 &&
+               pf->buffered + count > pf->max_buffered &&
+               job != pf->jobs + pf->head_job)
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        if (pf->abort || job->cancel) {
+            pthread_mutex_unlock(&pf->mutex);
+    break;
+        }
+        pf->buffered += count;
+        pthread_mutex_unlock(&pf->mutex);
+
+        chunk = calloc(1, sizeof(struct iso_filesrc_chunk));
+        if (chunk != NULL) {
+            chunk->data = malloc(count);
+            if (chunk->data == NULL) {
+                free(chunk);
+                chunk = NULL;
+            }
+        }
+        if (chunk == NULL) {
+            res = ISO_OUT_OF_MEM;
+            valid = 0;
+        } else {
+            res = iso_stream_read_buffer(file->stream, chunk->data, count,
+                                         &got);
+            valid = n;
+            if (res < 0)
+                valid = got / BLOCK_SIZE;
+        }
+        if (valid > 0 && ctx != NULL && !md5_failed) {
+            /* Only the valid blocks. The writer adds the zeros which
+               replace the others. */
+            got = (size_t) valid * BLOCK_SIZE;
+            if (file_size - (off_t) b * BLOCK_SIZE < (off_t) got)
+                got = file_size - (off_t) b * BLOCK_SIZE;
+            if (iso_md5_compute(ctx, chunk->data, (int) got) <= 0)
+                md5_failed = 1;
+        }
+
+        pthread_mutex_lock(&pf->mutex);
+        if (valid > 0) {
+            chunk->nblocks = valid;
+            if (job->last == NULL)
+                job->first = chunk;
+            else
+                job->last->next = chunk;
+            job->last = chunk;
+            pf->buffered -= count - (size_t) valid * BLOCK_SIZE;
+        } else {
+            pf->buffered -= count;
+            filesrc_chunk_free(chunk);
+        }
+        job->read_res = res;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+        if (res < 0)
+    break;
+    }
+    filesrc_close(file);
+
+    pthread_mutex_lock(&pf->mutex);
+    job->ctx = ctx;
+    job->md5_failed = md5_failed;
+    job->state = 3;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+}
+
+static
+void *filesrc_reader_thread(void *arg)
+{
+    struct iso_filesrc_prefetch *pf = arg;
+    struct iso_filesrc_job *job;
+
+    pthread_mutex_lock(&pf->mutex);
+    while (1) {
+        while (pf->next_job < pf->njobs && !pf->jobs[pf->next_job].concurrent)
+            pf->next_job++;
+        if (pf->abort || pf->next_job >= pf->njobs)
+    break;
+        if (pf->buffered >= pf->max_buffered &&
+            pf->next_job != pf->head_job) {
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+    continue;
+        }
+        job = pf->jobs + pf->next_job;
+        pf->next_job++;
+        job->state = 1;
+        pthread_mutex_unlock(&pf->mutex);
+
+        filesrc_job_read(job);
+
+        pthread_mutex_lock(&pf->mutex);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return NULL;
+}
+
+/* Wait until the reader thread has opened the file.
+   @return result of filesrc_open()
+*/
+static
+int filesrc_job_open(struct iso_filesrc_job *job, int *pre_md5_valid,
+                     char pre_md5[16])
+{
+    struct iso_filesrc_prefetch *pf = job->pf;
+    int ret;
+
+    pthread_mutex_lock(&pf->mutex);
+    while (job->state < 2)
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+    *pre_md5_valid = job->pre_md5_valid;
+    memcpy(pre_md5, job->pre_md5, 16);
+    ret = job->open_res;
+    pthread_mutex_unlock(&pf->mutex);
+    return ret;
+}
+
+/* Hand out the next block which was read by the reader thread.
+   The block stays valid until the next call.
+   @return 1 ok, < 0 read error
+*/
+static
+int filesrc_job_read_block(struct iso_filesrc_job *job, char **data)
+{
+    struct iso_filesrc_prefetch *pf = job->pf;
+    struct iso_filesrc_chunk *chunk;
+    int ret;
+
+    pthread_mutex_lock(&pf->mutex);
+    while (1) {
+        chunk = job->first;
+        if (chunk != NULL && chunk->consumed >= chunk->nblocks) {
+            job->first = chunk->next;
+            if (job->first == NULL)
+                job->last = NULL;
+            pf->buffered -= (size_t) chunk->nblocks * BLOCK_SIZE;
+            filesrc_chunk_free(chunk);
+            pthread_cond_broadcast(&pf->cond);
+    continue;
+        }
+        if (chunk != NULL) {
+            *data = chunk->data + (size_t) chunk->consumed * BLOCK_SIZE;
+            chunk->consumed++;
+            ret = 1;
+    break;
+        }
+        if (job->state >= 3) {
+            ret = job->read_res;
+            if (ret >= 0)
+                ret = ISO_FILE_READ_ERROR;
+    break;
+        }
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return ret;
+}
+
+/* Tell the reader thread to stop, wait until it closed the file, and take
+   over its MD5 context.
+*/
+static
+void filesrc_job_close(struct iso_filesrc_job *job, int cancel, void **ctx,
+                       int *md5_failed)
+{
+    struct iso_filesrc_prefetch *pf = job->pf;
+
+    pthread_mutex_lock(&pf->mutex);
+    if (cancel) {
+        job->cancel = 1;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    while (job->state < 3)
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+    if (ctx != NULL) {
+        *ctx = job->ctx;
+        job->ctx = NULL;
+    }
+    if (md5_failed != NULL)
+        *md5_failed = job->md5_failed;
+    pthread_mutex_unlock(&pf->mutex);
+}
+
+static
+int filesrc_prefetch_destroy(struct iso_filesrc_prefetch **pf_pt)
+{
+    struct iso_filesrc_prefetch *pf = *pf_pt;
+    struct iso_filesrc_chunk *chunk, *next;
+    size_t i;
+    int j;
+    char md5[16];
+
+    if (pf == NULL)
+        return ISO_SUCCESS;
+    pthread_mutex_lock(&pf->mutex);
+    pf->abort = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    for (j = 0; j < pf->nthreads; j++)
+        pthread_join(pf->threads[j], NULL);
+    for (i = 0; i < pf->njobs; i++) {
+        for (chunk = pf->jobs[i].first; chunk != NULL; chunk = next) {
+            next = chunk->next;
+            filesrc_chunk_free(chunk);
+        }
+        if (pf->jobs[i].ctx != NULL)
+            iso_md5_end(&(pf->jobs[i].ctx), md5);
+    }
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    LIBISO_FREE_MEM(pf->threads);
+    LIBISO_FREE_MEM(pf->jobs);
+    LIBISO_FREE_MEM(pf);
+    *pf_pt = NULL;
+    return ISO_SUCCESS;
+}
+
+struct iso_filesrc_resource {
+    void *resource;
+    size_t idx;
+};
+
+static
+int filesrc_cmp_resource(const void *v1, const void *v2)
+{
+    const struct iso_filesrc_resource *r1 = v1, *r2 = v2;
+
+    if (r1->resource != r2->resource)
+        return r1->resource < r2->resource ? -1 : 1;
+    return r1->idx < r2->idx ? -1 : (r1->idx > r2->idx);
+}
+
+/* Create the jobs for the NULL terminated filelist and start the reader
+   threads.
+*/
+static
+int filesrc_prefetch_new(Ecma119Image *t, IsoFileSrc **filelist,
+                         struct iso_filesrc_prefetch **pf_pt)
+{
+    int ret, nthreads;
+    size_t i, j, n, count;
+    struct iso_filesrc_prefetch *pf = NULL;
+    struct iso_filesrc_resource *resources = NULL;
+
+    *pf_pt = NULL;
+    count = 0;
+    while (filelist[count] != NULL)
+        count++;
+
+    LIBISO_ALLOC_MEM(pf, struct iso_filesrc_prefetch, 1);
+    pf->t = t;
+    pf->njobs = count;
+    pf->max_buffered = (size_t) t->opts->data_threads *
+                       ISO_FILESRC_PREFETCH_PER_THREAD;
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    LIBISO_ALLOC_MEM(pf->jobs, struct iso_filesrc_job, count + 1);
+    LIBISO_ALLOC_MEM(resources, struct iso_filesrc_resource, count + 1);
+    for (i = 0; i < count; i++) {
+        pf->jobs[i].pf = pf;
+        pf->jobs[i].file = filelist[i];
+        resources[i].idx = i;
+        resources[i].resource = NULL;
+        if (filelist[i]->no_write)
+    continue;
+        pf->jobs[i].concurrent =
+            iso_stream_concurrent_ok(filelist[i]->stream,
+                                     &(resources[i].resource), 0);
+    }
+
+    /* Files which share their data source must be read one after the other,
+       so leave them to the writer thread.
+    */
+    qsort(resources, count, sizeof(struct iso_filesrc_resource),
+          filesrc_cmp_resource);
+    for (i = 0; i + 1 < count; i++) {
+        if (resources[i].resource == NULL ||
+            resources[i].resource != resources[i + 1].resource)
+    continue;
+        for (j = i; j < count; j++) {
+            if (resources[j].resource != resources[i].resource)
+        break;
+            pf->jobs[resources[j].idx].concurrent = 0;
+        }
+        i = j - 1;
+    }
+
+    nthreads = t->opts->data_threads;
+    LIBISO_ALLOC_MEM(pf->threads, pthread_t, nthreads);
+    for (n = 0; n < (size_t) nthreads; n++) {
+        ret = pthread_create(&(pf->threads[n]), NULL, filesrc_reader_thread,
+                             pf);
+        if (ret != 0) {
+            iso_msg_submit(t->image->id, ISO_THREAD_ERROR, 0,
+                           "Cannot create reader thread for data files");
+            ret = ISO_THREAD_ERROR;
+            goto ex;
+        }
+        pf->nthreads++;
+    }
+
+    *pf_pt = pf;
+    pf = NULL;
+    ret = ISO_SUCCESS;
+ex:;
+    LIBISO_FREE_MEM(resources);
+    if (pf != NULL)
+        filesrc_prefetch_destroy(&pf);
+    return ret;
+}
+
+/* Add data to the checksum of a data file, directly or by the checksum
+   thread of the image
+*/
+static
+int filesrc_md5_compute(Ecma119Image *t, void *ctx, int piped,
+                        char *data, int datalen)
+{
+    if (piped)
+        return iso_md5_pipe_feed_ctx(t->checksum_pipe, ctx, data, datalen);
+    return iso_md5_compute(ctx, data, datalen);
 }
 
 /* name must be NULL or offer at least PATH_MAX characters.
    buffer must be NULL or offer at least BLOCK_SIZE characters.
+   job must be NULL or a job of filesrc_prefetch_new() which is allowed to
+   be read concurrently.
 */
-int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
-                           char *name, char *buffer, int flag)
+static
+int filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
+                       char *name, char *buffer, struct iso_filesrc_job *job)
 {
-    int res, ret, was_error;
+    int res, ret, was_error, md5_failed = 0, md5_piped = 0;
     char *name_data = NULL;
     char *buffer_data = NULL;
+    char *data;
     size_t b;
     off_t file_size;
     uint32_t nblocks;
@@ -458,11 +1305,16 @@ int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
     file_size = iso_file_src_get_size(file);
     nblocks = DIV_UP(file_size, BLOCK_SIZE);
     pre_md5_valid = 0; 
-    if (file->checksum_index > 0 && (t->opts->md5_file_checksums & 2)) {
-        /* Obtain an MD5 of content by a first read pass */
-        pre_md5_valid = filesrc_make_md5(t, file, pre_md5, 0);
+    if (job != NULL) {
+        /* The reader thread did the pre-read pass and opened the file */
+        res = filesrc_job_open(job, &pre_md5_valid, pre_md5);
+    } else {
+        if (file->checksum_index > 0 && (t->opts->md5_file_checksums & 2)) {
+            /* Obtain an MD5 of content by a first read pass */
+            pre_md5_valid = filesrc_make_md5(t, file, pre_md5, 0);
+        }
+        res = filesrc_open(file);
     }
-    res = filesrc_open(file);
 
     /* Get file name from end of filter chain */
     for (stream = file->stream; ; stream = inp) {
@@ -502,7 +1354,10 @@ int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
                   "Size of file \"%s\" has changed. It will be %s", name,
                   (res == 2 ? "truncated" : "padded with 0's"));
         if (res < 0) {
-            filesrc_close(file);
+            if (job != NULL)
+                filesrc_job_close(job, 1, NULL, NULL);
+            else
+                filesrc_close(file);
             ret = res; /* aborted due to error severity */
             goto ex;
         }
@@ -523,7 +1378,10 @@ int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
             res = iso_libjte_forward_msgs(t->opts->libjte_handle, t->image->id,
                                     ISO_LIBJTE_FILE_FAILED, 0);
             if (res < 0) {
-                filesrc_close(file);
+                if (job != NULL)
+                    filesrc_job_close(job, 1, NULL, NULL);
+                else
+                    filesrc_close(file);
                 ret = ISO_LIBJTE_FILE_FAILED;
                 goto ex;
             }
@@ -532,40 +1390,71 @@ int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
     }
 #endif /* Libisofs_with_libjtE */
 
-    if (file->checksum_index > 0) {
+    if (file->checksum_index > 0 && job == NULL) {
         /* initialize file checksum */
         res = iso_md5_start(&ctx);
         if (res <= 0)
             file->checksum_index = 0;
+        /* The checksum thread can compute it, unless it is needed here
+           for comparison with the pre-read checksum */
+        else if (t->checksum_pipe != NULL &&
+                 !(t->opts->md5_file_checksums & 2))
+            md5_piped = 1;
     }
     /* write file contents to image */
     for (b = 0; b < nblocks; ++b) {
         int wres;
-        res = filesrc_read(file, buffer, BLOCK_SIZE);
+        if (job != NULL) {
+            res = filesrc_job_read_block(job, &data);
+        } else {
+            /* Read directly into the output buffer if possible */
+            wres = iso_write_reserve(t, BLOCK_SIZE, (void **) &data);
+            if (wres < 0) {
+                filesrc_close(file);
+                ret = wres;
+                goto ex;
+            }
+            if (wres != 1)
+                data = buffer;
+            res = filesrc_read(file, data, BLOCK_SIZE);
+        }
         if (res < 0) {
             /* read error */
             break;
         }
-        wres = iso_write(t, buffer, BLOCK_SIZE);
+        if (job == NULL && data != buffer)
+            wres = iso_write_commit(t, BLOCK_SIZE);
+        else
+            wres = iso_write(t, data, BLOCK_SIZE);
         if (wres < 0) {
             /* ko, writer error, we need to go out! */
-            filesrc_close(file);
+            if (job != NULL)
+                filesrc_job_close(job, 1, NULL, NULL);
+            else
+                filesrc_close(file);
             ret = wres;
             goto ex;
         }
-        if (file->checksum_index > 0) {
+        if (file->checksum_index > 0 && job == NULL) {
             /* Add to file checksum */
             if (file_size - b * BLOCK_SIZE > BLOCK_SIZE)
                 res = BLOCK_SIZE;
             else
                 res = file_size - b * BLOCK_SIZE;
-            res = iso_md5_compute(ctx, buffer, res);
+            res = filesrc_md5_compute(t, ctx, md5_piped, data, res);
             if (res <= 0)
                 file->checksum_index = 0;
         }
     }
 
-    filesrc_close(file);
+    if (job != NULL) {
+        /* The reader thread computed the checksum of the content */
+        filesrc_job_close(job, 0, &ctx, &md5_failed);
+        if (file->checksum_index > 0 && (ctx == NULL || md5_failed))
+            file->checksum_index = 0;
+    } else {
+        filesrc_close(file);
+    }
 
     if (b < nblocks) {
         /* premature end of file, due to error or eof */
@@ -603,13 +1492,20 @@ int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
                     res = BLOCK_SIZE;
                 else
                     res = file_size - b * BLOCK_SIZE;
-                res = iso_md5_compute(ctx, buffer, res);
+                res = filesrc_md5_compute(t, ctx, md5_piped, buffer, res);
                 if (res <= 0)
                     file->checksum_index = 0;
             }
         }
     }
     if (file->checksum_index > 0 &&
+        file->checksum_index <= t->checksum_idx_counter && md5_piped) {
+        /* Let the checksum thread write md5 into the checksum buffer at
+           file->checksum_index and dispose the checksum context */
+        iso_md5_pipe_end_ctx(t->checksum_pipe, ctx,
+                             t->checksum_buffer + 16 * file->checksum_index);
+        ctx = NULL;
+    } else if (file->checksum_index > 0 &&
         file->checksum_index <= t->checksum_idx_counter) {
         /* Obtain checksum and dispose checksum context */
         res = iso_md5_end(&ctx, md5);
@@ -636,7 +1532,9 @@ int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
 
     ret = ISO_SUCCESS;
 ex:;
-    if (ctx != NULL) /* avoid any memory leak */
+    if (ctx != NULL && md5_piped) /* the thread may still use ctx */
+        iso_md5_pipe_end_ctx(t->checksum_pipe, ctx, NULL);
+    else if (ctx != NULL) /* avoid any memory leak */
         iso_md5_end(&ctx, md5);
 
 #ifdef Libisofs_with_libjtE
@@ -654,6 +1552,12 @@ ex:;
     return ret;
 }
 
+int iso_filesrc_write_data(Ecma119Image *t, IsoFileSrc *file,
+                           char *name, char *buffer, int flag)
+{
+    return filesrc_write_data(t, file, name, buffer, NULL);
+}
+
 static
 int filesrc_writer_write_data(IsoImageWriter *writer)
 {
@@ -664,6 +1568,8 @@ int filesrc_writer_write_data(IsoImageWriter *writer)
     IsoFileSrc **filelist;
     char *name = NULL;
     char *buffer = NULL;
+    struct iso_filesrc_prefetch *pf = NULL;
+    struct iso_filesrc_job *job;
 
     if (writer == NULL) {
         ret = ISO_ASSERT_FAILURE; goto ex;
@@ -686,6 +1592,12 @@ int filesrc_writer_write_data(IsoImageWriter *writer)
             goto ex;
     }
 
+    if (t->opts->data_threads > 1) {
+        ret = filesrc_prefetch_new(t, filelist, &pf);
+        if (ret < 0)
+            goto ex;
+    }
+
     i = 0;
     while ((file = filelist[i++]) != NULL) {
         if (file->no_write) {
@@ -697,13 +1609,23 @@ int filesrc_writer_write_data(IsoImageWriter *writer)
                                 (file->sections[0].size + 2047) / BLOCK_SIZE));
     continue;
         }
-        ret = iso_filesrc_write_data(t, file, name, buffer, 0);
+        job = NULL;
+        if (pf != NULL) {
+            pthread_mutex_lock(&pf->mutex);
+            pf->head_job = i - 1;
+            pthread_cond_broadcast(&pf->cond);
+            pthread_mutex_unlock(&pf->mutex);
+            if (pf->jobs[i - 1].concurrent)
+                job = pf->jobs + (i - 1);
+        }
+        ret = filesrc_write_data(t, file, name, buffer, job);
         if (ret < 0)
             goto ex;
     }
 
     ret = ISO_SUCCESS;
 ex:;
+    filesrc_prefetch_destroy(&pf);
     LIBISO_FREE_MEM(buffer);
     LIBISO_FREE_MEM(name);
     return ret;
@@ -70,6 +70,10 @@ int iso_file_src_cmp(const void *n1, const void *n2);
  * with a node that refers to the same source file, the previously
  * created one will be returned. No new IsoFileSrc is created in that case.
  *
+ * While the trees are created concurrently, the caller has to hold
+ * ecma119_trees_lock(). It gets released meanwhile if file content has
+ * to be read for content deduplication.
+ *
  * @param img
  *      The image where this file is to be written
  * @param file
@@ -102,6 +106,12 @@ int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src);
  */
 int iso_file_src_add(Ecma119Image *img, IsoFileSrc *new, IsoFileSrc **src);
 
+/**
+ * Dispose the content deduplication tables which iso_file_src_create()
+ * builds if enabled by iso_write_opts_set_content_dedup().
+ */
+void iso_file_src_dedup_destroy(struct iso_file_src_dedup **dedup);
+
 /**
  * Free the IsoFileSrc especific data
  */
@@ -16,6 +16,12 @@
 #include "filter.h"
 #include "node.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
 
 void iso_filter_ref(FilterContext *filter)
 {
@@ -69,3 +75,351 @@ int iso_file_remove_filter(IsoFile *file, int flag)
     return 1;
 }
 
+
+
+/* --------------------------- Filter output cache ------------------------- */
+
+/* The output of the size determination run of a filter stream may be kept
+   until the stream gets read for writing the image. So the filter does not
+   have to process its input a second time.
+   The cached bytes are held in memory chunks as long as the overall memory
+   limit allows. Then they spill into a temporary file which is shared by all
+   caches. If both limits are exhausted, the cache of the affected stream is
+   given up and the filter will run again when the stream gets read.
+*/
+
+#define ISO_FILTER_CACHE_CHUNK (64 * 1024)
+
+struct iso_filter_cache_chunk
+{
+    char *mem;       /* NULL if the chunk is stored in the spill file */
+    off_t spill_pos; /* byte address in the spill file */
+};
+
+struct iso_filter_cache
+{
+    struct iso_filter_cache_chunk *chunks;
+    int num_chunks;
+    int chunks_size;
+
+    off_t size;
+
+    int spilled;     /* whether chunks are stored in the spill file */
+
+    /* The number of complete reads which are announced to come before the
+       one which may destroy the cache. See iso_filter_cache_hold(). */
+    int holds;
+};
+
+static off_t filter_cache_mem_limit = 0;
+static off_t filter_cache_spill_limit = 0;
+
+static off_t filter_cache_mem_used = 0;
+
+/* The spill file gets created when the first cache needs it and disposed
+   when the last cache which stored chunks in it gets destroyed.
+   The chunks of destroyed caches are recorded as free and get used again
+   before the file grows.
+*/
+static FILE *filter_cache_spill_fp = NULL;
+static off_t filter_cache_spill_used = 0;
+static off_t filter_cache_spill_end = 0;
+static int filter_cache_spill_users = 0;
+
+static off_t *filter_cache_spill_free = NULL;
+static int filter_cache_spill_num_free = 0;
+static int filter_cache_spill_free_size = 0;
+
+/* Caches may be created, filled, and destroyed by concurrent threads.
+   See iso_write_opts_set_data_threads().
+*/
+static pthread_mutex_t filter_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+int iso_set_filter_cache(off_t mem_limit, off_t spill_limit, int flag)
+{
+    if (mem_limit < 0 || spill_limit < 0)
+        return ISO_WRONG_ARG_VALUE;
+    pthread_mutex_lock(&filter_cache_mutex);
+    filter_cache_mem_limit = mem_limit;
+    filter_cache_spill_limit = spill_limit;
+    pthread_mutex_unlock(&filter_cache_mutex);
+    return ISO_SUCCESS;
+}
+
+
+int iso_filter_cache_new(IsoFilterCache **cache, int flag)
+{
+    IsoFilterCache *o;
+    int enabled;
+
+    *cache = NULL;
+    pthread_mutex_lock(&filter_cache_mutex);
+    enabled = (filter_cache_mem_limit > 0 || filter_cache_spill_limit > 0);
+    pthread_mutex_unlock(&filter_cache_mutex);
+    if (!enabled)
+        return 0;
+    o = calloc(1, sizeof(IsoFilterCache));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    o->chunks = NULL;
+    o->num_chunks = 0;
+    o->chunks_size = 0;
+    o->size = 0;
+    o->spilled = 0;
+    o->holds = 0;
+    *cache = o;
+    return ISO_SUCCESS;
+}
+
+
+/* To be called with filter_cache_mutex locked.
+   Record a chunk of the spill file as free. If the free list cannot grow,
+   the chunk stays unused until the spill file gets disposed.
+*/
+static
+void filter_cache_free_spill_chunk(off_t spill_pos)
+{
+    off_t *new_free;
+
+    filter_cache_spill_used -= ISO_FILTER_CACHE_CHUNK;
+    if (filter_cache_spill_num_free >= filter_cache_spill_free_size) {
+        new_free = realloc(filter_cache_spill_free,
+                           (filter_cache_spill_free_size + 256) *
+                           sizeof(off_t));
+        if (new_free == NULL)
+            return;
+        filter_cache_spill_free = new_free;
+        filter_cache_spill_free_size += 256;
+    }
+    filter_cache_spill_free[filter_cache_spill_num_free++] = spill_pos;
+}
+
+
+void iso_filter_cache_destroy(IsoFilterCache **cache, int flag)
+{
+    IsoFilterCache *o;
+    int i;
+
+    o = *cache;
+    if (o == NULL)
+        return;
+    pthread_mutex_lock(&filter_cache_mutex);
+    for (i = 0; i < o->num_chunks; i++) {
+        if (o->chunks[i].mem != NULL) {
+            free(o->chunks[i].mem);
+            filter_cache_mem_used -= ISO_FILTER_CACHE_CHUNK;
+        } else {
+            filter_cache_free_spill_chunk(o->chunks[i].spill_pos);
+        }
+    }
+    if (o->spilled) {
+        filter_cache_spill_users--;
+        if (filter_cache_spill_users <= 0 && filter_cache_spill_fp != NULL) {
+            /* tmpfile() removes the file when it gets closed */
+            fclose(filter_cache_spill_fp);
+            filter_cache_spill_fp = NULL;
+            filter_cache_spill_used = 0;
+            filter_cache_spill_end = 0;
+            filter_cache_spill_users = 0;
+            if (filter_cache_spill_free != NULL)
+                free(filter_cache_spill_free);
+            filter_cache_spill_free = NULL;
+            filter_cache_spill_num_free = 0;
+            filter_cache_spill_free_size = 0;
+        }
+    }
+    pthread_mutex_unlock(&filter_cache_mutex);
+    if (o->chunks != NULL)
+        free(o->chunks);
+    free(o);
+    *cache = NULL;
+}
+
+
+/* Add a chunk in memory or in the spill file.
+   @return 1= success, 0= limits exhausted, <0 error
+*/
+static
+int filter_cache_add_chunk(IsoFilterCache *o)
+{
+    struct iso_filter_cache_chunk *chunk, *new_chunks;
+    int ret;
+
+    if (o->num_chunks >= o->chunks_size) {
+        new_chunks = realloc(o->chunks, (o->chunks_size + 16) *
+                                        sizeof(struct iso_filter_cache_chunk));
+        if (new_chunks == NULL)
+            return ISO_OUT_OF_MEM;
+        o->chunks = new_chunks;
+        o->chunks_size += 16;
+    }
+    chunk = o->chunks + o->num_chunks;
+    chunk->mem = NULL;
+    chunk->spill_pos = 0;
+
+    pthread_mutex_lock(&filter_cache_mutex);
+    if (filter_cache_mem_used + ISO_FILTER_CACHE_CHUNK <=
+        filter_cache_mem_limit) {
+        chunk->mem = malloc(ISO_FILTER_CACHE_CHUNK);
+        if (chunk->mem == NULL) {
+            ret = ISO_OUT_OF_MEM;
+            goto ex;
+        }
+        filter_cache_mem_used += ISO_FILTER_CACHE_CHUNK;
+    } else if (filter_cache_spill_used + ISO_FILTER_CACHE_CHUNK <=
+               filter_cache_spill_limit) {
+        if (filter_cache_spill_fp == NULL) {
+            filter_cache_spill_fp = tmpfile();
+            if (filter_cache_spill_fp == NULL) {
+                ret = 0;
+                goto ex;
+            }
+        }
+        if (!o->spilled) {
+            o->spilled = 1;
+            filter_cache_spill_users++;
+        }
+        if (filter_cache_spill_num_free > 0) {
+            chunk->spill_pos =
+                     filter_cache_spill_free[--filter_cache_spill_num_free];
+        } else {
+            chunk->spill_pos = filter_cache_spill_end;
+            filter_cache_spill_end += ISO_FILTER_CACHE_CHUNK;
+        }
+        filter_cache_spill_used += ISO_FILTER_CACHE_CHUNK;
+    } else {
+        ret = 0;
+        goto ex;
+    }
+    o->num_chunks++;
+    ret = 1;
+ex:;
+    pthread_mutex_unlock(&filter_cache_mutex);
+    return ret;
+}
+
+
+int iso_filter_cache_append(IsoFilterCache *cache, char *buf, size_t count,
+                            int flag)
+{
+    struct iso_filter_cache_chunk *chunk;
+    size_t todo, done = 0;
+    off_t chunk_pos;
+    ssize_t wret;
+    int ret;
+
+    while (done < count) {
+        chunk_pos = cache->size % ISO_FILTER_CACHE_CHUNK;
+        if (cache->size / ISO_FILTER_CACHE_CHUNK >= cache->num_chunks) {
+            ret = filter_cache_add_chunk(cache);
+            if (ret <= 0)
+                return ret;
+        }
+        chunk = cache->chunks + cache->size / ISO_FILTER_CACHE_CHUNK;
+        todo = count - done;
+        if (todo > (size_t) (ISO_FILTER_CACHE_CHUNK - chunk_pos))
+            todo = ISO_FILTER_CACHE_CHUNK - chunk_pos;
+        if (chunk->mem != NULL) {
+            memcpy(chunk->mem + chunk_pos, buf + done, todo);
+        } else {
+            wret = pwrite(fileno(filter_cache_spill_fp), buf + done, todo,
+                          chunk->spill_pos + chunk_pos);
+            if (wret != (ssize_t) todo)
+                return 0;
+        }
+        done += todo;
+        cache->size += todo;
+    }
+    return 1;
+}
+
+
+int iso_filter_cache_read(IsoFilterCache *cache, off_t pos, char *buf,
+                          size_t count, int flag)
+{
+    struct iso_filter_cache_chunk *chunk;
+    size_t todo, done = 0;
+    off_t chunk_pos;
+    ssize_t rret;
+
+    while (done < count && pos < cache->size) {
+        chunk = cache->chunks + pos / ISO_FILTER_CACHE_CHUNK;
+        chunk_pos = pos % ISO_FILTER_CACHE_CHUNK;
+        todo = count - done;
+        if (todo > (size_t) (ISO_FILTER_CACHE_CHUNK - chunk_pos))
+            todo = ISO_FILTER_CACHE_CHUNK - chunk_pos;
+        if ((off_t) todo > cache->size - pos)
+            todo = cache->size - pos;
+        if (chunk->mem != NULL) {
+            memcpy(buf + done, chunk->mem + chunk_pos, todo);
+        } else {
+            rret = pread(fileno(filter_cache_spill_fp), buf + done, todo,
+                         chunk->spill_pos + chunk_pos);
+            if (rret != (ssize_t) todo)
+                return ISO_FILE_READ_ERROR;
+        }
+        done += todo;
+        pos += todo;
+    }
+    return (int) done;
+}
+
+
+off_t iso_filter_cache_get_size(IsoFilterCache *cache)
+{
+    return cache->size;
+}
+
+
+void iso_filter_cache_hold(IsoFilterCache *cache)
+{
+    pthread_mutex_lock(&filter_cache_mutex);
+    cache->holds++;
+    pthread_mutex_unlock(&filter_cache_mutex);
+}
+
+
+int iso_filter_cache_read_done(IsoFilterCache *cache)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&filter_cache_mutex);
+    if (cache->holds > 0) {
+        cache->holds--;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&filter_cache_mutex);
+    return ret;
+}
+
+
+int iso_stream_hold_filter_cache(IsoStream *stream, int flag)
+{
+    IsoFilterCache **cache_pt;
+    int ret = 0;
+
+    while (stream != NULL) {
+        cache_pt = gzip_stream_cache_pt(stream);
+        if (cache_pt == NULL)
+            cache_pt = ziso_stream_cache_pt(stream);
+        if (cache_pt == NULL)
+            cache_pt = extf_stream_cache_pt(stream);
+        if (cache_pt == NULL)
+            return ret; /* not a filter with cache */
+        if (*cache_pt != NULL) {
+            ret = 1;
+            if (!(flag & 1)) {
+                /* The input streams will not be read by a replay */
+                if (flag & 2)
+                    iso_filter_cache_read_done(*cache_pt);
+                else
+                    iso_filter_cache_hold(*cache_pt);
+                return 1;
+            }
+            iso_filter_cache_destroy(cache_pt, 0);
+        }
+        stream = iso_stream_get_input_stream(stream, 0);
+    }
+    return ret;
+}
@@ -73,4 +73,83 @@ int iso_file_add_filter(IsoFile *file, FilterContext *filter, int flag);
 void iso_filter_ref(FilterContext *filter);
 void iso_filter_unref(FilterContext *filter);
 
+
+/* Cache for the output of a filter stream. See iso_set_filter_cache(). */
+typedef struct iso_filter_cache IsoFilterCache;
+
+/**
+ * Create a cache for the output of the size determination run of a filter
+ * stream.
+ *
+ * @param cache
+ *      Will return the new cache, or NULL if caching is disabled
+ * @return
+ *      1 on success, 0 if caching is disabled, < 0 on error
+ */
+int iso_filter_cache_new(IsoFilterCache **cache, int flag);
+
+/**
+ * Append filter output to the cache.
+ *
+ * @return
+ *      1 on success, 0 if the cache limits are exhausted. In this case
+ *      the cache is incomplete and should be destroyed. < 0 on error
+ */
+int iso_filter_cache_append(IsoFilterCache *cache, char *buf, size_t count,
+                            int flag);
+
+/**
+ * Copy up to count bytes from the cache, starting at byte position pos.
+ *
+ * @return
+ *      The number of bytes copied, 0 if pos is at the end, < 0 on error
+ */
+int iso_filter_cache_read(IsoFilterCache *cache, off_t pos, char *buf,
+                          size_t count, int flag);
+
+off_t iso_filter_cache_get_size(IsoFilterCache *cache);
+
+/**
+ * Announce that the cache will be read completely once more before the
+ * read which shall use it last. E.g. an MD5 computation before the data
+ * file writer reads the stream.
+ */
+void iso_filter_cache_hold(IsoFilterCache *cache);
+
+/**
+ * Record that the cache was read completely.
+ *
+ * @return
+ *      1 if a read was announced by iso_filter_cache_hold(), so that the
+ *      cache is still needed. 0 if the cache should be destroyed now.
+ */
+int iso_filter_cache_read_done(IsoFilterCache *cache);
+
+/**
+ * Let the cache of stream or of its first cached input stream serve one
+ * more complete read, or destroy the caches of stream and its input streams.
+ * To be used for the streams of IsoFileSrc when reading them for other
+ * purposes than writing their content into the image.
+ *
+ * @param flag
+ *      bit0= destroy the caches, because the stream will not be read again
+ *      bit1= withdraw a hold, because the announced read was not complete
+ * @return
+ *      1 if a cache was found, 0 if not
+ */
+int iso_stream_hold_filter_cache(IsoStream *stream, int flag);
+
+/* The address of the cache pointer of a filter stream, or NULL if stream
+   is not of the particular filter class.
+*/
+IsoFilterCache **gzip_stream_cache_pt(IsoStream *stream);
+IsoFilterCache **ziso_stream_cache_pt(IsoStream *stream);
+IsoFilterCache **extf_stream_cache_pt(IsoStream *stream);
+
+/**
+ * Free the cache and give back its share of the cache limits.
+ * *cache will be set to NULL.
+ */
+void iso_filter_cache_destroy(IsoFilterCache **cache, int flag);
+
 #endif /*LIBISO_FILTER_H_*/
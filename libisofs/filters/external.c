@@ -21,6 +21,7 @@
 #include "../filter.h"
 #include "../fsource.h"
 #include "../stream.h"
+#include "../util.h"
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -56,6 +57,7 @@ typedef struct
     int out_eof;
     uint8_t pipebuf[2048]; /* buffers in case of EAGAIN on write() */
     int pipebuf_fill;
+    int replay; /* output comes from ExternalFilterStreamData.cache */
 } ExternalFilterRuntime;
 
 
@@ -77,6 +79,7 @@ int extf_running_new(ExternalFilterRuntime **running, int send_fd, int recv_fd,
     o->out_eof = 0;
     memset(o->pipebuf, 0, sizeof(o->pipebuf));
     o->pipebuf_fill = 0;
+    o->replay = 0;
     return 1;
 }
 
@@ -96,6 +99,8 @@ typedef struct
 
     ExternalFilterRuntime *running; /* is non-NULL when open */
 
+    IsoFilterCache *cache; /* output of the size determination run or NULL */
+
 } ExternalFilterStreamData;
 
 
@@ -132,6 +137,16 @@ int extf_stream_close_flag(IsoStream *stream, int flag)
     if (data->running == NULL) {
         return 1;
     }
+    if (data->running->replay) {
+        /* The cache is not needed any more after it was read completely,
+           unless another read was announced */
+        if (data->running->out_counter >= data->size &&
+            !iso_filter_cache_read_done(data->cache))
+            iso_filter_cache_destroy(&(data->cache), 0);
+        free(data->running);
+        data->running = NULL;
+        return 1;
+    }
 
     /* <<< */
     if (print_fd) {
@@ -192,6 +207,16 @@ int extf_stream_open_flag(IsoStream *stream, int flag)
       */
       stream->class->get_size(stream);
     }
+    if (data->cache != NULL && !(flag & 1)) {
+        /* Deliver the output of the size determination run rather than
+           starting the filter program again */
+        ret = extf_running_new(&running, -1, -1, 0, 0);
+        if (ret < 0)
+            return ret;
+        running->replay = 1;
+        data->running = running;
+        return 1;
+    }
 
     ret = pipe(send_pipe);
     if (ret == -1) {
@@ -401,6 +426,15 @@ int extf_stream_read(IsoStream *stream, void *buf, size_t desired)
     if (running->out_eof) {
         return 0;
     }
+    if (running->replay) {
+        ret = iso_filter_cache_read(data->cache, running->out_counter, buf,
+                                    desired, 0);
+        if (ret > 0)
+            running->out_counter += ret;
+        else if (ret == 0)
+            running->out_eof = 1;
+        return ret;
+    }
 
     while (1) {
         if (running->in_eof && !blocking) {
@@ -522,13 +556,20 @@ off_t extf_stream_get_size(IsoStream *stream)
     if (ret < 0) {
         return ret;
     }
+    /* Keep the output for the run which delivers it to the image */
+    iso_filter_cache_new(&(data->cache), 0);
     while (1) {
         ret = extf_stream_read(stream, buf, bufsize);
         if (ret <= 0)
             break;
         count += ret;
+        if (data->cache != NULL)
+            if (iso_filter_cache_append(data->cache, buf, ret, 0) != 1)
+                iso_filter_cache_destroy(&(data->cache), 0);
     }
     ret_close = extf_stream_close(stream);
+    if (ret < 0 || ret_close < 0)
+        iso_filter_cache_destroy(&(data->cache), 0);
     if (ret < 0)
         return ret;
     if (ret_close < 0)
@@ -572,6 +613,7 @@ void extf_stream_free(IsoStream *stream)
     if (data->running != NULL) {
         extf_stream_close(stream);
     }
+    iso_filter_cache_destroy(&(data->cache), 0);
     iso_stream_unref(data->orig);
     if (data->cmd->refcount > 0)
         data->cmd->refcount--;
@@ -619,12 +661,13 @@ int extf_clone_stream(IsoStream *old_stream, IsoStream **new_stream, int flag)
         return ret;
     }
     old_stream_data = (ExternalFilterStreamData *) old_stream->data;
-    stream_data->id = ++extf_ino_id;
+    stream_data->id = iso_counter_next_ino(&extf_ino_id, 0);
     stream_data->orig = new_input_stream;
     stream_data->cmd = old_stream_data->cmd;
     stream_data->cmd->refcount++;
     stream_data->size = old_stream_data->size;
     stream_data->running = NULL;
+    stream_data->cache = NULL;
     stream->data = stream_data;
     *new_stream = stream;
     return ISO_SUCCESS;
@@ -652,6 +695,14 @@ IsoStreamIface extf_stream_class = {
 };
 
 
+IsoFilterCache **extf_stream_cache_pt(IsoStream *stream)
+{
+    if (stream->class != &extf_stream_class)
+        return NULL;
+    return &(((ExternalFilterStreamData *) stream->data)->cache);
+}
+
+
 static
 int extf_cmp_ino(IsoStream *s1, IsoStream *s2)
 {
@@ -735,11 +786,12 @@ int extf_filter_get_filter(FilterContext *filter, IsoStream *original,
 
 
     /* These data items are not owned by this filter object */
-    data->id = ++extf_ino_id;
+    data->id = iso_counter_next_ino(&extf_ino_id, 0);
     data->orig = original;
     data->cmd = cmd;
     data->size = -1;
     data->running = NULL;
+    data->cache = NULL;
 
     /* get reference to the source */
     iso_stream_ref(data->orig);
@@ -74,6 +74,8 @@ typedef struct
 
     int error_ret;
 
+    int replay; /* output comes from GzipFilterStreamData.cache */
+
 } GzipFilterRuntime;
 
 #ifdef Libisofs_with_zliB
@@ -113,6 +115,7 @@ int gzip_running_new(GzipFilterRuntime **running, int flag)
     o->out_counter = 0;
     o->do_flush = Z_NO_FLUSH;
     o->error_ret = 1;
+    o->replay = 0;
 
     o->in_buffer_size= 2048;
     o->out_buffer_size= 2048;
@@ -165,6 +168,8 @@ typedef struct
 
     ino_t id;
 
+    IsoFilterCache *cache; /* output of the size determination run or NULL */
+
 } GzipFilterStreamData;
 
 
@@ -207,6 +212,15 @@ int gzip_stream_close_flag(IsoStream *stream, int flag)
     if (data->running == NULL) {
         return 1;
     }
+    if (data->running->replay) {
+        /* The cache is not needed any more after it was read completely,
+           unless another read was announced */
+        if (data->running->out_counter >= data->size &&
+            !iso_filter_cache_read_done(data->cache))
+            iso_filter_cache_destroy(&(data->cache), 0);
+        gzip_running_destroy(&(data->running), 0);
+        return 1;
+    }
     if (stream->class->read == &gzip_stream_uncompress) {
         inflateEnd(&(data->running->strm));
     } else {
@@ -269,6 +283,12 @@ int gzip_stream_open_flag(IsoStream *stream, int flag)
     }
     data->running = running;
 
+    if (data->cache != NULL && !(flag & 1)) {
+        /* Deliver the output of the size determination run */
+        running->replay = 1;
+        return 1;
+    }
+
     /* Start up zlib compression context */
     strm = &(running->strm);
     strm->zalloc = Z_NULL;
@@ -332,6 +352,13 @@ int gzip_stream_convert(IsoStream *stream, void *buf, size_t desired, int flag)
     if (rng == NULL) {
         return ISO_FILE_NOT_OPENED;
     }
+    if (rng->replay) {
+        ret = iso_filter_cache_read(data->cache, rng->out_counter, buf,
+                                    desired, 0);
+        if (ret > 0)
+            rng->out_counter += ret;
+        return ret;
+    }
     strm = &(rng->strm);
     if (rng->error_ret < 0) {
         return rng->error_ret;
@@ -448,13 +475,20 @@ off_t gzip_stream_get_size(IsoStream *stream)
     if (ret < 0) {
         return ret;
     }
+    /* Keep the output for the run which delivers it to the image */
+    iso_filter_cache_new(&(data->cache), 0);
     while (1) {
         ret = stream->class->read(stream, buf, bufsize);
         if (ret <= 0)
     break;
         count += ret;
+        if (data->cache != NULL)
+            if (iso_filter_cache_append(data->cache, buf, ret, 0) != 1)
+                iso_filter_cache_destroy(&(data->cache), 0);
     }
     ret_close = gzip_stream_close(stream);
+    if (ret < 0 || ret_close < 0)
+        iso_filter_cache_destroy(&(data->cache), 0);
     if (ret < 0)
         return ret;
     if (ret_close < 0)
@@ -499,12 +533,11 @@ void gzip_stream_free(IsoStream *stream)
         gzip_stream_close(stream);
     }
     if (stream->class->read == &gzip_stream_uncompress) {
-        if (--gunzip_ref_count < 0)
-            gunzip_ref_count = 0;
+        iso_counter_add_off(&gunzip_ref_count, (off_t) -1);
     } else {
-        if (--gzip_ref_count < 0)
-            gzip_ref_count = 0;
+        iso_counter_add_off(&gzip_ref_count, (off_t) -1);
     }
+    iso_filter_cache_destroy(&(data->cache), 0);
     iso_stream_unref(data->orig);
     free(data);
 }
@@ -557,7 +590,8 @@ int gzip_clone_stream(IsoStream *old_stream, IsoStream **new_stream, int flag)
     stream_data->orig = new_input_stream;
     stream_data->size = old_stream_data->size;
     stream_data->running = NULL;
-    stream_data->id = ++gzip_ino_id;
+    stream_data->id = iso_counter_next_ino(&gzip_ino_id, 0);
+    stream_data->cache = NULL;
     stream->data = stream_data;
     *new_stream = stream;
     return ISO_SUCCESS;
@@ -610,6 +644,15 @@ IsoStreamIface gzip_stream_uncompress_class = {
     gzip_clone_stream
 };
 
+
+IsoFilterCache **gzip_stream_cache_pt(IsoStream *stream)
+{
+    if (stream->class != &gzip_stream_compress_class &&
+        stream->class != &gzip_stream_uncompress_class)
+        return NULL;
+    return &(((GzipFilterStreamData *) stream->data)->cache);
+}
+
  
 static
 int gzip_cmp_ino(IsoStream *s1, IsoStream *s2)
@@ -685,10 +728,11 @@ int gzip_filter_get_filter(FilterContext *filter, IsoStream *original,
     }
 
     /* These data items are not owned by this filter object */
-    data->id = ++gzip_ino_id;
+    data->id = iso_counter_next_ino(&gzip_ino_id, 0);
     data->orig = original;
     data->size = -1;
     data->running = NULL;
+    data->cache = NULL;
 
     /* get reference to the source */
     iso_stream_ref(data->orig);
@@ -697,10 +741,10 @@ int gzip_filter_get_filter(FilterContext *filter, IsoStream *original,
     str->data = data;
     if (flag & 2) {
         str->class = &gzip_stream_uncompress_class;
-        gunzip_ref_count++;
+        iso_counter_add_off(&gunzip_ref_count, (off_t) 1);
     } else {
         str->class = &gzip_stream_compress_class;
-        gzip_ref_count++;
+        iso_counter_add_off(&gzip_ref_count, (off_t) 1);
     }
 
     *filtered = str;
@@ -825,8 +869,8 @@ int iso_file_add_gzip_filter(IsoFile *file, int flag)
 /* API function */
 int iso_gzip_get_refcounts(off_t *gzip_count, off_t *gunzip_count, int flag)
 {
-    *gzip_count = gzip_ref_count;
-    *gunzip_count = gunzip_ref_count;
+    *gzip_count = iso_counter_add_off(&gzip_ref_count, (off_t) 0);
+    *gunzip_count = iso_counter_add_off(&gunzip_ref_count, (off_t) 0);
     return ISO_SUCCESS;
 }
 
@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #ifdef Libisofs_with_zliB
 #include <zlib.h>
@@ -91,6 +92,11 @@ static uint64_t ziso_block_pointer_mgt(uint64_t num, int mode);
  */
 #define ISO_ZISOFS_KBF_RATIO  -1.0 
 
+/* Maximum number of threads which compress blocks of a single file.
+ * See ziso_compression_threads.
+ */
+#define ISO_ZISOFS_MAX_THREADS 64
+
 
 /* --------------------------- Runtime parameters ------------------------- */
 
@@ -108,6 +114,11 @@ static int64_t ziso_max_file_blocks = ISO_ZISOFS_MAX_BLOCKS_F;
 static int64_t ziso_many_block_limit = ISO_ZISOFS_MANY_BLOCKS;
 static double ziso_keep_blocks_free_ratio = ISO_ZISOFS_KBF_RATIO;
 
+/* Number of threads which compress the blocks of a single file.
+ * 1 means that the reading thread does all compression itself.
+ */
+static int ziso_compression_threads = 1;
+
 /* Discard block pointers on last stream close even if the size constraints
  * are not met. To be set to 1 at block pointer overflow. To be set to 0
  * when all compression filters are deleted.
@@ -158,6 +169,49 @@ int ziso_decide_bs_log2(off_t orig_size)
 /* --------------------------- ZisofsFilterRuntime ------------------------- */
 
 
+/* Threads which compress the blocks of the batches of a stream. They get
+   started with the first batch and persist until the stream gets closed.
+   The blocks of a batch get claimed one by one by the threads and by the
+   thread which reads the stream.
+*/
+struct ziso_batch_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;  /* signals a new batch or the end */
+    pthread_cond_t done_cond;  /* signals the completion of a batch */
+
+    pthread_t threads[ISO_ZISOFS_MAX_THREADS];
+    int num_threads;
+
+    /* Blocks next ... limit - 1 of the batch are not claimed yet */
+    int next;
+    int limit;
+    int done;
+    int end;
+};
+
+
+static
+void ziso_batch_pool_destroy(struct ziso_batch_pool **pool_pt)
+{
+    struct ziso_batch_pool *pool = *pool_pt;
+    int i;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->end = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+    *pool_pt = NULL;
+}
+
+
 /* Individual runtime properties exist only as long as the stream is opened.
  */
 typedef struct
@@ -186,6 +240,26 @@ typedef struct
 
     int error_ret;
 
+    int replay; /* data blocks come from ZisofsComprStreamData.cache */
+
+    /* Parallel compression. See ziso_compression_threads.
+       A batch of blocks gets read into batch_in and compressed into
+       batch_out by several threads. Then the blocks get delivered one by
+       one in their original sequence.
+    */
+    int batch_size;        /* 0 = not yet decided, -1 = serial compression */
+    int batch_fill;
+    int batch_rpos;
+    int batch_ended;       /* whether batch_end_ret holds the result of the
+                              input read which ended the batch */
+    int batch_end_ret;
+    char *batch_in;
+    char *batch_out;
+    int *batch_in_len;
+    unsigned long *batch_out_len;
+    int *batch_ret;
+    struct ziso_batch_pool *batch_pool;
+
 } ZisofsFilterRuntime;
 
 
@@ -195,6 +269,7 @@ int ziso_running_destroy(ZisofsFilterRuntime **running, int flag)
     ZisofsFilterRuntime *o= *running;
     if (o == NULL)
         return 0;
+    ziso_batch_pool_destroy(&(o->batch_pool));
     if (o->block_pointers != NULL) {
         ziso_block_pointer_mgt((uint64_t) o->block_pointer_fill, 2);
         free(o->block_pointers);
@@ -203,6 +278,16 @@ int ziso_running_destroy(ZisofsFilterRuntime **running, int flag)
         free(o->read_buffer);
     if (o->block_buffer != NULL)
         free(o->block_buffer);
+    if (o->batch_in != NULL)
+        free(o->batch_in);
+    if (o->batch_out != NULL)
+        free(o->batch_out);
+    if (o->batch_in_len != NULL)
+        free(o->batch_in_len);
+    if (o->batch_out_len != NULL)
+        free(o->batch_out_len);
+    if (o->batch_ret != NULL)
+        free(o->batch_ret);
     free((char *) o);
     *running = NULL;
     return 1;
@@ -236,6 +321,18 @@ int ziso_running_new(ZisofsFilterRuntime **running, off_t orig_size,
     o->in_counter = 0;
     o->out_counter = 0;
     o->error_ret = 0;
+    o->replay = 0;
+    o->batch_size = 0;
+    o->batch_fill = 0;
+    o->batch_rpos = 0;
+    o->batch_ended = 0;
+    o->batch_end_ret = 0;
+    o->batch_in = NULL;
+    o->batch_out = NULL;
+    o->batch_in_len = NULL;
+    o->batch_out_len = NULL;
+    o->batch_ret = NULL;
+    o->batch_pool = NULL;
 
     if (flag & 1)
         return 1;
@@ -265,12 +362,19 @@ failed:
                 3= return number of accounted block pointers
    @return      if not mode 3: 0= does not fit , 1= fits
 */
+/* Serializes the accounting of streams which get read by concurrent
+   threads. See iso_write_opts_set_data_threads().
+*/
+static pthread_mutex_t ziso_block_pointer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static
 uint64_t ziso_block_pointer_mgt(uint64_t num, int mode)
 {
     static uint64_t global_count = 0;
     static int underrun = 0;
+    uint64_t ret = 1;
 
+    pthread_mutex_lock(&ziso_block_pointer_mutex);
     if (mode == 2) {
         if (global_count < num) {
             if (underrun < 3)
@@ -282,14 +386,15 @@ uint64_t ziso_block_pointer_mgt(uint64_t num, int mode)
             global_count -= num;
         }
     } else if (mode == 3) {
-        return global_count;
+        ret = global_count;
     } else {
        if (global_count + num > (uint64_t) ziso_max_total_blocks)
-           return 0;
-       if (mode == 1)
+           ret = 0;
+       else if (mode == 1)
            global_count += num;
     }
-    return 1;
+    pthread_mutex_unlock(&ziso_block_pointer_mutex);
+    return ret;
 }
 
 
@@ -352,6 +457,11 @@ typedef struct
     uint64_t open_counter;
     int block_pointers_dropped;
 
+    IsoFilterCache *cache; /* Output of the size determination run or NULL.
+                              It can only be used together with
+                              block_pointers.
+                            */
+
 } ZisofsComprStreamData;
 
 
@@ -426,6 +536,7 @@ int ziso_discard_bpt(IsoStream *stream, int flag)
     }
     ziso_block_pointer_mgt(cstd->block_pointer_counter, 2);
     free((char *) cstd->block_pointers);
+    iso_filter_cache_destroy(&(cstd->cache), 0);
     cstd->block_pointers_dropped = 1;
     cstd->block_pointers = NULL;
     cstd->block_pointer_counter = 0;
@@ -442,6 +553,7 @@ int ziso_stream_close_flag(IsoStream *stream, int flag)
 {
     ZisofsFilterStreamData *data;
     ZisofsComprStreamData *cstd = NULL;
+    int replay;
 
     if (stream == NULL) {
         return ISO_NULL_POINTER;
@@ -456,12 +568,21 @@ int ziso_stream_close_flag(IsoStream *stream, int flag)
     if (data->running == NULL) {
         return 1;
     }
+    replay = data->running->replay;
+    if (replay && data->running->out_counter >= data->size &&
+        !iso_filter_cache_read_done(cstd->cache)) {
+        /* The cache is not needed any more after it was read completely,
+           unless another read was announced */
+        iso_filter_cache_destroy(&(cstd->cache), 0);
+    }
     ziso_running_destroy(&(data->running), 0);
     if (flag & 1)
         return 1;
     if (cstd != NULL)
         if (cstd->open_counter > 0)
             cstd->open_counter--;
+    if (replay)
+        return 1;
     return iso_stream_close(data->orig);
 }
 
@@ -514,6 +635,15 @@ int ziso_stream_open_flag(IsoStream *stream, int flag)
     }
     data->running = running;
 
+    if (stream->class->read == &ziso_stream_compress && !(flag & 1)) {
+        cstd = (ZisofsComprStreamData *) data;
+        if (cstd->cache != NULL && cstd->block_pointers != NULL) {
+            /* Deliver the data blocks of the size determination run */
+            running->replay = 1;
+            return 1;
+        }
+    }
+
     ret = iso_stream_open(data->orig);
     if (ret < 0) {
         return ret;
@@ -535,15 +665,18 @@ int ziso_stream_open(IsoStream *stream)
 static
 off_t ziso_stream_measure_size(IsoStream *stream, int flag)
 {
-    int ret, ret_close;
+    int ret, ret_close, skip;
     off_t count = 0;
     ZisofsFilterStreamData *data;
+    ZisofsComprStreamData *cstd = NULL;
     char buf[64 * 1024];
     size_t bufsize = 64 * 1024;
 
     if (stream == NULL)
         return ISO_NULL_POINTER;
     data = stream->data;
+    if (stream->class->read == &ziso_stream_compress && !(flag & 1))
+        cstd = (ZisofsComprStreamData *) data;
 
     /* Run filter command and count output bytes */
     if (!(flag & 1)) {
@@ -556,15 +689,35 @@ off_t ziso_stream_measure_size(IsoStream *stream, int flag)
         ret = ziso_stream_uncompress(stream, buf, 0);
         count = data->size;
     } else {
-        /* The size of the compression result has to be counted */
+        /* The size of the compression result has to be counted.
+           The data blocks are kept for the run which delivers them to the
+           image. Header and block pointers will then be produced anew.
+        */
+        if (cstd != NULL)
+            iso_filter_cache_new(&(cstd->cache), 0);
         while (1) {
             ret = stream->class->read(stream, buf, bufsize);
             if (ret <= 0)
         break;
+            if (cstd != NULL && cstd->cache != NULL &&
+                data->running->state >= 2) {
+                /* block_pointers[0] is the start of the data blocks */
+                skip = 0;
+                if (count < (off_t) cstd->block_pointers[0])
+                    skip = cstd->block_pointers[0] - count;
+                if (skip < ret)
+                    if (iso_filter_cache_append(cstd->cache, buf + skip,
+                                                ret - skip, 0) != 1)
+                        iso_filter_cache_destroy(&(cstd->cache), 0);
+            }
             count += ret;
         }
     }
+    if (cstd != NULL && ret < 0)
+        iso_filter_cache_destroy(&(cstd->cache), 0);
     ret_close = ziso_stream_close_flag(stream, flag & 2);
+    if (cstd != NULL && ret_close < 0)
+        iso_filter_cache_destroy(&(cstd->cache), 0);
     if (ret < 0)
         return ret;
     if (ret_close < 0)
@@ -575,6 +728,222 @@ off_t ziso_stream_measure_size(IsoStream *stream, int flag)
 }
 
 
+#ifdef Libisofs_with_zliB
+
+/* Compress a single block. A block of 0-bytes is represented by 0 bytes.
+   @param out_len  Submits the size of out and returns the compressed size
+*/
+static
+int ziso_compress_block(char *in, int in_len, char *out, uLongf *out_len)
+{
+    int i, ret;
+
+    /* Check whether all 0 : represent as 0-length block */;
+    for (i = 0; i < in_len; i++)
+        if (in[i])
+    break;
+    if (i >= in_len) { /* All 0-bytes. Bypass compression. */
+        *out_len = 0;
+        return 1;
+    }
+    ret = compress2((Bytef *) out, out_len, (Bytef *) in, (uLong) in_len,
+                    ziso_compression_level);
+    if (ret != Z_OK)
+        return ISO_ZLIB_COMPR_ERR;
+    return 1;
+}
+
+
+/* Compress the blocks of the current batch which are not claimed yet.
+   To be called with pool->mutex locked. Returns with the mutex locked.
+*/
+static
+void ziso_batch_compress(ZisofsFilterRuntime *rng)
+{
+    struct ziso_batch_pool *pool = rng->batch_pool;
+    int i;
+
+    while (pool->next < pool->limit) {
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        rng->batch_out_len[i] = rng->buffer_size;
+        rng->batch_ret[i] = ziso_compress_block(
+                          rng->batch_in + (size_t) i * rng->block_size,
+                          rng->batch_in_len[i],
+                          rng->batch_out + (size_t) i * rng->buffer_size,
+                          (uLongf *) (rng->batch_out_len + i));
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->done++;
+        if (pool->done >= pool->limit)
+            pthread_cond_broadcast(&pool->done_cond);
+    }
+}
+
+
+static
+void *ziso_batch_thread(void *arg)
+{
+    ZisofsFilterRuntime *rng = arg;
+    struct ziso_batch_pool *pool = rng->batch_pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        if (pool->end)
+    break;
+        if (pool->next >= pool->limit) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+    continue;
+        }
+        ziso_batch_compress(rng);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+
+/* Start the threads which help the reading thread with compression.
+   If none can be started, the reading thread compresses all blocks.
+*/
+static
+int ziso_batch_pool_new(ZisofsFilterRuntime *rng)
+{
+    struct ziso_batch_pool *pool;
+    int i;
+
+    pool = calloc(1, sizeof(struct ziso_batch_pool));
+    if (pool == NULL)
+        return ISO_OUT_OF_MEM;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->num_threads = 0;
+    pool->next = pool->limit = pool->done = 0;
+    pool->end = 0;
+    rng->batch_pool = pool;
+    for (i = 1; i < ziso_compression_threads; i++) {
+        if (pthread_create(&(pool->threads[pool->num_threads]), NULL,
+                           ziso_batch_thread, rng) != 0)
+    break;
+        pool->num_threads++;
+    }
+    return 1;
+}
+
+
+/* Decide whether the blocks of the stream get compressed by several threads
+   and allocate the batch buffers if so.
+*/
+static
+int ziso_batch_new(ZisofsFilterRuntime *rng, uint64_t orig_size)
+{
+    int n;
+
+    rng->batch_size = -1;
+    if (ziso_compression_threads <= 1 ||
+        orig_size <= (uint64_t) rng->block_size)
+        return 0;
+    n = ziso_compression_threads * 2;
+    rng->batch_in = calloc(n, rng->block_size);
+    rng->batch_out = calloc(n, rng->buffer_size);
+    rng->batch_in_len = calloc(n, sizeof(int));
+    rng->batch_out_len = calloc(n, sizeof(unsigned long));
+    rng->batch_ret = calloc(n, sizeof(int));
+    if (rng->batch_in == NULL || rng->batch_out == NULL ||
+        rng->batch_in_len == NULL || rng->batch_out_len == NULL ||
+        rng->batch_ret == NULL)
+        return 0; /* Compress serially. Memory gets freed at close time. */
+    if (ziso_batch_pool_new(rng) <= 0)
+        return 0;
+    if (rng->batch_pool->num_threads <= 0) {
+        ziso_batch_pool_destroy(&(rng->batch_pool));
+        return 0;
+    }
+    rng->batch_size = n;
+    return 1;
+}
+
+
+/* Read the next batch of input blocks and compress them concurrently */
+static
+int ziso_batch_fill(ZisofsFilterRuntime *rng, IsoStream *orig)
+{
+    struct ziso_batch_pool *pool = rng->batch_pool;
+    int ret;
+
+    rng->batch_fill = rng->batch_rpos = 0;
+    while (rng->batch_fill < rng->batch_size) {
+        ret = iso_stream_read(orig,
+                   rng->batch_in + (size_t) rng->batch_fill * rng->block_size,
+                   rng->block_size);
+        if (ret <= 0) {
+            rng->batch_ended = 1;
+            rng->batch_end_ret = ret;
+    break;
+        }
+        rng->batch_in_len[rng->batch_fill] = ret;
+        rng->batch_fill++;
+    }
+
+    /* Hand the batch to the threads and take part in the work */
+    pthread_mutex_lock(&pool->mutex);
+    pool->next = 0;
+    pool->done = 0;
+    pool->limit = rng->batch_fill;
+    pthread_cond_broadcast(&pool->work_cond);
+    ziso_batch_compress(rng);
+    while (pool->done < pool->limit)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    return 1;
+}
+
+
+/* Obtain the next input block and its compressed form in rng->block_buffer
+   @param buf_len  Returns the number of compressed bytes
+   @return >0 = number of input bytes, 0 = end of input, <0 = error
+*/
+static
+int ziso_next_block(ZisofsComprStreamData *data, ZisofsFilterRuntime *rng,
+                    uLongf *buf_len)
+{
+    int ret, i;
+
+    if (rng->batch_size == 0)
+        ziso_batch_new(rng, data->orig_size);
+
+    if (rng->batch_size > 0) {
+        if (rng->batch_rpos >= rng->batch_fill) {
+            if (rng->batch_ended)
+                return rng->batch_end_ret;
+            ziso_batch_fill(rng, data->std.orig);
+            if (rng->batch_fill <= 0)
+                return rng->batch_end_ret;
+        }
+        i = rng->batch_rpos++;
+        if (rng->batch_ret[i] < 0)
+            return rng->batch_ret[i];
+        *buf_len = rng->batch_out_len[i];
+        memcpy(rng->block_buffer, rng->batch_out + (size_t) i * rng->buffer_size,
+               *buf_len);
+        return rng->batch_in_len[i];
+    }
+
+    ret = iso_stream_read(data->std.orig, rng->read_buffer, rng->block_size);
+    if (ret <= 0)
+        return ret;
+    *buf_len = rng->buffer_size;
+    i = ziso_compress_block(rng->read_buffer, ret, rng->block_buffer,
+                            buf_len);
+    if (i < 0)
+        return i;
+    return ret;
+}
+
+#endif /* Libisofs_with_zliB */
+
+
 static
 int ziso_stream_compress(IsoStream *stream, void *buf, size_t desired)
 {
@@ -731,32 +1100,30 @@ int ziso_stream_compress(IsoStream *stream, void *buf, size_t desired)
                 }
             }
         }
+        if (rng->state == 2 && rng->replay) {
+            /* Delivering data blocks from the size determination run */;
+
+            ret = iso_filter_cache_read(data->cache, rng->out_counter -
+                                        (off_t) data->block_pointers[0],
+                                        cbuf + fill, desired - fill, 0);
+            if (ret < 0)
+                return (rng->error_ret = ret);
+            if (ret == 0)
+                rng->state = 3;
+            fill += ret;
+            rng->out_counter += ret;
+            return fill;
+        }
         if (rng->state == 2 && rng->buffer_rpos >= rng->buffer_fill) {
             /* Delivering data blocks */;
 
-            ret = iso_stream_read(data->std.orig, rng->read_buffer,
-                                  rng->block_size);
+            ret = ziso_next_block(data, rng, &buf_len);
             if (ret > 0) {
                 rng->in_counter += ret;
                 if ((uint64_t) rng->in_counter > data->orig_size) {
                     /* Input size became larger */
                     return (rng->error_ret = ISO_FILTER_WRONG_INPUT);
                 }
-                /* Check whether all 0 : represent as 0-length block */;
-                for (i = 0; i < ret; i++)
-                    if (rng->read_buffer[i])
-                break;
-                if (i >= ret) { /* All 0-bytes. Bypass compression. */
-                    buf_len = 0;
-                } else {
-                    buf_len = rng->buffer_size;
-                    ret = compress2((Bytef *) rng->block_buffer, &buf_len,
-                                    (Bytef *) rng->read_buffer, (uLong) ret,
-                                    ziso_compression_level);
-                    if (ret != Z_OK) {
-                        return (rng->error_ret = ISO_ZLIB_COMPR_ERR);
-                    }
-                }
                 rng->buffer_fill = buf_len;
                 rng->buffer_rpos = 0;
 
@@ -1176,17 +1543,15 @@ void ziso_stream_free(IsoStream *stream)
         ziso_stream_close(stream);
     }
     if (stream->class->read == &ziso_stream_uncompress) {
-        if (--ziso_osiz_ref_count < 0)
-            ziso_osiz_ref_count = 0;
+        iso_counter_add_off(&ziso_osiz_ref_count, (off_t) -1);
     } else {
         nstd = stream->data;
         if (nstd->block_pointers != NULL) {
             ziso_block_pointer_mgt(nstd->block_pointer_counter, 2);
             free((char *) nstd->block_pointers);
         }
-        if (--ziso_ref_count < 0)
-            ziso_ref_count = 0;
-        if (ziso_ref_count == 0)
+        iso_filter_cache_destroy(&(nstd->cache), 0);
+        if (iso_counter_add_off(&ziso_ref_count, (off_t) -1) == 0)
             ziso_early_bpt_discard = 0;
     }
     iso_stream_unref(data->orig);
@@ -1250,6 +1615,7 @@ int ziso_clone_stream(IsoStream *old_stream, IsoStream **new_stream, int flag)
         compr->block_pointers = NULL;
         compr->block_pointer_counter = 0;
         compr->open_counter = 0;
+        compr->cache = NULL;
         if (old_compr->block_pointers != NULL ||
             old_compr->block_pointers_dropped)
             compr->block_pointers_dropped = 1;
@@ -1260,7 +1626,7 @@ int ziso_clone_stream(IsoStream *old_stream, IsoStream **new_stream, int flag)
     stream_data->orig = new_input_stream;
     stream_data->size = old_stream_data->size;
     stream_data->running = NULL;
-    stream_data->id = ++ziso_ino_id;
+    stream_data->id = iso_counter_next_ino(&ziso_ino_id, 0);
     stream->data = stream_data;
     *new_stream = stream;
     return ISO_SUCCESS;
@@ -1314,6 +1680,14 @@ IsoStreamIface ziso_stream_uncompress_class = {
 };
 
 
+IsoFilterCache **ziso_stream_cache_pt(IsoStream *stream)
+{
+    if (stream->class != &ziso_stream_compress_class)
+        return NULL;
+    return &(((ZisofsComprStreamData *) stream->data)->cache);
+}
+
+
 static
 int ziso_cmp_ino(IsoStream *s1, IsoStream *s2)
 {
@@ -1398,7 +1772,7 @@ int ziso_filter_get_filter(FilterContext *filter, IsoStream *original,
     }
 
     /* These data items are not owned by this filter object */
-    data->id = ++ziso_ino_id;
+    data->id = iso_counter_next_ino(&ziso_ino_id, 0);
     data->orig = original;
     data->size = -1;
     data->running = NULL;
@@ -1413,15 +1787,16 @@ int ziso_filter_get_filter(FilterContext *filter, IsoStream *original,
         unstd->header_size_div4 = 0;
         unstd->block_size_log2 = 0;
         str->class = &ziso_stream_uncompress_class;
-        ziso_osiz_ref_count++;
+        iso_counter_add_off(&ziso_osiz_ref_count, (off_t) 1);
     } else {
         cnstd->orig_size = iso_stream_get_size(original);
         cnstd->block_pointers = NULL;
         cnstd->block_pointer_counter = 0;
         cnstd->open_counter = 0;
         cnstd->block_pointers_dropped = 0;
+        cnstd->cache = NULL;
         str->class = &ziso_stream_compress_class;
-        ziso_ref_count++;
+        iso_counter_add_off(&ziso_ref_count, (off_t) 1);
     }
 
     *filtered = str;
@@ -1555,8 +1930,8 @@ int iso_file_add_zisofs_filter(IsoFile *file, int flag)
 /* API function */
 int iso_zisofs_get_refcounts(off_t *ziso_count, off_t *osiz_count, int flag)
 {
-    *ziso_count = ziso_ref_count;
-    *osiz_count = ziso_osiz_ref_count;
+    *ziso_count = iso_counter_add_off(&ziso_ref_count, (off_t) 0);
+    *osiz_count = iso_counter_add_off(&ziso_osiz_ref_count, (off_t) 0);
     return ISO_SUCCESS;
 }
 
@@ -1673,7 +2048,7 @@ int iso_zisofs_set_params(struct iso_zisofs_ctrl *params, int flag)
 
 #ifdef Libisofs_with_zliB
 
-    if (params->version < 0 || params->version > 1)
+    if (params->version < 0 || params->version > 2)
        return ISO_WRONG_ARG_VALUE;
 
     if (params->compression_level < 0 || params->compression_level > 9 ||
@@ -1687,7 +2062,11 @@ int iso_zisofs_set_params(struct iso_zisofs_ctrl *params, int flag)
              (params->v2_block_size_log2 < ISO_ZISOFS_V2_MIN_LOG2 ||
               params->v2_block_size_log2 > ISO_ZISOFS_V2_MAX_LOG2)))
             return ISO_WRONG_ARG_VALUE;
-    if (ziso_ref_count > 0) {
+    if (params->version >= 2)
+        if (params->compression_threads < 0 ||
+            params->compression_threads > ISO_ZISOFS_MAX_THREADS)
+            return ISO_WRONG_ARG_VALUE;
+    if (iso_counter_add_off(&ziso_ref_count, (off_t) 0) > 0) {
         return ISO_ZISOFS_PARAM_LOCK;
     }
     ziso_compression_level = params->compression_level;
@@ -1710,6 +2089,12 @@ int iso_zisofs_set_params(struct iso_zisofs_ctrl *params, int flag)
     if (params->bpt_discard_free_ratio != 0.0)
         ziso_keep_blocks_free_ratio = params->bpt_discard_free_ratio;
 
+    if (params->version == 1)
+        return 1;
+
+    if (params->compression_threads > 0)
+        ziso_compression_threads = params->compression_threads;
+
     return 1;
     
 #else
@@ -1727,12 +2112,12 @@ int iso_zisofs_get_params(struct iso_zisofs_ctrl *params, int flag)
 
 #ifdef Libisofs_with_zliB
 
-    if (params->version < 0 || params->version > 1)
+    if (params->version < 0 || params->version > 2)
        return ISO_WRONG_ARG_VALUE;
 
     params->compression_level = ziso_compression_level;
     params->block_size_log2 = ziso_block_size_log2;
-    if (params->version == 1) {
+    if (params->version >= 1) {
         params->v2_enabled = ziso_v2_enabled;
         params->v2_block_size_log2 = ziso_v2_block_size_log2;
         params->max_total_blocks = ziso_max_total_blocks;
@@ -1742,6 +2127,8 @@ int iso_zisofs_get_params(struct iso_zisofs_ctrl *params, int flag)
         params->bpt_discard_file_blocks = ziso_many_block_limit;
         params->bpt_discard_free_ratio = ziso_keep_blocks_free_ratio;
     }
+    if (params->version >= 2)
+        params->compression_threads = ziso_compression_threads;
     return 1;
 
 #else
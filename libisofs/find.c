@@ -124,6 +124,7 @@ void update_next(IsoDirIter *iter)
     }
     
     ret = get_next(data, &n);
+    iso_dir_iter_unregister(iter);
     iso_node_unref((IsoNode*)iter->dir);
     if (ret == 1) {
         data->current = n;
@@ -136,6 +137,7 @@ void update_next(IsoDirIter *iter)
         iter->dir = data->dir;
     }
     iso_node_ref((IsoNode*)iter->dir);
+    iso_dir_iter_register(iter);
 }
 
 static
@@ -183,7 +185,10 @@ void find_iter_free(IsoDirIter *iter)
         iso_node_unref(data->current);
     }
 
-    /* free underlying iter */
+    /* free underlying iters */
+    if (data->itersec != NULL) {
+        iso_dir_iter_free(data->itersec);
+    }
     iso_dir_iter_free(data->iter);
     free(iter->data);
 }
@@ -213,6 +218,7 @@ int find_iter_remove(IsoDirIter *iter)
 void find_notify_child_taken(IsoDirIter *iter, IsoNode *node)
 {
     struct find_iter_data *data = iter->data;
+    IsoNode *prev;
     
     if (data->prev == node) {
         /* free our ref */
@@ -221,7 +227,12 @@ void find_notify_child_taken(IsoDirIter *iter, IsoNode *node)
     } else if (data->current == node) {
         iso_node_unref(node);
         data->current = NULL;
+
+        /* update_next() would make the lost node the last returned one */
+        prev = data->prev;
+        data->prev = NULL;
         update_next(iter);
+        data->prev = prev;
     }
 }
 
@@ -27,6 +27,7 @@
 #include "node.h"
 #include "aaip_0_2.h"
 #include "system_area.h"
+#include "data_source.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +36,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <pthread.h>
 
 
 /* Enable this and write the correct absolute path into the include statement
@@ -53,6 +55,10 @@
 #endif /* Libisofs_syslinux_tesT */
 
 
+/* Maximum number of directory blocks which read_dir() reads at once */
+#define ISO_READ_DIR_WINDOW 32
+
+
 /**
  * Options for image reading.
  * There are four kind of options:
@@ -150,6 +156,26 @@ struct iso_read_opts
      */
     int keep_import_src;
 
+    /**
+     * Load the directories below the root only when they get inspected.
+     * See iso_read_opts_set_lazy_dirs().
+     */
+    unsigned int lazy_dirs : 1;
+
+    /**
+     * Number of threads which read directories ahead of the tree walk.
+     * 0 or 1 = no reading ahead.
+     * See iso_read_opts_set_dir_threads().
+     */
+    int dir_threads;
+
+    /**
+     * Number of blocks of Continuation Areas to keep in memory.
+     * 0 = default, -1 = none.
+     * See iso_read_opts_set_ce_cache().
+     */
+    int ce_cache_blocks;
+
     /**
      * What to do in case of name longer than truncate_length:
      *  0= throw FAILURE
@@ -415,6 +441,14 @@ typedef struct
 
     size_t joliet_ucs2_failures;
 
+    /* Blocks of Continuation Areas which were read ahead for the directory
+       which read_dir() is working on, or NULL
+     */
+    struct susp_ce_blocks *ce_blocks;
+
+    /* Recently read blocks of Continuation Areas */
+    SuspCeCache *ce_cache;
+
 } _ImageFsData;
 
 typedef struct image_fs_data ImageFileSourceData;
@@ -468,6 +502,12 @@ struct image_fs_data
      */
     unsigned char *aa_string;
 
+    /**
+     * Directory content which was read ahead by the threads of
+     * ifs_prefetcher_new(), or NULL.
+     */
+    struct ifs_prefetch *pre;
+
 };
 
 struct child_list
@@ -568,6 +608,556 @@ int ifs_access(IsoFileSource *src)
     return ISO_SUCCESS;
 }
 
+/*
+ * Reading ahead of iso_add_dir_src_rec() when it walks an imported tree.
+ *
+ * Worker threads read the extents of the directories and the blocks of the
+ * Continuation Areas to which their records point. They look into the
+ * records only for the addresses of subdirectories and of CE entries.
+ * read_dir() then parses the records from memory. The creation of the
+ * IsoFileSource objects with their Rock Ridge and AAIP information stays
+ * on the thread of the tree walk, so the resulting tree and the messages
+ * are the same as without reading ahead.
+ */
+
+/* Maximum number of directories which were read ahead and not yet
+   consumed by read_dir(). The workers pause when this is exceeded.
+*/
+#define IFS_PREFETCH_MAX_PENDING 4096
+
+/* The directory extent and the CE blocks of a single directory */
+struct ifs_prefetch
+{
+    struct ifs_prefetcher *pf;
+
+    /* Start block of the directory extent */
+    uint32_t block;
+
+    /* 0= not queued, 1= in the queue, 2= being read, 3= read,
+       4= being read but no longer wanted
+    */
+    int state;
+
+    /* < 0 if the directory could not be read ahead. read_dir() then reads
+       it by itself and reports the problem.
+    */
+    int read_ret;
+
+    uint8_t *extent;
+    uint32_t nblocks;
+
+    struct susp_ce_blocks ce;
+
+    /* The subdirectories in the sequence of their records */
+    struct ifs_prefetch **children;
+    size_t nchildren;
+    size_t next_child;
+
+    /* Links in the queue of directories */
+    struct ifs_prefetch *prev;
+    struct ifs_prefetch *next;
+};
+
+struct ifs_prefetcher
+{
+    IsoImageFilesystem *fs;
+
+    /* Directories to be read. Last in, first out, so that the workers
+       stay near the directory which the tree walk is working on.
+    */
+    struct ifs_prefetch *queue;
+
+    /* Number of read ahead directories which were not consumed yet */
+    size_t pending;
+
+    /* Number of existing struct ifs_prefetch */
+    size_t count;
+
+    int abort;
+
+    /* Set when the threads are gone. The last ifs_prefetch disposes the
+       prefetcher then.
+    */
+    int stopped;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    int nthreads;
+};
+
+
+static
+struct ifs_prefetch *ifs_prefetch_new(struct ifs_prefetcher *pf,
+                                      uint32_t block)
+{
+    struct ifs_prefetch *rec;
+
+    rec = calloc(1, sizeof(struct ifs_prefetch));
+    if (rec == NULL)
+        return NULL;
+    rec->pf = pf;
+    rec->block = block;
+    return rec;
+}
+
+static
+void ifs_prefetcher_free(struct ifs_prefetcher *pf)
+{
+    iso_filesystem_unref(pf->fs);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    LIBISO_FREE_MEM(pf->threads);
+    LIBISO_FREE_MEM(pf);
+}
+
+/* To be called with pf->mutex locked.
+   Unused children are dropped too. If a worker is still reading the
+   directory, then it is only marked. The worker will drop it when done.
+*/
+static
+void ifs_prefetch_free(struct ifs_prefetch *rec)
+{
+    struct ifs_prefetcher *pf = rec->pf;
+    size_t i;
+
+    if (rec->state == 2) {
+        rec->state = 4;
+        return;
+    }
+    if (rec->state == 1) {
+        if (rec->prev != NULL)
+            rec->prev->next = rec->next;
+        else
+            pf->queue = rec->next;
+        if (rec->next != NULL)
+            rec->next->prev = rec->prev;
+    }
+    for (i = 0; i < rec->nchildren; i++)
+        if (rec->children[i] != NULL)
+            ifs_prefetch_free(rec->children[i]);
+    if (rec->state == 3)
+        pf->pending--;
+    LIBISO_FREE_MEM(rec->children);
+    LIBISO_FREE_MEM(rec->extent);
+    LIBISO_FREE_MEM(rec->ce.lba);
+    LIBISO_FREE_MEM(rec->ce.data);
+    free(rec);
+    pf->count--;
+}
+
+/* Dispose a record from the thread of the tree walk */
+static
+void ifs_prefetch_drop(struct ifs_prefetch *rec)
+{
+    struct ifs_prefetcher *pf = rec->pf;
+    int gone;
+
+    pthread_mutex_lock(&pf->mutex);
+    ifs_prefetch_free(rec);
+    gone = (pf->stopped && pf->count == 0);
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    if (gone)
+        ifs_prefetcher_free(pf);
+}
+
+static
+int ifs_prefetch_cmp_lba(const void *a, const void *b)
+{
+    uint32_t la = *((uint32_t *) a), lb = *((uint32_t *) b);
+
+    return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+/* Remember the blocks of the continuation area to which a CE entry in the
+   System Use field of record points.
+*/
+static
+int ifs_prefetch_note_ce(struct ifs_prefetch *rec, _ImageFsData *fsdata,
+                         struct ecma119_dir_record *record, size_t *ce_size)
+{
+    struct susp_sys_user_entry *entry;
+    uint8_t *base;
+    uint32_t ce_block, ce_off, ce_len, nblocks, i, *new_lba;
+    int pad, size, pos;
+
+    pad = (record->len_fi[0] + 1) % 2;
+    base = record->file_id + record->len_fi[0] + pad;
+    size = record->len_dr[0] - record->len_fi[0] - 33 - pad;
+    for (pos = fsdata->len_skp; pos + 4 <= size; pos += entry->len_sue[0]) {
+        entry = (struct susp_sys_user_entry *) (base + pos);
+        if (entry->len_sue[0] == 0 || SUSP_SIG(entry, 'S', 'T'))
+    break;
+        if (!SUSP_SIG(entry, 'C', 'E') || entry->len_sue[0] < 28 ||
+            pos + entry->len_sue[0] > size)
+    continue;
+        ce_block = iso_read_bb(entry->data.CE.block, 4, NULL);
+        ce_off = iso_read_bb(entry->data.CE.offset, 4, NULL);
+        ce_len = iso_read_bb(entry->data.CE.len, 4, NULL);
+        if (ce_len == 0 || ce_len > ISO_SUSP_MAX_CE_BYTES)
+    continue;
+        ce_block += ce_off / BLOCK_SIZE;
+        nblocks = DIV_UP(ce_off % BLOCK_SIZE + ce_len, BLOCK_SIZE);
+        if (((uint64_t) ce_block) + nblocks >
+            ((uint64_t) fsdata->session_lba) + fsdata->nblocks)
+    continue;
+        if (rec->ce.count + nblocks > *ce_size) {
+            *ce_size = 2 * *ce_size + nblocks;
+            new_lba = realloc(rec->ce.lba, *ce_size * sizeof(uint32_t));
+            if (new_lba == NULL)
+                return ISO_OUT_OF_MEM;
+            rec->ce.lba = new_lba;
+        }
+        for (i = 0; i < nblocks; i++)
+            rec->ce.lba[rec->ce.count++] = ce_block + i;
+    }
+    return ISO_SUCCESS;
+}
+
+/* Read the CE blocks noted by ifs_prefetch_note_ce(). Contiguous blocks
+   get read by a single request.
+*/
+static
+int ifs_prefetch_read_ce(struct ifs_prefetch *rec, _ImageFsData *fsdata)
+{
+    size_t i, j, n;
+    int ret;
+
+    if (rec->ce.count == 0)
+        return ISO_SUCCESS;
+    qsort(rec->ce.lba, rec->ce.count, sizeof(uint32_t), ifs_prefetch_cmp_lba);
+    for (i = 1, n = 1; i < rec->ce.count; i++)
+        if (rec->ce.lba[i] != rec->ce.lba[n - 1])
+            rec->ce.lba[n++] = rec->ce.lba[i];
+    rec->ce.count = n;
+    rec->ce.data = malloc(rec->ce.count * BLOCK_SIZE);
+    if (rec->ce.data == NULL)
+        return ISO_OUT_OF_MEM;
+    for (i = 0; i < rec->ce.count; i = j) {
+        for (j = i + 1; j < rec->ce.count; j++)
+            if (rec->ce.lba[j] != rec->ce.lba[j - 1] + 1)
+        break;
+        ret = iso_data_source_read_blocks(fsdata->src, rec->ce.lba[i],
+                                          (uint32_t) (j - i),
+                                          rec->ce.data + i * BLOCK_SIZE);
+        if (ret < 0)
+            return ret;
+    }
+    return ISO_SUCCESS;
+}
+
+/* Read the directory extent, walk its records like read_dir() does, and
+   read the CE blocks. Called without pf->mutex.
+*/
+static
+void ifs_prefetch_read(struct ifs_prefetch *rec)
+{
+    _ImageFsData *fsdata = rec->pf->fs->data;
+    struct ecma119_dir_record *record;
+    struct ifs_prefetch *child, **new_children;
+    uint8_t *buffer, *new_extent;
+    uint32_t size, tlen = 0, pos = 0, b = 0;
+    size_t children_size = 0, ce_size = 0;
+    int ret;
+
+    rec->extent = malloc(BLOCK_SIZE);
+    if (rec->extent == NULL)
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+    ret = fsdata->src->read_block(fsdata->src, rec->block, rec->extent);
+    if (ret < 0)
+        goto ex;
+    record = (struct ecma119_dir_record *) rec->extent;
+    size = iso_read_bb(record->length, 4, NULL);
+    rec->nblocks = DIV_UP(size, BLOCK_SIZE);
+    if (rec->nblocks == 0 || ((uint64_t) rec->block) + rec->nblocks >
+                             ((uint64_t) fsdata->session_lba) + fsdata->nblocks)
+        {ret = ISO_WRONG_ECMA119; goto ex;}
+    if (rec->nblocks > 1) {
+        new_extent = realloc(rec->extent, rec->nblocks * BLOCK_SIZE);
+        if (new_extent == NULL)
+            {ret = ISO_OUT_OF_MEM; goto ex;}
+        rec->extent = new_extent;
+        ret = iso_data_source_read_blocks(fsdata->src, rec->block + 1,
+                                          rec->nblocks - 1,
+                                          rec->extent + BLOCK_SIZE);
+        if (ret < 0)
+            goto ex;
+    }
+
+    /* Skip "." and ".." */
+    buffer = rec->extent;
+    record = (struct ecma119_dir_record *) buffer;
+    tlen = pos = record->len_dr[0];
+    record = (struct ecma119_dir_record *) (buffer + pos);
+    tlen += record->len_dr[0];
+    pos += record->len_dr[0];
+
+    while (tlen < size) {
+        record = (struct ecma119_dir_record *) (buffer + pos);
+        if (pos >= BLOCK_SIZE || record->len_dr[0] == 0) {
+            b++;
+            if (b >= rec->nblocks)
+    break;
+            buffer = rec->extent + b * BLOCK_SIZE;
+            tlen += BLOCK_SIZE - pos;
+            pos = 0;
+    continue;
+        }
+        if (record->len_dr[0] < 34 || pos + record->len_dr[0] > BLOCK_SIZE)
+    break; /* read_dir() will find out what is wrong */
+
+        if (record->flags[0] & 2) {
+            if (rec->nchildren >= children_size) {
+                children_size = children_size * 2 + 16;
+                new_children = realloc(rec->children,
+                               children_size * sizeof(struct ifs_prefetch *));
+                if (new_children == NULL)
+                    {ret = ISO_OUT_OF_MEM; goto ex;}
+                rec->children = new_children;
+            }
+            child = ifs_prefetch_new(rec->pf,
+                                     iso_read_bb(record->block, 4, NULL) +
+                                     record->len_xa[0]);
+            if (child == NULL)
+                {ret = ISO_OUT_OF_MEM; goto ex;}
+            rec->children[rec->nchildren++] = child;
+        }
+        if (fsdata->rr) {
+            ret = ifs_prefetch_note_ce(rec, fsdata, record, &ce_size);
+            if (ret < 0)
+                goto ex;
+        }
+        tlen += record->len_dr[0];
+        pos += record->len_dr[0];
+    }
+
+    ret = ifs_prefetch_read_ce(rec, fsdata);
+ex:;
+    rec->read_ret = ret < 0 ? ret : ISO_SUCCESS;
+}
+
+/* To be called with pf->mutex locked after ifs_prefetch_read() */
+static
+void ifs_prefetch_done(struct ifs_prefetch *rec)
+{
+    struct ifs_prefetcher *pf = rec->pf;
+    struct ifs_prefetch *child;
+    size_t i;
+
+    pf->count += rec->nchildren;
+    if (rec->state == 4) {
+        rec->state = 3;
+        pf->pending++;
+        ifs_prefetch_free(rec);
+        pthread_cond_broadcast(&pf->cond);
+        return;
+    }
+    rec->state = 3;
+    pf->pending++;
+
+    /* Queue the subdirectories so that the first one gets read first */
+    for (i = rec->nchildren; i > 0; i--) {
+        child = rec->children[i - 1];
+        child->state = 1;
+        child->prev = NULL;
+        child->next = pf->queue;
+        if (pf->queue != NULL)
+            pf->queue->prev = child;
+        pf->queue = child;
+    }
+    pthread_cond_broadcast(&pf->cond);
+}
+
+static
+void *ifs_prefetch_worker(void *arg)
+{
+    struct ifs_prefetcher *pf = arg;
+    struct ifs_prefetch *rec;
+
+    pthread_mutex_lock(&pf->mutex);
+    while (1) {
+        while (!pf->abort &&
+               (pf->queue == NULL || pf->pending >= IFS_PREFETCH_MAX_PENDING))
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        if (pf->abort)
+    break;
+        rec = pf->queue;
+        pf->queue = rec->next;
+        if (pf->queue != NULL)
+            pf->queue->prev = NULL;
+        rec->state = 2;
+        pthread_mutex_unlock(&pf->mutex);
+
+        ifs_prefetch_read(rec);
+
+        pthread_mutex_lock(&pf->mutex);
+        ifs_prefetch_done(rec);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return NULL;
+}
+
+/* Called by read_dir(). If no worker has begun to read the directory yet,
+   then the calling thread does it by itself rather than waiting.
+   @return 1 = rec can be used, 0 = read_dir() has to read by itself
+*/
+static
+int ifs_prefetch_wait(struct ifs_prefetch *rec)
+{
+    struct ifs_prefetcher *pf = rec->pf;
+    int ret;
+
+    pthread_mutex_lock(&pf->mutex);
+    if (rec->state == 0 || rec->state == 1) {
+        if (rec->state == 1) {
+            if (rec->prev != NULL)
+                rec->prev->next = rec->next;
+            else
+                pf->queue = rec->next;
+            if (rec->next != NULL)
+                rec->next->prev = rec->prev;
+        }
+        rec->state = 2;
+        pthread_mutex_unlock(&pf->mutex);
+
+        ifs_prefetch_read(rec);
+
+        pthread_mutex_lock(&pf->mutex);
+        ifs_prefetch_done(rec);
+    }
+    while (rec->state != 3)
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+    ret = (rec->read_ret >= 0);
+    pthread_mutex_unlock(&pf->mutex);
+    return ret;
+}
+
+/* Take the record of the next subdirectory out of rec */
+static
+struct ifs_prefetch *ifs_prefetch_next_child(struct ifs_prefetch *rec)
+{
+    struct ifs_prefetch *child;
+
+    if (rec->next_child >= rec->nchildren)
+        return NULL;
+    child = rec->children[rec->next_child];
+    rec->children[rec->next_child] = NULL;
+    rec->next_child++;
+    return child;
+}
+
+/* Stop the threads. Records which are still attached to IsoFileSource
+   objects stay usable. read_dir() then reads by itself.
+*/
+static
+int ifs_prefetcher_destroy(struct ifs_prefetcher **pf_pt)
+{
+    struct ifs_prefetcher *pf = *pf_pt;
+    int i, gone;
+
+    if (pf == NULL)
+        return ISO_SUCCESS;
+    pthread_mutex_lock(&pf->mutex);
+    pf->abort = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    for (i = 0; i < pf->nthreads; i++)
+        pthread_join(pf->threads[i], NULL);
+    ifs_fs_close(pf->fs);
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->stopped = 1;
+    gone = (pf->count == 0);
+    pthread_mutex_unlock(&pf->mutex);
+    if (gone)
+        ifs_prefetcher_free(pf);
+    *pf_pt = NULL;
+    return ISO_SUCCESS;
+}
+
+/* Start threads which read ahead of iso_add_dir_src_rec() when it walks the
+   tree underneath the directory dir.
+   @return  1 = started, 0 = not suitable for reading ahead, <0 = error
+*/
+static
+int ifs_prefetcher_new(IsoFileSource *dir, int num_threads,
+                       struct ifs_prefetcher **pf_pt)
+{
+    struct ifs_prefetcher *pf = NULL;
+    struct ifs_prefetch *rec;
+    ImageFileSourceData *data;
+    _ImageFsData *fsdata;
+    uint8_t *map;
+    int ret, i;
+
+    *pf_pt = NULL;
+    data = dir->data;
+    fsdata = data->fs->data;
+    if (data->pre != NULL || !S_ISDIR(data->info.st_mode))
+        return 0;
+
+    /* Data sources which are not known to be safe for concurrent reading
+       get no reading ahead. Neither do memory mapped ones, although they
+       are safe. read_dir() parses their blocks directly in the map and
+       there is no i/o latency which threads could hide. */
+    if (!iso_data_source_concurrent_ok(fsdata->src))
+        return 0;
+    if (iso_data_source_map_blocks(fsdata->src, data->sections[0].block, 1,
+                                   &map) == 1)
+        return 0;
+
+    LIBISO_ALLOC_MEM(pf, struct ifs_prefetcher, 1);
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pf->fs = data->fs;
+    iso_filesystem_ref(pf->fs);
+    pf->queue = NULL;
+    pf->pending = 0;
+    pf->count = 0;
+    pf->abort = 0;
+    pf->stopped = 0;
+    pf->threads = NULL;
+    pf->nthreads = 0;
+    LIBISO_ALLOC_MEM(pf->threads, pthread_t, num_threads);
+
+    /* Keep the data source open while the workers read */
+    ret = ifs_fs_open(pf->fs);
+    if (ret < 0)
+        goto ex;
+
+    rec = ifs_prefetch_new(pf, data->sections[0].block);
+    if (rec == NULL) {
+        ifs_fs_close(pf->fs);
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+    }
+    rec->state = 1;
+    pf->queue = rec;
+    pf->count = 1;
+    data->pre = rec;
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&(pf->threads[i]), NULL, ifs_prefetch_worker,
+                           pf) != 0)
+    break;
+        pf->nthreads++;
+    }
+    /* With no thread at all, read_dir() reads the directories itself */
+    *pf_pt = pf;
+    pf = NULL;
+    ret = 1;
+ex:;
+    if (pf != NULL) {
+        iso_filesystem_unref(pf->fs);
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->mutex);
+        LIBISO_FREE_MEM(pf->threads);
+        LIBISO_FREE_MEM(pf);
+    }
+    return ret;
+}
+
+
 /**
  * Read all directory records in a directory, and creates an IsoFileSource for
  * each of them, storing them in the data field of the IsoFileSource for the
@@ -578,33 +1168,62 @@ int read_dir(ImageFileSourceData *data)
 {
     int ret;
     uint32_t size;
-    uint32_t block;
+    uint32_t block, dir_blocks, win_block, win_count, done;
     IsoImageFilesystem *fs;
     _ImageFsData *fsdata;
     struct ecma119_dir_record *record;
-    uint8_t *buffer = NULL;
+    uint8_t *buffer, *window = NULL, *win_base;
     IsoFileSource *child = NULL;
+    struct ifs_prefetch *pre = NULL, *child_pre;
+    ImageFileSourceData *child_data;
     uint32_t pos = 0;
     uint32_t tlen = 0;
 
     if (data == NULL) {
         ret = ISO_NULL_POINTER; goto ex;
     }
-
-    LIBISO_ALLOC_MEM(buffer, uint8_t, BLOCK_SIZE);
     fs = data->fs;
     fsdata = fs->data;
 
+    /* Take over what the threads of ifs_prefetcher_new() have read */
+    pre = data->pre;
+    data->pre = NULL;
+    if (pre != NULL) {
+        if (!ifs_prefetch_wait(pre) || pre->block != data->sections[0].block) {
+            ifs_prefetch_drop(pre);
+            pre = NULL;
+        }
+    }
+
+    /* The blocks of the directory extent get read in pieces of up to
+       ISO_READ_DIR_WINDOW blocks, unless the data source is mapped into
+       memory */
+    LIBISO_ALLOC_MEM(window, uint8_t, ISO_READ_DIR_WINDOW * BLOCK_SIZE);
+
     /* a dir has always a single extent */
     block = data->sections[0].block;
-    ret = fsdata->src->read_block(fsdata->src, block, buffer);
-    if (ret < 0) {
-        goto ex;
+    if (pre != NULL) {
+        win_base = pre->extent;
+        win_count = pre->nblocks;
+        fsdata->ce_blocks = &(pre->ce);
+    } else {
+        if (iso_data_source_map_blocks(fsdata->src, block, 1, &win_base)
+            != 1) {
+            ret = fsdata->src->read_block(fsdata->src, block, window);
+            if (ret < 0) {
+                goto ex;
+            }
+            win_base = window;
+        }
+        win_count = 1;
     }
+    buffer = win_base;
+    win_block = block;
 
     /* "." entry, get size of the dir and skip */
     record = (struct ecma119_dir_record *)(buffer + pos);
     size = iso_read_bb(record->length, 4, NULL);
+    dir_blocks = size / BLOCK_SIZE + !!(size % BLOCK_SIZE);
     tlen += record->len_dr[0];
     pos += record->len_dr[0];
 
@@ -621,9 +1240,25 @@ int read_dir(ImageFileSourceData *data)
              * The directory entries are split in several blocks
              * read next block
              */
-            ret = fsdata->src->read_block(fsdata->src, ++block, buffer);
-            if (ret < 0) {
-                goto ex;
+            block++;
+            if (block - win_block < win_count) {
+                buffer = win_base + (block - win_block) * BLOCK_SIZE;
+            } else {
+                done = block - data->sections[0].block;
+                win_count = done < dir_blocks ? dir_blocks - done : 1;
+                if (iso_data_source_map_blocks(fsdata->src, block, win_count,
+                                               &win_base) != 1) {
+                    if (win_count > ISO_READ_DIR_WINDOW)
+                        win_count = ISO_READ_DIR_WINDOW;
+                    ret = iso_data_source_read_blocks(fsdata->src, block,
+                                                      win_count, window);
+                    if (ret < 0) {
+                        goto ex;
+                    }
+                    win_base = window;
+                }
+                buffer = win_base;
+                win_block = block;
             }
             tlen += 2048 - pos;
             pos = 0;
@@ -671,6 +1306,18 @@ int read_dir(ImageFileSourceData *data)
          * reference from child to parent.
          */
         ret = iso_file_source_new_ifs(fs, NULL, record, &child, 0);
+        child_pre = NULL;
+        if (pre != NULL && (record->flags[0] & 2))
+            child_pre = ifs_prefetch_next_child(pre);
+        if (child_pre != NULL) {
+            child_data = ret == 1 ? child->data : NULL;
+            if (child_data != NULL && S_ISDIR(child_data->info.st_mode) &&
+                child_data->pre == NULL &&
+                child_data->sections[0].block == child_pre->block)
+                child_data->pre = child_pre;
+            else
+                ifs_prefetch_drop(child_pre);
+        }
         if (ret < 0) {
             if (child) {
                 /*
@@ -710,7 +1357,11 @@ int read_dir(ImageFileSourceData *data)
 
     ret = ISO_SUCCESS;
 ex:;
-    LIBISO_FREE_MEM(buffer);
+    if (pre != NULL) {
+        fsdata->ce_blocks = NULL;
+        ifs_prefetch_drop(pre);
+    }
+    LIBISO_FREE_MEM(window);
     return ret;
 }
 
@@ -855,6 +1506,32 @@ uint32_t size_available(int nsections, struct iso_file_section *sections,
     return 0; /* should never happen */
 }
 
+/**
+ * Get the number of whole blocks which may be read from the section of the
+ * given offset. It is 0 if the offset is not aligned to a block start.
+ */
+static
+uint32_t blocks_available(int nsections, struct iso_file_section *sections,
+                          off_t offset)
+{
+    int section = 0;
+    off_t bytes = 0;
+
+    do {
+        if ( (offset - bytes) < (off_t) sections[section].size ) {
+            uint32_t curr_section_offset = (uint32_t)(offset - bytes);
+            if (curr_section_offset % BLOCK_SIZE)
+                return 0;
+            return (sections[section].size - curr_section_offset) / BLOCK_SIZE;
+        } else {
+            bytes += (off_t) sections[section].size;
+            section++;
+        }
+
+    } while(section < nsections);
+    return 0; /* should never happen */
+}
+
 /**
  * Get the block offset for reading the given file offset
  */
@@ -901,7 +1578,7 @@ int ifs_read(IsoFileSource *src, void *buf, size_t count)
 {
     int ret;
     ImageFileSourceData *data;
-    uint32_t read = 0;
+    uint32_t read = 0, nblocks;
 
     if (src == NULL || src->data == NULL || buf == NULL) {
         return ISO_NULL_POINTER;
@@ -921,7 +1598,39 @@ int ifs_read(IsoFileSource *src, void *buf, size_t count)
         size_t bytes;
         uint8_t *orig;
 
-        if (block_offset(data->nsections, data->sections, data->data.offset) == 0) {
+        nblocks = blocks_available(data->nsections, data->sections,
+                                   data->data.offset);
+        if (nblocks > (count - read) / BLOCK_SIZE)
+            nblocks = (count - read) / BLOCK_SIZE;
+        if ((off_t) nblocks > (data->info.st_size - data->data.offset) /
+                              BLOCK_SIZE)
+            nblocks = (data->info.st_size - data->data.offset) / BLOCK_SIZE;
+        if (nblocks > 0) {
+            /* Read whole blocks directly into buf */
+            uint32_t block;
+            _ImageFsData *fsdata;
+
+            fsdata = data->fs->data;
+            block = block_from_offset(data->nsections, data->sections,
+                                      data->data.offset);
+            ret = iso_data_source_read_blocks(fsdata->src, block, nblocks,
+                                              (uint8_t *) buf + read);
+            if (ret < 0) {
+                return ret;
+            }
+            read += nblocks * BLOCK_SIZE;
+            data->data.offset += (off_t) nblocks * BLOCK_SIZE;
+            continue;
+        }
+
+        orig = NULL;
+        if (iso_data_source_map_blocks(((_ImageFsData *) data->fs->data)->src,
+                                       block_from_offset(data->nsections,
+                                                         data->sections,
+                                                         data->data.offset),
+                                       1, &orig) == 1) {
+            /* Copy directly from the mapped image */;
+        } else if (block_offset(data->nsections, data->sections, data->data.offset) == 0) {
             /* we need to buffer next block */
             uint32_t block;
             _ImageFsData *fsdata;
@@ -946,7 +1655,8 @@ int ifs_read(IsoFileSource *src, void *buf, size_t count)
         if (data->data.offset + (off_t)bytes > data->info.st_size) {
              bytes = data->info.st_size - data->data.offset;
         }
-        orig = data->data.content;
+        if (orig == NULL)
+            orig = data->data.content;
         orig += block_offset(data->nsections, data->sections, data->data.offset);
         memcpy((uint8_t*)buf + read, orig, bytes);
         read += bytes;
@@ -1137,6 +1847,8 @@ void ifs_free(IsoFileSource *src)
     if (S_ISLNK(data->info.st_mode)) {
         free(data->data.content);
     }
+    if (data->pre != NULL)
+        ifs_prefetch_drop(data->pre);
     iso_filesystem_unref(data->fs);
     if (data->parent != NULL) {
         iso_file_source_unref(data->parent);
@@ -1611,6 +2323,9 @@ int iso_file_source_new_ifs(IsoImageFilesystem *fs, IsoFileSource *parent,
         if (iter == NULL) {
             {ret = ISO_OUT_OF_MEM; goto ex;}
         }
+        if (fsdata->ce_blocks != NULL)
+            susp_iter_set_ce_blocks(iter, fsdata->ce_blocks);
+        susp_iter_set_ce_cache(iter, fsdata->ce_cache);
 
         while ((ret = susp_iter_next(iter, &sue, 0)) > 0) {
 
@@ -2361,6 +3076,7 @@ int ifs_fs_close(IsoImageFilesystem *fs)
 
     if (--data->open_count == 0) {
         /* we need to actually close the data source */
+        susp_ce_cache_invalidate(data->ce_cache);
         return data->src->close(data->src);
     }
     return ISO_SUCCESS;
@@ -2400,6 +3116,7 @@ void ifs_fs_free(IsoFilesystem *fs)
 
     if(data->catcontent != NULL)
         free(data->catcontent);
+    susp_ce_cache_free(data->ce_cache);
 
     free(data);
 }
@@ -2462,6 +3179,7 @@ int read_root_susp_entries(_ImageFsData *data, uint32_t block)
     if (iter == NULL) {
         ret = ISO_OUT_OF_MEM; goto ex;
     }
+    susp_iter_set_ce_cache(iter, data->ce_cache);
 
     /* first entry must be an SP system use entry */
     ret = susp_iter_next(iter, &sue, 1);
@@ -2918,7 +3636,7 @@ int iso_image_filesystem_new(IsoDataSource *src, struct iso_read_opts *opts,
     data->catcontent = NULL;
 
     /* get an id for the filesystem */
-    data->id = ++fs_dev_id;
+    data->id = iso_counter_next_uint(&fs_dev_id, 0);
 
     /* fill data from opts */
     data->gid = opts->gid;
@@ -2964,6 +3682,12 @@ int iso_image_filesystem_new(IsoDataSource *src, struct iso_read_opts *opts,
     ifs->close = ifs_fs_close;
     ifs->free = ifs_fs_free;
 
+    if (opts->ce_cache_blocks >= 0) {
+        ret = susp_ce_cache_new(opts->ce_cache_blocks, &(data->ce_cache));
+        if (ret < 0)
+            goto fs_cleanup;
+    }
+
     /* read Volume Descriptors and ensure it is a valid image */
     if (data->md5_load == 1) {
         /* From opts->block on : check for superblock and tree tags */;
@@ -3461,6 +4185,12 @@ int image_builder_create_node(IsoNodeBuilder *builder, IsoImage *image,
             goto ex;
     }
 
+    if (image->node_compaction) {
+        ret = iso_node_compact(new, image->node_compaction);
+        if (ret < 0)
+            goto ex;
+    }
+
     *node = new; new = NULL;
     {ret = ISO_SUCCESS; goto ex;}
 
@@ -5803,6 +6533,236 @@ int iso_image_report_el_torito(IsoImage *image,
 }
 
 
+/* ------------------- Lazy loading of directories ---------------------- */
+
+/**
+ * The state of an iso_image_import() with iso_read_opts_set_lazy_dirs().
+ * It is shared by the directory stubs of the imported tree. The import
+ * settings of the image get recorded so that later loading ignores their
+ * eventual changes by the application.
+ */
+struct iso_lazy_import
+{
+    int refcount;
+
+    /* NULL if the image is gone or has imported a new tree */
+    IsoImage *image;
+
+    IsoImageFilesystem *fs;
+    IsoNodeBuilder *builder;
+
+    unsigned int follow_symlinks : 1;
+    unsigned int ignore_hidden : 1;
+    int ignore_special;
+    enum iso_replace_mode replace;
+
+    /* Whether iso_add_dir_src_rec() shall create stubs */
+    int active;
+
+    /* The number of directories which still wait for loading */
+    size_t pending;
+
+    /* Postponed img_make_inos() flags, 0 if not needed */
+    int make_inos;
+};
+
+struct iso_dir_lazy
+{
+    IsoFileSource *src;
+    struct iso_lazy_import *import;
+};
+
+
+static
+int iso_lazy_import_new(IsoImage *image, IsoImageFilesystem *fs,
+                        struct iso_lazy_import **lazy)
+{
+    struct iso_lazy_import *o;
+
+    o = calloc(1, sizeof(struct iso_lazy_import));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    o->refcount = 1;
+    o->image = image;
+    o->fs = fs;
+    iso_filesystem_ref(fs);
+    o->builder = image->builder;
+    iso_node_builder_ref(o->builder);
+    o->follow_symlinks = image->follow_symlinks;
+    o->ignore_hidden = image->ignore_hidden;
+    o->ignore_special = image->ignore_special;
+    o->replace = image->replace;
+    o->active = 0;
+    o->pending = 0;
+    o->make_inos = 0;
+    *lazy = o;
+    return ISO_SUCCESS;
+}
+
+static
+void iso_lazy_import_unref(struct iso_lazy_import *lazy)
+{
+    if (--lazy->refcount > 0)
+        return;
+    iso_node_builder_unref(lazy->builder);
+    iso_filesystem_unref(lazy->fs);
+    free(lazy);
+}
+
+void iso_lazy_import_detach(struct iso_lazy_import **lazy)
+{
+    if (*lazy == NULL)
+        return;
+    (*lazy)->image = NULL;
+    iso_lazy_import_unref(*lazy);
+    *lazy = NULL;
+}
+
+int iso_image_lazy_dir(IsoImage *image, IsoDir *dir, IsoFileSource *src)
+{
+    struct iso_lazy_import *lazy;
+    struct iso_dir_lazy *stub;
+
+    lazy = image->lazy_import;
+    if (lazy == NULL || !lazy->active)
+        return 0;
+    stub = calloc(1, sizeof(struct iso_dir_lazy));
+    if (stub == NULL)
+        return ISO_OUT_OF_MEM;
+    stub->src = src;
+    iso_file_source_ref(src);
+    stub->import = lazy;
+    lazy->refcount++;
+    lazy->pending++;
+    dir->lazy = stub;
+    return 1;
+}
+
+void iso_dir_lazy_free(struct iso_dir_lazy *lazy)
+{
+    lazy->import->pending--;
+    iso_lazy_import_unref(lazy->import);
+    iso_file_source_unref(lazy->src);
+    free(lazy);
+}
+
+/* Run iso_add_dir_src_rec() with the settings of the import */
+static
+int iso_lazy_import_load(struct iso_lazy_import *lazy, IsoDir *dir,
+                         IsoFileSource *src)
+{
+    int ret, active, ignore_special, nexcludes;
+    unsigned int follow_symlinks, ignore_hidden;
+    enum iso_replace_mode replace;
+    IsoImage *image;
+    IsoNodeBuilder *builder;
+    struct iso_lazy_import *image_lazy;
+    struct iso_exclude_matcher *exclude_matcher;
+    int (*report)(IsoImage *image, IsoFileSource *src);
+    _ImageFsData *data;
+
+    image = lazy->image;
+    if (image == NULL)
+        return ISO_SUCCESS; /* Nobody will ever look at the old tree */
+
+    builder = image->builder;
+    follow_symlinks = image->follow_symlinks;
+    ignore_hidden = image->ignore_hidden;
+    ignore_special = image->ignore_special;
+    replace = image->replace;
+    report = image->report;
+    nexcludes = image->nexcludes;
+    exclude_matcher = image->exclude_matcher;
+    image_lazy = image->lazy_import;
+    active = lazy->active;
+
+    image->builder = lazy->builder;
+    image->follow_symlinks = lazy->follow_symlinks;
+    image->ignore_hidden = lazy->ignore_hidden;
+    image->ignore_special = lazy->ignore_special;
+    image->replace = lazy->replace;
+    image->report = NULL;
+    image->nexcludes = 0;
+    image->exclude_matcher = NULL;
+    image->lazy_import = lazy;
+    lazy->active = 1;
+
+    ret = iso_add_dir_src_rec(image, dir, src);
+
+    lazy->active = active;
+    image->lazy_import = image_lazy;
+    image->exclude_matcher = exclude_matcher;
+    image->nexcludes = nexcludes;
+    image->report = report;
+    image->replace = replace;
+    image->ignore_special = ignore_special;
+    image->ignore_hidden = ignore_hidden;
+    image->follow_symlinks = follow_symlinks;
+    image->builder = builder;
+
+    /* Keep track of the PX inode numbers like iso_image_import() does */
+    data = lazy->fs->data;
+    if (image->inode_counter < data->inode_counter)
+        image->inode_counter = data->inode_counter;
+    if (data->px_ino_status & (2 | 4 | 8))
+        lazy->make_inos = 2 | 4 | 8;
+    return ret;
+}
+
+int iso_dir_load_lazy(IsoDir *dir, int flag)
+{
+    int ret;
+    struct iso_dir_lazy *stub;
+    IsoNode *pos;
+
+    if (dir == NULL)
+        return ISO_NULL_POINTER;
+    stub = dir->lazy;
+    if (stub != NULL) {
+        /* Detach first. iso_add_dir_src_rec() will inquire dir. */
+        dir->lazy = NULL;
+        ret = iso_lazy_import_load(stub->import, dir, stub->src);
+        iso_dir_lazy_free(stub);
+        if (ret < 0)
+            return ret;
+    }
+    if (!(flag & 1))
+        return ISO_SUCCESS;
+    for (pos = dir->children; pos != NULL; pos = pos->next) {
+        if (pos->type != LIBISO_DIR)
+    continue;
+        ret = iso_dir_load_lazy((IsoDir *) pos, 1);
+        if (ret < 0)
+            return ret;
+    }
+    return ISO_SUCCESS;
+}
+
+/* @param flag bit0= only load, do not give out postponed inode numbers
+*/
+int iso_image_load_lazy_dirs(IsoImage *image, int flag)
+{
+    int ret;
+    struct iso_lazy_import *lazy;
+
+    lazy = image->lazy_import;
+    if (lazy == NULL)
+        return ISO_SUCCESS;
+    if (lazy->pending > 0) {
+        ret = iso_dir_load_lazy(image->root, 1);
+        if (ret < 0)
+            return ret;
+    }
+    if (lazy->make_inos && !(flag & 1)) {
+        ret = img_make_inos(image, image->root, lazy->make_inos);
+        if (ret < 0)
+            return ret;
+        lazy->make_inos = 0;
+    }
+    return ISO_SUCCESS;
+}
+
+
 int iso_image_import(IsoImage *image, IsoDataSource *src,
                      struct iso_read_opts *opts,
                      IsoReadImageFeatures **features)
@@ -5828,6 +6788,8 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     char md5[16];
     struct el_torito_boot_catalog *catalog = NULL;
     ElToritoBootImage *boot_image = NULL;
+    struct iso_lazy_import *old_lazy = NULL;
+    struct ifs_prefetcher *prefetcher = NULL;
 
     if (image == NULL || src == NULL || opts == NULL) {
         return ISO_NULL_POINTER;
@@ -5911,6 +6873,8 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     image->bootcat = NULL;
     old_checksum_array = image->checksum_array;
     image->checksum_array = NULL;
+    old_lazy = image->lazy_import;
+    image->lazy_import = NULL;
 
     /* create new builder */
     ret = iso_image_builder_new(blback, &image->builder);
@@ -5925,6 +6889,7 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     if (ret < 0) {
         goto import_revert;
     }
+    iso_tree_block_index_destroy(&(image->block_index));
     {
         struct stat info;
 
@@ -6011,8 +6976,34 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
         catalog = NULL; /* So it does not get freed */
     }
 
+    /* Boot images are recognized while the tree gets loaded and the excluded
+       or reported files would have to be known now. So lazy loading is
+       only done if none of this is involved. */
+    if (opts->lazy_dirs && !data->eltorito && !opts->make_new_ino &&
+        image->nexcludes == 0 && image->exclude_matcher == NULL &&
+        image->report == NULL) {
+        ret = iso_lazy_import_new(image, fs, &(image->lazy_import));
+        if (ret < 0) {
+            iso_node_builder_unref(image->builder);
+            goto import_revert;
+        }
+        image->lazy_import->active = 1;
+    }
+
+    /* Lazily loaded directories are read one by one when needed */
+    if (opts->dir_threads > 1 && image->lazy_import == NULL) {
+        ret = ifs_prefetcher_new(newroot, opts->dir_threads, &prefetcher);
+        if (ret < 0) {
+            iso_node_builder_unref(image->builder);
+            goto import_revert;
+        }
+    }
+
     /* recursively add image */
     ret = iso_add_dir_src_rec(image, image->root, newroot);
+    if (image->lazy_import != NULL)
+        image->lazy_import->active = 0;
+    ifs_prefetcher_destroy(&prefetcher);
     if (ret < 0) {
         /* error during recursive image addition */
         iso_node_builder_unref(image->builder);
@@ -6034,10 +7025,15 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
             hflag = 1; /* Equip all data files with new unique inos */
         else
             hflag = 2 | 4 | 8; /* Equip any file type if it has ino == 0 */
-        ret = img_make_inos(image, image->root, hflag);
-        if (ret < 0) {
-            iso_node_builder_unref(image->builder);
-            goto import_revert;
+        if (image->lazy_import != NULL) {
+            /* The maximum PX inode number is not known yet */
+            image->lazy_import->make_inos = hflag;
+        } else {
+            ret = img_make_inos(image, image->root, hflag);
+            if (ret < 0) {
+                iso_node_builder_unref(image->builder);
+                goto import_revert;
+            }
         }
     }
 
@@ -6222,6 +7218,7 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     import_revert:;
 
     iso_node_unref((IsoNode*)image->root);
+    iso_tree_block_index_destroy(&(image->block_index));
     el_torito_boot_catalog_free(image->bootcat);
     image->root = oldroot;
     oldroot = NULL;
@@ -6229,6 +7226,9 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     oldbootcat = NULL;
     image->checksum_array = old_checksum_array;
     old_checksum_array = NULL;
+    iso_lazy_import_detach(&(image->lazy_import));
+    image->lazy_import = old_lazy;
+    old_lazy = NULL;
 
     import_cleanup:;
 
@@ -6237,6 +7237,7 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     image->builder = blback;
 
     /* free old root */
+    iso_lazy_import_detach(&old_lazy);
     if (oldroot != NULL)
         iso_node_unref((IsoNode*)oldroot);
 
@@ -6337,6 +7338,9 @@ int iso_read_opts_new(IsoReadOpts **opts, int profile)
     ropts->nomd5 = 1;
     ropts->load_system_area = 0;
     ropts->keep_import_src = 0;
+    ropts->lazy_dirs = 0;
+    ropts->dir_threads = 0;
+    ropts->ce_cache_blocks = 0;
     ropts->truncate_mode = 1;
     ropts->truncate_length = LIBISOFS_NODE_NAME_MAX;
 
@@ -6513,6 +7517,39 @@ int iso_read_opts_keep_import_src(IsoReadOpts *opts, int mode)
     return ISO_SUCCESS;
 }
 
+int iso_read_opts_set_lazy_dirs(IsoReadOpts *opts, int mode)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    opts->lazy_dirs = mode & 1;
+    return ISO_SUCCESS;
+}
+
+int iso_read_opts_set_dir_threads(IsoReadOpts *opts, int num_threads)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (num_threads < 0 || num_threads > ISO_MAX_INGEST_THREADS) {
+        return ISO_WRONG_ARG_VALUE;
+    }
+    opts->dir_threads = num_threads;
+    return ISO_SUCCESS;
+}
+
+int iso_read_opts_set_ce_cache(IsoReadOpts *opts, int num_blocks)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (num_blocks < -1 || num_blocks > ISO_MAX_CE_CACHE_BLOCKS) {
+        return ISO_WRONG_ARG_VALUE;
+    }
+    opts->ce_cache_blocks = num_blocks;
+    return ISO_SUCCESS;
+}
+
 /**
  * Destroy an IsoReadImageFeatures object obtained with iso_image_import.
  */
@@ -19,6 +19,7 @@
 #include "fsource.h"
 #include "util.h"
 #include "aaip_0_2.h"
+#include "node.h"
 
 #include <stdlib.h>
 #include <sys/types.h>
@@ -29,6 +30,7 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <string.h>
+#include <pthread.h>
 
 /* O_BINARY is needed for Cygwin but undefined elsewhere */
 #ifndef O_BINARY
@@ -39,10 +41,15 @@ static
 int iso_file_source_new_lfs(IsoFileSource *parent, const char *name, 
                             IsoFileSource **src);
 
+IsoFileSourceIface lfs_class;
+
 /*
  * We can share a local filesystem object, as it has no private atts.
  */
 IsoFilesystem *lfs= NULL;
+static pthread_mutex_t lfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct lfs_prefetch;
 
 /* IMPORTANT: Any change must be reflected by lfs_clone_src() */
 typedef struct
@@ -56,8 +63,41 @@ typedef struct
         int fd;
         DIR *dir;
     } info;
+
+    /** Results of iso_lfs_prefetcher threads, NULL if none */
+    struct lfs_prefetch *pre;
 } _LocalFsFileSource;
 
+
+/* Choose an appropriate return code for a failed stat(2) or lstat(2) */
+static
+int lfs_stat_error(int err)
+{
+    switch (err) {
+    case EACCES:
+        return ISO_FILE_ACCESS_DENIED;
+    case ENOTDIR:
+    case ENAMETOOLONG:
+    case ELOOP:
+        return ISO_FILE_BAD_PATH;
+    case ENOENT:
+        return ISO_FILE_DOESNT_EXIST;
+    case EFAULT:
+    case ENOMEM:
+        return ISO_OUT_OF_MEM;
+    }
+    return ISO_FILE_ERROR;
+}
+
+/* Choose an appropriate return code for a failed readlink(2) */
+static
+int lfs_readlink_error(int err)
+{
+    if (err == EINVAL)
+        return ISO_FILE_IS_NOT_SYMLINK;
+    return lfs_stat_error(err);
+}
+
 static
 char* lfs_get_path(IsoFileSource *src)
 {
@@ -97,44 +137,579 @@ char* lfs_get_name(IsoFileSource *src)
     return strdup(data->name);
 }
 
+static
+int lfs_get_path_aa_string(char *path, unsigned char **aa_string, int flag)
+{
+    int ret, no_non_user_perm= 0;
+    size_t num_attrs = 0, *value_lengths = NULL, result_len;
+    ssize_t sret;
+    char **names = NULL, **values = NULL;
+    unsigned char *result = NULL;
+
+    *aa_string = NULL;
+
+    if ((flag & 6 ) == 6) { /* Neither ACL nor xattr shall be read */
+        ret = 1;
+        goto ex;
+    }
+    /* Obtain EAs and ACLs ("access" and "default"). ACLs encoded according
+       to AAIP ACL representation. Clean out st_mode ACL entries.
+    */ 
+    ret = aaip_get_attr_list(path, &num_attrs, &names,
+                             &value_lengths, &values,
+                             (!(flag & 2)) | 2 | (flag & 4) | (flag & 8) | 16);
+    if (ret <= 0) {
+        if (ret == -2)
+            ret = ISO_AAIP_NO_GET_LOCAL;
+        else
+            ret = ISO_FILE_ERROR;
+        goto ex;
+    }
+    if(ret == 2)
+        no_non_user_perm= 1;
+      
+    if (num_attrs == 0)
+        result = NULL;
+    else {
+        sret = aaip_encode(num_attrs, names,
+                           value_lengths, values, &result_len, &result, 0);
+        if (sret < 0) {
+            ret = sret;
+            goto ex;
+        }
+    }
+    *aa_string = result;
+    ret = 1 + no_non_user_perm;
+ex:;
+    if (names != NULL || value_lengths != NULL || values != NULL)
+        aaip_get_attr_list(NULL, &num_attrs, &names, &value_lengths, &values,
+                           1 << 15); /* free memory */
+    return ret;
+}
+
+
+/*
+ * Reading ahead of iso_add_dir_src_rec().
+ *
+ * Worker threads list the directories of the tree and make the system calls
+ * for their entries which the tree walk will ask for: lstat(), stat(),
+ * access(), readlink() and the inquiry of ACL and xattr.
+ * lfs_readdir() attaches the results to the IsoFileSource objects of the
+ * entries. The methods of these objects then use the results instead of
+ * making the system calls on the thread of the tree walk.
+ * The worker threads never touch IsoFileSource objects or their reference
+ * counters. The tree walk itself stays sequential, so the resulting tree and
+ * the messages are the same as without prefetching.
+ */
+
+/* Maximum number of prefetched entries which the tree walk did not yet
+   drop. The workers pause when this is exceeded.
+*/
+#define LFS_PREFETCH_MAX_PENDING 65536
+
+/* The prefetched results for a single file */
+struct lfs_prefetch
+{
+    struct iso_lfs_prefetcher *pf;
+
+    /* Name in the parent directory, NULL for the start directory */
+    char *name;
+
+    /* bit0= lstat_*, bit1= stat_*, bit2= access_ret, bit3= link_*,
+       bit4= aa_*
+    */
+    int have;
+
+    int lstat_ret;
+    struct stat lstat_info;
+    int stat_ret;
+    struct stat stat_info;
+    int access_ret;
+
+    /* Result of readlink() with a buffer of LIBISOFS_NODE_PATH_MAX */
+    int link_ret;
+    char *link_dest;
+
+    int aa_flag;
+    int aa_ret;
+    unsigned char *aa_string;
+
+    /* Path of a directory which shall be listed, else NULL */
+    char *path;
+
+    /* 0= not to be listed or listed by nobody yet,
+       1= in the queue, 2= being listed, 3= listed,
+       4= being listed but no longer wanted
+    */
+    int state;
+
+    /* The result of lfs_readdir() after the last child */
+    int readdir_ret;
+
+    struct lfs_prefetch **children;
+    size_t nchildren;
+    size_t next_child;
+
+    /* Links in the queue of directories */
+    struct lfs_prefetch *prev;
+    struct lfs_prefetch *next;
+};
+
+struct iso_lfs_prefetcher
+{
+    int follow_symlinks;
+    int aa_flag;
+    int (*skip)(void *handle, char *path, char *name, struct stat *info);
+    void *handle;
+
+    /* Directories to be listed. Last in, first out, so that the workers
+       stay near the directory which the tree walk is working on.
+    */
+    struct lfs_prefetch *queue;
+
+    /* Number of prefetched entries which were not dropped yet */
+    size_t pending;
+
+    int abort;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    int nthreads;
+};
+
+
+static
+struct lfs_prefetch *lfs_prefetch_new(struct iso_lfs_prefetcher *pf,
+                                      char *name)
+{
+    struct lfs_prefetch *rec;
+
+    rec = calloc(1, sizeof(struct lfs_prefetch));
+    if (rec == NULL)
+        return NULL;
+    rec->pf = pf;
+    if (name != NULL) {
+        rec->name = strdup(name);
+        if (rec->name == NULL) {
+            free(rec);
+            return NULL;
+        }
+    }
+    return rec;
+}
+
+/* To be called with pf->mutex locked.
+   Unused children are dropped too. If a worker is still listing the
+   directory, then it is only marked. The worker will drop it when done.
+*/
+static
+void lfs_prefetch_free(struct lfs_prefetch *rec)
+{
+    struct iso_lfs_prefetcher *pf = rec->pf;
+    size_t i;
+
+    if (rec->state == 2) {
+        rec->state = 4;
+        return;
+    }
+    if (rec->state == 1) {
+        if (rec->prev != NULL)
+            rec->prev->next = rec->next;
+        else
+            pf->queue = rec->next;
+        if (rec->next != NULL)
+            rec->next->prev = rec->prev;
+    }
+    for (i = 0; i < rec->nchildren; i++)
+        if (rec->children[i] != NULL)
+            lfs_prefetch_free(rec->children[i]);
+    if (rec->name != NULL) {
+        free(rec->name);
+        pf->pending--;
+    }
+    if (rec->children != NULL)
+        free(rec->children);
+    if (rec->link_dest != NULL)
+        free(rec->link_dest);
+    if (rec->aa_string != NULL)
+        free(rec->aa_string);
+    if (rec->path != NULL)
+        free(rec->path);
+    free(rec);
+}
+
+/* Make the system calls for a single entry of a directory */
+static
+void lfs_prefetch_inquire(struct lfs_prefetch *rec, char *dir_path)
+{
+    struct iso_lfs_prefetcher *pf = rec->pf;
+    struct stat *info;
+    char *path;
+    int ret, size;
+    size_t len;
+
+    len = strlen(dir_path);
+    path = malloc(len + strlen(rec->name) + 2);
+    if (path == NULL)
+        return;
+    strcpy(path, dir_path);
+    if (len != 1) /* len can only be 1 for root */
+        strcat(path, "/");
+    strcat(path, rec->name);
+
+    if (lstat(path, &rec->lstat_info) != 0)
+        rec->lstat_ret = lfs_stat_error(errno);
+    else
+        rec->lstat_ret = ISO_SUCCESS;
+    rec->have |= 1;
+    if (rec->lstat_ret == ISO_SUCCESS && S_ISLNK(rec->lstat_info.st_mode)) {
+        if (stat(path, &rec->stat_info) != 0)
+            rec->stat_ret = lfs_stat_error(errno);
+        else
+            rec->stat_ret = ISO_SUCCESS;
+    } else {
+        rec->stat_ret = rec->lstat_ret;
+        rec->stat_info = rec->lstat_info;
+    }
+    rec->have |= 2;
+
+    if (pf->follow_symlinks) {
+        ret = rec->stat_ret;
+        info = &rec->stat_info;
+    } else {
+        ret = rec->lstat_ret;
+        info = &rec->lstat_info;
+    }
+    if (ret < 0)
+        goto ex;
+    if (pf->skip != NULL && pf->skip(pf->handle, path, rec->name, info))
+        goto ex;
+
+    if (S_ISLNK(info->st_mode)) {
+        rec->link_dest = malloc(LIBISOFS_NODE_PATH_MAX);
+        if (rec->link_dest != NULL) {
+            size = readlink(path, rec->link_dest, LIBISOFS_NODE_PATH_MAX);
+            if (size < 0)
+                rec->link_ret = lfs_readlink_error(errno);
+            else
+                rec->link_ret = size;
+            rec->have |= 8;
+        }
+    }
+    if (S_ISREG(info->st_mode) && rec->stat_ret == ISO_SUCCESS) {
+        rec->access_ret = iso_eaccess(path);
+        rec->have |= 4;
+    }
+    rec->aa_flag = pf->aa_flag;
+    rec->aa_ret = lfs_get_path_aa_string(path, &rec->aa_string, pf->aa_flag);
+    rec->have |= 16;
+
+    if (S_ISDIR(info->st_mode)) {
+        /* To be listed later */
+        rec->path = path;
+        path = NULL;
+    }
+ex:;
+    if (path != NULL)
+        free(path);
+}
+
+/* Read the directory and inquire its entries. Called without pf->mutex. */
+static
+void lfs_prefetch_list(struct lfs_prefetch *rec)
+{
+    struct lfs_prefetch *child, **new_children;
+    struct dirent *entry;
+    size_t size = 0;
+    DIR *dir;
+
+    dir = opendir(rec->path);
+    if (dir == NULL) {
+        rec->readdir_ret = ISO_FILE_ERROR;
+        return;
+    }
+    while (1) {
+        entry = readdir(dir);
+        if (entry == NULL) {
+            if (errno == EBADF)
+                rec->readdir_ret = ISO_FILE_ERROR;
+    break;
+        }
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+    continue;
+        if (rec->nchildren >= size) {
+            size = size * 2 + 16;
+            new_children = realloc(rec->children,
+                                   size * sizeof(struct lfs_prefetch *));
+            if (new_children == NULL) {
+                rec->readdir_ret = ISO_OUT_OF_MEM;
+    break;
+            }
+            rec->children = new_children;
+        }
+        child = lfs_prefetch_new(rec->pf, entry->d_name);
+        if (child == NULL) {
+            rec->readdir_ret = ISO_OUT_OF_MEM;
+    break;
+        }
+        lfs_prefetch_inquire(child, rec->path);
+        rec->children[rec->nchildren++] = child;
+    }
+    closedir(dir);
+}
+
+/* To be called with pf->mutex locked after lfs_prefetch_list() */
+static
+void lfs_prefetch_listed(struct lfs_prefetch *rec)
+{
+    struct iso_lfs_prefetcher *pf = rec->pf;
+    struct lfs_prefetch *child;
+    size_t i;
+
+    pf->pending += rec->nchildren;
+    if (rec->state == 4) {
+        rec->state = 3;
+        lfs_prefetch_free(rec);
+        pthread_cond_broadcast(&pf->cond);
+        return;
+    }
+    rec->state = 3;
+
+    /* Queue the subdirectories so that the first one gets listed first */
+    for (i = rec->nchildren; i > 0; i--) {
+        child = rec->children[i - 1];
+        if (child->path == NULL)
+    continue;
+        child->state = 1;
+        child->prev = NULL;
+        child->next = pf->queue;
+        if (pf->queue != NULL)
+            pf->queue->prev = child;
+        pf->queue = child;
+    }
+    pthread_cond_broadcast(&pf->cond);
+}
+
+static
+void *lfs_prefetch_worker(void *arg)
+{
+    struct iso_lfs_prefetcher *pf = arg;
+    struct lfs_prefetch *rec;
+
+    pthread_mutex_lock(&pf->mutex);
+    while (1) {
+        while (!pf->abort &&
+               (pf->queue == NULL || pf->pending >= LFS_PREFETCH_MAX_PENDING))
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+        if (pf->abort)
+    break;
+        rec = pf->queue;
+        pf->queue = rec->next;
+        if (pf->queue != NULL)
+            pf->queue->prev = NULL;
+        rec->state = 2;
+        pthread_mutex_unlock(&pf->mutex);
+
+        lfs_prefetch_list(rec);
+
+        pthread_mutex_lock(&pf->mutex);
+        lfs_prefetch_listed(rec);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return NULL;
+}
+
+/* Called by lfs_readdir() for directories which get listed by prefetching.
+   If no worker has begun to list the directory yet, then the calling thread
+   does it by itself rather than waiting.
+*/
+static
+int lfs_prefetch_readdir(IsoFileSource *src, IsoFileSource **child)
+{
+    _LocalFsFileSource *data, *child_data;
+    struct lfs_prefetch *rec, *entry;
+    struct iso_lfs_prefetcher *pf;
+    int ret;
+
+    data = src->data;
+    rec = data->pre;
+    pf = rec->pf;
+    pthread_mutex_lock(&pf->mutex);
+    if (rec->state == 0 || rec->state == 1) {
+        if (rec->state == 1) {
+            if (rec->prev != NULL)
+                rec->prev->next = rec->next;
+            else
+                pf->queue = rec->next;
+            if (rec->next != NULL)
+                rec->next->prev = rec->prev;
+        }
+        rec->state = 2;
+        pthread_mutex_unlock(&pf->mutex);
+
+        lfs_prefetch_list(rec);
+
+        pthread_mutex_lock(&pf->mutex);
+        lfs_prefetch_listed(rec);
+    }
+    while (rec->state != 3)
+        pthread_cond_wait(&pf->cond, &pf->mutex);
+    if (rec->next_child >= rec->nchildren) {
+        ret = rec->readdir_ret;
+        pthread_mutex_unlock(&pf->mutex);
+        return ret;
+    }
+    entry = rec->children[rec->next_child];
+    rec->children[rec->next_child] = NULL;
+    rec->next_child++;
+    pthread_mutex_unlock(&pf->mutex);
+
+    ret = iso_file_source_new_lfs(src, entry->name, child);
+    if (ret < 0) {
+        pthread_mutex_lock(&pf->mutex);
+        lfs_prefetch_free(entry);
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+        return ret;
+    }
+    child_data = (*child)->data;
+    child_data->pre = entry;
+    return ret;
+}
+
+void iso_lfs_prefetch_drop(IsoFileSource *src)
+{
+    _LocalFsFileSource *data;
+    struct iso_lfs_prefetcher *pf;
+
+    if (src == NULL || src->class != &lfs_class)
+        return;
+    data = src->data;
+    if (data->pre == NULL)
+        return;
+    pf = data->pre->pf;
+    pthread_mutex_lock(&pf->mutex);
+    lfs_prefetch_free(data->pre);
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    data->pre = NULL;
+}
+
+int iso_lfs_prefetcher_destroy(struct iso_lfs_prefetcher **pf_pt, int flag)
+{
+    struct iso_lfs_prefetcher *pf = *pf_pt;
+    int i;
+
+    if (pf == NULL)
+        return ISO_SUCCESS;
+    pthread_mutex_lock(&pf->mutex);
+    pf->abort = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    for (i = 0; i < pf->nthreads; i++)
+        pthread_join(pf->threads[i], NULL);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->mutex);
+    LIBISO_FREE_MEM(pf->threads);
+    LIBISO_FREE_MEM(pf);
+    *pf_pt = NULL;
+    return ISO_SUCCESS;
+}
+
+int iso_lfs_prefetcher_new(IsoFileSource *dir, int num_threads,
+                           int follow_symlinks, int aa_flag,
+                           int (*skip)(void *handle, char *path, char *name,
+                                       struct stat *info),
+                           void *handle,
+                           struct iso_lfs_prefetcher **pf_pt, int flag)
+{
+    struct iso_lfs_prefetcher *pf = NULL;
+    struct lfs_prefetch *rec = NULL;
+    _LocalFsFileSource *data;
+    int ret, i;
+
+    *pf_pt = NULL;
+    if (dir == NULL || dir->class != &lfs_class)
+        return 0;
+    data = dir->data;
+    if (data->pre != NULL)
+        return 0; /* already prefetching */
+
+    LIBISO_ALLOC_MEM(pf, struct iso_lfs_prefetcher, 1);
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pf->follow_symlinks = follow_symlinks;
+    pf->aa_flag = aa_flag;
+    pf->skip = skip;
+    pf->handle = handle;
+    pf->queue = NULL;
+    pf->pending = 0;
+    pf->abort = 0;
+    pf->threads = NULL;
+    pf->nthreads = 0;
+    LIBISO_ALLOC_MEM(pf->threads, pthread_t, num_threads);
+
+    rec = lfs_prefetch_new(pf, NULL);
+    if (rec == NULL)
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+    rec->path = lfs_get_path(dir);
+    if (rec->path == NULL)
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+    rec->state = 1;
+    pf->queue = rec;
+    data->pre = rec;
+    rec = NULL;
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&(pf->threads[i]), NULL, lfs_prefetch_worker,
+                           pf) != 0)
+    break;
+        pf->nthreads++;
+    }
+    /* With no thread at all, the tree walk lists the directories itself */
+    *pf_pt = pf;
+    pf = NULL;
+    ret = 1;
+ex:;
+    if (rec != NULL) {
+        if (rec->path != NULL)
+            free(rec->path);
+        free(rec);
+    }
+    if (pf != NULL) {
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->mutex);
+        LIBISO_FREE_MEM(pf->threads);
+        LIBISO_FREE_MEM(pf);
+    }
+    return ret;
+}
+
+
 static
 int lfs_lstat(IsoFileSource *src, struct stat *info)
 {
     char *path;
+    _LocalFsFileSource *data;
 
     if (src == NULL || info == NULL) {
         return ISO_NULL_POINTER;
     }
+    data = src->data;
+    if (data->pre != NULL && (data->pre->have & 1)) {
+        if (data->pre->lstat_ret < 0)
+            return data->pre->lstat_ret;
+        *info = data->pre->lstat_info;
+        return ISO_SUCCESS;
+    }
     path = lfs_get_path(src);
     if (path == NULL)
         return ISO_OUT_OF_MEM;
 
     if (lstat(path, info) != 0) {
-        int err;
-
-        /* error, choose an appropriate return code */
-        switch (errno) {
-        case EACCES:
-            err = ISO_FILE_ACCESS_DENIED;
-            break;
-        case ENOTDIR:
-        case ENAMETOOLONG:
-        case ELOOP:
-            err = ISO_FILE_BAD_PATH;
-            break;
-        case ENOENT:
-            err = ISO_FILE_DOESNT_EXIST;
-            break;
-        case EFAULT:
-        case ENOMEM:
-            err = ISO_OUT_OF_MEM;
-            break;
-        default:
-            err = ISO_FILE_ERROR;
-            break;
-        }
         free(path);
-        return err;
+        return lfs_stat_error(errno);
     }
     free(path);
     return ISO_SUCCESS;
@@ -144,40 +719,25 @@ static
 int lfs_stat(IsoFileSource *src, struct stat *info)
 {
     char *path;
+    _LocalFsFileSource *data;
 
     if (src == NULL || info == NULL) {
         return ISO_NULL_POINTER;
     }
+    data = src->data;
+    if (data->pre != NULL && (data->pre->have & 2)) {
+        if (data->pre->stat_ret < 0)
+            return data->pre->stat_ret;
+        *info = data->pre->stat_info;
+        return ISO_SUCCESS;
+    }
     path = lfs_get_path(src);
     if (path == NULL)
         return ISO_OUT_OF_MEM;
 
     if (stat(path, info) != 0) {
-        int err;
-
-        /* error, choose an appropriate return code */
-        switch (errno) {
-        case EACCES:
-            err = ISO_FILE_ACCESS_DENIED;
-            break;
-        case ENOTDIR:
-        case ENAMETOOLONG:
-        case ELOOP:
-            err = ISO_FILE_BAD_PATH;
-            break;
-        case ENOENT:
-            err = ISO_FILE_DOESNT_EXIST;
-            break;
-        case EFAULT:
-        case ENOMEM:
-            err = ISO_OUT_OF_MEM;
-            break;
-        default:
-            err = ISO_FILE_ERROR;
-            break;
-        }
         free(path);
-        return err;
+        return lfs_stat_error(errno);
     }
     free(path);
     return ISO_SUCCESS;
@@ -188,10 +748,14 @@ int lfs_access(IsoFileSource *src)
 {
     int ret;
     char *path;
+    _LocalFsFileSource *data;
 
     if (src == NULL) {
         return ISO_NULL_POINTER;
     }
+    data = src->data;
+    if (data->pre != NULL && (data->pre->have & 4))
+        return data->pre->access_ret;
     path = lfs_get_path(src);
 
     ret = iso_eaccess(path);
@@ -394,6 +958,9 @@ int lfs_readdir(IsoFileSource *src, IsoFileSource **child)
             struct dirent *entry;
             int ret;
 
+            if (data->pre != NULL && data->pre->path != NULL)
+                return lfs_prefetch_readdir(src, child);
+
             /* while to skip "." and ".." dirs */
             while (1) {
                 entry = readdir(data->info.dir);
@@ -422,6 +989,8 @@ int lfs_readlink(IsoFileSource *src, char *buf, size_t bufsiz)
 {
     int size, ret;
     char *path;
+    _LocalFsFileSource *data;
+    struct lfs_prefetch *pre;
 
     if (src == NULL || buf == NULL) {
         return ISO_NULL_POINTER;
@@ -431,33 +1000,32 @@ int lfs_readlink(IsoFileSource *src, char *buf, size_t bufsiz)
         return ISO_WRONG_ARG_VALUE;
     }
 
-    path = lfs_get_path(src);
+    data = src->data;
+    pre = data->pre;
+    if (pre != NULL && (pre->have & 8) &&
+        (pre->link_ret < 0 || pre->link_ret < LIBISOFS_NODE_PATH_MAX ||
+         bufsiz <= LIBISOFS_NODE_PATH_MAX)) {
+        /* Same outcome as if readlink() was called with bufsiz */
+        size = pre->link_ret;
+        if (size > 0 && (size_t) size > bufsiz)
+            size = bufsiz;
+        if (size > 0)
+            memcpy(buf, pre->link_dest, size);
+    } else {
+        path = lfs_get_path(src);
 
-    /*
-     * invoke readlink, with bufsiz -1 to reserve an space for
-     * the NULL character
-     */
-    size = readlink(path, buf, bufsiz);
-    free(path);
+        /*
+         * invoke readlink, with bufsiz -1 to reserve an space for
+         * the NULL character
+         */
+        size = readlink(path, buf, bufsiz);
+        free(path);
+        if (size < 0)
+            size = lfs_readlink_error(errno);
+    }
     if (size < 0) {
         /* error */
-        switch (errno) {
-        case EACCES:
-            return ISO_FILE_ACCESS_DENIED;
-        case ENOTDIR:
-        case ENAMETOOLONG:
-        case ELOOP:
-            return ISO_FILE_BAD_PATH;
-        case ENOENT:
-            return ISO_FILE_DOESNT_EXIST;
-        case EINVAL:
-            return ISO_FILE_IS_NOT_SYMLINK;
-        case EFAULT:
-        case ENOMEM:
-            return ISO_OUT_OF_MEM;
-        default:
-            return ISO_FILE_ERROR;
-        }
+        return size;
     }
 
     /* NULL-terminate the buf */
@@ -487,6 +1055,8 @@ void lfs_free(IsoFileSource *src)
     if (data->openned) {
         src->class->close(src);
     }
+    if (data->pre != NULL)
+        iso_lfs_prefetch_drop(src);
     if (data->parent != src) {
         iso_file_source_unref(data->parent);
     }
@@ -499,57 +1069,30 @@ void lfs_free(IsoFileSource *src)
 static 
 int lfs_get_aa_string(IsoFileSource *src, unsigned char **aa_string, int flag)
 {
-    int ret, no_non_user_perm= 0;
-    size_t num_attrs = 0, *value_lengths = NULL, result_len;
-    ssize_t sret;
-    char *path = NULL, **names = NULL, **values = NULL;
-    unsigned char *result = NULL;
+    int ret;
+    char *path;
+    _LocalFsFileSource *data;
 
-    *aa_string = NULL;
+    data = src->data;
+    if (data->pre != NULL && (data->pre->have & 16) &&
+        data->pre->aa_flag == flag) {
+        /* Hand over the prefetched string. It can be obtained only once. */
+        *aa_string = data->pre->aa_string;
+        data->pre->aa_string = NULL;
+        data->pre->have &= ~16;
+        return data->pre->aa_ret;
+    }
 
+    *aa_string = NULL;
     if ((flag & 6 ) == 6) { /* Neither ACL nor xattr shall be read */
-        ret = 1;
-        goto ex;
+        return 1;
     }
-    /* Obtain EAs and ACLs ("access" and "default"). ACLs encoded according
-       to AAIP ACL representation. Clean out st_mode ACL entries.
-    */ 
     path = iso_file_source_get_path(src);
     if (path == NULL) {
-        ret = ISO_NULL_POINTER;
-        goto ex;
-    }
-    ret = aaip_get_attr_list(path, &num_attrs, &names,
-                             &value_lengths, &values,
-                             (!(flag & 2)) | 2 | (flag & 4) | (flag & 8) | 16);
-    if (ret <= 0) {
-        if (ret == -2)
-            ret = ISO_AAIP_NO_GET_LOCAL;
-        else
-            ret = ISO_FILE_ERROR;
-        goto ex;
-    }
-    if(ret == 2)
-        no_non_user_perm= 1;
-      
-    if (num_attrs == 0)
-        result = NULL;
-    else {
-        sret = aaip_encode(num_attrs, names,
-                           value_lengths, values, &result_len, &result, 0);
-        if (sret < 0) {
-            ret = sret;
-            goto ex;
-        }
+        return ISO_NULL_POINTER;
     }
-    *aa_string = result;
-    ret = 1 + no_non_user_perm;
-ex:;
-    if (path != NULL)
-        free(path);
-    if (names != NULL || value_lengths != NULL || values != NULL)
-        aaip_get_attr_list(NULL, &num_attrs, &names, &value_lengths, &values,
-                           1 << 15); /* free memory */
+    ret = lfs_get_path_aa_string(path, aa_string, flag);
+    free(path);
     return ret;
 }
 
@@ -657,6 +1200,7 @@ int iso_file_source_new_lfs(IsoFileSource *parent, const char *name,
     /* fill struct */
     data->name = name ? strdup(name) : NULL;
     data->openned = 0;
+    data->pre = NULL;
     if (parent) {
         data->parent = parent;
         iso_file_source_ref(parent);
@@ -795,38 +1339,53 @@ int lfs_fs_close(IsoFilesystem *fs)
 static
 void lfs_fs_free(IsoFilesystem *fs)
 {
-    lfs = NULL;
+    pthread_mutex_lock(&lfs_mutex);
+    /* A new lfs may have been created after the refcount dropped to 0 */
+    if (lfs == fs)
+        lfs = NULL;
+    pthread_mutex_unlock(&lfs_mutex);
 }
 
 int iso_local_filesystem_new(IsoFilesystem **fs)
 {
+    IsoFilesystem *new_lfs;
+
     if (fs == NULL) {
         return ISO_NULL_POINTER;
     }
 
-    if (lfs != NULL) {
-        /* just take a new ref */
-        iso_filesystem_ref(lfs);
-    } else {
+    /* The local filesystem is shared by all images, which may get created
+       and disposed by different threads.
+    */
+    pthread_mutex_lock(&lfs_mutex);
+    if (lfs != NULL && iso_filesystem_ref_if_alive(lfs)) {
+        /* just took a new ref */
+        *fs = lfs;
+        pthread_mutex_unlock(&lfs_mutex);
+        return ISO_SUCCESS;
+    }
 
-        lfs = malloc(sizeof(IsoFilesystem));
-        if (lfs == NULL) {
-            return ISO_OUT_OF_MEM;
-        }
+    new_lfs = malloc(sizeof(IsoFilesystem));
+    if (new_lfs == NULL) {
+        pthread_mutex_unlock(&lfs_mutex);
+        return ISO_OUT_OF_MEM;
+    }
 
-        /* fill struct */
-        memcpy(lfs->type, "file", 4);
-        lfs->refcount = 1;
-        lfs->version = 0;
-        lfs->data = NULL; /* we don't need private data */
-        lfs->get_root = lfs_get_root;
-        lfs->get_by_path = lfs_get_by_path;
-        lfs->get_id = lfs_get_id;
-        lfs->open = lfs_fs_open;
-        lfs->close = lfs_fs_close;
-        lfs->free = lfs_fs_free;
-    }
-    *fs = lfs;
+    /* fill struct */
+    memcpy(new_lfs->type, "file", 4);
+    new_lfs->refcount = 1;
+    new_lfs->version = 0;
+    new_lfs->data = NULL; /* we don't need private data */
+    new_lfs->get_root = lfs_get_root;
+    new_lfs->get_by_path = lfs_get_by_path;
+    new_lfs->get_id = lfs_get_id;
+    new_lfs->open = lfs_fs_open;
+    new_lfs->close = lfs_fs_close;
+    new_lfs->free = lfs_fs_free;
+    lfs = new_lfs;
+    pthread_mutex_unlock(&lfs_mutex);
+
+    *fs = new_lfs;
     return ISO_SUCCESS;
 }
 
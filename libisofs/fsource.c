@@ -14,6 +14,16 @@
 
 #include "fsource.h"
 #include <stdlib.h>
+#include <pthread.h>
+
+/* GCC and clang offer atomic builtins. Without them the reference counts
+   of the filesystems get changed under a mutex.
+*/
+#ifdef __ATOMIC_SEQ_CST
+#define Libisofs_fs_atomiC yes
+#else
+static pthread_mutex_t fs_ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /**
  * Values belong 1000 are reserved for libisofs usage
@@ -33,19 +43,63 @@ void iso_file_source_unref(IsoFileSource *src)
     }
 }
 
+/* IsoFilesystem objects like the local filesystem get shared among all
+   images, which may be used by different threads. So their reference counts
+   get changed atomically.
+*/
 void iso_filesystem_ref(IsoFilesystem *fs)
 {
+#ifdef Libisofs_fs_atomiC
+    __atomic_add_fetch(&fs->refcount, 1, __ATOMIC_SEQ_CST);
+#else
+    pthread_mutex_lock(&fs_ref_mutex);
     ++fs->refcount;
+    pthread_mutex_unlock(&fs_ref_mutex);
+#endif
 }
 
 void iso_filesystem_unref(IsoFilesystem *fs)
 {
-    if (--fs->refcount == 0) {
+    unsigned int count;
+
+#ifdef Libisofs_fs_atomiC
+    count = __atomic_sub_fetch(&fs->refcount, 1, __ATOMIC_SEQ_CST);
+#else
+    pthread_mutex_lock(&fs_ref_mutex);
+    count = --fs->refcount;
+    pthread_mutex_unlock(&fs_ref_mutex);
+#endif
+    if (count == 0) {
         fs->free(fs);
         free(fs);
     }
 }
 
+/* Take a reference only if fs is not already on its way to be freed.
+   @return 1 = reference taken, 0 = refcount was 0
+*/
+int iso_filesystem_ref_if_alive(IsoFilesystem *fs)
+{
+    unsigned int count;
+
+#ifdef Libisofs_fs_atomiC
+    count = __atomic_load_n(&fs->refcount, __ATOMIC_SEQ_CST);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&fs->refcount, &count, count + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+    return 0;
+#else
+    pthread_mutex_lock(&fs_ref_mutex);
+    count = fs->refcount;
+    if (count > 0)
+        ++fs->refcount;
+    pthread_mutex_unlock(&fs_ref_mutex);
+    return (count > 0);
+#endif
+}
+
 /* 
  * this are just helpers to invoque methods in class
  */
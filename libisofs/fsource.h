@@ -32,6 +32,11 @@
  */
 int iso_local_filesystem_new(IsoFilesystem **fs);
 
+/* Take a reference to fs unless its refcount already dropped to 0.
+ * @return  1 = reference taken, 0 = fs is being freed
+ */
+int iso_filesystem_ref_if_alive(IsoFilesystem *fs);
+
 
 /* Rank two IsoFileSource of ifs_class by their eventual old image LBAs.
  * @param cmp_ret  will return the reply value -1, 0, or 1.
@@ -49,6 +54,37 @@ int iso_ifs_source_clone(IsoFileSource *old_source, IsoFileSource **new_source,
                          int flag);
 
 
+struct iso_lfs_prefetcher;
+
+/* Start threads which read ahead of iso_add_dir_src_rec() when it walks the
+ * tree of the local filesystem directory dir.
+ * The prefetched results get attached to the IsoFileSource objects handed out
+ * by iso_file_source_readdir(). They have to be dropped by
+ * iso_lfs_prefetch_drop() when the tree walk is done with a source.
+ * @param follow_symlinks  like image->follow_symlinks
+ * @param aa_flag          the flag for iso_file_source_get_aa_string() which
+ *                         the node builder will use
+ * @param skip             if not NULL: decides whether the tree walk will skip
+ *                         a file, so that its directory needs not be listed.
+ *                         Called by the worker threads.
+ * @return  1 = started, 0 = dir is not of the local filesystem, <0 = error
+ */
+int iso_lfs_prefetcher_new(IsoFileSource *dir, int num_threads,
+                           int follow_symlinks, int aa_flag,
+                           int (*skip)(void *handle, char *path, char *name,
+                                       struct stat *info),
+                           void *handle,
+                           struct iso_lfs_prefetcher **pf, int flag);
+
+/* Dispose the prefetched results of a source, so that further inquiries
+   get answered by the local filesystem.
+*/
+void iso_lfs_prefetch_drop(IsoFileSource *src);
+
+/* Stop the threads. All sources must have been dropped before. */
+int iso_lfs_prefetcher_destroy(struct iso_lfs_prefetcher **pf, int flag);
+
+
 off_t iso_file_source_lseek_capacity(IsoFileSource *src, off_t wanted_size, 
                                      int flag);
 
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 /* To be used if Ecma119.hfsplus_block_size == 0 in hfsplus_writer_create().
    It cannot be larger than 2048 because filesrc_writer aligns data file
@@ -60,13 +61,10 @@ static
 int pad_up_block(Ecma119Image *t)
 {
     int ret;
-    static char buffer[2048], buf_zeroed = 0;
+    char buffer[2048];
 
-    if (!buf_zeroed) {
-        memset(buffer, 0, 2048);
-        buf_zeroed = 1;
-    }
     if (t->bytes_written % 2048) {
+        memset(buffer, 0, 2048);
 	ret = iso_write(t, buffer, 2048 - (t->bytes_written % 2048));
 	if (ret < 0)
 	    return ret;
@@ -231,13 +229,27 @@ int iso_get_hfsplus_name(char *input_charset, int imgid, char *name,
     return ISO_SUCCESS;
 }
 
+/* The names get interned in t->hfsp_arena */
 static
 int set_hfsplus_name(Ecma119Image *t, char *name, HFSPlusNode *node)
 {
     int ret;
+    uint16_t *ucs_name = NULL, *cmp_name = NULL;
+    uint32_t ucs_len = 0;
 
     ret = iso_get_hfsplus_name(t->input_charset, t->image->id, name,
-                            &(node->name), &(node->strlen), &(node->cmp_name));
+                               &ucs_name, &ucs_len, &cmp_name);
+    if (ret < 0 || ucs_name == NULL)
+        return ret;
+    node->name = iso_arena_memdup(t->hfsp_arena, ucs_name,
+                                  (ucs_len + 1) * sizeof(uint16_t));
+    node->cmp_name = iso_arena_memdup(t->hfsp_arena, cmp_name,
+                               (ucslen(cmp_name) + 1) * sizeof(uint16_t));
+    node->strlen = ucs_len;
+    free(ucs_name);
+    free(cmp_name);
+    if (node->name == NULL || node->cmp_name == NULL)
+        return ISO_OUT_OF_MEM;
     return ret;
 }
 
@@ -343,7 +355,8 @@ int create_tree(Ecma119Image *t, IsoNode *iso, uint32_t parent_id)
 	{
 	  IsoSymlink *sym = (IsoSymlink*) iso;
 	  t->hfsp_leafs[t->hfsp_curleaf].type = HFSPLUS_FILE;
-	  t->hfsp_leafs[t->hfsp_curleaf].symlink_dest = strdup(sym->dest);
+	  t->hfsp_leafs[t->hfsp_curleaf].symlink_dest =
+	                                iso_arena_strdup(t->hfsp_arena, sym->dest);
 	  if (t->hfsp_leafs[t->hfsp_curleaf].symlink_dest == NULL)
 	      return ISO_OUT_OF_MEM;
 	  t->hfsp_leafs[t->hfsp_curleaf].unix_type = UNIX_SYMLINK;
@@ -360,7 +373,9 @@ int create_tree(Ecma119Image *t, IsoNode *iso, uint32_t parent_id)
 	{
 	  IsoFile *file = (IsoFile*) iso;
 	  t->hfsp_leafs[t->hfsp_curleaf].type = HFSPLUS_FILE;
+	  ecma119_trees_lock(t, 0);
 	  ret = iso_file_src_create(t, file, &t->hfsp_leafs[t->hfsp_curleaf].file);
+	  ecma119_trees_lock(t, 1);
 	  if (ret < 0) {
             return ret;
 	  }
@@ -595,7 +610,7 @@ int
 write_sb (Ecma119Image *t)
 {
     struct hfsplus_volheader sb;
-    static char buffer[1024];
+    char buffer[1024];
     int ret;
     int i;
     uint32_t block_size;
@@ -673,7 +688,7 @@ static
 int hfsplus_writer_write_data(IsoImageWriter *writer)
 {
     int ret;
-    static char buffer[2 * HFSPLUS_MAX_BLOCK_SIZE];
+    char buffer[2 * HFSPLUS_MAX_BLOCK_SIZE];
     Ecma119Image *t;
     struct hfsplus_btnode *node_head;
     struct hfsplus_btheader *tree_head;
@@ -1042,7 +1057,7 @@ static
 int hfsplus_tail_writer_write_data(IsoImageWriter *writer)
 {
     int ret;
-    static char buffer[2 * HFSPLUS_MAX_BLOCK_SIZE];
+    char buffer[2 * HFSPLUS_MAX_BLOCK_SIZE];
     uint32_t complete_blocks, remaining_blocks, block_size;
     int over;
     Ecma119Image *t;
@@ -1103,25 +1118,31 @@ int hfsplus_tail_writer_write_data(IsoImageWriter *writer)
     return ret;
 }
 
+void hfsplus_tree_free(Ecma119Image *t)
+{
+    uint32_t i;
+
+    if (t->hfsp_leafs == NULL)
+        return;
+    /* Names and symlink destinations are in t->hfsp_arena */
+    iso_arena_destroy(&(t->hfsp_arena));
+    free(t->hfsp_leafs);
+    t->hfsp_leafs = NULL;
+    t->hfsp_curleaf = 0;
+    if (t->hfsp_levels != NULL) {
+        for (i = 0; i < t->hfsp_nlevels; i++)
+          free (t->hfsp_levels[i].nodes);
+        free(t->hfsp_levels);
+    }
+    t->hfsp_levels = NULL;
+    t->hfsp_nlevels = 0;
+}
+
 static
 int hfsplus_writer_free_data(IsoImageWriter *writer)
 {
     /* free the Hfsplus tree */
-    Ecma119Image *t = writer->target;
-    uint32_t i;
-    for (i = 0; i < t->hfsp_curleaf; i++)
-      if (t->hfsp_leafs[i].type != HFSPLUS_FILE_THREAD
-	  && t->hfsp_leafs[i].type != HFSPLUS_DIR_THREAD)
-	{
-	  free (t->hfsp_leafs[i].name);
-	  free (t->hfsp_leafs[i].cmp_name);
-	  if (t->hfsp_leafs[i].symlink_dest != NULL)
-	      free (t->hfsp_leafs[i].symlink_dest);
-	}
-    free(t->hfsp_leafs);
-    for (i = 0; i < t->hfsp_nlevels; i++)
-      free (t->hfsp_levels[i].nodes);
-    free(t->hfsp_levels);
+    hfsplus_tree_free(writer->target);
     return ISO_SUCCESS;
 }
 
@@ -1201,7 +1222,7 @@ int subst_symlink_dest_comp(Ecma119Image *target, uint32_t idx,
     new_len = strlen(new_name);
     new_dest_len =
                *comp_start - *dest + new_len + *dest_len - (*comp_end - *dest);
-    new_dest = calloc(1, new_dest_len + 1);
+    new_dest = iso_arena_alloc(target->hfsp_arena, new_dest_len + 1);
     if (new_dest == NULL)
         return ISO_OUT_OF_MEM;
     wpt = new_dest;
@@ -1219,7 +1240,6 @@ int subst_symlink_dest_comp(Ecma119Image *target, uint32_t idx,
     *comp_end = *comp_start + new_len;
     target->hfsp_leafs[idx].symlink_dest = new_dest;
     *dest_len = new_dest_len;
-    free(*dest);
     *dest = new_dest;
     return ISO_SUCCESS;
 }
@@ -1410,13 +1430,8 @@ int try_mangle(Ecma119Image *target, uint32_t idx, uint32_t prev_idx,
          */
         sprintf(new_name, "%s_%s", prefix, number);
 
-        /* The original name is kept until the end of the try */
-        if (target->hfsp_leafs[idx].name != old_name)
-            free(target->hfsp_leafs[idx].name);
-        if (target->hfsp_leafs[idx].cmp_name != old_cmp_name)
-            free(target->hfsp_leafs[idx].cmp_name);
-
-
+        /* The original name is kept until the end of the try.
+           Names of failed tries stay unused in target->hfsp_arena. */
         ret = set_hfsplus_name(target, new_name, &(target->hfsp_leafs[idx]));
         if (ret < 0)
             goto no_success;
@@ -1452,8 +1467,6 @@ int try_mangle(Ecma119Image *target, uint32_t idx, uint32_t prev_idx,
             goto no_success;
     }
 
-    free(old_name);
-    free(old_cmp_name);
     return 1;
 
 no_success:;
@@ -1587,10 +1600,19 @@ void iso_setup_hfsplus_block_size(Ecma119Image *target)
     target->hfsp_iso_block_fac = 2048 / target->opts->hfsp_block_size;
 }
 
-int hfsplus_writer_create(Ecma119Image *target)
+/* The character tables are shared by all image productions */
+static pthread_once_t hfsplus_pages_once = PTHREAD_ONCE_INIT;
+
+static
+void hfsplus_make_pages(void)
+{
+    make_hfsplus_decompose_pages();
+    make_hfsplus_class_pages();
+}
+
+int hfsplus_tree_create(Ecma119Image *target)
 {
     int ret;
-    IsoImageWriter *writer = NULL;
     int max_levels;
     int level = 0;
     IsoNode *pos;
@@ -1598,25 +1620,11 @@ int hfsplus_writer_create(Ecma119Image *target)
     int i;
     uint32_t cat_node_size;
 
-    writer = calloc(1, sizeof(IsoImageWriter));
-    if (writer == NULL) {
-        ret = ISO_OUT_OF_MEM;
-        goto ex;
-    }
-
-    make_hfsplus_decompose_pages();
-    make_hfsplus_class_pages();
+    pthread_once(&hfsplus_pages_once, hfsplus_make_pages);
 
     iso_setup_hfsplus_block_size(target);
     cat_node_size = target->hfsp_cat_node_size;
 
-    writer->compute_data_blocks = hfsplus_writer_compute_data_blocks;
-    writer->write_vol_desc = nop_writer_write_vol_desc;
-    writer->write_data = hfsplus_writer_write_data;
-    writer->free_data = hfsplus_writer_free_data;
-    writer->data = NULL;
-    writer->target = target;
-
     iso_msg_debug(target->image->id, "Creating HFS+ tree...");
     target->hfsp_nfiles = 0;
     target->hfsp_ndirs = 0;
@@ -1636,6 +1644,9 @@ int hfsplus_writer_create(Ecma119Image *target)
         ret = ISO_OUT_OF_MEM;
         goto ex;
     }
+    ret = iso_arena_new(&target->hfsp_arena, 0, 0);
+    if (ret < 0)
+        goto ex;
     ret = set_hfsplus_name (target, target->image->volume_id,
                             &target->hfsp_leafs[target->hfsp_curleaf]);
     if (ret < 0)
@@ -1803,6 +1814,36 @@ int hfsplus_writer_create(Ecma119Image *target)
 	goto ex;
       }
 
+    ret = ISO_SUCCESS;
+ex:;
+    return ret;
+}
+
+int hfsplus_writer_create(Ecma119Image *target)
+{
+    int ret;
+    IsoImageWriter *writer = NULL;
+
+    writer = calloc(1, sizeof(IsoImageWriter));
+    if (writer == NULL) {
+        ret = ISO_OUT_OF_MEM;
+        goto ex;
+    }
+
+    writer->compute_data_blocks = hfsplus_writer_compute_data_blocks;
+    writer->write_vol_desc = nop_writer_write_vol_desc;
+    writer->write_data = hfsplus_writer_write_data;
+    writer->free_data = hfsplus_writer_free_data;
+    writer->data = NULL;
+    writer->target = target;
+
+    if (target->hfsp_leafs == NULL) {
+        /* Not yet created by ecma119_create_trees() */
+        ret = hfsplus_tree_create(target);
+        if (ret < 0)
+            goto ex;
+    }
+
     /* add this writer to image */
     target->writers[target->nwriters++] = writer;
     writer = NULL;
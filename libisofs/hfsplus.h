@@ -66,6 +66,14 @@ struct hfsplus_node
   uint32_t used_size;
 };
 
+/* Create the HFS+ tree of the image. hfsplus_writer_create() does this if
+   it was not done before.
+*/
+int hfsplus_tree_create(Ecma119Image *target);
+
+/* Dispose the HFS+ tree */
+void hfsplus_tree_free(Ecma119Image *target);
+
 int hfsplus_writer_create(Ecma119Image *target);
 int hfsplus_tail_writer_create(Ecma119Image *target);
 
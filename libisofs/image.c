@@ -17,6 +17,7 @@
 #include "node.h"
 #include "messages.h"
 #include "eltorito.h"
+#include "tree.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -166,7 +167,7 @@ int iso_image_new(const char *name, IsoImage **image)
         return res;
     }
     img->refcount = 1;
-    img->id = iso_message_id++;
+    img->id = iso_counter_next_int(&iso_message_id, 1);
 
     if (name != NULL) {
         img->volset_id = strdup(name);
@@ -202,6 +203,7 @@ int iso_image_new(const char *name, IsoImage **image)
     for (i = 0; i < ISO_HFSPLUS_BLESS_MAX; i++)
         img->hfsplus_blessed[i] = NULL;
     img->collision_warnings = 0;
+    img->lazy_import = NULL;
     img->imported_sa_info = NULL;
     img->blind_on_local_get_attrs = 0;
 
@@ -237,9 +239,12 @@ void iso_image_unref(IsoImage *image)
             free(image->excludes[nexcl]);
         }
         free(image->excludes);
+        iso_exclude_matcher_destroy(&(image->exclude_matcher));
+        iso_tree_block_index_destroy(&(image->block_index));
         for (i = 0; i < ISO_HFSPLUS_BLESS_MAX; i++)
             if (image->hfsplus_blessed[i] != NULL)
                 iso_node_unref(image->hfsplus_blessed[i]);
+        iso_lazy_import_detach(&(image->lazy_import));
         iso_node_unref((IsoNode*)image->root);
         iso_node_builder_unref(image->builder);
         iso_filesystem_unref(image->fs);
@@ -533,6 +538,9 @@ int dir_update_size(IsoImage *image, IsoDir *dir)
     uint32_t lba;
 #endif
 
+    ret = iso_dir_load_lazy(dir, 0);
+    if (ret < 0)
+        return ret;
     pos = dir->children;
     while (pos) {
         if (pos->type == LIBISO_FILE) {
@@ -623,6 +631,21 @@ int iso_image_get_ignore_aclea(IsoImage *image)
 }
 
 
+int iso_image_set_node_compaction(IsoImage *image, int flag)
+{
+    if (image == NULL)
+        return ISO_NULL_POINTER;
+    image->node_compaction = flag & 3;
+    return ISO_SUCCESS;
+}
+
+
+int iso_image_get_node_compaction(IsoImage *image)
+{
+    return image->node_compaction;
+}
+
+
 static
 int img_register_ino(IsoImage *image, IsoNode *node, int flag)
 {
@@ -714,7 +737,7 @@ uint32_t img_give_ino_number(IsoImage *image, int flag)
 {
     int ret;
     uint64_t new_ino, ino_idx;
-    static uint64_t limit = 0xffffffff;
+    uint64_t limit = 0xffffffff;
 
     if (flag & 1) {
         image->inode_counter = 0;
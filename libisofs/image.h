@@ -157,12 +157,38 @@ struct Iso_Image
     char** excludes;
     int nexcludes;
 
+    /**
+     * Compiled form of excludes for fast matching. NULL if there are no
+     * excludes or if it could not be created.
+     */
+    struct iso_exclude_matcher *exclude_matcher;
+
+    /**
+     * Index of the data file extents of imported files for
+     * iso_tree_get_node_of_block(). NULL if not created yet.
+     */
+    struct iso_block_index *block_index;
+
     /**
      * if the dir already contains a node with the same name, whether to
      * replace or not the old node with the new. 
      */
     enum iso_replace_mode replace;
 
+    /**
+     * Whether new nodes share equal names and AAIP strings with other nodes.
+     * See iso_image_set_node_compaction().
+     * bit0= share names
+     * bit1= share AAIP strings
+     */
+    int node_compaction;
+
+    /**
+     * Number of threads which read ahead of iso_tree_add_dir_rec().
+     * 0 or 1 = no reading ahead
+     */
+    int ingest_threads;
+
     /* TODO
     enum iso_replace_mode (*confirm_replace)(IsoFileSource *src, IsoNode *node);
     */
@@ -244,6 +270,13 @@ struct Iso_Image
     /* Counts the name collisions while iso_image_import() */
     size_t collision_warnings;
 
+    /**
+     * The state of a lazy iso_image_import() which left directories of the
+     * imported tree unloaded. See iso_read_opts_set_lazy_dirs().
+     * NULL if the tree was loaded completely.
+     */
+    struct iso_lazy_import *lazy_import;
+
     /* Contains the assessment of boot aspects of the loaded image */
     struct iso_imported_sys_area *imported_sa_info;
 
@@ -307,6 +340,27 @@ int iso_image_set_checksums(IsoImage *image, char *checksum_array,
                             uint32_t idx_count, int flag);
 
 
+/**
+ * Called by iso_add_dir_src_rec() for each new directory node.
+ * If a lazy iso_image_import() is loading, the node is left as unloaded stub
+ * which remembers its source.
+ * @return
+ *     1 dir is a stub now, 0 dir shall be loaded by recursion, < 0 error
+ */
+int iso_image_lazy_dir(IsoImage *image, IsoDir *dir, IsoFileSource *src);
+
+/**
+ * Load all directories which a lazy iso_image_import() left unloaded and
+ * give out the inode numbers which the import had to postpone.
+ */
+int iso_image_load_lazy_dirs(IsoImage *image, int flag);
+
+/**
+ * Cut the connection between a lazy import state and its image, so that
+ * the remaining unloaded directories stay empty, and give up the reference.
+ */
+void iso_lazy_import_detach(struct iso_lazy_import **lazy);
+
 int iso_image_set_pvd_times(IsoImage *image,
                             char *creation_time, char *modification_time,
                             char *expiration_time, char *effective_time);
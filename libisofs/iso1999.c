@@ -82,11 +82,9 @@ void iso1999_node_free(Iso1999Node *node)
         }
         if (node->info.dir->children != NULL)
             free(node->info.dir->children);
-        free(node->info.dir);
     }
+    /* The node and its name belong to t->iso1999_arena */
     iso_node_unref(node->node);
-    free(node->name);
-    free(node);
 }
 
 /**
@@ -100,24 +98,23 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
     int ret;
     Iso1999Node *n;
 
-    n = calloc(1, sizeof(Iso1999Node));
+    /* On error the memory stays unused in the arena */
+    n = iso_arena_alloc(t->iso1999_arena, sizeof(Iso1999Node));
     if (n == NULL) {
         return ISO_OUT_OF_MEM;
     }
 
     if (iso->type == LIBISO_DIR) {
         IsoDir *dir = (IsoDir*) iso;
-        n->info.dir = calloc(1, sizeof(struct iso1999_dir_info));
+        n->info.dir = iso_arena_alloc(t->iso1999_arena,
+                                      sizeof(struct iso1999_dir_info));
         if (n->info.dir == NULL) {
-            free(n);
             return ISO_OUT_OF_MEM;
         }
         n->info.dir->children = NULL;
         if (dir->nchildren > 0) {
             n->info.dir->children = calloc(sizeof(void*), dir->nchildren);
             if (n->info.dir->children == NULL) {
-                free(n->info.dir);
-                free(n);
                 return ISO_OUT_OF_MEM;
             }
         }
@@ -134,14 +131,14 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
             ret = iso_msg_submit(t->image->id, ISO_FILE_TOO_BIG, 0,
                          "File \"%s\" can't be added to image because is "
                          "greater than 4GB", ipath);
-            free(n);
             free(ipath);
             return ret;
         }
 
+        ecma119_trees_lock(t, 0);
         ret = iso_file_src_create(t, file, &src);
+        ecma119_trees_lock(t, 1);
         if (ret < 0) {
-            free(n);
             return ret;
         }
         n->info.file = src;
@@ -150,51 +147,139 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
         /* it's a el-torito boot catalog, that we write as a file */
         IsoFileSrc *src;
 
+        ecma119_trees_lock(t, 0);
         ret = el_torito_catalog_file_src_create(t, &src);
+        ecma119_trees_lock(t, 1);
         if (ret < 0) {
-            free(n);
             return ret;
         }
         n->info.file = src;
         n->type = ISO1999_FILE;
     } else {
         /* should never happen */
-        free(n);
         return ISO_ASSERT_FAILURE;
     }
 
     /* take a ref to the IsoNode */
     n->node = iso;
+    ecma119_trees_lock(t, 0);
     iso_node_ref(iso);
+    ecma119_trees_lock(t, 1);
 
     *node = n;
     return ISO_SUCCESS;
 }
 
+/* Directories with at least this number of children get the names of their
+   children converted by several threads, if enabled by opts->tree_threads
+   and if a character set conversion is needed.
+*/
+#define ISO1999_PARALLEL_NAMES_MIN 256
+
+struct iso1999_name_job {
+    Ecma119Image *t;
+    IsoNode **nodes;
+    char **names;
+};
+
+/* Convert the name of a single child for iso1999_convert_names().
+   Names which cannot be converted are left to create_tree(), which tries
+   again and so reports problems in the order of the children.
+*/
+static
+int iso1999_name_job_run(void *ctx, size_t idx)
+{
+    struct iso1999_name_job *job = ctx;
+    IsoNode *iso;
+    char *name = NULL;
+    int ret;
+
+    iso = job->nodes[idx];
+    job->names[idx] = NULL;
+    if ((iso->hidden & LIBISO_HIDE_ON_1999) || iso->name == NULL)
+        return ISO_SUCCESS;
+    ret = strconv(iso->name, job->t->input_charset, job->t->output_charset,
+                  &name);
+    if (ret < 0)
+        return ISO_SUCCESS;
+    if (strlen(name) > 207)
+        name[207] = '\0';
+    job->names[idx] = name;
+    return ISO_SUCCESS;
+}
+
+/* Convert the names of the children of a large directory by several threads.
+   @param names  Returns NULL or an array of dir->nchildren names, some of
+                 which may be NULL
+*/
+static
+int iso1999_convert_names(Ecma119Image *t, IsoDir *dir, char ***names)
+{
+    int ret;
+    size_t i;
+    IsoNode *pos;
+    struct iso1999_name_job job;
+
+    *names = NULL;
+    job.t = t;
+    job.nodes = NULL;
+    job.names = NULL;
+    if (t->opts->tree_threads <= 1 ||
+        dir->nchildren < ISO1999_PARALLEL_NAMES_MIN ||
+        !strcmp(t->input_charset, t->output_charset))
+        return ISO_SUCCESS;
+
+    LIBISO_ALLOC_MEM(job.nodes, IsoNode *, dir->nchildren);
+    LIBISO_ALLOC_MEM(job.names, char *, dir->nchildren);
+    for (pos = dir->children, i = 0; pos != NULL && i < (size_t) dir->nchildren;
+         pos = pos->next, i++)
+        job.nodes[i] = pos;
+    ret = iso_run_parallel(t->opts->tree_threads, i, 64,
+                           iso1999_name_job_run, &job);
+    if (ret < 0)
+        goto ex;
+    *names = job.names;
+    job.names = NULL;
+    ret = ISO_SUCCESS;
+ex:;
+    LIBISO_FREE_MEM(job.nodes);
+    LIBISO_FREE_MEM(job.names);
+    return ret;
+}
+
 /**
  * Create the low level ISO 9660:1999 tree from the high level ISO tree.
  *
+ * @param iso_name
+ *      NULL or the ISO 9660:1999 name of iso, which then is owned by
+ *      create_tree()
  * @return
  *      1 success, 0 file ignored, < 0 error
  */
 static
-int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
+int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen,
+                char *iso_name)
 {
     int ret, max_path;
     Iso1999Node *node = NULL;
-    char *iso_name = NULL;
 
     if (t == NULL || iso == NULL || tree == NULL) {
+        if (iso_name != NULL)
+            free(iso_name);
         return ISO_NULL_POINTER;
     }
 
     if (iso->hidden & LIBISO_HIDE_ON_1999) {
         /* file will be ignored */
+        if (iso_name != NULL)
+            free(iso_name);
         return 0;
     }
-    ret = get_iso1999_name(t, iso->name, &iso_name);
-    if (ret < 0) {
-        return ret;
+    if (iso_name == NULL) {
+        ret = get_iso1999_name(t, iso->name, &iso_name);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     max_path = pathlen + 1 + (iso_name ? strlen(iso_name): 0);
@@ -216,19 +301,41 @@ int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
         {
             IsoNode *pos;
             IsoDir *dir = (IsoDir*)iso;
+            char **names = NULL;
+            size_t i;
+
             ret = create_node(t, iso, &node);
             if (ret < 0) {
                 free(iso_name);
                 return ret;
             }
+            ret = iso1999_convert_names(t, dir, &names);
+            if (ret < 0) {
+                ecma119_trees_lock(t, 0);
+                iso1999_node_free(node);
+                ecma119_trees_lock(t, 1);
+                free(iso_name);
+                return ret;
+            }
+            ret = ISO_SUCCESS;
             pos = dir->children;
+            i = 0;
             while (pos) {
                 int cret;
                 Iso1999Node *child;
-                cret = create_tree(t, pos, &child, max_path);
+                char *child_name = NULL;
+
+                if (names != NULL && i < (size_t) dir->nchildren) {
+                    child_name = names[i];
+                    names[i] = NULL;
+                }
+                i++;
+                cret = create_tree(t, pos, &child, max_path, child_name);
                 if (cret < 0) {
                     /* error */
+                    ecma119_trees_lock(t, 0);
                     iso1999_node_free(node);
+                    ecma119_trees_lock(t, 1);
                     ret = cret;
                     break;
                 } else if (cret == ISO_SUCCESS) {
@@ -239,6 +346,12 @@ int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
                 }
                 pos = pos->next;
             }
+            if (names != NULL) {
+                for (i = 0; i < (size_t) dir->nchildren; i++)
+                    if (names[i] != NULL)
+                        free(names[i]);
+                free(names);
+            }
         }
         break;
     case LIBISO_BOOT:
@@ -269,7 +382,16 @@ int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
         free(iso_name);
         return ret;
     }
-    node->name = iso_name;
+    if (iso_name != NULL) {
+        node->name = iso_arena_strdup(t->iso1999_arena, iso_name);
+        free(iso_name);
+        if (node->name == NULL) {
+            ecma119_trees_lock(t, 0);
+            iso1999_node_free(node);
+            ecma119_trees_lock(t, 1);
+            return ISO_OUT_OF_MEM;
+        }
+    }
     *tree = node;
     return ISO_SUCCESS;
 }
@@ -442,7 +564,7 @@ int mangle_single_dir(Ecma119Image *img, Iso1999Node *dir)
                     }
                 }
                 if (ok) {
-                    char *new = strdup(tmp);
+                    char *new = iso_arena_strdup(img->iso1999_arena, tmp);
                     if (new == NULL) {
                         ret = ISO_OUT_OF_MEM;
                         goto ex;
@@ -451,7 +573,6 @@ int mangle_single_dir(Ecma119Image *img, Iso1999Node *dir)
                                   children[k]->name, new);
 
                     iso_htable_remove_ptr(table, children[k]->name, NULL);
-                    free(children[k]->name);
                     children[k]->name = new;
                     iso_htable_add(table, new, new);
 
@@ -494,12 +615,65 @@ ex:;
     return ret;
 }
 
+struct iso1999_mangle_job {
+    Ecma119Image *t;
+    Iso1999Node **dirs;
+    size_t count;
+};
+
+static
+void iso1999_collect_dirs(Iso1999Node *dir, struct iso1999_mangle_job *job)
+{
+    size_t i;
+
+    if (job->dirs != NULL)
+        job->dirs[job->count] = dir;
+    job->count++;
+    for (i = 0; i < dir->info.dir->nchildren; ++i)
+        if (dir->info.dir->children[i]->type == ISO1999_DIR)
+            iso1999_collect_dirs(dir->info.dir->children[i], job);
+}
+
+static
+int iso1999_mangle_job_run(void *ctx, size_t idx)
+{
+    struct iso1999_mangle_job *job = ctx;
+
+    return mangle_single_dir(job->t, job->dirs[idx]);
+}
+
+/* The names in a directory are mangled independently of other directories.
+   So the directories may be handed to several threads.
+*/
+static
+int mangle_tree_parallel(Ecma119Image *t, Iso1999Node *dir)
+{
+    int ret;
+    struct iso1999_mangle_job job;
+
+    job.t = t;
+    job.dirs = NULL;
+    job.count = 0;
+    iso1999_collect_dirs(dir, &job);
+    LIBISO_ALLOC_MEM(job.dirs, Iso1999Node *, job.count);
+    job.count = 0;
+    iso1999_collect_dirs(dir, &job);
+    ret = iso_run_parallel(t->opts->tree_threads, job.count, 16,
+                           iso1999_mangle_job_run, &job);
+ex:;
+    LIBISO_FREE_MEM(job.dirs);
+    return ret;
+}
+
 static
 int mangle_tree(Ecma119Image *t, Iso1999Node *dir)
 {
     int ret;
     size_t i;
 
+    if (t->opts->tree_threads > 1)
+        return mangle_tree_parallel(t, dir);
+
     ret = mangle_single_dir(t, dir);
     if (ret < 0) {
         return ret;
@@ -518,7 +692,6 @@ int mangle_tree(Ecma119Image *t, Iso1999Node *dir)
     return ISO_SUCCESS;
 }
 
-static
 int iso1999_tree_create(Ecma119Image *t)
 {
     int ret;
@@ -528,7 +701,12 @@ int iso1999_tree_create(Ecma119Image *t)
         return ISO_NULL_POINTER;
     }
 
-    ret = create_tree(t, (IsoNode*)t->image->root, &root, 0);
+    if (t->iso1999_arena == NULL) {
+        ret = iso_arena_new(&t->iso1999_arena, 0, 0);
+        if (ret < 0)
+            return ret;
+    }
+    ret = create_tree(t, (IsoNode*)t->image->root, &root, 0, NULL);
     if (ret <= 0) {
         if (ret == 0) {
             /* unexpected error, root ignored!! This can't happen */
@@ -830,7 +1008,8 @@ int iso1999_writer_write_vol_desc(IsoImageWriter *writer)
 }
 
 static
-int write_one_dir(Ecma119Image *t, Iso1999Node *dir)
+int write_one_dir(Ecma119Image *t, Iso1999Node *dir,
+                  struct iso_render_out *out)
 {
     int ret;
     uint8_t *buffer = NULL;
@@ -861,7 +1040,7 @@ int write_one_dir(Ecma119Image *t, Iso1999Node *dir)
         for (section = 0; section < nsections; ++section) {
             if ( (buf + len - buffer) > BLOCK_SIZE) {
                 /* dir doesn't fit in current block */
-                ret = iso_write(t, buffer, BLOCK_SIZE);
+                ret = iso_write_render(t, out, buffer, BLOCK_SIZE);
                 if (ret < 0) {
                     goto ex;
                 }
@@ -875,35 +1054,79 @@ int write_one_dir(Ecma119Image *t, Iso1999Node *dir)
     }
 
     /* write the last block */
-    ret = iso_write(t, buffer, BLOCK_SIZE);
+    ret = iso_write_render(t, out, buffer, BLOCK_SIZE);
 ex:;
     LIBISO_FREE_MEM(buffer);
     return ret;
 }
 
+struct iso1999_dir_render {
+    Ecma119Image *t;
+    Iso1999Node **dirs;
+    size_t count;
+    size_t max;
+};
+
 static
-int write_dirs(Ecma119Image *t, Iso1999Node *root)
+void collect_dirs(struct iso1999_dir_render *r, Iso1999Node *dir)
 {
-    int ret;
     size_t i;
 
-    /* write all directory entries for this dir */
-    ret = write_one_dir(t, root);
-    if (ret < 0) {
-        return ret;
+    if (r->count >= r->max) {
+        /* Mismatch with calc_dir_pos() will be detected by the caller */
+        r->count++;
+        return;
     }
-
-    /* recurse */
-    for (i = 0; i < root->info.dir->nchildren; i++) {
-        Iso1999Node *child = root->info.dir->children[i];
+    r->dirs[r->count++] = dir;
+    for (i = 0; i < dir->info.dir->nchildren; i++) {
+        Iso1999Node *child = dir->info.dir->children[i];
         if (child->type == ISO1999_DIR) {
-            ret = write_dirs(t, child);
-            if (ret < 0) {
-                return ret;
-            }
+            collect_dirs(r, child);
         }
     }
-    return ISO_SUCCESS;
+}
+
+static
+int render_one_dir(void *ctx, size_t idx, struct iso_render_out *out)
+{
+    struct iso1999_dir_render *r = ctx;
+
+    return write_one_dir(r->t, r->dirs[idx], out);
+}
+
+/**
+ * Write the directories of the tree in the order of calc_dir_pos().
+ * end_block is the first block after the last directory.
+ */
+static
+int write_dirs(Ecma119Image *t, Iso1999Node *root, uint32_t end_block)
+{
+    int ret;
+    size_t i;
+    struct iso1999_dir_render r;
+    uint32_t *blocks = NULL;
+
+    memset(&r, 0, sizeof(r));
+    r.t = t;
+    r.max = t->iso1999_ndirs;
+    LIBISO_ALLOC_MEM(r.dirs, Iso1999Node *, r.max);
+    LIBISO_ALLOC_MEM(blocks, uint32_t, r.max + 1);
+
+    collect_dirs(&r, root);
+    if (r.count != r.max) {
+        iso_msg_submit(t->image->id, ISO_ASSERT_FAILURE, 0,
+                       "Number of directories differs from ISO 9660:1999 layout");
+        ret = ISO_ASSERT_FAILURE; goto ex;
+    }
+    for (i = 0; i < r.count; i++)
+        blocks[i] = r.dirs[i]->info.dir->block;
+    blocks[r.count] = end_block;
+
+    ret = iso_render_dirs(t, r.count, blocks, render_one_dir, &r);
+ex:;
+    LIBISO_FREE_MEM(blocks);
+    LIBISO_FREE_MEM(r.dirs);
+    return ret;
 }
 
 static
@@ -1019,7 +1242,7 @@ int iso1999_writer_write_data(IsoImageWriter *writer)
     t = writer->target;
 
     /* first of all, we write the directory structure */
-    ret = write_dirs(t, t->iso1999_root);
+    ret = write_dirs(t, t->iso1999_root, t->iso1999_l_path_table_pos);
     if (ret < 0) {
         return ret;
     }
@@ -1030,12 +1253,19 @@ int iso1999_writer_write_data(IsoImageWriter *writer)
     return ret;
 }
 
+void iso1999_tree_free(Ecma119Image *t)
+{
+    if (t->iso1999_root != NULL)
+        iso1999_node_free(t->iso1999_root);
+    t->iso1999_root = NULL;
+    iso_arena_destroy(&(t->iso1999_arena));
+}
+
 static
 int iso1999_writer_free_data(IsoImageWriter *writer)
 {
     /* free the ISO 9660:1999 tree */
-    Ecma119Image *t = writer->target;
-    iso1999_node_free(t->iso1999_root);
+    iso1999_tree_free(writer->target);
     return ISO_SUCCESS;
 }
 
@@ -1056,12 +1286,15 @@ int iso1999_writer_create(Ecma119Image *target)
     writer->data = NULL;
     writer->target = target;
 
-    iso_msg_debug(target->image->id,
-                  "Creating low level ISO 9660:1999 tree...");
-    ret = iso1999_tree_create(target);
-    if (ret < 0) {
-        free((char *) writer);
-        return ret;
+    if (target->iso1999_root == NULL) {
+        /* Not yet created by ecma119_create_trees() */
+        iso_msg_debug(target->image->id,
+                      "Creating low level ISO 9660:1999 tree...");
+        ret = iso1999_tree_create(target);
+        if (ret < 0) {
+            free((char *) writer);
+            return ret;
+        }
     }
 
     /* add this writer to image */
@@ -48,6 +48,20 @@ struct iso1999_node
 	} info;
 };
 
+/**
+ * Create the ISO 9660:1999 tree of the image. iso1999_writer_create() does
+ * this if it was not done before.
+ *
+ * @return
+ *      1 on success, < 0 on error
+ */
+int iso1999_tree_create(Ecma119Image *target);
+
+/**
+ * Dispose the ISO 9660:1999 tree of the image together with its memory arena.
+ */
+void iso1999_tree_free(Ecma119Image *target);
+
 /**
  * Create a IsoWriter to deal with ISO 9660:1999 estructures, and add it to 
  * the given target.
@@ -128,11 +128,9 @@ void joliet_node_free(JolietNode *node)
         }
         if (node->info.dir->children != NULL)
             free(node->info.dir->children);
-        free(node->info.dir);
     }
+    /* The node and its name belong to t->joliet_arena */
     iso_node_unref(node->node);
-    free(node->name);
-    free(node);
 }
 
 /**
@@ -146,24 +144,23 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
     int ret;
     JolietNode *joliet;
 
-    joliet = calloc(1, sizeof(JolietNode));
+    /* On error the memory stays unused in the arena */
+    joliet = iso_arena_alloc(t->joliet_arena, sizeof(JolietNode));
     if (joliet == NULL) {
         return ISO_OUT_OF_MEM;
     }
 
     if (iso->type == LIBISO_DIR) {
         IsoDir *dir = (IsoDir*) iso;
-        joliet->info.dir = calloc(1, sizeof(struct joliet_dir_info));
+        joliet->info.dir = iso_arena_alloc(t->joliet_arena,
+                                           sizeof(struct joliet_dir_info));
         if (joliet->info.dir == NULL) {
-            free(joliet);
             return ISO_OUT_OF_MEM;
         }
         joliet->info.dir->children = NULL;
         if (dir->nchildren > 0) {
             joliet->info.dir->children = calloc(sizeof(void*), dir->nchildren);
             if (joliet->info.dir->children == NULL) {
-                free(joliet->info.dir);
-                free(joliet);
                 return ISO_OUT_OF_MEM;
             }
         }
@@ -178,7 +175,6 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
         if (size > (off_t)MAX_ISO_FILE_SECTION_SIZE &&
             t->opts->iso_level != 3) {
             char *ipath = iso_tree_get_node_path(iso);
-            free(joliet);
             ret = iso_msg_submit(t->image->id, ISO_FILE_TOO_BIG, 0,
                          "File \"%s\" can't be added to image because is "
                          "greater than 4GB", ipath);
@@ -186,9 +182,10 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
             return ret;
         }
 
+        ecma119_trees_lock(t, 0);
         ret = iso_file_src_create(t, file, &src);
+        ecma119_trees_lock(t, 1);
         if (ret < 0) {
-            free(joliet);
             return ret;
         }
         joliet->info.file = src;
@@ -197,51 +194,136 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
         /* it's a el-torito boot catalog, that we write as a file */
         IsoFileSrc *src;
 
+        ecma119_trees_lock(t, 0);
         ret = el_torito_catalog_file_src_create(t, &src);
+        ecma119_trees_lock(t, 1);
         if (ret < 0) {
-            free(joliet);
             return ret;
         }
         joliet->info.file = src;
         joliet->type = JOLIET_FILE;
     } else {
         /* should never happen */
-        free(joliet);
         return ISO_ASSERT_FAILURE;
     }
 
     /* take a ref to the IsoNode */
     joliet->node = iso;
+    ecma119_trees_lock(t, 0);
     iso_node_ref(iso);
+    ecma119_trees_lock(t, 1);
 
     *node = joliet;
     return ISO_SUCCESS;
 }
 
+/* Directories with at least this number of children get the names of their
+   children converted by several threads, if enabled by opts->tree_threads.
+*/
+#define JOLIET_PARALLEL_NAMES_MIN 256
+
+struct joliet_name_job {
+    Ecma119Image *t;
+    IsoNode **nodes;
+    uint16_t **names;
+};
+
+/* Convert the name of a single child for joliet_convert_names().
+   Names which would cause messages are left to create_tree(), which
+   converts them again and so reports problems in the order of the children.
+*/
+static
+int joliet_name_job_run(void *ctx, size_t idx)
+{
+    struct joliet_name_job *job = ctx;
+    IsoNode *iso;
+    size_t failures = 0;
+    int ret;
+
+    iso = job->nodes[idx];
+    job->names[idx] = NULL;
+    if (iso->hidden & LIBISO_HIDE_ON_JOLIET)
+        return ISO_SUCCESS;
+    ret = iso_get_joliet_name(job->t->opts, job->t->input_charset,
+                              job->t->image->id, iso->name, iso->type,
+                              &failures, &(job->names[idx]), 512);
+    if (ret >= 0 && failures > 0) {
+        free(job->names[idx]);
+        job->names[idx] = NULL;
+    }
+    return ISO_SUCCESS;
+}
+
+/* Convert the names of the children of a large directory by several threads.
+   @param names  Returns NULL or an array of dir->nchildren names, some of
+                 which may be NULL
+*/
+static
+int joliet_convert_names(Ecma119Image *t, IsoDir *dir, uint16_t ***names)
+{
+    int ret;
+    size_t i;
+    IsoNode *pos;
+    struct joliet_name_job job;
+
+    *names = NULL;
+    job.t = t;
+    job.nodes = NULL;
+    job.names = NULL;
+    if (t->opts->tree_threads <= 1 ||
+        dir->nchildren < JOLIET_PARALLEL_NAMES_MIN)
+        return ISO_SUCCESS;
+
+    LIBISO_ALLOC_MEM(job.nodes, IsoNode *, dir->nchildren);
+    LIBISO_ALLOC_MEM(job.names, uint16_t *, dir->nchildren);
+    for (pos = dir->children, i = 0; pos != NULL && i < (size_t) dir->nchildren;
+         pos = pos->next, i++)
+        job.nodes[i] = pos;
+    ret = iso_run_parallel(t->opts->tree_threads, i, 64,
+                           joliet_name_job_run, &job);
+    if (ret < 0)
+        goto ex;
+    *names = job.names;
+    job.names = NULL;
+    ret = ISO_SUCCESS;
+ex:;
+    LIBISO_FREE_MEM(job.nodes);
+    LIBISO_FREE_MEM(job.names);
+    return ret;
+}
+
 /**
  * Create the low level Joliet tree from the high level ISO tree.
  *
+ * @param jname
+ *      NULL or the Joliet name of iso, which then is owned by create_tree()
  * @return
  *      1 success, 0 file ignored, < 0 error
  */
 static
-int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
+int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen,
+                uint16_t *jname)
 {
     int ret, max_path;
     JolietNode *node = NULL;
-    uint16_t *jname = NULL;
 
     if (t == NULL || iso == NULL || tree == NULL) {
+        if (jname != NULL)
+            free(jname);
         return ISO_NULL_POINTER;
     }
 
     if (iso->hidden & LIBISO_HIDE_ON_JOLIET) {
         /* file will be ignored */
+        if (jname != NULL)
+            free(jname);
         return 0;
     }
-    ret = get_joliet_name(t, iso, &jname);
-    if (ret < 0) {
-        return ret;
+    if (jname == NULL) {
+        ret = get_joliet_name(t, iso, &jname);
+        if (ret < 0) {
+            return ret;
+        }
     }
     max_path = pathlen + 1 + (jname ? ucslen(jname) * 2 : 0);
     if (!t->opts->joliet_longer_paths && max_path > 240) {
@@ -266,19 +348,41 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
         {
             IsoNode *pos;
             IsoDir *dir = (IsoDir*)iso;
+            uint16_t **names = NULL;
+            size_t i;
+
             ret = create_node(t, iso, &node);
             if (ret < 0) {
                 free(jname);
                 return ret;
             }
+            ret = joliet_convert_names(t, dir, &names);
+            if (ret < 0) {
+                ecma119_trees_lock(t, 0);
+                joliet_node_free(node);
+                ecma119_trees_lock(t, 1);
+                free(jname);
+                return ret;
+            }
+            ret = ISO_SUCCESS;
             pos = dir->children;
+            i = 0;
             while (pos) {
                 int cret;
                 JolietNode *child;
-                cret = create_tree(t, pos, &child, max_path);
+                uint16_t *child_name = NULL;
+
+                if (names != NULL && i < (size_t) dir->nchildren) {
+                    child_name = names[i];
+                    names[i] = NULL;
+                }
+                i++;
+                cret = create_tree(t, pos, &child, max_path, child_name);
                 if (cret < 0) {
                     /* error */
+                    ecma119_trees_lock(t, 0);
                     joliet_node_free(node);
+                    ecma119_trees_lock(t, 1);
                     ret = cret;
                     break;
                 } else if (cret == ISO_SUCCESS) {
@@ -289,6 +393,12 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
                 }
                 pos = pos->next;
             }
+            if (names != NULL) {
+                for (i = 0; i < (size_t) dir->nchildren; i++)
+                    if (names[i] != NULL)
+                        free(names[i]);
+                free(names);
+            }
         }
         break;
     case LIBISO_BOOT:
@@ -319,7 +429,17 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
         free(jname);
         return ret;
     }
-    node->name = jname;
+    if (jname != NULL) {
+        node->name = iso_arena_memdup(t->joliet_arena, jname,
+                                      (ucslen(jname) + 1) * 2);
+        free(jname);
+        if (node->name == NULL) {
+            ecma119_trees_lock(t, 0);
+            joliet_node_free(node);
+            ecma119_trees_lock(t, 1);
+            return ISO_OUT_OF_MEM;
+        }
+    }
     *tree = node;
     return ISO_SUCCESS;
 }
@@ -556,14 +676,14 @@ int mangle_single_dir(Ecma119Image *t, JolietNode *dir)
                     }
                 }
                 if (ok) {
-                    uint16_t *new = ucsdup(tmp);
+                    uint16_t *new = iso_arena_memdup(t->joliet_arena, tmp,
+                                                     (ucslen(tmp) + 1) * 2);
                     if (new == NULL) {
                         ret = ISO_OUT_OF_MEM;
                         goto mangle_cleanup;
                     }
 
                     iso_htable_remove_ptr(table, children[k]->name, NULL);
-                    free(children[k]->name);
                     children[k]->name = new;
                     iso_htable_add(table, new, new);
 
@@ -607,12 +727,65 @@ ex:;
     return ret;
 }
 
+struct joliet_mangle_job {
+    Ecma119Image *t;
+    JolietNode **dirs;
+    size_t count;
+};
+
+static
+void joliet_collect_dirs(JolietNode *dir, struct joliet_mangle_job *job)
+{
+    size_t i;
+
+    if (job->dirs != NULL)
+        job->dirs[job->count] = dir;
+    job->count++;
+    for (i = 0; i < dir->info.dir->nchildren; ++i)
+        if (dir->info.dir->children[i]->type == JOLIET_DIR)
+            joliet_collect_dirs(dir->info.dir->children[i], job);
+}
+
+static
+int joliet_mangle_job_run(void *ctx, size_t idx)
+{
+    struct joliet_mangle_job *job = ctx;
+
+    return mangle_single_dir(job->t, job->dirs[idx]);
+}
+
+/* The names in a directory are mangled independently of other directories.
+   So the directories may be handed to several threads.
+*/
+static
+int mangle_tree_parallel(Ecma119Image *t, JolietNode *dir)
+{
+    int ret;
+    struct joliet_mangle_job job;
+
+    job.t = t;
+    job.dirs = NULL;
+    job.count = 0;
+    joliet_collect_dirs(dir, &job);
+    LIBISO_ALLOC_MEM(job.dirs, JolietNode *, job.count);
+    job.count = 0;
+    joliet_collect_dirs(dir, &job);
+    ret = iso_run_parallel(t->opts->tree_threads, job.count, 16,
+                           joliet_mangle_job_run, &job);
+ex:;
+    LIBISO_FREE_MEM(job.dirs);
+    return ret;
+}
+
 static
 int mangle_tree(Ecma119Image *t, JolietNode *dir)
 {
     int ret;
     size_t i;
 
+    if (t->opts->tree_threads > 1)
+        return mangle_tree_parallel(t, dir);
+
     ret = mangle_single_dir(t, dir);
     if (ret < 0) {
         return ret;
@@ -631,7 +804,6 @@ int mangle_tree(Ecma119Image *t, JolietNode *dir)
     return ISO_SUCCESS;
 }
 
-static
 int joliet_tree_create(Ecma119Image *t)
 {
     int ret;
@@ -641,7 +813,12 @@ int joliet_tree_create(Ecma119Image *t)
         return ISO_NULL_POINTER;
     }
 
-    ret = create_tree(t, (IsoNode*)t->image->root, &root, 0);
+    if (t->joliet_arena == NULL) {
+        ret = iso_arena_new(&t->joliet_arena, 0, 0);
+        if (ret < 0)
+            return ret;
+    }
+    ret = create_tree(t, (IsoNode*)t->image->root, &root, 0, NULL);
     if (ret <= 0) {
         if (ret == 0) {
             /* unexpected error, root ignored!! This can't happen */
@@ -1012,7 +1189,8 @@ int joliet_writer_write_vol_desc(IsoImageWriter *writer)
 }
 
 static
-int write_one_dir(Ecma119Image *t, JolietNode *dir)
+int write_one_dir(Ecma119Image *t, JolietNode *dir,
+                  struct iso_render_out *out)
 {
     int ret;
     uint8_t *buffer = NULL;
@@ -1050,7 +1228,7 @@ int write_one_dir(Ecma119Image *t, JolietNode *dir)
 
             if ( (buf + len - buffer) > BLOCK_SIZE) {
                 /* dir doesn't fit in current block */
-                ret = iso_write(t, buffer, BLOCK_SIZE);
+                ret = iso_write_render(t, out, buffer, BLOCK_SIZE);
                 if (ret < 0) {
                     goto ex;
                 }
@@ -1064,35 +1242,79 @@ int write_one_dir(Ecma119Image *t, JolietNode *dir)
     }
 
     /* write the last block */
-    ret = iso_write(t, buffer, BLOCK_SIZE);
+    ret = iso_write_render(t, out, buffer, BLOCK_SIZE);
 ex:;
     LIBISO_FREE_MEM(buffer);
     return ret;
 }
 
+struct joliet_dir_render {
+    Ecma119Image *t;
+    JolietNode **dirs;
+    size_t count;
+    size_t max;
+};
+
 static
-int write_dirs(Ecma119Image *t, JolietNode *root)
+void collect_dirs(struct joliet_dir_render *r, JolietNode *dir)
 {
-    int ret;
     size_t i;
 
-    /* write all directory entries for this dir */
-    ret = write_one_dir(t, root);
-    if (ret < 0) {
-        return ret;
+    if (r->count >= r->max) {
+        /* Mismatch with calc_dir_pos() will be detected by the caller */
+        r->count++;
+        return;
     }
-
-    /* recurse */
-    for (i = 0; i < root->info.dir->nchildren; i++) {
-        JolietNode *child = root->info.dir->children[i];
+    r->dirs[r->count++] = dir;
+    for (i = 0; i < dir->info.dir->nchildren; i++) {
+        JolietNode *child = dir->info.dir->children[i];
         if (child->type == JOLIET_DIR) {
-            ret = write_dirs(t, child);
-            if (ret < 0) {
-                return ret;
-            }
+            collect_dirs(r, child);
         }
     }
-    return ISO_SUCCESS;
+}
+
+static
+int render_one_dir(void *ctx, size_t idx, struct iso_render_out *out)
+{
+    struct joliet_dir_render *r = ctx;
+
+    return write_one_dir(r->t, r->dirs[idx], out);
+}
+
+/**
+ * Write the directories of the tree in the order of calc_dir_pos().
+ * end_block is the first block after the last directory.
+ */
+static
+int write_dirs(Ecma119Image *t, JolietNode *root, uint32_t end_block)
+{
+    int ret;
+    size_t i;
+    struct joliet_dir_render r;
+    uint32_t *blocks = NULL;
+
+    memset(&r, 0, sizeof(r));
+    r.t = t;
+    r.max = t->joliet_ndirs;
+    LIBISO_ALLOC_MEM(r.dirs, JolietNode *, r.max);
+    LIBISO_ALLOC_MEM(blocks, uint32_t, r.max + 1);
+
+    collect_dirs(&r, root);
+    if (r.count != r.max) {
+        iso_msg_submit(t->image->id, ISO_ASSERT_FAILURE, 0,
+                       "Number of directories differs from Joliet layout");
+        ret = ISO_ASSERT_FAILURE; goto ex;
+    }
+    for (i = 0; i < r.count; i++)
+        blocks[i] = r.dirs[i]->info.dir->block;
+    blocks[r.count] = end_block;
+
+    ret = iso_render_dirs(t, r.count, blocks, render_one_dir, &r);
+ex:;
+    LIBISO_FREE_MEM(blocks);
+    LIBISO_FREE_MEM(r.dirs);
+    return ret;
 }
 
 static
@@ -1216,7 +1438,10 @@ int joliet_writer_write_dirs(IsoImageWriter *writer)
     } else {
         root = t->joliet_root;
     }
-    ret = write_dirs(t, root);
+    if (t->eff_partition_offset > 0)
+        ret = write_dirs(t, root, t->j_part_l_path_table_pos);
+    else
+        ret = write_dirs(t, root, t->joliet_l_path_table_pos);
     if (ret < 0) {
         return ret;
     }
@@ -1252,15 +1477,22 @@ int joliet_writer_write_data(IsoImageWriter *writer)
     return ISO_SUCCESS;
 }
 
-static
-int joliet_writer_free_data(IsoImageWriter *writer)
+void joliet_tree_free(Ecma119Image *t)
 {
-    /* free the Joliet tree */
-    Ecma119Image *t = writer->target;
-    joliet_node_free(t->joliet_root);
+    if (t->joliet_root != NULL)
+        joliet_node_free(t->joliet_root);
+    t->joliet_root = NULL;
     if (t->j_part_root != NULL)
         joliet_node_free(t->j_part_root);
     t->j_part_root = NULL;
+    iso_arena_destroy(&(t->joliet_arena));
+}
+
+static
+int joliet_writer_free_data(IsoImageWriter *writer)
+{
+    /* free the Joliet tree */
+    joliet_tree_free(writer->target);
     return ISO_SUCCESS;
 }
 
@@ -1281,11 +1513,14 @@ int joliet_writer_create(Ecma119Image *target)
     writer->data = NULL;
     writer->target = target;
 
-    iso_msg_debug(target->image->id, "Creating low level Joliet tree...");
-    ret = joliet_tree_create(target);
-    if (ret < 0) {
-        free((char *) writer);
-        return ret;
+    if (target->joliet_root == NULL) {
+        /* Not yet created by ecma119_create_trees() */
+        iso_msg_debug(target->image->id, "Creating low level Joliet tree...");
+        ret = joliet_tree_create(target);
+        if (ret < 0) {
+            free((char *) writer);
+            return ret;
+        }
     }
 
     /* add this writer to image */
@@ -49,6 +49,20 @@ struct joliet_node
 	} info;
 };
 
+/**
+ * Create the Joliet tree of the image. joliet_writer_create() does this if
+ * it was not done before.
+ *
+ * @return
+ *      1 on success, < 0 on error
+ */
+int joliet_tree_create(Ecma119Image *target);
+
+/**
+ * Dispose the Joliet trees of the image together with their memory arena.
+ */
+void joliet_tree_free(Ecma119Image *target);
+
 /**
  * Create a IsoWriter to deal with Joliet estructures, and add it to the given
  * target.
@@ -246,6 +246,17 @@ int libiso_msgs_set_severities(struct libiso_msgs *m, int queue_severity,
 }
 
 
+int libiso_msgs_is_wanted(struct libiso_msgs *m, int severity, int flag)
+{
+ /* Read without lock, like libiso_msgs_submit() does with print_severity.
+    A concurrent change of severities can only delay the effect by one
+    message. */
+ if(severity >= m->print_severity || severity >= m->queue_severity)
+   return(1);
+ return(0);
+}
+
+
 int libiso_msgs__text_to_sev(char *severity_name, int *severity,
                              int flag)
 {
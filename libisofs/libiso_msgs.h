@@ -349,6 +349,15 @@ int libiso_msgs_set_severities(struct libiso_msgs *m, int queue_severity,
                                int print_severity, char *print_id, int flag);
 
 
+/** Tell whether a message of the given severity would be printed or queued.
+    This allows to skip the composition of message texts which nobody will
+    see. It does not lock the message handler.
+    @param flag Bitfield for control purposes (unused yet, submit 0)
+    @return 1 if wanted, 0 if not
+*/
+int libiso_msgs_is_wanted(struct libiso_msgs *m, int severity, int flag);
+
+
 /** Obtain a message item that has at least the given severity and priority.
     Usually all older messages of lower severity are discarded then. If no
     item of sufficient severity was found, all others are discarded from the
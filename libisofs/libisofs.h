@@ -412,7 +412,11 @@ typedef struct iso_data_source IsoDataSource;
 struct iso_data_source
 {
 
-    /* reserved for future usage, set to 0 */
+    /* Set to 0 or 1 for this version of the structure
+     * 0 = only members up to .data are valid
+     * 1 = member .read_blocks is valid
+     *     @since 1.5.6
+     */
     int version;
 
     /**
@@ -467,6 +471,30 @@ struct iso_data_source
 
     /** Source specific data */
     void *data;
+
+    /* ----------------- Only valid with .version >= 1 ----------------- */
+
+    /**
+     * Read a number of consecutive blocks (2048 bytes each) of data from
+     * the source. libisofs uses this for directory extents and for file
+     * content which is read in large pieces.
+     * May be NULL, in which case libisofs calls read_block() repeatedly.
+     *
+     * @param lba
+     *     First block to be read.
+     * @param count
+     *     Number of blocks to be read.
+     * @param buffer
+     *     Buffer where the data will be written. It should have at least
+     *     count * 2048 bytes.
+     * @return
+     *      1 if success,
+     *    < 0 if error. Same error codes as with read_block().
+     *
+     * @since 1.5.6
+     */
+    int (*read_blocks)(IsoDataSource *src, uint32_t lba, uint32_t count,
+                       uint8_t *buffer);
 };
 
 /**
@@ -1327,6 +1355,46 @@ void iso_image_set_ignore_aclea(IsoImage *image, int what);
 int iso_image_get_ignore_aclea(IsoImage *image);
 
 
+/**
+ * Control whether nodes which get created by iso_tree_add_node(),
+ * iso_tree_add_dir_rec() and related calls, or by iso_image_import(), shall
+ * share their name and their ACL and xattr with other nodes of equal
+ * content. This can save much memory with large trees, where many files
+ * bear the same name in different directories or the same set of ACL and
+ * xattr.
+ * The shared data are reference counted and pooled for all images. Nodes
+ * which stem from other sources keep their own copies.
+ * The API of IsoNode is not affected. Changes of names, ACL, or xattr by
+ * the iso_node_set_*() calls give the node its own copy again.
+ *
+ * @param image
+ *     The image of which the behavior is to be controlled
+ * @param flag
+ *     A bit field which sets the behavior:
+ *     bit0= share equal node names
+ *     bit1= share equal ACL and xattr
+ *     all other bits are reserved
+ * @return
+ *     ISO_SUCCESS or error
+ *
+ * @since 1.5.6
+ */
+int iso_image_set_node_compaction(IsoImage *image, int flag);
+
+
+/**
+ * Obtain the current setting of iso_image_set_node_compaction().
+ *
+ * @param image
+ *     The image to be inquired
+ * @return
+ *    The currently set value.
+ *
+ * @since 1.5.6
+ */
+int iso_image_get_node_compaction(IsoImage *image);
+
+
 /**
  * Creates an IsoWriteOpts for writing an image. You should set the options
  * desired with the correspondent setters.
@@ -1912,6 +1980,8 @@ int iso_write_opts_set_sort_files(IsoWriteOpts *opts, int sort);
  * were written into the image output stream, not necessarily as they were
  * on hard disk at any point of time.
  * See also calls iso_image_get_session_md5() and iso_file_get_md5().
+ * Since 1.5.6 the session checksum is computed by a thread of its own
+ * while the writer thread goes on with producing the image.
  * @param opts
  *      The option set to be manipulated.
  * @param session
@@ -2183,6 +2253,98 @@ int iso_write_opts_set_overwrite_buf(IsoWriteOpts *opts, uint8_t *overwrite);
  */
 int iso_write_opts_set_fifo_size(IsoWriteOpts *opts, size_t fifo_size);
 
+/**
+ * The maximum number of threads which may be set by
+ * iso_write_opts_set_data_threads().
+ *
+ * @since 1.5.6
+ */
+#define ISO_MAX_DATA_THREADS 64
+
+/**
+ * Set the number of worker threads which shall read, filter and checksum
+ * the content of data files in parallel while the image gets written.
+ * The writer thread still emits the file content in the block address order
+ * of the image. So the result is the same as with the default of a single
+ * thread. Only the time needed to produce it may be shorter.
+ * Data files which stem from an imported ISO image or which use stream
+ * classes unknown to libisofs are always read by the writer thread itself,
+ * because their reading is not known to be safe for concurrent use.
+ * Memory for the data which are read ahead is limited to 8 MiB per thread.
+ *
+ * @param opts
+ *        The option set to be manipulated.
+ * @param num_threads
+ *        0 or 1 = let the writer thread read all data files (default)
+ *        2 to ISO_MAX_DATA_THREADS = number of reader threads
+ * @return
+ *        ISO_SUCCESS or error
+ *
+ * @since 1.5.6
+ */
+int iso_write_opts_set_data_threads(IsoWriteOpts *opts, int num_threads);
+
+/**
+ * The maximum number of threads which may be set by
+ * iso_write_opts_set_tree_threads().
+ *
+ * @since 1.5.6
+ */
+#define ISO_MAX_TREE_THREADS 64
+
+/**
+ * Set the number of threads which shall build the directory trees of the
+ * image while iso_image_create_burn_source() prepares the image production.
+ * The Joliet tree, the ISO 9660:1999 tree, and the HFS+ tree get created
+ * concurrently after the ECMA-119 tree is complete. Within the Joliet and
+ * ISO 9660:1999 trees, the names of large directories get converted and the
+ * names of all directories get mangled by several threads.
+ * While the image gets written, the directory records of all trees get
+ * rendered by several threads ahead of the write position.
+ * The resulting image is the same as with the default of a single thread.
+ * If a node is omitted from the ECMA-119 tree, e.g. because it is hidden
+ * by iso_node_set_hidden(), then the other trees get created one after the
+ * other, because only this keeps the order of the file checksum indice.
+ *
+ * @param opts
+ *        The option set to be manipulated.
+ * @param num_threads
+ *        0 or 1 = let the calling thread create all trees (default)
+ *        2 to ISO_MAX_TREE_THREADS = number of threads per task
+ * @return
+ *        ISO_SUCCESS or error
+ *
+ * @since 1.5.6
+ */
+int iso_write_opts_set_tree_threads(IsoWriteOpts *opts, int num_threads);
+
+/**
+ * Let data files with equal content share a single data extent in the
+ * image, even if they are not hard links of the same input file.
+ * Files get compared only if they have the same size. Then their MD5
+ * checksums get computed by reading them, and optionally their bytes get
+ * compared in addition. So this costs additional reading of all files whose
+ * size occurs more than once.
+ * The files stay different files with own inode numbers in Rock Ridge.
+ * The file MD5 checksums of iso_write_opts_set_record_md5() get shared like
+ * the data extent.
+ * Not affected are files from an imported image which are kept in place by
+ * multi-session, and El Torito boot images, which might get patched.
+ *
+ * @param opts
+ *        The option set to be manipulated.
+ * @param mode
+ *        Bitfield for control purposes:
+ *        bit0= enable deduplication by size and MD5 checksum
+ *        bit1= confirm equality by comparing the bytes of the files
+ *        Submit 0 to disable deduplication (default).
+ * @return
+ *        ISO_SUCCESS or error
+ *
+ * @since 1.5.6
+ */
+int iso_write_opts_set_content_dedup(IsoWriteOpts *opts, int mode);
+
 /*
  * Attach 32 kB of binary data which shall get written to the first 32 kB 
  * of the ISO image, the ECMA-119 System Area. This space is intended for
@@ -3217,6 +3379,92 @@ int iso_read_opts_load_system_area(IsoReadOpts *opts, int mode);
  */
 int iso_read_opts_keep_import_src(IsoReadOpts *opts, int mode);
 
+/**
+ * Control whether iso_image_import() shall load the directories of the
+ * imported tree only when they get inspected. Only the root directory gets
+ * loaded by the import. Any other directory stays unloaded until its
+ * children get iterated, counted, or looked up, until a node gets added to
+ * it, or until the tree gets written by iso_image_create_burn_source().
+ * This saves time and memory if only few parts of a large tree get
+ * inspected or changed before a new session gets added.
+ * The IsoDataSource of the import has to stay readable until the whole
+ * tree is loaded.
+ * Inode numbers for imported nodes without PX inode numbers get handed out
+ * when the tree is complete.
+ * Lazy loading is not done if the image has El Torito boot records, if
+ * iso_read_opts_set_new_inos() is enabled, if excludes are set by
+ * iso_tree_add_exclude(), or if a callback is set by
+ * iso_tree_set_report_callback().
+ * Directories of a tree which got replaced by a new iso_image_import()
+ * will not get loaded any more.
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param mode
+ *       Bitfield for control purposes:
+ *       bit0= Load directories on demand
+ *       Submit any other bits with value 0.
+ * @return
+ *       1 success, < 0 error
+ *
+ * @since 1.5.6
+ */
+int iso_read_opts_set_lazy_dirs(IsoReadOpts *opts, int mode);
+
+/**
+ * Set the number of threads which shall read the directories of the imported
+ * tree ahead of its loading by iso_image_import(). Together with the
+ * directory extents they read the Continuation Areas of Rock Ridge and AAIP
+ * information. This can shorten the import of large trees from devices or
+ * network storage with high latency.
+ * The tree and the messages are the same as without reading ahead.
+ * Reading ahead is only done with data sources which are known to allow
+ * concurrent reading, i.e. those of iso_data_source_new_from_file() and
+ * those of iso_data_source_new_cached() which wrap such a data source.
+ * It is not done with the data sources of iso_data_source_new_mmap(),
+ * because their blocks are in memory anyway. It is not done for directories
+ * which get loaded on demand by iso_read_opts_set_lazy_dirs().
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param num_threads
+ *       0 or 1 = no reading ahead (default)
+ *       2 to ISO_MAX_INGEST_THREADS = number of threads
+ * @return
+ *       1 success, < 0 error
+ *
+ * @since 1.5.6
+ */
+int iso_read_opts_set_dir_threads(IsoReadOpts *opts, int num_threads);
+
+/**
+ * The maximum number of blocks which may be set by
+ * iso_read_opts_set_ce_cache().
+ *
+ * @since 1.5.6
+ */
+#define ISO_MAX_CE_CACHE_BLOCKS 4096
+
+/**
+ * Set the number of blocks of Rock Ridge and AAIP Continuation Areas which
+ * iso_image_import() keeps in memory. Continuation Areas of several
+ * directory entries often share a block. Remembering recently read blocks
+ * avoids reading them again for each entry.
+ * The tree is the same with any number of blocks.
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param num_blocks
+ *       0 = default number of 128 blocks
+ *       -1 = keep no blocks
+ *       1 to ISO_MAX_CE_CACHE_BLOCKS = number of blocks
+ * @return
+ *       1 success, < 0 error
+ *
+ * @since 1.5.6
+ */
+int iso_read_opts_set_ce_cache(IsoReadOpts *opts, int num_blocks);
+
 /**
  * Import a previous session or image, for growing or modify.
  *
@@ -4611,10 +4859,10 @@ int iso_image_report_el_torito(IsoImage *image,
  * See doc/boot_sectors.txt for the byte layout of GPT.
  *
  * This might be helpful for applications which want to manipulate GPT
- * directly. The function is in libisofs/system_area.c and self-contained.
+ * directly. The function is in libisofs/crc32.c and self-contained.
  * So if you want to copy+paste it under the license of that file: Be invited.
- * Be warned that this implementation works bit-wise and thus is much slower
- * than table-driven ones. For less than 32 KiB, it fully suffices, though.
+ * Since version 1.5.6 it is table-driven. It is the same CRC as computed by
+ * iso_crc32_update() with initial value 0.
  *
  * @param data
  *        The memory buffer with the data to sum up.
@@ -4628,6 +4876,27 @@ int iso_image_report_el_torito(IsoImage *image,
  */
 uint32_t iso_crc32_gpt(unsigned char *data, int count, int flag);
 
+/**
+ * Advance the computation of a CRC-32 by a chunk of data bytes.
+ * This is the CRC of GPT, Ethernet, and zlib. It may be used to compute a
+ * checksum of data which arrive in pieces, e.g. of the whole output of an
+ * image production as read from the struct burn_source.
+ *
+ * @param crc
+ *        The result of the previous call. Submit 0 with the first chunk.
+ * @param data
+ *        The memory buffer with the data to sum up.
+ * @param count
+ *        Number of bytes in data.
+ * @param flag
+ *        Bitfield for control purposes. Submit 0.
+ * @return
+ *        The CRC of all data so far. 
+ * @since 1.5.6
+ */
+uint32_t iso_crc32_update(uint32_t crc, unsigned char *data, int count,
+                          int flag);
+
 /**
  * Add a MIPS boot file path to the image.
  * Up to 15 such files can be written into a MIPS Big Endian Volume Header
@@ -5716,10 +5985,31 @@ int iso_symlink_set_dest(IsoSymlink *link, const char *dest);
  *      closer from the beginning of image the file will be written.
  *      Default value at IsoNode creation is 0.
  *
+ * If the children of a lazily imported directory cannot be loaded, then
+ * a message gets issued. Use iso_node_set_sort_weight_x() to learn about
+ * such a failure.
+ *
  * @since 0.6.2
  */
 void iso_node_set_sort_weight(IsoNode *node, int w);
 
+/**
+ * Like iso_node_set_sort_weight() but with a return value.
+ *
+ * @param node
+ *      The node which weight will be changed.
+ * @param w
+ *      The weight as with iso_node_set_sort_weight().
+ * @param flag
+ *      Bitfield for control purposes. Unused yet. Submit 0.
+ * @return
+ *      1 on success, < 0 on error, e.g. if the children of a lazily
+ *      imported directory cannot be loaded. See iso_read_opts_set_lazy_dirs().
+ *
+ * @since 1.5.6
+ */
+int iso_node_set_sort_weight_x(IsoNode *node, int w, int flag);
+
 /**
  * Get the sort weight of a file.
  *
@@ -6182,6 +6472,45 @@ void iso_tree_set_ignore_special(IsoImage *image, int skip);
  */
 int iso_tree_get_ignore_special(IsoImage *image);
 
+/**
+ * The maximum number of threads which may be set by
+ * iso_tree_set_ingest_threads().
+ *
+ * @since 1.5.6
+ */
+#define ISO_MAX_INGEST_THREADS 64
+
+/**
+ * Set the number of threads which shall read directories and inquire file
+ * attributes of the local filesystem ahead of iso_tree_add_dir_rec().
+ * These threads make the calls of lstat(2), stat(2), readlink(2) and the
+ * inquiries of ACL and xattr concurrently, which can shorten the time needed
+ * for large trees on network filesystems or fast storage devices.
+ * The nodes are still created and inserted in the same order as without
+ * reading ahead. So the replace mode, the excludes, and the report callback
+ * behave the same as with the default of no extra threads.
+ * Only in effect with the local filesystem as source of the tree.
+ *
+ * @param image
+ *      The image to manipulate.
+ * @param num_threads
+ *      0 or 1 = no reading ahead (default)
+ *      2 to ISO_MAX_INGEST_THREADS = number of threads
+ * @return
+ *      ISO_SUCCESS or error
+ *
+ * @since 1.5.6
+ */
+int iso_tree_set_ingest_threads(IsoImage *image, int num_threads);
+
+/**
+ * Get current setting for ingest_threads.
+ *
+ * @see iso_tree_set_ingest_threads
+ * @since 1.5.6
+ */
+int iso_tree_get_ingest_threads(IsoImage *image);
+
 /**
  * Add a excluded path. These are paths that won't never added to image, and
  * will be excluded even when adding recursively its parent directory.
@@ -6632,6 +6961,64 @@ void iso_data_source_unref(IsoDataSource *src);
  */
 int iso_data_source_new_from_file(const char *path, IsoDataSource **src);
 
+/**
+ * Create a new IsoDataSource from a local file, which gets mapped into
+ * memory by mmap(2) when the data source is opened. libisofs then parses
+ * directory records and SUSP entries of an imported image directly in the
+ * mapped memory and copies file content from there without intermediate
+ * buffers.
+ * If the file cannot be mapped, e.g. because it is larger than the address
+ * space, then it gets read like with iso_data_source_new_from_file().
+ * The content of the file must not be truncated while the data source is
+ * open.
+ *
+ * @param path
+ *     The absolute path of the file
+ * @param src
+ *     Will be filled with the pointer to the newly created data source.
+ * @param flag
+ *     Bitfield for control purposes, unused yet, submit 0
+ * @return
+ *    1 on success, < 0 on error.
+ *
+ * @since 1.5.6
+ */
+int iso_data_source_new_mmap(const char *path, IsoDataSource **src,
+                             int flag);
+
+/**
+ * Create a new IsoDataSource which serves the blocks of another
+ * IsoDataSource from a cache in memory. The cache is organized in chunks
+ * of consecutive blocks. On cache miss the whole chunk which contains the
+ * desired block gets read at once by the read_blocks() method of the
+ * original data source if it has one. The least recently used chunk gets
+ * replaced.
+ * This reduces the number of read operations when an image gets loaded
+ * or its file content gets read block by block.
+ * The cache gets emptied when the data source is closed.
+ *
+ * @param src
+ *     The data source to be wrapped. The new data source takes its own
+ *     reference on it, so you still need to iso_data_source_unref() yours.
+ * @param chunk_blocks
+ *     Number of 2048 byte blocks per chunk. 0 chooses the default of 32.
+ *     Allowed are up to 8192.
+ * @param num_chunks
+ *     Number of chunks in the cache. 0 chooses the default of 32.
+ *     Allowed are up to 65536.
+ * @param cached
+ *     Will be filled with the pointer to the newly created data source.
+ * @param flag
+ *     Bitfield for control purposes, unused yet, submit 0
+ * @return
+ *    1 on success, < 0 on error.
+ *
+ * @since 1.5.6
+ */
+int iso_data_source_new_cached(IsoDataSource *src, int chunk_blocks,
+                               int num_chunks, IsoDataSource **cached,
+                               int flag);
+
 /**
  * Get the status of the buffer used by a burn_source.
  *
@@ -8096,10 +8483,12 @@ int iso_zisofs_get_refcounts(off_t *ziso_count, off_t *osiz_count, int flag);
  */
 struct iso_zisofs_ctrl {
 
-    /* Set to 0 or 1 for this version of the structure
+    /* Set to 0, 1, or 2 for this version of the structure
      * 0 = only members up to .block_size_log2 are valid
      * 1 = members up to .bpt_discard_free_ratio are valid
      *     @since 1.5.4
+     * 2 = members up to .compression_threads are valid
+     *     @since 1.5.6
      */
     int version;
 
@@ -8194,6 +8583,18 @@ struct iso_zisofs_ctrl {
      */
     double bpt_discard_free_ratio;
 
+    /* ------------------- Only valid with .version >= 2 ------------------- */
+
+    /*
+     * Number of threads which compress the blocks of a single file
+     * concurrently. The result is the same as with compression by a single
+     * thread. Allowed are 1 to 64. 1 lets the reading thread do all
+     * compression. This is the default.
+     * 0 keeps the current setting.
+     * @since 1.5.6
+     */
+    int compression_threads;
+
 };
 
 /**
@@ -8321,6 +8722,38 @@ int iso_file_add_gzip_filter(IsoFile *file, int flag);
 int iso_gzip_get_refcounts(off_t *gzip_count, off_t *gunzip_count, int flag);
 
 
+/**
+ * Enable or disable caching of the output of content filters.
+ * The filters for zisofs, gzip, and external programs have to run over
+ * the whole input in order to determine the size of their output. Normally
+ * this output is discarded and the filter runs a second time when the data
+ * get written into the image. With the cache enabled, the output of the
+ * first run is kept and delivered to the image without processing the input
+ * again.
+ * The cache of a file is created when its filtered size gets determined,
+ * e.g. by iso_file_add_zisofs_filter(). It is disposed after it was
+ * delivered completely or when the file gets disposed.
+ * If the limits are exhausted, the output of further files is not cached.
+ * The settings apply to files which get filtered after this call.
+ * @param mem_limit
+ *      Maximum number of bytes which may be held in memory by all caches
+ *      together. 0 disables caching in memory.
+ * @param spill_limit
+ *      Maximum number of bytes which may be stored in a temporary file
+ *      when mem_limit is exhausted. The file is created by tmpfile(3).
+ *      Space of disposed caches gets used again, so the file does not
+ *      grow beyond spill_limit.
+ *      0 disables caching in a file.
+ * @param flag
+ *      Bitfield for control purposes, unused yet, submit 0
+ * @return
+ *      1 on success, <0 on error
+ *
+ * @since 1.5.6
+ */
+int iso_set_filter_cache(off_t mem_limit, off_t spill_limit, int flag);
+
+
 /* ---------------------------- MD5 Checksums --------------------------- */
 
 /* Production and loading of MD5 checksums is controlled by calls
@@ -8399,6 +8832,68 @@ int iso_file_get_md5(IsoImage *image, IsoFile *file, char md5[16], int flag);
  */
 int iso_file_make_md5(IsoFile *file, int flag);
 
+/**
+ * Check the data files of the imported image and the imported session by
+ * the MD5 checksums which were recorded when the session was written with
+ * iso_write_opts_set_record_md5(). The image has to be imported with MD5
+ * loading enabled (see iso_read_opts_set_no_md5()).
+ * The extents of the files and the session range get read in large
+ * sequential pieces in the sequence of their block addresses. The MD5 of
+ * the session and the files get computed by several threads in parallel.
+ * Only the data files which have a recorded MD5 get checked. Directories
+ * which were left unloaded by iso_read_opts_set_lazy_dirs() get loaded
+ * first. The tree must not be changed while this call is running.
+ *
+ * @param image
+ *      The image into which the session was imported.
+ * @param src
+ *      The data source from which the session was imported. It is not
+ *      needed to be safe for concurrent use, because only the calling
+ *      thread reads from it.
+ *      NULL means to use the data source which is kept by the image if
+ *      iso_read_opts_keep_import_src() was enabled for the import.
+ * @param num_threads
+ *      Number of threads which compute MD5 checksums:
+ *      0 = compute in the calling thread
+ *      1 to ISO_MAX_INGEST_THREADS = number of threads.
+ *      The MD5 of a single file or of the session gets computed by a single
+ *      thread. So more threads help only if there are many files.
+ * @param report
+ *      If not NULL: a function which gets called by the calling thread with
+ *      the results of the checks and with the progress of reading.
+ *      Parameter event tells what happened:
+ *        0 = progress report. file is NULL.
+ *        1 = file matches its recorded MD5 (only with flag bit0)
+ *        2 = file does not match its recorded MD5
+ *        3 = file could not be read completely
+ *        4 = session matches its recorded MD5
+ *        5 = session does not match its recorded MD5
+ *        6 = session could not be read completely
+ *      The file results come in the sequence of the block addresses of the
+ *      files. The session result comes after the file results.
+ *      done_bytes and total_bytes tell the amount of data which was read and
+ *      which will be read in total.
+ *      If the function returns a value < 0, then the check gets aborted
+ *      and iso_image_verify_md5() returns ISO_CANCELED.
+ * @param handle
+ *      Gets handed to report as first parameter.
+ * @param flag
+ *      Bitfield for control purposes:
+ *      bit0= report also the files which match their recorded MD5
+ *      Submit any other bits with value 0.
+ * @return
+ *      1 = all checked files and the session match their recorded MD5
+ *      2 = no recorded MD5 was found
+ *      0 = mismatches or read errors were found
+ *      < 0 = error
+ *
+ * @since 1.5.6
+ */
+int iso_image_verify_md5(IsoImage *image, IsoDataSource *src, int num_threads,
+                         int (*report)(void *handle, int event, IsoFile *file,
+                                       off_t done_bytes, off_t total_bytes),
+                         void *handle, int flag);
+
 /**
  * Check a data block whether it is a libisofs session checksum tag and
  * eventually obtain its recorded parameters. These tags get written after
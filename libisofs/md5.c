@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "writer.h"
 #include "messages.h"
@@ -31,6 +32,7 @@
 #include "util.h"
 
 #include "md5.h"
+#include "data_source.h"
 
 
 /* This code is derived from RFC 1321 and implements computation of the
@@ -283,6 +285,462 @@ static int md5_final(libisofs_md5_ctx *ctx, char result[16], int flag)
  return(1);
 }
 
+
+/* ------------------------- Multi-buffer MD5 ---------------------------- */
+
+/* MD5 is a strict chain of dependent steps, so a single message cannot make
+   use of SIMD registers. But several independent messages can be hashed in
+   lockstep, each in its own 32 bit lane of the registers.
+   The engine gets chosen at runtime by the features of the CPU:
+   AVX2 with 8 lanes, SSE2 with 4 lanes, or the plain md5__transform().
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define Libisofs_md5_x86_multI yes
+#include <immintrin.h>
+#endif
+
+#define Libisofs_md5_max_laneS 8
+
+/* An engine processes nblocks consecutive blocks of 64 bytes from each of
+   data[0] to data[lanes - 1] and updates the corresponding state[].
+*/
+typedef void (*md5_multi_engine)(uint32_t *state[], unsigned char *data[],
+                                 size_t nblocks);
+
+static md5_multi_engine md5_multi_wide = NULL;
+static int md5_multi_wide_lanes = 1;
+static md5_multi_engine md5_multi_narrow = NULL;
+static int md5_multi_narrow_lanes = 1;
+static pthread_once_t md5_multi_once = PTHREAD_ONCE_INIT;
+
+
+#ifdef Libisofs_md5_x86_multI
+
+/* The 64 steps of MD5 expressed by the vector operations
+   Libisofs_md5v_{ADD,AND,OR,XOR,ANDNOT,SET1,ROL}, which each engine defines
+   before expanding Libisofs_md5v_ROUNDS.
+   ANDNOT(x, y) is (~x) & y.
+*/
+#define Libisofs_md5v_F(x, y, z) \
+    Libisofs_md5v_OR(Libisofs_md5v_AND((x), (y)), \
+                     Libisofs_md5v_ANDNOT((x), (z)))
+#define Libisofs_md5v_G(x, y, z) \
+    Libisofs_md5v_OR(Libisofs_md5v_AND((x), (z)), \
+                     Libisofs_md5v_ANDNOT((z), (y)))
+#define Libisofs_md5v_H(x, y, z) \
+    Libisofs_md5v_XOR(Libisofs_md5v_XOR((x), (y)), (z))
+#define Libisofs_md5v_I(x, y, z) \
+    Libisofs_md5v_XOR((y), Libisofs_md5v_OR((x), \
+                                  Libisofs_md5v_XOR((z), ones)))
+
+#define Libisofs_md5v_STEP(f, a, b, c, d, x, s, ac) { \
+    (a) = Libisofs_md5v_ADD((a), Libisofs_md5v_ADD(f((b), (c), (d)), \
+                 Libisofs_md5v_ADD((x), Libisofs_md5v_SET1(ac)))); \
+    (a) = Libisofs_md5v_ROL((a), (s)); \
+    (a) = Libisofs_md5v_ADD((a), (b)); \
+  }
+#define Libisofs_md5v_FF(a, b, c, d, x, s, ac) \
+    Libisofs_md5v_STEP(Libisofs_md5v_F, a, b, c, d, x, s, ac)
+#define Libisofs_md5v_GG(a, b, c, d, x, s, ac) \
+    Libisofs_md5v_STEP(Libisofs_md5v_G, a, b, c, d, x, s, ac)
+#define Libisofs_md5v_HH(a, b, c, d, x, s, ac) \
+    Libisofs_md5v_STEP(Libisofs_md5v_H, a, b, c, d, x, s, ac)
+#define Libisofs_md5v_II(a, b, c, d, x, s, ac) \
+    Libisofs_md5v_STEP(Libisofs_md5v_I, a, b, c, d, x, s, ac)
+
+#define Libisofs_md5v_ROUNDS { \
+  Libisofs_md5v_FF (a, b, c, d, x[ 0], Libisofs_md5_S11, 0xd76aa478); \
+  Libisofs_md5v_FF (d, a, b, c, x[ 1], Libisofs_md5_S12, 0xe8c7b756); \
+  Libisofs_md5v_FF (c, d, a, b, x[ 2], Libisofs_md5_S13, 0x242070db); \
+  Libisofs_md5v_FF (b, c, d, a, x[ 3], Libisofs_md5_S14, 0xc1bdceee); \
+  Libisofs_md5v_FF (a, b, c, d, x[ 4], Libisofs_md5_S11, 0xf57c0faf); \
+  Libisofs_md5v_FF (d, a, b, c, x[ 5], Libisofs_md5_S12, 0x4787c62a); \
+  Libisofs_md5v_FF (c, d, a, b, x[ 6], Libisofs_md5_S13, 0xa8304613); \
+  Libisofs_md5v_FF (b, c, d, a, x[ 7], Libisofs_md5_S14, 0xfd469501); \
+  Libisofs_md5v_FF (a, b, c, d, x[ 8], Libisofs_md5_S11, 0x698098d8); \
+  Libisofs_md5v_FF (d, a, b, c, x[ 9], Libisofs_md5_S12, 0x8b44f7af); \
+  Libisofs_md5v_FF (c, d, a, b, x[10], Libisofs_md5_S13, 0xffff5bb1); \
+  Libisofs_md5v_FF (b, c, d, a, x[11], Libisofs_md5_S14, 0x895cd7be); \
+  Libisofs_md5v_FF (a, b, c, d, x[12], Libisofs_md5_S11, 0x6b901122); \
+  Libisofs_md5v_FF (d, a, b, c, x[13], Libisofs_md5_S12, 0xfd987193); \
+  Libisofs_md5v_FF (c, d, a, b, x[14], Libisofs_md5_S13, 0xa679438e); \
+  Libisofs_md5v_FF (b, c, d, a, x[15], Libisofs_md5_S14, 0x49b40821); \
+  Libisofs_md5v_GG (a, b, c, d, x[ 1], Libisofs_md5_S21, 0xf61e2562); \
+  Libisofs_md5v_GG (d, a, b, c, x[ 6], Libisofs_md5_S22, 0xc040b340); \
+  Libisofs_md5v_GG (c, d, a, b, x[11], Libisofs_md5_S23, 0x265e5a51); \
+  Libisofs_md5v_GG (b, c, d, a, x[ 0], Libisofs_md5_S24, 0xe9b6c7aa); \
+  Libisofs_md5v_GG (a, b, c, d, x[ 5], Libisofs_md5_S21, 0xd62f105d); \
+  Libisofs_md5v_GG (d, a, b, c, x[10], Libisofs_md5_S22,  0x2441453); \
+  Libisofs_md5v_GG (c, d, a, b, x[15], Libisofs_md5_S23, 0xd8a1e681); \
+  Libisofs_md5v_GG (b, c, d, a, x[ 4], Libisofs_md5_S24, 0xe7d3fbc8); \
+  Libisofs_md5v_GG (a, b, c, d, x[ 9], Libisofs_md5_S21, 0x21e1cde6); \
+  Libisofs_md5v_GG (d, a, b, c, x[14], Libisofs_md5_S22, 0xc33707d6); \
+  Libisofs_md5v_GG (c, d, a, b, x[ 3], Libisofs_md5_S23, 0xf4d50d87); \
+  Libisofs_md5v_GG (b, c, d, a, x[ 8], Libisofs_md5_S24, 0x455a14ed); \
+  Libisofs_md5v_GG (a, b, c, d, x[13], Libisofs_md5_S21, 0xa9e3e905); \
+  Libisofs_md5v_GG (d, a, b, c, x[ 2], Libisofs_md5_S22, 0xfcefa3f8); \
+  Libisofs_md5v_GG (c, d, a, b, x[ 7], Libisofs_md5_S23, 0x676f02d9); \
+  Libisofs_md5v_GG (b, c, d, a, x[12], Libisofs_md5_S24, 0x8d2a4c8a); \
+  Libisofs_md5v_HH (a, b, c, d, x[ 5], Libisofs_md5_S31, 0xfffa3942); \
+  Libisofs_md5v_HH (d, a, b, c, x[ 8], Libisofs_md5_S32, 0x8771f681); \
+  Libisofs_md5v_HH (c, d, a, b, x[11], Libisofs_md5_S33, 0x6d9d6122); \
+  Libisofs_md5v_HH (b, c, d, a, x[14], Libisofs_md5_S34, 0xfde5380c); \
+  Libisofs_md5v_HH (a, b, c, d, x[ 1], Libisofs_md5_S31, 0xa4beea44); \
+  Libisofs_md5v_HH (d, a, b, c, x[ 4], Libisofs_md5_S32, 0x4bdecfa9); \
+  Libisofs_md5v_HH (c, d, a, b, x[ 7], Libisofs_md5_S33, 0xf6bb4b60); \
+  Libisofs_md5v_HH (b, c, d, a, x[10], Libisofs_md5_S34, 0xbebfbc70); \
+  Libisofs_md5v_HH (a, b, c, d, x[13], Libisofs_md5_S31, 0x289b7ec6); \
+  Libisofs_md5v_HH (d, a, b, c, x[ 0], Libisofs_md5_S32, 0xeaa127fa); \
+  Libisofs_md5v_HH (c, d, a, b, x[ 3], Libisofs_md5_S33, 0xd4ef3085); \
+  Libisofs_md5v_HH (b, c, d, a, x[ 6], Libisofs_md5_S34,  0x4881d05); \
+  Libisofs_md5v_HH (a, b, c, d, x[ 9], Libisofs_md5_S31, 0xd9d4d039); \
+  Libisofs_md5v_HH (d, a, b, c, x[12], Libisofs_md5_S32, 0xe6db99e5); \
+  Libisofs_md5v_HH (c, d, a, b, x[15], Libisofs_md5_S33, 0x1fa27cf8); \
+  Libisofs_md5v_HH (b, c, d, a, x[ 2], Libisofs_md5_S34, 0xc4ac5665); \
+  Libisofs_md5v_II (a, b, c, d, x[ 0], Libisofs_md5_S41, 0xf4292244); \
+  Libisofs_md5v_II (d, a, b, c, x[ 7], Libisofs_md5_S42, 0x432aff97); \
+  Libisofs_md5v_II (c, d, a, b, x[14], Libisofs_md5_S43, 0xab9423a7); \
+  Libisofs_md5v_II (b, c, d, a, x[ 5], Libisofs_md5_S44, 0xfc93a039); \
+  Libisofs_md5v_II (a, b, c, d, x[12], Libisofs_md5_S41, 0x655b59c3); \
+  Libisofs_md5v_II (d, a, b, c, x[ 3], Libisofs_md5_S42, 0x8f0ccc92); \
+  Libisofs_md5v_II (c, d, a, b, x[10], Libisofs_md5_S43, 0xffeff47d); \
+  Libisofs_md5v_II (b, c, d, a, x[ 1], Libisofs_md5_S44, 0x85845dd1); \
+  Libisofs_md5v_II (a, b, c, d, x[ 8], Libisofs_md5_S41, 0x6fa87e4f); \
+  Libisofs_md5v_II (d, a, b, c, x[15], Libisofs_md5_S42, 0xfe2ce6e0); \
+  Libisofs_md5v_II (c, d, a, b, x[ 6], Libisofs_md5_S43, 0xa3014314); \
+  Libisofs_md5v_II (b, c, d, a, x[13], Libisofs_md5_S44, 0x4e0811a1); \
+  Libisofs_md5v_II (a, b, c, d, x[ 4], Libisofs_md5_S41, 0xf7537e82); \
+  Libisofs_md5v_II (d, a, b, c, x[11], Libisofs_md5_S42, 0xbd3af235); \
+  Libisofs_md5v_II (c, d, a, b, x[ 2], Libisofs_md5_S43, 0x2ad7d2bb); \
+  Libisofs_md5v_II (b, c, d, a, x[ 9], Libisofs_md5_S44, 0xeb86d391); \
+  }
+
+
+/* SSE2: 4 lanes */
+
+#define Libisofs_md5v_ADD(x, y)    _mm_add_epi32((x), (y))
+#define Libisofs_md5v_AND(x, y)    _mm_and_si128((x), (y))
+#define Libisofs_md5v_OR(x, y)     _mm_or_si128((x), (y))
+#define Libisofs_md5v_XOR(x, y)    _mm_xor_si128((x), (y))
+#define Libisofs_md5v_ANDNOT(x, y) _mm_andnot_si128((x), (y))
+#define Libisofs_md5v_SET1(c)      _mm_set1_epi32((int) (c))
+#define Libisofs_md5v_ROL(x, n) \
+    _mm_or_si128(_mm_slli_epi32((x), (n)), _mm_srli_epi32((x), 32 - (n)))
+
+__attribute__((target("sse2")))
+static void md5__transform_sse2(uint32_t *state[], unsigned char *data[],
+                                size_t nblocks)
+{
+    __m128i a, b, c, d, aa, bb, cc, dd, x[16], r[4], t[4], ones;
+    uint32_t out[4][4];
+    size_t n;
+    int i, l;
+
+    ones = _mm_set1_epi32(-1);
+    a = _mm_set_epi32(state[3][0], state[2][0], state[1][0], state[0][0]);
+    b = _mm_set_epi32(state[3][1], state[2][1], state[1][1], state[0][1]);
+    c = _mm_set_epi32(state[3][2], state[2][2], state[1][2], state[0][2]);
+    d = _mm_set_epi32(state[3][3], state[2][3], state[1][3], state[0][3]);
+
+    for (n = 0; n < nblocks; n++) {
+        /* Transpose 4 words of each lane into 4 words of all lanes */
+        for (i = 0; i < 4; i++) {
+            for (l = 0; l < 4; l++)
+                r[l] = _mm_loadu_si128((__m128i *)
+                                       (data[l] + 64 * n + 16 * i));
+            t[0] = _mm_unpacklo_epi32(r[0], r[1]);
+            t[1] = _mm_unpackhi_epi32(r[0], r[1]);
+            t[2] = _mm_unpacklo_epi32(r[2], r[3]);
+            t[3] = _mm_unpackhi_epi32(r[2], r[3]);
+            x[4 * i + 0] = _mm_unpacklo_epi64(t[0], t[2]);
+            x[4 * i + 1] = _mm_unpackhi_epi64(t[0], t[2]);
+            x[4 * i + 2] = _mm_unpacklo_epi64(t[1], t[3]);
+            x[4 * i + 3] = _mm_unpackhi_epi64(t[1], t[3]);
+        }
+        aa = a; bb = b; cc = c; dd = d;
+        Libisofs_md5v_ROUNDS
+        a = _mm_add_epi32(a, aa);
+        b = _mm_add_epi32(b, bb);
+        c = _mm_add_epi32(c, cc);
+        d = _mm_add_epi32(d, dd);
+    }
+
+    _mm_storeu_si128((__m128i *) out[0], a);
+    _mm_storeu_si128((__m128i *) out[1], b);
+    _mm_storeu_si128((__m128i *) out[2], c);
+    _mm_storeu_si128((__m128i *) out[3], d);
+    for (l = 0; l < 4; l++)
+        for (i = 0; i < 4; i++)
+            state[l][i] = out[i][l];
+}
+
+#undef Libisofs_md5v_ADD
+#undef Libisofs_md5v_AND
+#undef Libisofs_md5v_OR
+#undef Libisofs_md5v_XOR
+#undef Libisofs_md5v_ANDNOT
+#undef Libisofs_md5v_SET1
+#undef Libisofs_md5v_ROL
+
+
+/* AVX2: 8 lanes */
+
+#define Libisofs_md5v_ADD(x, y)    _mm256_add_epi32((x), (y))
+#define Libisofs_md5v_AND(x, y)    _mm256_and_si256((x), (y))
+#define Libisofs_md5v_OR(x, y)     _mm256_or_si256((x), (y))
+#define Libisofs_md5v_XOR(x, y)    _mm256_xor_si256((x), (y))
+#define Libisofs_md5v_ANDNOT(x, y) _mm256_andnot_si256((x), (y))
+#define Libisofs_md5v_SET1(c)      _mm256_set1_epi32((int) (c))
+#define Libisofs_md5v_ROL(x, n) \
+    _mm256_or_si256(_mm256_slli_epi32((x), (n)), \
+                    _mm256_srli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2")))
+static void md5__transform_avx2(uint32_t *state[], unsigned char *data[],
+                                size_t nblocks)
+{
+    __m256i a, b, c, d, aa, bb, cc, dd, x[16], r[8], t[8], s[8], ones;
+    uint32_t out[4][8];
+    size_t n;
+    int h, i, l;
+
+#define Libisofs_md5v_LANES(w) \
+    _mm256_set_epi32(state[7][w], state[6][w], state[5][w], state[4][w], \
+                     state[3][w], state[2][w], state[1][w], state[0][w])
+
+    ones = _mm256_set1_epi32(-1);
+    a = Libisofs_md5v_LANES(0);
+    b = Libisofs_md5v_LANES(1);
+    c = Libisofs_md5v_LANES(2);
+    d = Libisofs_md5v_LANES(3);
+
+#undef Libisofs_md5v_LANES
+
+    for (n = 0; n < nblocks; n++) {
+        /* Transpose 8 words of each lane into 8 words of all lanes */
+        for (h = 0; h < 2; h++) {
+            for (l = 0; l < 8; l++)
+                r[l] = _mm256_loadu_si256((__m256i *)
+                                          (data[l] + 64 * n + 32 * h));
+            for (l = 0; l < 8; l += 2) {
+                t[l] = _mm256_unpacklo_epi32(r[l], r[l + 1]);
+                t[l + 1] = _mm256_unpackhi_epi32(r[l], r[l + 1]);
+            }
+            for (l = 0; l < 8; l += 4) {
+                s[l] = _mm256_unpacklo_epi64(t[l], t[l + 2]);
+                s[l + 1] = _mm256_unpackhi_epi64(t[l], t[l + 2]);
+                s[l + 2] = _mm256_unpacklo_epi64(t[l + 1], t[l + 3]);
+                s[l + 3] = _mm256_unpackhi_epi64(t[l + 1], t[l + 3]);
+            }
+            for (i = 0; i < 4; i++) {
+                x[8 * h + i] = _mm256_permute2x128_si256(s[i], s[i + 4],
+                                                         0x20);
+                x[8 * h + i + 4] = _mm256_permute2x128_si256(s[i], s[i + 4],
+                                                             0x31);
+            }
+        }
+        aa = a; bb = b; cc = c; dd = d;
+        Libisofs_md5v_ROUNDS
+        a = _mm256_add_epi32(a, aa);
+        b = _mm256_add_epi32(b, bb);
+        c = _mm256_add_epi32(c, cc);
+        d = _mm256_add_epi32(d, dd);
+    }
+
+    _mm256_storeu_si256((__m256i *) out[0], a);
+    _mm256_storeu_si256((__m256i *) out[1], b);
+    _mm256_storeu_si256((__m256i *) out[2], c);
+    _mm256_storeu_si256((__m256i *) out[3], d);
+    for (l = 0; l < 8; l++)
+        for (i = 0; i < 4; i++)
+            state[l][i] = out[i][l];
+}
+
+#undef Libisofs_md5v_ADD
+#undef Libisofs_md5v_AND
+#undef Libisofs_md5v_OR
+#undef Libisofs_md5v_XOR
+#undef Libisofs_md5v_ANDNOT
+#undef Libisofs_md5v_SET1
+#undef Libisofs_md5v_ROL
+
+#endif /* Libisofs_md5_x86_multI */
+
+
+static
+void md5_multi_choose_engines(void)
+{
+#ifdef Libisofs_md5_x86_multI
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        md5_multi_narrow = md5__transform_sse2;
+        md5_multi_narrow_lanes = 4;
+        md5_multi_wide = md5__transform_sse2;
+        md5_multi_wide_lanes = 4;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        md5_multi_wide = md5__transform_avx2;
+        md5_multi_wide_lanes = 8;
+    }
+#endif /* Libisofs_md5_x86_multI */
+}
+
+
+/* @return The number of messages which get hashed in lockstep at most
+*/
+int iso_md5_multi_lanes(void)
+{
+    pthread_once(&md5_multi_once, md5_multi_choose_engines);
+    return md5_multi_wide_lanes;
+}
+
+
+/* Replace the engines which md5_multi_choose_engines() chose.
+   @param engine  0= by the CPU, 1= scalar, 2= SSE2, 3= AVX2
+   @return 1 success, ISO_WRONG_ARG_VALUE if the CPU cannot run the engine
+*/
+int iso_md5_multi_set_engine(int engine)
+{
+    pthread_once(&md5_multi_once, md5_multi_choose_engines);
+    if (engine == 0 || engine == 1) {
+        md5_multi_narrow = md5_multi_wide = NULL;
+        md5_multi_narrow_lanes = md5_multi_wide_lanes = 1;
+        if (engine == 0)
+            md5_multi_choose_engines();
+        return ISO_SUCCESS;
+    }
+
+#ifdef Libisofs_md5_x86_multI
+
+    if (engine == 2 && __builtin_cpu_supports("sse2")) {
+        md5_multi_narrow = md5_multi_wide = md5__transform_sse2;
+        md5_multi_narrow_lanes = md5_multi_wide_lanes = 4;
+        return ISO_SUCCESS;
+    }
+    if (engine == 3 && __builtin_cpu_supports("avx2")) {
+        md5_multi_narrow = md5_multi_wide = md5__transform_avx2;
+        md5_multi_narrow_lanes = md5_multi_wide_lanes = 8;
+        return ISO_SUCCESS;
+    }
+
+#endif /* Libisofs_md5_x86_multI */
+
+    return ISO_WRONG_ARG_VALUE;
+}
+
+
+/* Like md5_update() for count different contexts.
+   data_in[] and datalen_in[] get used as work space.
+*/
+static
+void md5_update_multi(libisofs_md5_ctx *ctx[], unsigned char *data_in[],
+                      int datalen_in[], int count)
+{
+    libisofs_md5_ctx *c;
+    unsigned char *data[Libisofs_md5_max_laneS];
+    uint32_t *state[Libisofs_md5_max_laneS], dummy_state[4];
+    md5_multi_engine engine;
+    int i, k, l, lanes, index, partlen, datalen, active;
+    size_t nblocks, *todo = NULL, *done = NULL, steps;
+
+    todo = calloc(count, sizeof(size_t));
+    done = calloc(count, sizeof(size_t));
+    if (todo == NULL || done == NULL) {
+        for (k = 0; k < count; k++)
+            md5_update(ctx[k], data_in[k], datalen_in[k], 0);
+        goto ex;
+    }
+
+    /* Complete the buffered blocks and count the whole blocks to do */
+    for (k = 0; k < count; k++) {
+        c = ctx[k];
+        datalen = datalen_in[k];
+        index = ((c->count[0] >> 3) & 0x3F);
+        if ((c->count[0] += ((uint32_t) datalen << 3)) <
+            ((uint32_t) datalen << 3))
+            c->count[1]++;
+        c->count[1] += ((uint32_t) datalen >> 29);
+        partlen = 64 - index;
+        if (index > 0) {
+            if (datalen < partlen) {
+                memcpy(c->buffer + index, data_in[k], datalen);
+                datalen_in[k] = 0;
+    continue;
+            }
+            memcpy(c->buffer + index, data_in[k], partlen);
+            md5__transform(c->state, c->buffer);
+            data_in[k] += partlen;
+            datalen_in[k] -= partlen;
+        }
+        todo[k] = datalen_in[k] / 64;
+    }
+
+    /* Run the whole blocks through the engines */
+    memset(dummy_state, 0, sizeof(dummy_state));
+    while (1) {
+        active = 0;
+        for (k = 0; k < count; k++)
+            if (done[k] < todo[k])
+                active++;
+        if (active == 0)
+    break;
+        if (active == 1 || md5_multi_narrow == NULL) {
+            for (k = 0; k < count; k++)
+                for (; done[k] < todo[k]; done[k]++)
+                    md5__transform(ctx[k]->state,
+                                   data_in[k] + 64 * done[k]);
+    continue;
+        }
+        /* A wide engine with many idle lanes would be slower than the
+           narrow one */
+        if (active > md5_multi_narrow_lanes) {
+            engine = md5_multi_wide;
+            lanes = md5_multi_wide_lanes;
+        } else {
+            engine = md5_multi_narrow;
+            lanes = md5_multi_narrow_lanes;
+        }
+        steps = 0;
+        for (k = 0, l = 0; k < count && l < lanes; k++) {
+            if (done[k] >= todo[k])
+        continue;
+            nblocks = todo[k] - done[k];
+            if (steps == 0 || nblocks < steps)
+                steps = nblocks;
+            state[l] = ctx[k]->state;
+            data[l] = data_in[k] + 64 * done[k];
+            l++;
+        }
+        /* Idle lanes compute garbage from the data of lane 0 */
+        for (i = l; i < lanes; i++) {
+            state[i] = dummy_state;
+            data[i] = data[0];
+        }
+        engine(state, data, steps);
+        for (k = 0, l = 0; k < count && l < lanes; k++) {
+            if (done[k] >= todo[k])
+        continue;
+            done[k] += steps;
+            l++;
+        }
+    }
+
+    /* Buffer the remaining data */
+    for (k = 0; k < count; k++) {
+        datalen = datalen_in[k] - 64 * todo[k];
+        if (datalen > 0)
+            memcpy(ctx[k]->buffer, data_in[k] + 64 * todo[k], datalen);
+    }
+ex:;
+    if (todo != NULL)
+        free(todo);
+    if (done != NULL)
+        free(done);
+}
+
+
 /** Compute a MD5 checksum from one or more calls of this function.
     The first call has to be made with flag bit0 == 1. It may already submit
     processing payload in data and datalen.
@@ -373,6 +831,68 @@ int iso_md5_compute(void *md5_context, char *data, int datalen)
 }
 
 
+/* Add data[k] to the MD5 context ctx[k] for k = 0 to count - 1.
+   Independent contexts get hashed in lockstep by the multi-buffer engine.
+   A context may occur more than once. Its data get added in the order
+   of the arrays.
+*/
+int iso_md5_compute_multi(void *ctx[], char *data[], int datalen[],
+                          int count)
+{
+    libisofs_md5_ctx **c = NULL;
+    unsigned char **d = NULL;
+    int *len = NULL, *round = NULL, n, k, j, todo, r, ret;
+
+    if (count <= 0)
+        return ISO_SUCCESS;
+    pthread_once(&md5_multi_once, md5_multi_choose_engines);
+
+    LIBISO_ALLOC_MEM(c, libisofs_md5_ctx *, count);
+    LIBISO_ALLOC_MEM(d, unsigned char *, count);
+    LIBISO_ALLOC_MEM(len, int, count);
+    LIBISO_ALLOC_MEM(round, int, count);
+
+    ret = ISO_SUCCESS;
+    todo = count;
+    for (k = 0; k < count; k++) {
+        round[k] = 0;
+        if (ctx[k] == NULL) {
+            round[k] = -1;
+            todo--;
+            ret = ISO_NULL_POINTER;
+        }
+    }
+
+    /* Each round takes at most one piece of data per context */
+    for (r = 1; todo > 0; r++) {
+        n = 0;
+        for (k = 0; k < count; k++) {
+            if (round[k] != 0)
+        continue;
+            for (j = 0; j < k; j++)
+                if ((round[j] == 0 || round[j] == r) && ctx[j] == ctx[k])
+            break;
+            if (j < k)
+        continue;
+            round[k] = r;
+            c[n] = ctx[k];
+            d[n] = (unsigned char *) data[k];
+            len[n] = datalen[k];
+            n++;
+        }
+        md5_update_multi(c, d, len, n);
+        todo -= n;
+    }
+
+ex:;
+    LIBISO_FREE_MEM(c);
+    LIBISO_FREE_MEM(d);
+    LIBISO_FREE_MEM(len);
+    LIBISO_FREE_MEM(round);
+    return ret;
+}
+
+
 /* API */
 int iso_md5_clone(void *old_md5_context, void **new_md5_context)
 {
@@ -411,6 +931,278 @@ int iso_md5_match(char first_md5[16], char second_md5[16])
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+/* Side thread for the session checksum and the checksums of data files.
+   The writer thread copies its output into slots and hands each full slot
+   over to a thread which adds it to the MD5 context of the slot. So the MD5
+   computation overlaps with reading, filtering, and writing of the image
+   data. The thread takes as many queued slots at once as have different
+   contexts and lets iso_md5_compute_multi() hash them in lockstep.
+*/
+
+#define ISO_MD5_PIPE_SLOTS     16
+#define ISO_MD5_PIPE_SLOT_SIZE (64 * 1024)
+
+/* The slots which get filled: one for the session checksum, one for the
+   data file which is being written */
+#define ISO_MD5_PIPE_FEEDERS   2
+
+struct iso_md5_pipe_slot {
+    char *data;
+    int fill;
+    void *ctx;
+
+    /* Dispose ctx after its data. If result is not NULL, then it gets the
+       16 bytes of the checksum. */
+    int end;
+    char *result;
+};
+
+struct iso_md5_pipe {
+    /* The session checksum context. May be NULL. */
+    void *ctx;
+
+    /* The ring of slots which are handed over to the thread */
+    struct iso_md5_pipe_slot slots[ISO_MD5_PIPE_SLOTS];
+
+    /* The slots which get filled by the writer thread */
+    struct iso_md5_pipe_slot open[ISO_MD5_PIPE_FEEDERS];
+
+    /* The free slot which takes the next handed over slot */
+    int head;
+    /* The slot which is to be computed next by the thread */
+    int tail;
+    /* Number of slots which are handed over and not yet computed */
+    int queued;
+    int end;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int thread_running;
+};
+
+
+static
+void *iso_md5_pipe_thread(void *arg)
+{
+    struct iso_md5_pipe *md5p = arg;
+    struct iso_md5_pipe_slot *slot;
+    void *ctx[ISO_MD5_PIPE_SLOTS];
+    char *data[ISO_MD5_PIPE_SLOTS], dummy[16];
+    int fill[ISO_MD5_PIPE_SLOTS], n, i, j;
+
+    pthread_mutex_lock(&md5p->mutex);
+    while (1) {
+        if (md5p->queued == 0) {
+            if (md5p->end)
+    break;
+            pthread_cond_wait(&md5p->cond, &md5p->mutex);
+    continue;
+        }
+        /* Take the queued slots up to the first one with a context which
+           is already taken */
+        for (n = 0; n < md5p->queued; n++) {
+            slot = &(md5p->slots[(md5p->tail + n) % ISO_MD5_PIPE_SLOTS]);
+            for (j = 0; j < n; j++)
+                if (ctx[j] == slot->ctx)
+            break;
+            if (j < n)
+        break;
+            ctx[n] = slot->ctx;
+            data[n] = slot->data;
+            fill[n] = slot->fill;
+        }
+        pthread_mutex_unlock(&md5p->mutex);
+
+        iso_md5_compute_multi(ctx, data, fill, n);
+        for (i = 0; i < n; i++) {
+            slot = &(md5p->slots[(md5p->tail + i) % ISO_MD5_PIPE_SLOTS]);
+            if (slot->end)
+                iso_md5_end(&(slot->ctx),
+                            slot->result != NULL ? slot->result : dummy);
+        }
+
+        pthread_mutex_lock(&md5p->mutex);
+        for (i = 0; i < n; i++) {
+            slot = &(md5p->slots[md5p->tail]);
+            slot->fill = 0;
+            slot->ctx = NULL;
+            slot->end = 0;
+            slot->result = NULL;
+            md5p->tail = (md5p->tail + 1) % ISO_MD5_PIPE_SLOTS;
+        }
+        md5p->queued -= n;
+        pthread_cond_broadcast(&md5p->cond);
+    }
+    pthread_mutex_unlock(&md5p->mutex);
+    return NULL;
+}
+
+
+/* Hand over the open slot of the feeder and wait until the next ring slot
+   is free */
+static
+void iso_md5_pipe_push(struct iso_md5_pipe *md5p, int feeder)
+{
+    struct iso_md5_pipe_slot swap;
+
+    pthread_mutex_lock(&md5p->mutex);
+    swap = md5p->slots[md5p->head];
+    md5p->slots[md5p->head] = md5p->open[feeder];
+    md5p->open[feeder] = swap;
+    md5p->queued++;
+    md5p->head = (md5p->head + 1) % ISO_MD5_PIPE_SLOTS;
+    pthread_cond_broadcast(&md5p->cond);
+    while (md5p->queued >= ISO_MD5_PIPE_SLOTS)
+        pthread_cond_wait(&md5p->cond, &md5p->mutex);
+    pthread_mutex_unlock(&md5p->mutex);
+}
+
+
+/* @param md5_context  The session checksum context or NULL if only
+                       iso_md5_pipe_feed_ctx() will be used
+*/
+int iso_md5_pipe_new(void *md5_context, struct iso_md5_pipe **pipe_pt)
+{
+    int ret, i;
+    struct iso_md5_pipe *md5p = NULL;
+
+    *pipe_pt = NULL;
+    LIBISO_ALLOC_MEM(md5p, struct iso_md5_pipe, 1);
+    md5p->ctx = md5_context;
+    memset(md5p->slots, 0, sizeof(md5p->slots));
+    memset(md5p->open, 0, sizeof(md5p->open));
+    md5p->head = md5p->tail = md5p->queued = md5p->end = 0;
+    md5p->thread_running = 0;
+    pthread_mutex_init(&md5p->mutex, NULL);
+    pthread_cond_init(&md5p->cond, NULL);
+    for (i = 0; i < ISO_MD5_PIPE_SLOTS; i++)
+        LIBISO_ALLOC_MEM(md5p->slots[i].data, char, ISO_MD5_PIPE_SLOT_SIZE);
+    for (i = 0; i < ISO_MD5_PIPE_FEEDERS; i++)
+        LIBISO_ALLOC_MEM(md5p->open[i].data, char, ISO_MD5_PIPE_SLOT_SIZE);
+
+    ret = pthread_create(&(md5p->thread), NULL, iso_md5_pipe_thread, md5p);
+    if (ret != 0) {
+        ret = ISO_THREAD_ERROR;
+        goto ex;
+    }
+    md5p->thread_running = 1;
+    *pipe_pt = md5p;
+    md5p = NULL;
+    ret = ISO_SUCCESS;
+ex:;
+    if (md5p != NULL)
+        iso_md5_pipe_destroy(&md5p);
+    return ret;
+}
+
+
+static
+int iso_md5_pipe_feed_slot(struct iso_md5_pipe *md5p, int feeder, void *ctx,
+                           char *data, size_t count)
+{
+    struct iso_md5_pipe_slot *slot;
+    size_t todo;
+
+    slot = &(md5p->open[feeder]);
+    if (slot->fill > 0 && slot->ctx != ctx)
+        iso_md5_pipe_push(md5p, feeder);
+    while (count > 0) {
+        slot->ctx = ctx;
+        todo = ISO_MD5_PIPE_SLOT_SIZE - slot->fill;
+        if (todo > count)
+            todo = count;
+        memcpy(slot->data + slot->fill, data, todo);
+        slot->fill += todo;
+        data += todo;
+        count -= todo;
+        if (slot->fill >= ISO_MD5_PIPE_SLOT_SIZE)
+            iso_md5_pipe_push(md5p, feeder);
+    }
+    return ISO_SUCCESS;
+}
+
+
+/* Add data to the session checksum context */
+int iso_md5_pipe_feed(struct iso_md5_pipe *md5p, char *data, size_t count)
+{
+    return iso_md5_pipe_feed_slot(md5p, 0, md5p->ctx, data, count);
+}
+
+
+/* Add data to the checksum context of a data file. The context may only be
+   used again by iso_md5_pipe_end_ctx().
+*/
+int iso_md5_pipe_feed_ctx(struct iso_md5_pipe *md5p, void *ctx,
+                          char *data, size_t count)
+{
+    return iso_md5_pipe_feed_slot(md5p, 1, ctx, data, count);
+}
+
+
+/* Let the thread dispose the checksum context of a data file after all its
+   data are added. The checksum gets stored in result, if not NULL, before
+   iso_md5_pipe_sync() returns.
+*/
+int iso_md5_pipe_end_ctx(struct iso_md5_pipe *md5p, void *ctx, char *result)
+{
+    struct iso_md5_pipe_slot *slot;
+
+    slot = &(md5p->open[1]);
+    if (slot->fill > 0 && slot->ctx != ctx)
+        iso_md5_pipe_push(md5p, 1);
+    slot->ctx = ctx;
+    slot->end = 1;
+    slot->result = result;
+    iso_md5_pipe_push(md5p, 1);
+    return ISO_SUCCESS;
+}
+
+
+int iso_md5_pipe_sync(struct iso_md5_pipe *md5p)
+{
+    int i;
+
+    for (i = 0; i < ISO_MD5_PIPE_FEEDERS; i++)
+        if (md5p->open[i].fill > 0)
+            iso_md5_pipe_push(md5p, i);
+    pthread_mutex_lock(&md5p->mutex);
+    while (md5p->queued > 0)
+        pthread_cond_wait(&md5p->cond, &md5p->mutex);
+    pthread_mutex_unlock(&md5p->mutex);
+    return ISO_SUCCESS;
+}
+
+
+int iso_md5_pipe_destroy(struct iso_md5_pipe **pipe_pt)
+{
+    struct iso_md5_pipe *md5p;
+    int i;
+
+    md5p = *pipe_pt;
+    if (md5p == NULL)
+        return 0;
+    if (md5p->thread_running) {
+        pthread_mutex_lock(&md5p->mutex);
+        md5p->end = 1;
+        pthread_cond_broadcast(&md5p->cond);
+        pthread_mutex_unlock(&md5p->mutex);
+        pthread_join(md5p->thread, NULL);
+    }
+    pthread_mutex_destroy(&md5p->mutex);
+    pthread_cond_destroy(&md5p->cond);
+    for (i = 0; i < ISO_MD5_PIPE_SLOTS; i++)
+        LIBISO_FREE_MEM(md5p->slots[i].data);
+    for (i = 0; i < ISO_MD5_PIPE_FEEDERS; i++)
+        LIBISO_FREE_MEM(md5p->open[i].data);
+    free(md5p);
+    *pipe_pt = NULL;
+    return 1;
+}
+
+
 /* ----------------------------------------------------------------------- */
 
 
@@ -634,6 +1426,10 @@ int checksum_writer_write_data(IsoImageWriter *writer)
     t = writer->target;
     iso_msg_debug(t->image->id, "Writing Checksums...");
 
+    /* Wait for the data file checksums and the session checksum */
+    if (t->checksum_pipe != NULL)
+        iso_md5_pipe_sync(t->checksum_pipe);
+
     /* Write image checksum to index 0 */
     if (t->checksum_ctx != NULL) {
         res = iso_md5_clone(t->checksum_ctx, &ctx);
@@ -730,6 +1526,8 @@ int iso_md5_write_scdbackup_tag(Ecma119Image *t, char *tag_block, int flag)
 
     LIBISO_ALLOC_MEM(record, char, 160);
     line_start = strlen(tag_block);
+    if (t->checksum_pipe != NULL)
+        iso_md5_pipe_sync(t->checksum_pipe);
     iso_md5_compute(t->checksum_ctx, tag_block, line_start);
     ret = iso_md5_clone(t->checksum_ctx, &ctx);
     if (ret < 0)
@@ -796,6 +1594,8 @@ int iso_md5_write_tag(Ecma119Image *t, int flag)
     mode = flag & 255;
     if (mode < 1 || mode > 4)
         {ret = ISO_WRONG_ARG_VALUE; goto ex;}
+    if (t->checksum_pipe != NULL)
+        iso_md5_pipe_sync(t->checksum_pipe);
     ret = iso_md5_clone(t->checksum_ctx, &ctx);
     if (ret < 0)
         goto ex;
@@ -878,3 +1678,768 @@ ex:;
 }
 
 
+
+
+/* ----------------------------------------------------------------------- */
+
+/* Verification of an imported image by its recorded MD5 checksums.
+
+   The extents of the data files and the session range get sorted by their
+   block addresses and the image gets read in large chunks, skipping only
+   larger gaps. Each file and the session get assigned to one of several
+   hashing lanes. Every lane sees all chunks in the sequence of reading, so
+   each MD5 gets computed over its data in the correct sequence, while the
+   lanes work in parallel with each other and with the reading thread.
+*/
+
+/* Blocks per read chunk */
+#define ISO_MD5_VERIFY_CHUNK_BLOCKS 512
+
+/* Number of chunks which may be read ahead of the slowest lane */
+#define ISO_MD5_VERIFY_SLOTS 8
+
+/* Gaps between extents up to this size get read rather than skipped */
+#define ISO_MD5_VERIFY_GAP_BLOCKS 64
+
+struct iso_md5_verify_entry
+{
+    IsoFile *file;       /* NULL for the session */
+    char md5[16];        /* the recorded checksum */
+    void *ctx;
+    int lane;
+
+    /* Index of the first extent in iso_md5_verify.segs */
+    size_t first_seg;
+    int nsegs;
+    int segs_done;
+    int bad;             /* some block could not be read */
+
+    /* 0= not done yet, 1= match, 2= mismatch, 3= read error */
+    int result;
+};
+
+struct iso_md5_verify_seg
+{
+    uint32_t lba;
+    uint32_t nblocks;
+    off_t size;          /* bytes of the extent which belong to the data */
+    off_t done;          /* bytes already processed */
+    size_t entry;
+};
+
+struct iso_md5_verify_slot
+{
+    uint8_t *data;
+    uint8_t *bad;        /* per block: 1= could not be read, zeroized */
+    uint32_t lba;
+    uint32_t count;
+    uint64_t seq;        /* sequence number of the chunk, 0= none yet */
+    int pending;         /* number of lanes which still need the chunk */
+};
+
+struct iso_md5_verify;
+
+struct iso_md5_verify_lane
+{
+    struct iso_md5_verify *vf;
+
+    /* The extents of the lane, sorted by block address */
+    struct iso_md5_verify_seg **segs;
+    size_t nsegs;
+    size_t next_seg;
+
+    /* Extents which are begun and not yet finished */
+    struct iso_md5_verify_seg **active;
+    size_t nactive;
+
+    /* Extents which get finished by the current chunk */
+    struct iso_md5_verify_seg **finished;
+
+    /* The pieces of the current chunk for iso_md5_compute_multi() */
+    void **md5_ctx;
+    char **md5_data;
+    int *md5_len;
+
+    off_t load;
+    pthread_t thread;
+    int thread_running;
+};
+
+struct iso_md5_verify
+{
+    IsoDataSource *src;
+
+    struct iso_md5_verify_entry *entries;  /* data files, then session */
+    size_t nentries;
+    size_t entries_size;
+    struct iso_md5_verify_seg *segs;
+    size_t nsegs;
+    size_t segs_size;
+
+    /* The extents which get read, sorted by block address */
+    struct iso_md5_verify_seg **sorted;
+    size_t nsorted;
+
+    struct iso_md5_verify_lane *lanes;
+    int nlanes;
+
+    struct iso_md5_verify_slot slots[ISO_MD5_VERIFY_SLOTS];
+
+    /* Set by the reading thread after the last chunk */
+    int end;
+    int abort;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+
+static
+int iso_md5_verify_add(struct iso_md5_verify *vf, IsoFile *file, char md5[16],
+                       uint32_t num_sections, struct iso_file_section *sections)
+{
+    struct iso_md5_verify_entry *entry, *new_entries;
+    struct iso_md5_verify_seg *seg, *new_segs;
+    uint32_t i;
+
+    if (vf->nentries >= vf->entries_size) {
+        vf->entries_size = 2 * vf->entries_size + 256;
+        new_entries = realloc(vf->entries, vf->entries_size *
+                                         sizeof(struct iso_md5_verify_entry));
+        if (new_entries == NULL)
+            return ISO_OUT_OF_MEM;
+        vf->entries = new_entries;
+    }
+    if (vf->nsegs + num_sections > vf->segs_size) {
+        vf->segs_size = 2 * vf->segs_size + num_sections + 256;
+        new_segs = realloc(vf->segs, vf->segs_size *
+                                     sizeof(struct iso_md5_verify_seg));
+        if (new_segs == NULL)
+            return ISO_OUT_OF_MEM;
+        vf->segs = new_segs;
+    }
+    entry = vf->entries + vf->nentries;
+    memset(entry, 0, sizeof(struct iso_md5_verify_entry));
+    entry->file = file;
+    memcpy(entry->md5, md5, 16);
+    entry->first_seg = vf->nsegs;
+    for (i = 0; i < num_sections; i++) {
+        if (sections[i].size == 0)
+    continue;
+        seg = vf->segs + vf->nsegs;
+        seg->lba = sections[i].block;
+        seg->nblocks = DIV_UP(sections[i].size, BLOCK_SIZE);
+        seg->size = sections[i].size;
+        seg->done = 0;
+        seg->entry = vf->nentries;
+        if (((uint64_t) seg->lba) + seg->nblocks > (uint64_t) 0xffffffff)
+            entry->bad = 1;
+        vf->nsegs++;
+        entry->nsegs++;
+    }
+    vf->nentries++;
+    return ISO_SUCCESS;
+}
+
+/* Collect the data files which have a recorded MD5 and extents in the
+   imported image.
+*/
+static
+int iso_md5_verify_collect(struct iso_md5_verify *vf, IsoImage *image,
+                           IsoNode *node)
+{
+    IsoNode *pos;
+    struct iso_file_section *sections = NULL;
+    int ret, num_sections = 0;
+    char md5[16];
+
+    if (node->type == LIBISO_FILE) {
+        ret = iso_file_get_md5(image, (IsoFile *) node, md5, 0);
+        if (ret <= 0)
+            return ret;
+        ret = iso_file_get_old_image_sections((IsoFile *) node,
+                                              &num_sections, &sections, 0);
+        if (ret <= 0)
+            return ret;
+        ret = iso_md5_verify_add(vf, (IsoFile *) node, md5,
+                                 (uint32_t) num_sections, sections);
+        if (sections != NULL)
+            free(sections);
+        if (ret < 0)
+            return ret;
+        iso_node_ref(node);
+    } else if (node->type == LIBISO_DIR) {
+        for (pos = ((IsoDir *) node)->children; pos != NULL; pos = pos->next) {
+            ret = iso_md5_verify_collect(vf, image, pos);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return ISO_SUCCESS;
+}
+
+static
+int iso_md5_verify_cmp_seg(const void *a, const void *b)
+{
+    struct iso_md5_verify_seg *sa, *sb;
+
+    sa = *((struct iso_md5_verify_seg **) a);
+    sb = *((struct iso_md5_verify_seg **) b);
+    if (sa->lba != sb->lba)
+        return sa->lba < sb->lba ? -1 : 1;
+    /* Extents of the same entry are stored in the sequence of their data */
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+/* Whether the extents of entry ascend without overlapping, so that the
+   sequential reading brings them in the sequence of the data.
+*/
+static
+int iso_md5_verify_is_ascending(struct iso_md5_verify *vf,
+                                struct iso_md5_verify_entry *entry)
+{
+    struct iso_md5_verify_seg *seg;
+    int i;
+
+    seg = vf->segs + entry->first_seg;
+    for (i = 1; i < entry->nsegs; i++)
+        if (((uint64_t) seg[i].lba) <
+            ((uint64_t) seg[i - 1].lba) + seg[i - 1].nblocks)
+            return 0;
+    return 1;
+}
+
+/* To be called when all data of entry are processed */
+static
+void iso_md5_verify_conclude(struct iso_md5_verify *vf,
+                             struct iso_md5_verify_entry *entry)
+{
+    char md5[16];
+    int result;
+
+    if (entry->ctx == NULL)
+        iso_md5_start(&(entry->ctx));
+    if (entry->ctx != NULL) {
+        iso_md5_end(&(entry->ctx), md5);
+        result = iso_md5_match(md5, entry->md5) ? 1 : 2;
+    } else {
+        result = 3;
+    }
+    if (entry->bad)
+        result = 3;
+    pthread_mutex_lock(&vf->mutex);
+    entry->result = result;
+    pthread_mutex_unlock(&vf->mutex);
+}
+
+/* Take the part of seg which lies in the chunk of slot.
+   @param data  Returns the bytes which have to be added to the checksum
+                context of the entry of seg
+   @param len   Returns the number of bytes, 0= nothing to add
+   @return 1= seg is complete
+*/
+static
+int iso_md5_verify_take(struct iso_md5_verify *vf,
+                        struct iso_md5_verify_seg *seg,
+                        struct iso_md5_verify_slot *slot,
+                        char **data, int *len)
+{
+    struct iso_md5_verify_entry *entry;
+    uint32_t b0, b1, b;
+    off_t l;
+
+    *data = NULL;
+    *len = 0;
+    entry = vf->entries + seg->entry;
+    b0 = seg->lba > slot->lba ? seg->lba : slot->lba;
+    b1 = seg->lba + seg->nblocks;
+    if (b1 > slot->lba + slot->count)
+        b1 = slot->lba + slot->count;
+    if (b0 >= b1)
+        return (b1 == seg->lba + seg->nblocks);
+    for (b = b0; b < b1; b++)
+        if (slot->bad[b - slot->lba])
+            entry->bad = 1;
+    l = ((off_t) (b1 - b0)) * BLOCK_SIZE;
+    if (l > seg->size - seg->done)
+        l = seg->size - seg->done;
+    if (entry->ctx == NULL && !entry->bad)
+        if (iso_md5_start(&(entry->ctx)) < 0)
+            entry->bad = 1;
+    if (entry->ctx != NULL) {
+        *data = (char *) slot->data + (b0 - slot->lba) * BLOCK_SIZE;
+        *len = (int) l;
+    }
+    seg->done += l;
+    return (b1 == seg->lba + seg->nblocks);
+}
+
+/* Feed the part of seg which lies in the chunk of slot.
+   @return 1= seg is complete
+*/
+static
+int iso_md5_verify_feed(struct iso_md5_verify *vf,
+                        struct iso_md5_verify_seg *seg,
+                        struct iso_md5_verify_slot *slot)
+{
+    char *data;
+    int len, ret;
+
+    ret = iso_md5_verify_take(vf, seg, slot, &data, &len);
+    if (len > 0)
+        iso_md5_compute(vf->entries[seg->entry].ctx, data, len);
+    return ret;
+}
+
+/* Process the chunk in slot for the extents of lane */
+static
+void iso_md5_verify_lane_chunk(struct iso_md5_verify_lane *lane,
+                               struct iso_md5_verify_slot *slot)
+{
+    struct iso_md5_verify *vf = lane->vf;
+    struct iso_md5_verify_seg *seg;
+    struct iso_md5_verify_entry *entry;
+    uint64_t chunk_end;
+    size_t i, j, nfinished = 0;
+    int n = 0;
+
+    chunk_end = ((uint64_t) slot->lba) + slot->count;
+    while (lane->next_seg < lane->nsegs &&
+           lane->segs[lane->next_seg]->lba < chunk_end)
+        lane->active[lane->nactive++] = lane->segs[lane->next_seg++];
+
+    for (i = j = 0; i < lane->nactive; i++) {
+        seg = lane->active[i];
+        if (iso_md5_verify_take(vf, seg, slot, lane->md5_data + n,
+                                lane->md5_len + n))
+            lane->finished[nfinished++] = seg;
+        else
+            lane->active[j++] = seg;
+        if (lane->md5_len[n] > 0)
+            lane->md5_ctx[n++] = vf->entries[seg->entry].ctx;
+    }
+    lane->nactive = j;
+
+    /* The files and the session in the chunk get hashed in lockstep */
+    iso_md5_compute_multi(lane->md5_ctx, lane->md5_data, lane->md5_len, n);
+
+    for (i = 0; i < nfinished; i++) {
+        entry = vf->entries + lane->finished[i]->entry;
+        entry->segs_done++;
+        if (entry->segs_done >= entry->nsegs)
+            iso_md5_verify_conclude(vf, entry);
+    }
+}
+
+static
+void *iso_md5_verify_lane_thread(void *arg)
+{
+    struct iso_md5_verify_lane *lane = arg;
+    struct iso_md5_verify *vf = lane->vf;
+    struct iso_md5_verify_slot *slot;
+    uint64_t seq = 1;
+
+    pthread_mutex_lock(&vf->mutex);
+    while (1) {
+        slot = &(vf->slots[(seq - 1) % ISO_MD5_VERIFY_SLOTS]);
+        if (vf->abort)
+    break;
+        if (slot->seq != seq) {
+            if (vf->end)
+    break;
+            pthread_cond_wait(&vf->cond, &vf->mutex);
+    continue;
+        }
+        pthread_mutex_unlock(&vf->mutex);
+
+        iso_md5_verify_lane_chunk(lane, slot);
+
+        pthread_mutex_lock(&vf->mutex);
+        slot->pending--;
+        seq++;
+        pthread_cond_broadcast(&vf->cond);
+    }
+    pthread_mutex_unlock(&vf->mutex);
+    return NULL;
+}
+
+/* Read count blocks from lba into slot. Unreadable blocks get marked. */
+static
+void iso_md5_verify_read(struct iso_md5_verify *vf,
+                         struct iso_md5_verify_slot *slot,
+                         uint32_t lba, uint32_t count)
+{
+    uint32_t i;
+    int ret;
+
+    slot->lba = lba;
+    slot->count = count;
+    memset(slot->bad, 0, count);
+    ret = iso_data_source_read_blocks(vf->src, lba, count, slot->data);
+    if (ret >= 0)
+        return;
+    /* Find out which blocks are unreadable */
+    for (i = 0; i < count; i++) {
+        ret = vf->src->read_block(vf->src, lba + i,
+                                  slot->data + i * BLOCK_SIZE);
+        if (ret < 0) {
+            memset(slot->data + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            slot->bad[i] = 1;
+        }
+    }
+}
+
+/* Check an entry whose extents are not in ascending order by reading them
+   one after the other. Such files are rare.
+*/
+static
+void iso_md5_verify_direct(struct iso_md5_verify *vf,
+                           struct iso_md5_verify_entry *entry)
+{
+    struct iso_md5_verify_slot *slot = &(vf->slots[0]);
+    struct iso_md5_verify_seg *seg;
+    uint32_t lba, count;
+    int i;
+
+    for (i = 0; i < entry->nsegs && !entry->bad; i++) {
+        seg = vf->segs + entry->first_seg + i;
+        for (lba = seg->lba; lba < seg->lba + seg->nblocks; lba += count) {
+            count = seg->lba + seg->nblocks - lba;
+            if (count > ISO_MD5_VERIFY_CHUNK_BLOCKS)
+                count = ISO_MD5_VERIFY_CHUNK_BLOCKS;
+            iso_md5_verify_read(vf, slot, lba, count);
+            iso_md5_verify_feed(vf, seg, slot);
+        }
+    }
+    iso_md5_verify_conclude(vf, entry);
+}
+
+static
+void iso_md5_verify_destroy(struct iso_md5_verify *vf)
+{
+    size_t i;
+    int j;
+
+    for (i = 0; i < vf->nentries; i++) {
+        if (vf->entries[i].ctx != NULL)
+            iso_md5_end(&(vf->entries[i].ctx), vf->entries[i].md5);
+        if (vf->entries[i].file != NULL)
+            iso_node_unref((IsoNode *) vf->entries[i].file);
+    }
+    if (vf->lanes != NULL) {
+        for (j = 0; j < vf->nlanes; j++) {
+            LIBISO_FREE_MEM(vf->lanes[j].segs);
+            LIBISO_FREE_MEM(vf->lanes[j].active);
+            LIBISO_FREE_MEM(vf->lanes[j].finished);
+            LIBISO_FREE_MEM(vf->lanes[j].md5_ctx);
+            LIBISO_FREE_MEM(vf->lanes[j].md5_data);
+            LIBISO_FREE_MEM(vf->lanes[j].md5_len);
+        }
+    }
+    for (j = 0; j < ISO_MD5_VERIFY_SLOTS; j++) {
+        LIBISO_FREE_MEM(vf->slots[j].data);
+        LIBISO_FREE_MEM(vf->slots[j].bad);
+    }
+    LIBISO_FREE_MEM(vf->lanes);
+    LIBISO_FREE_MEM(vf->sorted);
+    LIBISO_FREE_MEM(vf->segs);
+    LIBISO_FREE_MEM(vf->entries);
+    pthread_cond_destroy(&vf->cond);
+    pthread_mutex_destroy(&vf->mutex);
+    free(vf);
+}
+
+/* Report the entries which are complete, in the sequence of order.
+   Then report the progress.
+*/
+static
+int iso_md5_verify_report(struct iso_md5_verify *vf,
+                          struct iso_md5_verify_entry **order,
+                          size_t *reported,
+                          int (*report)(void *handle, int event, IsoFile *file,
+                                        off_t done_bytes, off_t total_bytes),
+                          void *handle, int flag, off_t done, off_t total)
+{
+    struct iso_md5_verify_entry *entry;
+    size_t ready;
+    int event, ret;
+
+    pthread_mutex_lock(&vf->mutex);
+    for (ready = *reported; ready < vf->nentries; ready++)
+        if (order[ready]->result == 0)
+    break;
+    pthread_mutex_unlock(&vf->mutex);
+
+    for (; *reported < ready; (*reported)++) {
+        entry = order[*reported];
+        if (entry->file == NULL)
+            event = entry->result == 1 ? 4 : entry->result == 2 ? 5 : 6;
+        else
+            event = entry->result;
+        if (report == NULL || (event == 1 && !(flag & 1)))
+    continue;
+        ret = report(handle, event, entry->file, done, total);
+        if (ret < 0)
+            return ISO_CANCELED;
+    }
+    if (report != NULL) {
+        ret = report(handle, 0, NULL, done, total);
+        if (ret < 0)
+            return ISO_CANCELED;
+    }
+    return ISO_SUCCESS;
+}
+
+/* Find the next run of blocks which get read in one piece */
+static
+void iso_md5_verify_next_run(struct iso_md5_verify *vf, size_t *idx,
+                             uint32_t *run_start, uint32_t *run_end)
+{
+    struct iso_md5_verify_seg *seg;
+    size_t i;
+
+    i = *idx;
+    seg = vf->sorted[i];
+    *run_start = seg->lba;
+    *run_end = seg->lba + seg->nblocks;
+    for (i++; i < vf->nsorted; i++) {
+        seg = vf->sorted[i];
+        if (((uint64_t) seg->lba) >
+            ((uint64_t) *run_end) + ISO_MD5_VERIFY_GAP_BLOCKS)
+    break;
+        if (seg->lba + seg->nblocks > *run_end)
+            *run_end = seg->lba + seg->nblocks;
+    }
+    *idx = i;
+}
+
+
+/* API */
+int iso_image_verify_md5(IsoImage *image, IsoDataSource *src, int num_threads,
+                         int (*report)(void *handle, int event, IsoFile *file,
+                                       off_t done_bytes, off_t total_bytes),
+                         void *handle, int flag)
+{
+    struct iso_md5_verify *vf = NULL;
+    struct iso_md5_verify_entry *entry, **order = NULL;
+    struct iso_md5_verify_seg *seg;
+    struct iso_md5_verify_lane *lane;
+    struct iso_md5_verify_slot *slot;
+    struct iso_file_section session;
+    uint32_t start_lba, end_lba, run_start, run_end, lba, count;
+    uint64_t seq = 0;
+    off_t done = 0, total = 0;
+    size_t i, k, reported = 0;
+    int ret, j, best, src_open = 0;
+    char md5[16];
+
+    if (image == NULL)
+        return ISO_NULL_POINTER;
+    if (src == NULL)
+        src = image->import_src;
+    if (src == NULL)
+        return ISO_NULL_POINTER;
+    if (num_threads < 0 || num_threads > ISO_MAX_INGEST_THREADS)
+        return ISO_WRONG_ARG_VALUE;
+
+    /* The whole tree is needed */
+    ret = iso_image_load_lazy_dirs(image, 0);
+    if (ret < 0)
+        return ret;
+
+    LIBISO_ALLOC_MEM(vf, struct iso_md5_verify, 1);
+    memset(vf, 0, sizeof(struct iso_md5_verify));
+    vf->src = src;
+    pthread_mutex_init(&vf->mutex, NULL);
+    pthread_cond_init(&vf->cond, NULL);
+
+    ret = iso_md5_verify_collect(vf, image, (IsoNode *) image->root);
+    if (ret < 0)
+        goto ex;
+    ret = iso_image_get_session_md5(image, &start_lba, &end_lba, md5, 0);
+    if (ret < 0)
+        goto ex;
+    if (ret > 0 && end_lba > start_lba) {
+        session.block = start_lba;
+        session.size = ((off_t) (end_lba - start_lba)) * BLOCK_SIZE;
+        ret = iso_md5_verify_add(vf, NULL, md5, 1, &session);
+        if (ret < 0)
+            goto ex;
+    }
+    if (vf->nentries == 0) {
+        ret = 2;
+        goto ex;
+    }
+
+    for (j = 0; j < ISO_MD5_VERIFY_SLOTS; j++) {
+        LIBISO_ALLOC_MEM(vf->slots[j].data, uint8_t,
+                         ISO_MD5_VERIFY_CHUNK_BLOCKS * BLOCK_SIZE);
+        LIBISO_ALLOC_MEM(vf->slots[j].bad, uint8_t,
+                         ISO_MD5_VERIFY_CHUNK_BLOCKS);
+    }
+    ret = src->open(src);
+    if (ret < 0)
+        goto ex;
+    src_open = 1;
+
+    /* Files without data and those with unusual extent layout get done
+       now. The others get assigned to the lane with the least load so far.
+    */
+    vf->nlanes = num_threads > 0 ? num_threads : 1;
+    LIBISO_ALLOC_MEM(vf->lanes, struct iso_md5_verify_lane, vf->nlanes);
+    memset(vf->lanes, 0, vf->nlanes * sizeof(struct iso_md5_verify_lane));
+    for (i = 0; i < vf->nentries; i++) {
+        entry = vf->entries + i;
+        entry->lane = -1;
+        if (entry->nsegs == 0 || entry->bad) {
+            iso_md5_verify_conclude(vf, entry);
+        } else if (!iso_md5_verify_is_ascending(vf, entry)) {
+            iso_md5_verify_direct(vf, entry);
+        } else {
+            best = 0;
+            for (j = 1; j < vf->nlanes; j++)
+                if (vf->lanes[j].load < vf->lanes[best].load)
+                    best = j;
+            entry->lane = best;
+            for (k = 0; k < (size_t) entry->nsegs; k++)
+                vf->lanes[best].load += vf->segs[entry->first_seg + k].size;
+            vf->lanes[best].nsegs += entry->nsegs;
+        }
+    }
+
+    /* Sort the extents which are to be read and distribute them to their
+       lanes */
+    LIBISO_ALLOC_MEM(vf->sorted, struct iso_md5_verify_seg *, vf->nsegs + 1);
+    for (i = 0; i < vf->nsegs; i++)
+        if (vf->entries[vf->segs[i].entry].lane >= 0)
+            vf->sorted[vf->nsorted++] = vf->segs + i;
+    qsort(vf->sorted, vf->nsorted, sizeof(struct iso_md5_verify_seg *),
+          iso_md5_verify_cmp_seg);
+    for (j = 0; j < vf->nlanes; j++) {
+        lane = vf->lanes + j;
+        lane->vf = vf;
+        LIBISO_ALLOC_MEM(lane->segs, struct iso_md5_verify_seg *,
+                         lane->nsegs + 1);
+        LIBISO_ALLOC_MEM(lane->active, struct iso_md5_verify_seg *,
+                         lane->nsegs + 1);
+        LIBISO_ALLOC_MEM(lane->finished, struct iso_md5_verify_seg *,
+                         lane->nsegs + 1);
+        LIBISO_ALLOC_MEM(lane->md5_ctx, void *, lane->nsegs + 1);
+        LIBISO_ALLOC_MEM(lane->md5_data, char *, lane->nsegs + 1);
+        LIBISO_ALLOC_MEM(lane->md5_len, int, lane->nsegs + 1);
+        lane->nsegs = 0;
+    }
+    for (i = 0; i < vf->nsorted; i++) {
+        seg = vf->sorted[i];
+        lane = vf->lanes + vf->entries[seg->entry].lane;
+        lane->segs[lane->nsegs++] = seg;
+    }
+
+    /* Report the data files in the sequence of their first extents,
+       the files without data and the session at the end
+    */
+    LIBISO_ALLOC_MEM(order, struct iso_md5_verify_entry *, vf->nentries);
+    k = 0;
+    for (i = 0; i < vf->nsorted; i++) {
+        seg = vf->sorted[i];
+        entry = vf->entries + seg->entry;
+        if (seg == vf->segs + entry->first_seg && entry->file != NULL)
+            order[k++] = entry;
+    }
+    for (i = 0; i < vf->nentries; i++) {
+        entry = vf->entries + i;
+        if (entry->lane < 0 && entry->file != NULL)
+            order[k++] = entry;
+    }
+    for (i = 0; i < vf->nentries; i++)
+        if (vf->entries[i].file == NULL)
+            order[k++] = vf->entries + i;
+
+    /* Determine the amount of data to read */
+    for (i = 0; i < vf->nsorted; ) {
+        iso_md5_verify_next_run(vf, &i, &run_start, &run_end);
+        total += ((off_t) (run_end - run_start)) * BLOCK_SIZE;
+    }
+
+    if (num_threads > 0) {
+        for (j = 0; j < vf->nlanes; j++) {
+            ret = pthread_create(&(vf->lanes[j].thread), NULL,
+                                 iso_md5_verify_lane_thread, vf->lanes + j);
+            if (ret != 0) {
+                ret = ISO_THREAD_ERROR;
+                goto ex;
+            }
+            vf->lanes[j].thread_running = 1;
+        }
+    }
+
+    /* Read the runs of blocks and hand them over to the lanes */
+    for (i = 0; i < vf->nsorted; ) {
+        iso_md5_verify_next_run(vf, &i, &run_start, &run_end);
+        for (lba = run_start; lba < run_end; lba += count) {
+            count = run_end - lba;
+            if (count > ISO_MD5_VERIFY_CHUNK_BLOCKS)
+                count = ISO_MD5_VERIFY_CHUNK_BLOCKS;
+            slot = &(vf->slots[seq % ISO_MD5_VERIFY_SLOTS]);
+            seq++;
+            if (num_threads > 0) {
+                pthread_mutex_lock(&vf->mutex);
+                while (slot->pending > 0)
+                    pthread_cond_wait(&vf->cond, &vf->mutex);
+                pthread_mutex_unlock(&vf->mutex);
+            }
+            iso_md5_verify_read(vf, slot, lba, count);
+            if (num_threads > 0) {
+                pthread_mutex_lock(&vf->mutex);
+                slot->seq = seq;
+                slot->pending = vf->nlanes;
+                pthread_cond_broadcast(&vf->cond);
+                pthread_mutex_unlock(&vf->mutex);
+            } else {
+                slot->seq = seq;
+                iso_md5_verify_lane_chunk(vf->lanes, slot);
+            }
+            done += ((off_t) count) * BLOCK_SIZE;
+            ret = iso_md5_verify_report(vf, order, &reported, report, handle,
+                                        flag, done, total);
+            if (ret < 0)
+                goto ex;
+        }
+    }
+
+    /* Wait for the lanes to finish */
+    pthread_mutex_lock(&vf->mutex);
+    vf->end = 1;
+    pthread_cond_broadcast(&vf->cond);
+    pthread_mutex_unlock(&vf->mutex);
+    for (j = 0; j < vf->nlanes; j++) {
+        if (vf->lanes[j].thread_running)
+            pthread_join(vf->lanes[j].thread, NULL);
+        vf->lanes[j].thread_running = 0;
+    }
+    ret = iso_md5_verify_report(vf, order, &reported, report, handle, flag,
+                                done, total);
+    if (ret < 0)
+        goto ex;
+
+    ret = 1;
+    for (i = 0; i < vf->nentries; i++)
+        if (vf->entries[i].result != 1)
+            ret = 0;
+ex:;
+    if (vf != NULL && vf->lanes != NULL) {
+        pthread_mutex_lock(&vf->mutex);
+        vf->abort = 1;
+        pthread_cond_broadcast(&vf->cond);
+        pthread_mutex_unlock(&vf->mutex);
+        for (j = 0; j < vf->nlanes; j++)
+            if (vf->lanes[j].thread_running)
+                pthread_join(vf->lanes[j].thread, NULL);
+    }
+    LIBISO_FREE_MEM(order);
+    if (src_open)
+        src->close(src);
+    if (vf != NULL)
+        iso_md5_verify_destroy(vf);
+    return ret;
+}
@@ -14,6 +14,26 @@
 /* The MD5 computation API is in libisofs.h : iso_md5_start() et.al. */
 
 
+/* Add data[k] to the MD5 context ctx[k] for k = 0 to count - 1.
+   Independent contexts get hashed in lockstep by SIMD lanes if the CPU
+   offers them. A context may occur more than once in ctx[].
+*/
+int iso_md5_compute_multi(void *ctx[], char *data[], int datalen[],
+                          int count);
+
+/* The number of contexts which iso_md5_compute_multi() hashes in lockstep
+   at most. 1 means that there is no multi-buffer engine.
+*/
+int iso_md5_multi_lanes(void);
+
+/* Force the engine of iso_md5_compute_multi():
+   0= the one which suits the CPU, 1= scalar, 2= SSE2, 3= AVX2.
+   Meant for tests. Do not call it while hashing is going on.
+   @return 1 success, < 0 the CPU cannot run the engine
+*/
+int iso_md5_multi_set_engine(int engine);
+
+
 /** Create a writer object for checksums and add it to the writer list of
     the given Ecma119Image.
 */
@@ -36,6 +56,30 @@ int checksum_writer_create(Ecma119Image *target);
 int iso_md5_write_tag(Ecma119Image *t, int flag);
 
 
+/* Side thread which computes the session checksum and the checksums of
+   data files while the writer thread goes on with producing image data.
+   iso_md5_pipe_feed() and iso_md5_pipe_feed_ctx() copy the data and return
+   quickly unless all slots are waiting for computation. iso_md5_pipe_sync()
+   waits until all fed data are added to their contexts and all results of
+   iso_md5_pipe_end_ctx() are stored. Only then the session context may be
+   used otherwise.
+*/
+struct iso_md5_pipe;
+
+int iso_md5_pipe_new(void *md5_context, struct iso_md5_pipe **pipe_pt);
+
+int iso_md5_pipe_feed(struct iso_md5_pipe *md5p, char *data, size_t count);
+
+int iso_md5_pipe_feed_ctx(struct iso_md5_pipe *md5p, void *ctx,
+                          char *data, size_t count);
+
+int iso_md5_pipe_end_ctx(struct iso_md5_pipe *md5p, void *ctx, char *result);
+
+int iso_md5_pipe_sync(struct iso_md5_pipe *md5p);
+
+int iso_md5_pipe_destroy(struct iso_md5_pipe **pipe_pt);
+
+
 #endif /* ! LIBISO_MD5_H_ */
 
 
@@ -234,6 +234,7 @@ void iso_finish()
     libiso_msgs_destroy(&libiso_msgr, 0);
     iso_node_xinfo_dispose_cloners(0);
     iso_stream_destroy_cmpranks(0);
+    iso_node_dispose_pools(0);
 }
 
 int iso_set_abort_severity(char *severity)
@@ -255,6 +256,11 @@ void iso_msg_debug(int imgid, const char *fmt, ...)
     char *msg = NULL;
     va_list ap;
 
+    /* Most callers run in loops. Do not format what nobody will see. */
+    if (libiso_msgr == NULL ||
+        !libiso_msgs_is_wanted(libiso_msgr, LIBISO_MSGS_SEV_DEBUG, 0))
+        return;
+
     LIBISO_ALLOC_MEM_VOID(msg, char, MAX_MSG_LEN);
     va_start(ap, fmt);
     vsnprintf(msg, MAX_MSG_LEN, fmt, ap);
@@ -27,6 +27,7 @@
 #include <time.h>
 #include <limits.h>
 #include <stdio.h>
+#include <pthread.h>
 
 
 struct dir_iter_data
@@ -40,6 +41,345 @@ struct dir_iter_data
     int flag;
 };
 
+
+/*
+ * Search index of large directories.
+ *
+ * The sorted list of children stays the authoritative storage. The index is
+ * a skip list whose entries refer to about a quarter of the children. Level 0
+ * of the index is the next lower level above that list, each further level
+ * holds again a quarter of the entries of the level below.
+ * A lookup descends the levels and ends with a short walk along the list of
+ * children. So it needs O(log n) comparisons instead of O(n).
+ */
+
+struct iso_dir_skip
+{
+    IsoNode *node;
+
+    /* Successors on levels 0 to nlevels - 1. Allocated after the struct. */
+    struct iso_dir_skip **next;
+};
+
+struct iso_dir_index
+{
+    /* Number of levels in use */
+    int nlevels;
+
+    /* Random number state for choosing the level of new entries */
+    uint32_t seed;
+
+    struct iso_dir_skip *head[ISO_DIR_INDEX_LEVELS];
+};
+
+/* @return number of index levels on which the next new node shall appear */
+static
+int iso_dir_index_level(struct iso_dir_index *index)
+{
+    int level = 0;
+    uint32_t r;
+
+    index->seed = index->seed * 1103515245 + 12345;
+    r = index->seed >> 2;
+    while (level < ISO_DIR_INDEX_LEVELS && (r & 3) == 0) {
+        level++;
+        r >>= 2;
+    }
+    return level;
+}
+
+static
+struct iso_dir_skip *iso_dir_skip_new(IsoNode *node, int level)
+{
+    struct iso_dir_skip *entry;
+
+    entry = malloc(sizeof(struct iso_dir_skip) +
+                   level * sizeof(struct iso_dir_skip *));
+    if (entry == NULL)
+        return NULL;
+    entry->node = node;
+    entry->next = (struct iso_dir_skip **) (entry + 1);
+    return entry;
+}
+
+static
+void iso_dir_index_free(struct iso_dir_index *index)
+{
+    struct iso_dir_skip *entry, *next;
+
+    if (index == NULL)
+        return;
+    for (entry = index->head[0]; entry != NULL; entry = next) {
+        next = entry->next[0];
+        free(entry);
+    }
+    free(index);
+}
+
+/**
+ * Create the index of a directory from its list of children.
+ * On lack of memory the directory simply stays without index.
+ */
+static
+void iso_dir_index_create(IsoDir *dir)
+{
+    struct iso_dir_index *index;
+    struct iso_dir_skip *entry, **tail[ISO_DIR_INDEX_LEVELS];
+    IsoNode *pos;
+    int i, level;
+
+    index = calloc(1, sizeof(struct iso_dir_index));
+    if (index == NULL)
+        return;
+    index->seed = 1;
+    for (i = 0; i < ISO_DIR_INDEX_LEVELS; i++)
+        tail[i] = &(index->head[i]);
+    for (pos = dir->children; pos != NULL; pos = pos->next) {
+        level = iso_dir_index_level(index);
+        if (level == 0)
+    continue;
+        entry = iso_dir_skip_new(pos, level);
+        if (entry == NULL) {
+            iso_dir_index_free(index);
+            return;
+        }
+        for (i = 0; i < level; i++) {
+            entry->next[i] = NULL;
+            *(tail[i]) = entry;
+            tail[i] = &(entry->next[i]);
+        }
+        if (level > index->nlevels)
+            index->nlevels = level;
+    }
+    dir->index = index;
+}
+
+/**
+ * Find the last index entry with a name smaller than the given name.
+ *
+ * @param links
+ *     If not NULL: Array of ISO_DIR_INDEX_LEVELS elements. Gets the
+ *     addresses of the links which point to the first entry with a name
+ *     not smaller than the given name, for all levels in use.
+ * @return
+ *     The found entry or NULL if there is no such entry.
+ */
+static
+struct iso_dir_skip *iso_dir_index_seek(struct iso_dir_index *index,
+                                        const char *name,
+                                        struct iso_dir_skip ***links)
+{
+    struct iso_dir_skip *prev = NULL, **link;
+    int i;
+
+    for (i = index->nlevels - 1; i >= 0; i--) {
+        link = (prev == NULL) ? &(index->head[i]) : &(prev->next[i]);
+        while (*link != NULL && strcmp((*link)->node->name, name) < 0) {
+            prev = *link;
+            link = &(prev->next[i]);
+        }
+        if (links != NULL)
+            links[i] = link;
+    }
+    return prev;
+}
+
+/* Register a node which was just inserted into the list of children */
+static
+void iso_dir_index_add(IsoDir *dir, IsoNode *node)
+{
+    struct iso_dir_index *index;
+    struct iso_dir_skip *entry, **links[ISO_DIR_INDEX_LEVELS];
+    int i, level;
+
+    index = dir->index;
+    level = iso_dir_index_level(index);
+    if (level == 0)
+        return;
+    entry = iso_dir_skip_new(node, level);
+    if (entry == NULL) {
+        /* Better no index than an incomplete one */
+        iso_dir_index_free(index);
+        dir->index = NULL;
+        return;
+    }
+    iso_dir_index_seek(index, node->name, links);
+    for (i = index->nlevels; i < level; i++)
+        links[i] = &(index->head[i]);
+    if (level > index->nlevels)
+        index->nlevels = level;
+    for (i = 0; i < level; i++) {
+        entry->next[i] = *(links[i]);
+        *(links[i]) = entry;
+    }
+}
+
+/* Unregister a node which is about to be removed from the list of children,
+   or replace it by new_node if that is not NULL. Both have the same name.
+*/
+static
+void iso_dir_index_remove(IsoDir *dir, IsoNode *node, IsoNode *new_node)
+{
+    struct iso_dir_index *index;
+    struct iso_dir_skip *entry, **links[ISO_DIR_INDEX_LEVELS];
+    int i;
+
+    index = dir->index;
+    iso_dir_index_seek(index, node->name, links);
+    if (index->nlevels <= 0)
+        return;
+    entry = *(links[0]);
+    if (entry == NULL || entry->node != node)
+        return; /* node has no entry */
+    if (new_node != NULL) {
+        entry->node = new_node;
+        return;
+    }
+    for (i = 0; i < index->nlevels; i++) {
+        if (*(links[i]) != entry)
+    break;
+        *(links[i]) = entry->next[i];
+    }
+    free(entry);
+    while (index->nlevels > 0 && index->head[index->nlevels - 1] == NULL)
+        index->nlevels--;
+}
+
+/*
+ * Pools of names and AAIP strings which are shared among nodes in compact
+ * mode. See iso_image_set_node_compaction().
+ * The pools get created with the first compacted node and are shared by all
+ * images. IsoNode.pooled tells which strings of a node are from the pools.
+ * Other strings get freed as usual, without looking into the pools.
+ * A pool stays alive as long as it holds strings or iso_node_compact() is
+ * busy with putting a string into it.
+ */
+static struct iso_intern_pool *iso_node_name_pool = NULL;
+static struct iso_intern_pool *iso_node_aa_pool = NULL;
+static int iso_node_pool_busy = 0;
+static pthread_mutex_t iso_node_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* @param flag bit0= create the pool if it does not exist yet and register
+                     a user, who has to call iso_node_pool_done()
+*/
+static
+struct iso_intern_pool *iso_node_get_pool(struct iso_intern_pool **pool,
+                                          int flag)
+{
+    struct iso_intern_pool *ret;
+
+    pthread_mutex_lock(&iso_node_pool_mutex);
+    if (*pool == NULL && (flag & 1))
+        iso_intern_pool_new(pool, 0);
+    ret = *pool;
+    if (ret != NULL && (flag & 1))
+        iso_node_pool_busy++;
+    pthread_mutex_unlock(&iso_node_pool_mutex);
+    return ret;
+}
+
+static
+void iso_node_pool_done()
+{
+    pthread_mutex_lock(&iso_node_pool_mutex);
+    iso_node_pool_busy--;
+    pthread_mutex_unlock(&iso_node_pool_mutex);
+}
+
+void iso_node_free_name(IsoNode *node)
+{
+    struct iso_intern_pool *pool;
+
+    if (node->name == NULL)
+        return;
+    if (node->pooled & 1) {
+        /* The pool cannot vanish as long as it holds this name */
+        pool = iso_node_get_pool(&iso_node_name_pool, 0);
+        if (pool != NULL)
+            iso_intern_pool_release(pool, node->name,
+                                    strlen(node->name) + 1, 0);
+        node->pooled &= ~1;
+    } else {
+        free(node->name);
+    }
+    node->name = NULL;
+}
+
+/* Dispose the data of an extended info item of the node.
+   An AAIP string may be shared.
+*/
+static
+void iso_node_dispose_xinfo_data(IsoNode *node, IsoExtendedInfo *info)
+{
+    struct iso_intern_pool *pool;
+
+    if (info->process == aaip_xinfo_func && (node->pooled & 2)) {
+        node->pooled &= ~2;
+        if (info->data == NULL)
+            return;
+        pool = iso_node_get_pool(&iso_node_aa_pool, 0);
+        if (pool != NULL)
+            iso_intern_pool_release(pool, info->data,
+                      aaip_count_bytes((unsigned char *) info->data, 0), 0);
+        return;
+    }
+    info->process(info->data, 1);
+}
+
+int iso_node_compact(IsoNode *node, int flag)
+{
+    IsoExtendedInfo *info;
+    struct iso_intern_pool *pool;
+    void *shared;
+
+    if ((flag & 1) && node->name != NULL && !(node->pooled & 1)) {
+        pool = iso_node_get_pool(&iso_node_name_pool, 1);
+        if (pool == NULL)
+            return ISO_OUT_OF_MEM;
+        shared = iso_intern_pool_get(pool, node->name,
+                                     strlen(node->name) + 1);
+        iso_node_pool_done();
+        if (shared == NULL)
+            return ISO_OUT_OF_MEM;
+        free(node->name);
+        node->name = shared;
+        node->pooled |= 1;
+    }
+    if ((flag & 2) && !(node->pooled & 2)) {
+        for (info = node->xinfo; info != NULL; info = info->next)
+            if (info->process == aaip_xinfo_func)
+        break;
+        if (info == NULL || info->data == NULL)
+            return ISO_SUCCESS;
+        pool = iso_node_get_pool(&iso_node_aa_pool, 1);
+        if (pool == NULL)
+            return ISO_OUT_OF_MEM;
+        shared = iso_intern_pool_get(pool, info->data,
+                             aaip_count_bytes((unsigned char *) info->data, 0));
+        iso_node_pool_done();
+        if (shared == NULL)
+            return ISO_OUT_OF_MEM;
+        free(info->data);
+        info->data = shared;
+        node->pooled |= 2;
+    }
+    return ISO_SUCCESS;
+}
+
+void iso_node_dispose_pools(int flag)
+{
+    pthread_mutex_lock(&iso_node_pool_mutex);
+    if (iso_node_pool_busy == 0) {
+        if (iso_node_name_pool != NULL)
+            if (iso_intern_pool_count(iso_node_name_pool) == 0)
+                iso_intern_pool_destroy(&iso_node_name_pool);
+        if (iso_node_aa_pool != NULL)
+            if (iso_intern_pool_count(iso_node_aa_pool) == 0)
+                iso_intern_pool_destroy(&iso_node_aa_pool);
+    }
+    pthread_mutex_unlock(&iso_node_pool_mutex);
+}
+
 /**
  * Increments the reference counting of the given node.
  */
@@ -68,6 +408,9 @@ void iso_node_unref(IsoNode *node)
                     iso_node_unref(child);
                     child = tmp;
                 }
+                iso_dir_index_free(((IsoDir*)node)->index);
+                if (((IsoDir*)node)->lazy != NULL)
+                    iso_dir_lazy_free(((IsoDir*)node)->lazy);
             }
             break;
         case LIBISO_FILE:
@@ -100,12 +443,12 @@ void iso_node_unref(IsoNode *node)
                 IsoExtendedInfo *tmp = info->next;
 
                 /* free extended info */
-                info->process(info->data, 1);
+                iso_node_dispose_xinfo_data(node, info);
                 free(info);
                 info = tmp;
             }
         }
-        free(node->name);
+        iso_node_free_name(node);
         free(node);
     }
 }
@@ -182,7 +525,7 @@ int iso_node_remove_xinfo(IsoNode *node, iso_node_xinfo_func proc)
     while (pos != NULL) {
         if (pos->process == proc) {
             /* this is the extended info we want to remove */
-            pos->process(pos->data, 1);
+            iso_node_dispose_xinfo_data(node, pos);
 
             if (prev != NULL) {
                 prev->next = pos->next;
@@ -261,7 +604,7 @@ int iso_node_remove_all_xinfo(IsoNode *node, int flag)
 
     for (pos = node->xinfo; pos != NULL; pos = next) {
         next = pos->next;
-        pos->process(pos->data, 1);
+        iso_node_dispose_xinfo_data(node, pos);
         free((char *) pos);
     }
     node->xinfo = NULL;
@@ -295,6 +638,25 @@ int iso_node_clone_xinfo(IsoNode *from_node, IsoNode *to_node, int flag)
         ret = iso_node_get_next_xinfo(from_node, &handle, &proc, &data);
         if (ret <= 0)
     break;
+        if (proc == aaip_xinfo_func && (from_node->pooled & 2) &&
+            data != NULL) {
+            /* Share the pooled AAIP string. The pool cannot vanish as long
+               as from_node holds a reference. */
+            iso_intern_pool_release(iso_node_get_pool(&iso_node_aa_pool, 0),
+                                    data,
+                                    aaip_count_bytes((unsigned char *) data, 0),
+                                    1);
+            ret = iso_node_add_xinfo(to_node, proc, data);
+            if (ret < 0) {
+                iso_intern_pool_release(iso_node_get_pool(&iso_node_aa_pool,
+                                                          0),
+                              data, aaip_count_bytes((unsigned char *) data, 0),
+                              0);
+    break;
+            }
+            to_node->pooled |= 2;
+    continue;
+        }
         ret = iso_node_xinfo_get_cloner(proc, &cloner, 0);
         if (ret == 0)
             return ISO_XINFO_NO_CLONE;
@@ -372,19 +734,22 @@ int iso_node_set_name_trunc(IsoNode *node, const char *in_name,
         ret = ISO_OUT_OF_MEM;
         goto ex;
     }
-    free(node->name);
-    node->name = new;
     if (node->parent != NULL) {
         IsoDir *parent;
         int res;
         /* take and add again to ensure correct children order */
         parent = node->parent;
         iso_node_take(node);
+        iso_node_free_name(node);
+        node->name = new;
         res = iso_dir_add_node(parent, node, 0);
         if (res < 0) {
             ret = res;
             goto ex;
         }
+    } else {
+        iso_node_free_name(node);
+        node->name = new;
     }
     ret = ISO_SUCCESS;
 ex:
@@ -591,6 +956,7 @@ int iso_node_get_hidden(IsoNode *node)
 int iso_dir_add_node(IsoDir *dir, IsoNode *child,
                      enum iso_replace_mode replace)
 {
+    int ret;
     IsoNode **pos;
 
     if (dir == NULL || child == NULL) {
@@ -608,7 +974,9 @@ int iso_dir_add_node(IsoDir *dir, IsoNode *child,
         return ISO_NODE_ALREADY_ADDED;
     }
 
-    iso_dir_find(dir, child->name, &pos);
+    ret = iso_dir_find(dir, child->name, &pos);
+    if (ret < 0)
+        return ret;
     return iso_dir_insert(dir, child, pos, replace);
 }
 
@@ -638,6 +1006,8 @@ int iso_dir_get_node(IsoDir *dir, const char *name, IsoNode **node)
     }
 
     ret = iso_dir_exists(dir, name, &pos);
+    if (ret < 0)
+        return ret;
     if (ret == 0) {
         if (node) {
             *node = NULL;
@@ -698,9 +1068,14 @@ int iso_image_dir_get_node(IsoImage *image, IsoDir *dir,
  */
 int iso_dir_get_children_count(IsoDir *dir)
 {
+    int ret;
+
     if (dir == NULL) {
         return ISO_NULL_POINTER;
     }
+    ret = iso_dir_load_lazy(dir, 0);
+    if (ret < 0)
+        return ret;
     return dir->nchildren;
 }
 
@@ -791,6 +1166,12 @@ void iter_free(IsoDirIter *iter)
 static IsoNode** iso_dir_find_node(IsoDir *dir, IsoNode *node)
 {
     IsoNode **pos;
+
+    /* An indexed directory is loaded. So iso_dir_find() cannot fail. */
+    if (dir->index != NULL && iso_dir_find(dir, node->name, &pos) >= 0) {
+        if (*pos == node)
+            return pos;
+    }
     pos = &(dir->children);
     while (*pos != NULL && *pos != node) {
         pos = &((*pos)->next);
@@ -828,8 +1209,12 @@ int iso_node_take(IsoNode *node)
         return ISO_ASSERT_FAILURE;
     }
 
+    if (dir->index != NULL)
+        iso_dir_index_remove(dir, node, NULL);
+
     /* notify iterators just before remove */
     iso_notify_dir_iters(node, 0);
+    iso_dir_count_change(dir);
 
     *pos = node->next;
     node->parent = NULL;
@@ -963,14 +1348,19 @@ void iter_notify_child_taken(IsoDirIter *iter, IsoNode *node)
     data = iter->data;
 
     if (data->pos == node) {
+        /* Another iterator may already have unlinked node. Then the walk
+           stops at the successor of node. */
         pos = iter->dir->children;
         pre = NULL;
-        while (pos != NULL && pos != data->pos) {
+        while (pos != NULL && pos != node && pos != node->next) {
             pre = pos;
             pos = pos->next;
         }
-        if (pos == NULL || pos != data->pos) {
-            return;
+        if (pos == node) {
+            if (pre == NULL)
+                iter->dir->children = pos->next;
+            else
+                pre->next = pos->next;
         }
 
         /* dispose iterator reference */
@@ -978,13 +1368,14 @@ void iter_notify_child_taken(IsoDirIter *iter, IsoNode *node)
 
         if (pre == NULL) {
             /* node is a first position */
-            iter->dir->children = pos->next;
             data->pos = NULL;
         } else {
-            pre->next = pos->next;
             data->pos = pre;
             iso_node_ref(pre); /* take iter ref */
         }
+
+        /* node cannot be taken through this iterator any more */
+        data->flag &= ~0x01;
     }
 }
 
@@ -1000,12 +1391,16 @@ struct iso_dir_iter_iface iter_class = {
 
 int iso_dir_get_children(const IsoDir *dir, IsoDirIter **iter)
 {
+    int ret;
     IsoDirIter *it;
     struct dir_iter_data *data;
 
     if (dir == NULL || iter == NULL) {
         return ISO_NULL_POINTER;
     }
+    ret = iso_dir_load_lazy((IsoDir *) dir, 0);
+    if (ret < 0)
+        return ret;
     it = malloc(sizeof(IsoDirIter));
     if (it == NULL) {
         return ISO_OUT_OF_MEM;
@@ -1118,16 +1513,43 @@ int iso_symlink_set_dest(IsoSymlink *link, const char *dest)
  */
 void iso_node_set_sort_weight(IsoNode *node, int w)
 {
+    int ret;
+
+    ret = iso_node_set_sort_weight_x(node, w, 0);
+    if (ret < 0)
+        iso_msg_submit(-1, ret, 0,
+                   "Cannot set sort weight in lazily imported directory tree");
+}
+
+/**
+ * Like iso_node_set_sort_weight() but returning an error if the children
+ * of a lazily imported directory cannot be loaded.
+ *
+ * @return
+ *      1 on success, < 0 on error
+ */
+int iso_node_set_sort_weight_x(IsoNode *node, int w, int flag)
+{
+    int ret;
+
     if (node->type == LIBISO_DIR) {
-        IsoNode *child = ((IsoDir*)node)->children;
+        IsoNode *child;
+
+        ret = iso_dir_load_lazy((IsoDir *) node, 0);
+        if (ret < 0)
+            return ret;
+        child = ((IsoDir*)node)->children;
         while (child) {
-            iso_node_set_sort_weight(child, w);
+            ret = iso_node_set_sort_weight_x(child, w, 0);
+            if (ret < 0)
+                return ret;
             child = child->next;
         }
     } else if (node->type == LIBISO_FILE) {
         ((IsoFile*)node)->sort_weight = w;
         ((IsoFile*)node)->explicit_weight = 1;
     }
+    return ISO_SUCCESS;
 }
 
 /**
@@ -1327,19 +1749,39 @@ int iso_node_is_valid_link_dest(const char *dest)
     return ret;
 }
 
-void iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos)
+int iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos)
 {
+    int ret;
+    struct iso_dir_skip *entry = NULL;
+
     *pos = &(dir->children);
+    if (dir->lazy != NULL) {
+        ret = iso_dir_load_lazy(dir, 0);
+        if (ret < 0)
+            return ret;
+    }
+    if (dir->index == NULL && dir->nchildren >= ISO_DIR_INDEX_MIN)
+        iso_dir_index_create(dir);
+    if (dir->index != NULL)
+        entry = iso_dir_index_seek(dir->index, name, NULL);
+    if (entry != NULL)
+        *pos = &(entry->node->next);
+    else
+        *pos = &(dir->children);
     while (**pos != NULL && strcmp((**pos)->name, name) < 0) {
         *pos = &((**pos)->next);
     }
+    return ISO_SUCCESS;
 }
 
 int iso_dir_exists(IsoDir *dir, const char *name, IsoNode ***pos)
 {
+    int ret;
     IsoNode **node;
 
-    iso_dir_find(dir, name, &node);
+    ret = iso_dir_find(dir, name, &node);
+    if (ret < 0)
+        return ret;
     if (pos) {
         *pos = node;
     }
@@ -1384,47 +1826,89 @@ int iso_dir_insert(IsoDir *dir, IsoNode *node, IsoNode **pos,
         }
 
         /* if we are reach here we have to replace */
+        if (dir->index != NULL)
+            iso_dir_index_remove(dir, *pos, node);
         node->next = (*pos)->next;
         (*pos)->parent = NULL;
         (*pos)->next = NULL;
         iso_node_unref(*pos);
         *pos = node;
         node->parent = dir;
+        iso_dir_count_change(dir);
         return dir->nchildren;
     }
 
     node->next = *pos;
     *pos = node;
     node->parent = dir;
+    if (dir->index != NULL)
+        iso_dir_index_add(dir, node);
+    iso_dir_count_change(dir);
 
     return ++dir->nchildren;
 }
 
-/* iterators are stored in a linked list */
-struct iter_reg_node {
-    IsoDirIter *iter;
-    struct iter_reg_node *next;
-};
+/* GCC and clang offer atomic builtins. Without them the number of watchers
+   gets read and changed under a mutex.
+*/
+#ifdef __ATOMIC_SEQ_CST
+#define Libisofs_watch_atomiC yes
+#else
+static pthread_mutex_t iso_dir_watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-/* list header */
-static
-struct iter_reg_node *iter_reg = NULL;
+/* The number of block indexes which need up-to-date tree_changes counters */
+static int iso_dir_watchers = 0;
+
+void iso_dir_watch_changes(int up)
+{
+#ifdef Libisofs_watch_atomiC
+    __atomic_add_fetch(&iso_dir_watchers, up ? 1 : -1, __ATOMIC_SEQ_CST);
+#else
+    pthread_mutex_lock(&iso_dir_watch_mutex);
+    iso_dir_watchers += up ? 1 : -1;
+    pthread_mutex_unlock(&iso_dir_watch_mutex);
+#endif
+}
+
+void iso_dir_count_change(IsoDir *dir)
+{
+    int watchers;
+
+#ifdef Libisofs_watch_atomiC
+    watchers = __atomic_load_n(&iso_dir_watchers, __ATOMIC_SEQ_CST);
+#else
+    pthread_mutex_lock(&iso_dir_watch_mutex);
+    watchers = iso_dir_watchers;
+    pthread_mutex_unlock(&iso_dir_watch_mutex);
+#endif
+    /* Without any block index there is no need to find the top of the tree.
+       A new index records the counter of its tree when it gets built.
+    */
+    if (watchers <= 0)
+        return;
+    while (dir->node.parent != NULL && dir->node.parent != dir)
+        dir = dir->node.parent;
+    dir->tree_changes++;
+}
 
 /**
- * Add a new iterator to the registry. The iterator register keeps track of
- * all iterators being used, and are notified when directory structure
- * changes.
+ * Add an iterator to the list of iterators of the directory iter->dir.
+ * These iterators get notified when the directory structure changes.
+ * If iter->dir gets changed, then the iterator has to be unregistered
+ * before and registered again afterwards.
  */
 int iso_dir_iter_register(IsoDirIter *iter)
 {
-    struct iter_reg_node *new;
-    new = malloc(sizeof(struct iter_reg_node));
-    if (new == NULL) {
-        return ISO_OUT_OF_MEM;
-    }
-    new->iter = iter;
-    new->next = iter_reg;
-    iter_reg = new;
+    IsoDir *dir = iter->dir;
+
+    iter->reg_dir = dir;
+    iter->reg_prev = NULL;
+    iter->reg_next = dir->iters;
+    if (dir->iters != NULL)
+        dir->iters->reg_prev = iter;
+    dir->iters = iter;
+    iter->notify_stamp = 0;
     return ISO_SUCCESS;
 }
 
@@ -1433,27 +1917,41 @@ int iso_dir_iter_register(IsoDirIter *iter)
  */
 void iso_dir_iter_unregister(IsoDirIter *iter)
 {
-    struct iter_reg_node **pos;
-    pos = &iter_reg;
-    while (*pos != NULL && (*pos)->iter != iter) {
-        pos = &(*pos)->next;
-    }
-    if (*pos) {
-        struct iter_reg_node *tmp = (*pos)->next;
-        free(*pos);
-        *pos = tmp;
-    }
+    if (iter->reg_dir == NULL)
+        return;
+    if (iter->reg_prev != NULL)
+        iter->reg_prev->reg_next = iter->reg_next;
+    else
+        iter->reg_dir->iters = iter->reg_next;
+    if (iter->reg_next != NULL)
+        iter->reg_next->reg_prev = iter->reg_prev;
+    iter->reg_dir = NULL;
+    iter->reg_prev = iter->reg_next = NULL;
 }
 
 void iso_notify_dir_iters(IsoNode *node, int flag)
 {
-    struct iter_reg_node *pos = iter_reg;
-    while (pos != NULL) {
-        IsoDirIter *iter = pos->iter;
-        if (iter->dir == node->parent) {
-            iter->class->notify_child_taken(iter, node);
-        }
-        pos = pos->next;
+    IsoDir *dir = node->parent;
+    IsoDirIter *iter;
+    unsigned int stamp;
+
+    if (dir == NULL)
+        return;
+
+    /* The notified iterators may unregister or free other iterators of
+       the directory. So the list gets searched anew after each notification,
+       skipping the iterators which were already notified.
+    */
+    stamp = ++(dir->iter_stamp);
+    if (stamp == 0)
+        stamp = ++(dir->iter_stamp);
+again:;
+    for (iter = dir->iters; iter != NULL; iter = iter->reg_next) {
+        if (iter->notify_stamp == stamp)
+    continue;
+        iter->notify_stamp = stamp;
+        iter->class->notify_child_taken(iter, node);
+        goto again;
     }
 }
 
@@ -2518,6 +3016,9 @@ int iso_node_zf_by_magic(IsoNode *node, int flag)
         return 0;
 
     dir = (IsoDir *) node;
+    ret = iso_dir_load_lazy(dir, 0);
+    if (ret < 0)
+        return ret;
     pos = dir->children;
     while (pos) {
         ret = 1;
@@ -2914,7 +3415,7 @@ int iso_root_set_isofsca(IsoNode *node, uint32_t start_lba, uint32_t end_lba,
     char buffer[5 + 5 + 5 + 2 + 81], *wpt = buffer, *valuept = buffer;
     int result_len, ret;
     static char *names = "isofs.ca";
-    static size_t value_lengths[1];
+    size_t value_lengths[1];
 
     /* Set value of isofs.ca with
        4 byte START, 4 byte END, 4 byte COUNT, SIZE = 16,  MD5 */
@@ -2985,7 +3486,7 @@ int iso_root_set_isofsnt(IsoNode *node, uint32_t truncate_mode,
     char buffer[5 + 5], *wpt = buffer, *valuept = buffer;
     int result_len, ret;
     static char *names = "isofs.nt";
-    static size_t value_lengths[1];
+    size_t value_lengths[1];
 
     iso_util_encode_len_bytes(truncate_mode, wpt, 0, &result_len, 0);
     wpt += result_len;
@@ -123,6 +123,12 @@ struct Iso_Node
 
     int hidden; /**< whether the node will be hidden, see IsoHideNodeFlag */
 
+    /**
+     * Which strings are shared with other nodes, see iso_node_compact():
+     * bit0= name , bit1= AAIP string of aaip_xinfo_func
+     */
+    int pooled;
+
     IsoDir *parent; /**< parent node, NULL for root */
 
     /*
@@ -136,12 +142,49 @@ struct Iso_Node
     IsoExtendedInfo *xinfo;
 };
 
+/* The number of children from where on a directory gets a search index */
+#define ISO_DIR_INDEX_MIN 64
+
+/* The maximum number of levels of the search index */
+#define ISO_DIR_INDEX_LEVELS 16
+
+struct iso_dir_index;
+
 struct Iso_Dir
 {
     IsoNode node;
 
     size_t nchildren; /**< The number of children of this directory. */
     IsoNode *children; /**< list of children. ptr to first child */
+
+    /**
+     * Skip list over the sorted list of children. It gets created by
+     * iso_dir_find() when nchildren reaches ISO_DIR_INDEX_MIN and is then
+     * kept up to date by iso_dir_insert() and iso_node_take().
+     * NULL if not created yet.
+     */
+    struct iso_dir_index *index;
+
+    /**
+     * The iterators which currently iterate over this directory. They get
+     * notified when a child is taken. See iso_notify_dir_iters().
+     */
+    IsoDirIter *iters;
+
+    /** Counts the notifications of the iterators */
+    unsigned int iter_stamp;
+
+    /**
+     * Counts the insertions and removals of nodes in the whole tree if this
+     * directory is the top of a tree. See iso_dir_count_change().
+     */
+    unsigned int tree_changes;
+
+    /**
+     * Non-NULL if the directory was imported by a lazy iso_image_import()
+     * and its children have not been loaded yet. See iso_dir_load_lazy().
+     */
+    struct iso_dir_lazy *lazy;
 };
 
 /* IMPORTANT: Any change must be reflected by iso_tree_clone_file. */
@@ -226,6 +269,14 @@ struct Iso_Dir_Iter
     IsoDir *dir;
 
     void *data;
+
+    /* Registration in the list of iterators of dir.
+       See iso_dir_iter_register().
+     */
+    IsoDir *reg_dir;
+    IsoDirIter *reg_prev;
+    IsoDirIter *reg_next;
+    unsigned int notify_stamp;
 };
 
 int iso_node_new_root(IsoDir **root);
@@ -337,8 +388,11 @@ int iso_node_is_valid_link_dest(const char *dest);
  *      The node name to search for. It can't be NULL
  * @param pos
  *      Will be filled with the position where to insert. It can't be NULL
+ * @return
+ *      ISO_SUCCESS, or < 0 if the children of a lazily imported dir could
+ *      not be loaded
  */
-void iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos);
+int iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos);
 
 /**
  * Check if a node with the given name exists in a dir.
@@ -351,7 +405,7 @@ void iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos);
  *      If not NULL, will be filled with the position where to insert. If the
  *      node exists, (**pos) will refer to the given node.
  * @return
- *      1 if node exists, 0 if not
+ *      1 if node exists, 0 if not, < 0 on error
  */
 int iso_dir_exists(IsoDir *dir, const char *name, IsoNode ***pos);
 
@@ -523,6 +577,20 @@ int iso_root_get_isofsnt(IsoNode *node, uint32_t *truncate_mode,
                          uint32_t *truncate_length, int flag);
 
 
+/**
+ * Load the children of a directory which was left unloaded by a lazy
+ * iso_image_import(). Nothing happens with other directories.
+ * @param flag bit0= also load all unloaded directories underneath
+ * @return 1 = ok, < 0 = error
+ */
+int iso_dir_load_lazy(IsoDir *dir, int flag);
+
+/**
+ * Dispose the unloaded state of a directory.
+ */
+void iso_dir_lazy_free(struct iso_dir_lazy *lazy);
+
+
 /**
  * Copy the xinfo list from one node to the another.
  */
@@ -554,10 +622,38 @@ int zisofs_zf_xinfo_func(void *data, int flag);
 int zisofs_zf_xinfo_cloner(void *old_data, void **new_data, int flag);
 
 
+/* Increment the tree_changes counter of the directory at the top of the
+ * tree to which dir belongs.
+ * The walk up to the top is only done while any tree has a block index
+ * which could become outdated. See iso_dir_watch_changes().
+ */
+void iso_dir_count_change(IsoDir *dir);
+
+/* Register (up = 1) or unregister (up = 0) a user of the tree_changes
+ * counters, e.g. a block index of iso_tree_get_node_of_block().
+ */
+void iso_dir_watch_changes(int up);
+
 /* Performing search for possibly truncated node name.
  */
 int iso_dir_get_node_trunc(IsoDir *dir, int truncate_length,
                            const char *name, IsoNode **node);
 
 
+/* Share the name and the AAIP string of the node with other nodes of equal
+ * content. See iso_image_set_node_compaction().
+ * @param flag bit0= share name
+ *             bit1= share AAIP string
+ */
+int iso_node_compact(IsoNode *node, int flag);
+
+/* Dispose the name of a node, which may be shared or not, and set it to NULL.
+ */
+void iso_node_free_name(IsoNode *node);
+
+/* Dispose the pools of shared names and AAIP strings if they are empty.
+ */
+void iso_node_dispose_pools(int flag);
+
+
 #endif /*LIBISO_NODE_H_*/
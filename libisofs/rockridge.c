@@ -42,17 +42,27 @@ static
 int susp_make_CE(Ecma119Image *t, uint8_t **CE,
                  uint32_t block_offset, uint32_t byte_offset, uint32_t size);
 
+static
+void susp_info_free(struct susp_info* susp);
+
 
 static
 int susp_append(Ecma119Image *t, struct susp_info *susp, uint8_t *data)
 {
-    susp->n_susp_fields++;
-    susp->susp_fields = realloc(susp->susp_fields, sizeof(void*)
-                                * susp->n_susp_fields);
-    if (susp->susp_fields == NULL) {
-        return ISO_OUT_OF_MEM;
+    uint8_t **fields;
+
+    if (susp->susp_fields == NULL)
+        susp->alloc_susp_fields = 0;
+    if (susp->n_susp_fields >= susp->alloc_susp_fields) {
+        fields = realloc(susp->susp_fields, sizeof(uint8_t *) *
+                         (susp->alloc_susp_fields + ISO_SUSP_ALLOC_STEP));
+        if (fields == NULL)
+            return ISO_OUT_OF_MEM;
+        susp->susp_fields = fields;
+        susp->alloc_susp_fields += ISO_SUSP_ALLOC_STEP;
     }
-    susp->susp_fields[susp->n_susp_fields - 1] = data;
+    susp->susp_fields[susp->n_susp_fields] = data;
+    susp->n_susp_fields++;
     susp->suf_len += data[2];
     return ISO_SUCCESS;
 }
@@ -1422,6 +1432,66 @@ int add_aa_string(Ecma119Image *t, Ecma119Node *n, struct susp_info *info,
 }
 
 
+/* Compose the System Use field of a directory record of n which needs no
+   Continuation Area. Keep it in the susp_cache of the parent directory,
+   so that rrip_get_susp_fields() can replay it instead of composing it a
+   second time.
+   @param su_size  The size as computed by rrip_calc_len()
+*/
+static
+void susp_cache_fields(Ecma119Image *t, Ecma119Node *n, size_t used_up,
+                       size_t su_size)
+{
+    int ret;
+    struct susp_info info;
+    struct ecma119_dir_info *dir;
+    size_t needed, new_alloc;
+    uint8_t *mem;
+
+    /* The CL field of a placeholder refers to a block which is not yet
+       known when the parent directory gets sized */
+    if (n->parent == NULL || n->type == ECMA119_PLACEHOLDER ||
+        n->susp_cache_pos > 0 || su_size > 255 || used_up > 255)
+        return;
+    dir = n->parent->info.dir;
+    needed = 2 + su_size;
+    if (dir->susp_cache_len + needed > dir->susp_cache_alloc) {
+        new_alloc = dir->susp_cache_alloc > 0 ? dir->susp_cache_alloc : 1024;
+        while (dir->susp_cache_len + needed > new_alloc)
+            new_alloc *= 2;
+        if (new_alloc >= 0xffffffff ||
+            t->susp_cache_bytes + (new_alloc - dir->susp_cache_alloc) >
+                                                           ISO_SUSP_CACHE_MAX)
+            return;
+        mem = realloc(dir->susp_cache, new_alloc);
+        if (mem == NULL)
+            return;
+        t->susp_cache_bytes += new_alloc - dir->susp_cache_alloc;
+        dir->susp_cache = mem;
+        dir->susp_cache_alloc = new_alloc;
+    }
+
+    memset(&info, 0, sizeof(struct susp_info));
+    ret = rrip_get_susp_fields(t, n, 0, used_up, &info);
+    if (ret < 0)
+        return; /* info was already freed */
+    if (info.n_ce_susp_fields > 0 || (size_t) info.suf_len != su_size) {
+        susp_info_free(&info);
+        return;
+    }
+
+    /* Record: su_size, used_up, su_size bytes of fields and padding */
+    mem = dir->susp_cache + dir->susp_cache_len;
+    mem[0] = su_size;
+    mem[1] = used_up;
+    memset(mem + 2, 0, su_size);
+    rrip_write_susp_fields(t, &info, mem + 2);
+    susp_info_free(&info);
+    n->susp_cache_pos = dir->susp_cache_len + 1;
+    dir->susp_cache_len += needed;
+}
+
+
 /**
  * Compute the length needed for write all RR and SUSP entries for a given
  * node.
@@ -1442,7 +1512,7 @@ size_t rrip_calc_len(Ecma119Image *t, Ecma119Node *n, int type, size_t used_up,
                      size_t *ce, size_t base_ce)
 {
     size_t su_size, space;
-    int ret;
+    int ret, cacheable = 0;
     size_t aaip_sua_free= 0, aaip_len= 0;
 
     /* Directory record length must be even (ECMA-119, 9.1.13). Maximum is 254.
@@ -1503,6 +1573,8 @@ size_t rrip_calc_len(Ecma119Image *t, Ecma119Node *n, int type, size_t used_up,
 
         /* Try without CE */
         ret = susp_calc_nm_sl_al(t, n, space, &su_size, ce, base_ce, 0);
+        if (ret == 1)
+            cacheable = 1;
         if (ret == 0) /* Retry with CE but no block crossing */
             ret = susp_calc_nm_sl_al(t, n, space, &su_size, ce, base_ce, 1);
         if (ret == 0) /* Retry with aligned CE and block hopping */
@@ -1551,6 +1623,9 @@ size_t rrip_calc_len(Ecma119Image *t, Ecma119Node *n, int type, size_t used_up,
      * it is an odd number (ECMA-119, 9.1.13)
      */
     su_size += (su_size % 2);
+
+    if (cacheable)
+        susp_cache_fields(t, n, used_up, su_size);
     return su_size;
 }
 
@@ -1605,6 +1680,7 @@ int rrip_get_susp_fields(Ecma119Image *t, Ecma119Node *n, int type,
     int ce_is_predicted = 0;
     size_t aaip_sua_free= 0, aaip_len= 0, ce_mem;
     int space;
+    uint8_t *cache;
 
     if (t == NULL || n == NULL || info == NULL) {
         return ISO_NULL_POINTER;
@@ -1624,6 +1700,16 @@ int rrip_get_susp_fields(Ecma119Image *t, Ecma119Node *n, int type,
     info->current_ce_start = info->n_ce_susp_fields;
     ce_mem = info->ce_len;
 
+    if (type == 0 && n->susp_cache_pos > 0 && info->n_susp_fields == 0) {
+        /* Replay the fields which were composed by rrip_calc_len() */
+        cache = n->parent->info.dir->susp_cache + (n->susp_cache_pos - 1);
+        if (cache[1] == used_up) {
+            info->cached_fields = cache + 2;
+            info->suf_len = cache[0];
+            return ISO_SUCCESS;
+        }
+    }
+
 #ifdef Libisofs_ce_calc_debug_filetraP
 
     if (n->node->name != NULL)
@@ -2177,6 +2263,12 @@ void rrip_write_susp_fields(Ecma119Image *t, struct susp_info *info,
     size_t pos = 0;
     int ret;
 
+    if (info->cached_fields != NULL) {
+        memcpy(buf, info->cached_fields, info->suf_len);
+        info->cached_fields = NULL;
+        info->suf_len = 0;
+        return;
+    }
     if (info->n_susp_fields == 0) {
         return;
     }
@@ -2197,15 +2289,17 @@ void rrip_write_susp_fields(Ecma119Image *t, struct susp_info *info,
     free(info->susp_fields);
     info->susp_fields = NULL;
     info->n_susp_fields = 0;
+    info->alloc_susp_fields = 0;
     info->suf_len = 0;
 }
 
 /**
  * Write the Continuation Area entries for the given struct susp_info, using
- * the iso_write() function.
+ * the iso_write_render() function with the given out.
  * After written, the ce_susp_fields array will be freed.
  */
-int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info)
+int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info,
+                         struct iso_render_out *out)
 {
     size_t i;
     uint8_t *padding = NULL;
@@ -2224,14 +2318,14 @@ int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info)
             if (pad_size == BLOCK_SIZE)
     continue;
             memset(padding, 0, pad_size);
-            ret = iso_write(t, padding, pad_size);
+            ret = iso_write_render(t, out, padding, pad_size);
             if (ret < 0)
                 goto write_ce_field_cleanup;
             written += pad_size;
     continue;
         }
-        ret = iso_write(t, info->ce_susp_fields[i], 
-                        info->ce_susp_fields[i][2]);
+        ret = iso_write_render(t, out, info->ce_susp_fields[i],
+                               info->ce_susp_fields[i][2]);
         if (ret < 0) {
             goto write_ce_field_cleanup;
         }
@@ -2242,7 +2336,7 @@ int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info)
     i = BLOCK_SIZE - (info->ce_len % BLOCK_SIZE);
     if (i > 0 && i < BLOCK_SIZE) {
         memset(padding, 0, i);
-        ret = iso_write(t, padding, i);
+        ret = iso_write_render(t, out, padding, i);
         if (ret < 0)
             goto write_ce_field_cleanup;
         written += i;
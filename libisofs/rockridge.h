@@ -73,11 +73,27 @@ struct susp_info
     /* Marks the start index in ce_susp_fields of the current node */
     size_t current_ce_start;
 
+    /* The number of allocated members in susp_fields */
+    size_t alloc_susp_fields;
+
+    /* If not NULL: The suf_len bytes of the System Use field as cached by
+       rrip_calc_len(). They replace susp_fields. Not owned by susp_info.
+    */
+    uint8_t *cached_fields;
+
 };
 
 /* Step to increase allocated size of susp_info.ce_susp_fields */
 #define ISO_SUSP_CE_ALLOC_STEP 16
 
+/* Step to increase allocated size of susp_info.susp_fields */
+#define ISO_SUSP_ALLOC_STEP 8
+
+/* Maximum number of bytes which rrip_calc_len() may keep in the susp_cache
+   of the ECMA-119 directories
+*/
+#define ISO_SUSP_CACHE_MAX (64 * 1024 * 1024)
+
 
 /* SUSP 5.1 */
 struct susp_CE {
@@ -202,6 +218,9 @@ struct susp_sys_user_entry
  *      Fill of continuation area by previous nodes of same dir
  * @return
  *      The size needed for the RR entries in the System Use Area
+ *
+ * If an entry of type 0 needs no Continuation Area, then its fields get
+ * composed and cached in the parent directory for rrip_get_susp_fields().
  */
 size_t rrip_calc_len(Ecma119Image *t, Ecma119Node *n, int type, size_t space,
                      size_t *ce, size_t base_ce);
@@ -236,12 +255,15 @@ int rrip_get_susp_fields(Ecma119Image *t, Ecma119Node *n, int type,
 void rrip_write_susp_fields(Ecma119Image *t, struct susp_info *info,
                             uint8_t *buf);
 
+struct iso_render_out;
+
 /**
  * Write the Continuation Area entries for the given struct susp_info, using
- * the iso_write() function.
+ * the iso_write_render() function with the given out.
  * After written, the ce_susp_fields array will be freed.
  */
-int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info);
+int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info,
+                         struct iso_render_out *out);
 
 /**
  * The SUSP iterator is used to iterate over the System User Entries
@@ -252,6 +274,9 @@ int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info);
  */
 typedef struct susp_iterator SuspIterator;
 
+/* More than 1 MiB in a single file's CE area is suspicious */
+#define ISO_SUSP_MAX_CE_BYTES (1024 * 1024)
+
 SuspIterator *
 susp_iter_new(IsoDataSource *src, struct ecma119_dir_record *record, 
               uint32_t fs_blocks, uint8_t len_skp, int msgid);
@@ -274,6 +299,57 @@ int susp_iter_next(SuspIterator *iter, struct susp_sys_user_entry **sue,
  */
 void susp_iter_free(SuspIterator *iter);
 
+/**
+ * Blocks of Continuation Areas which were read in advance, sorted by their
+ * block addresses.
+ */
+struct susp_ce_blocks
+{
+    uint32_t *lba;
+    uint8_t *data; /* count * BLOCK_SIZE bytes in the sequence of lba */
+    size_t count;
+};
+
+/**
+ * Let the iterator take the blocks of Continuation Areas from blocks rather
+ * than reading them from the data source, as far as they are present there.
+ * blocks has to stay valid as long as the iterator is in use.
+ */
+void susp_iter_set_ce_blocks(SuspIterator *iter, struct susp_ce_blocks *blocks);
+
+/**
+ * Cache of recently read blocks of Continuation Areas, keyed by their block
+ * addresses. The SuspIterator objects of an imported filesystem share one
+ * such cache, because the CE areas of many siblings are usually packed into
+ * the same few blocks. The cache is not safe for concurrent use.
+ */
+typedef struct susp_ce_cache SuspCeCache;
+
+/* Default number of blocks in a SuspCeCache */
+#define ISO_SUSP_CE_CACHE_BLOCKS 128
+
+/**
+ * @param num_blocks
+ *      Number of blocks to keep. <= 0 means ISO_SUSP_CE_CACHE_BLOCKS.
+ * @return
+ *      1 success, < 0 error
+ */
+int susp_ce_cache_new(int num_blocks, SuspCeCache **cache);
+
+/**
+ * Forget all cached blocks, e.g. because the data source got closed.
+ */
+void susp_ce_cache_invalidate(SuspCeCache *cache);
+
+void susp_ce_cache_free(SuspCeCache *cache);
+
+/**
+ * Let the iterator look for blocks of Continuation Areas in cache and store
+ * the blocks which it reads from the data source there.
+ * cache has to stay valid as long as the iterator is in use.
+ */
+void susp_iter_set_ce_cache(SuspIterator *iter, SuspCeCache *cache);
+
 
 /**
  * Fills a struct stat with the values of a Rock Ridge PX entry (RRIP, 4.1.1).
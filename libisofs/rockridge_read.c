@@ -22,6 +22,7 @@
 #include "util.h"
 #include "rockridge.h"
 #include "messages.h"
+#include "data_source.h"
 
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -46,8 +47,102 @@ struct susp_iterator
     uint32_t ce_len; 
 
     uint8_t *buffer; /*< If there are continuation areas */
+
+    /* Blocks of continuation areas which were read in advance, or NULL */
+    struct susp_ce_blocks *ce_blocks;
+
+    /* Blocks of continuation areas which were read recently, or NULL */
+    SuspCeCache *ce_cache;
+};
+
+struct susp_ce_cache
+{
+    int num_blocks;
+    uint8_t *mem;          /* num_blocks * BLOCK_SIZE bytes */
+    uint32_t *lba;
+    uint8_t *valid;
+    uint64_t *used;        /* value of use_counter at last usage */
+    uint64_t use_counter;
 };
 
+int susp_ce_cache_new(int num_blocks, SuspCeCache **cache)
+{
+    SuspCeCache *o;
+
+    *cache = NULL;
+    if (num_blocks <= 0)
+        num_blocks = ISO_SUSP_CE_CACHE_BLOCKS;
+    o = calloc(1, sizeof(SuspCeCache));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    o->num_blocks = num_blocks;
+    o->mem = calloc(num_blocks, BLOCK_SIZE);
+    o->lba = calloc(num_blocks, sizeof(uint32_t));
+    o->valid = calloc(num_blocks, 1);
+    o->used = calloc(num_blocks, sizeof(uint64_t));
+    if (o->mem == NULL || o->lba == NULL || o->valid == NULL ||
+        o->used == NULL) {
+        susp_ce_cache_free(o);
+        return ISO_OUT_OF_MEM;
+    }
+    o->use_counter = 0;
+    *cache = o;
+    return ISO_SUCCESS;
+}
+
+void susp_ce_cache_invalidate(SuspCeCache *cache)
+{
+    if (cache == NULL)
+        return;
+    memset(cache->valid, 0, cache->num_blocks);
+}
+
+void susp_ce_cache_free(SuspCeCache *cache)
+{
+    if (cache == NULL)
+        return;
+    free(cache->mem);
+    free(cache->lba);
+    free(cache->valid);
+    free(cache->used);
+    free(cache);
+}
+
+/* @return pointer to the cached block, or NULL if it is not cached */
+static
+uint8_t *susp_ce_cache_lookup(SuspCeCache *cache, uint32_t lba)
+{
+    int i;
+
+    for (i = 0; i < cache->num_blocks; i++) {
+        if (cache->valid[i] && cache->lba[i] == lba) {
+            cache->used[i] = ++cache->use_counter;
+            return cache->mem + (size_t) i * BLOCK_SIZE;
+        }
+    }
+    return NULL;
+}
+
+/* Store a copy of data in the least recently used slot */
+static
+void susp_ce_cache_store(SuspCeCache *cache, uint32_t lba, uint8_t *data)
+{
+    int i, victim = 0;
+
+    for (i = 0; i < cache->num_blocks; i++) {
+        if (!cache->valid[i]) {
+            victim = i;
+    break;
+        }
+        if (cache->used[i] < cache->used[victim])
+            victim = i;
+    }
+    memcpy(cache->mem + (size_t) victim * BLOCK_SIZE, data, BLOCK_SIZE);
+    cache->lba[victim] = lba;
+    cache->valid[victim] = 1;
+    cache->used[victim] = ++cache->use_counter;
+}
+
 SuspIterator*
 susp_iter_new(IsoDataSource *src, struct ecma119_dir_record *record,
               uint32_t fs_blocks, uint8_t len_skp, int msgid)
@@ -67,12 +162,89 @@ susp_iter_new(IsoDataSource *src, struct ecma119_dir_record *record,
 
     iter->ce_len = 0;
     iter->buffer = NULL;
+    iter->ce_blocks = NULL;
+    iter->ce_cache = NULL;
 
     return iter;
 }
 
-/* More than 1 MiB in a single file's CE area is suspicious */
-#define ISO_SUSP_MAX_CE_BYTES (1024 * 1024)
+void susp_iter_set_ce_blocks(SuspIterator *iter, struct susp_ce_blocks *blocks)
+{
+    iter->ce_blocks = blocks;
+}
+
+void susp_iter_set_ce_cache(SuspIterator *iter, SuspCeCache *cache)
+{
+    iter->ce_cache = cache;
+}
+
+static
+uint8_t *susp_ce_blocks_lookup(struct susp_ce_blocks *blocks, uint32_t lba)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = blocks->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (blocks->lba[mid] == lba)
+            return blocks->data + mid * BLOCK_SIZE;
+        if (blocks->lba[mid] < lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* Read the blocks of a continuation area into buffer. Blocks which were
+   read in advance or recently get copied. The others get read in runs of
+   contiguous blocks and then remembered in the cache.
+*/
+static
+int susp_iter_read_ce(SuspIterator *iter, uint32_t lba, uint32_t nblocks,
+                      uint8_t *buffer)
+{
+    uint32_t block, run, i;
+    uint8_t *known, *missing = NULL;
+    int ret;
+
+    missing = calloc(nblocks, 1);
+    if (missing == NULL)
+        return ISO_OUT_OF_MEM;
+    for (block = 0; block < nblocks; block++) {
+        known = NULL;
+        if (iter->ce_blocks != NULL)
+            known = susp_ce_blocks_lookup(iter->ce_blocks, lba + block);
+        if (known == NULL && iter->ce_cache != NULL)
+            known = susp_ce_cache_lookup(iter->ce_cache, lba + block);
+        if (known != NULL)
+            memcpy(buffer + block * BLOCK_SIZE, known, BLOCK_SIZE);
+        else
+            missing[block] = 1;
+    }
+    for (block = 0; block < nblocks; block += run) {
+        if (!missing[block]) {
+            run = 1;
+    continue;
+        }
+        for (run = 1; block + run < nblocks; run++)
+            if (!missing[block + run])
+        break;
+        ret = iso_data_source_read_blocks(iter->src, lba + block, run,
+                                          buffer + block * BLOCK_SIZE);
+        if (ret < 0)
+            goto ex;
+        if (iter->ce_cache != NULL)
+            for (i = 0; i < run; i++)
+                susp_ce_cache_store(iter->ce_cache, lba + block + i,
+                                    buffer + (block + i) * BLOCK_SIZE);
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    free(missing);
+    return ret;
+}
 
 
 /* @param flag bit0 = First call on root:
@@ -103,7 +275,8 @@ int susp_iter_next(SuspIterator *iter, struct susp_sys_user_entry **sue,
          * (IEEE 1281, SUSP. section 4) 
          */
         if (iter->ce_len) {
-            uint32_t block, nblocks, skipped_blocks, skipped_bytes;
+            uint32_t nblocks, skipped_blocks, skipped_bytes;
+            uint8_t *area;
 
             /* A CE was found, there is another continuation area */
             skipped_blocks = iter->ce_off / BLOCK_SIZE;
@@ -115,19 +288,30 @@ int susp_iter_next(SuspIterator *iter, struct susp_sys_user_entry **sue,
             if (((uint64_t) iter->ce_block) + skipped_blocks + nblocks >
                 (uint64_t) iter->fs_blocks)
                 return ISO_SUSP_WRONG_CE_SIZE;
-            iter->buffer = realloc(iter->buffer, nblocks * BLOCK_SIZE);
 
-            /* Read blocks needed to cache the given CE area range */
-            for (block = 0; block < nblocks; ++block) {
+            if (iso_data_source_map_blocks(iter->src,
+                                           iter->ce_block + skipped_blocks,
+                                           nblocks, &area) == 1) {
+                /* Parse directly in the mapped image */
+                iter->base = area + (iter->ce_off - skipped_bytes);
+            } else {
                 int ret;
-                ret = iter->src->read_block(iter->src,
-                                       iter->ce_block + skipped_blocks + block,
-                                       iter->buffer + block * BLOCK_SIZE);
-                if (ret < 0) {
+                uint8_t *new_buffer;
+
+                /* On failure the old buffer stays with iter and gets freed
+                   by susp_iter_free() */
+                new_buffer = realloc(iter->buffer, nblocks * BLOCK_SIZE);
+                if (new_buffer == NULL)
+                    return ISO_OUT_OF_MEM;
+                iter->buffer = new_buffer;
+
+                /* Read blocks needed to cache the given CE area range */
+                ret = susp_iter_read_ce(iter, iter->ce_block + skipped_blocks,
+                                        nblocks, iter->buffer);
+                if (ret < 0)
                     return ret;
-                }
+                iter->base = iter->buffer + (iter->ce_off - skipped_bytes);
             }
-            iter->base = iter->buffer + (iter->ce_off - skipped_bytes);
             iter->pos = 0;
             iter->size = iter->ce_len;
             iter->ce_len = 0;
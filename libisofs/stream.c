@@ -22,6 +22,7 @@
 #include <string.h>
 #include <limits.h>
 #include <stdio.h>
+#include <pthread.h>
 
 
 #ifndef PATH_MAX
@@ -274,7 +275,7 @@ int iso_file_source_stream_new(IsoFileSource *src, IsoStream **stream)
              * st_dev and st_ino fields. Use serial_id.
              */
             data->dev_id = (dev_t) 0;
-            data->ino_id = serial_id++;
+            data->ino_id = iso_counter_next_ino(&serial_id, 1);
         } else {
             data->dev_id = info.st_dev;
             data->ino_id = info.st_ino;
@@ -480,7 +481,7 @@ int cut_out_clone_stream(IsoStream *old_stream, IsoStream **new_stream,
     }
 
     new_data->dev_id = (dev_t) 0;
-    new_data->ino_id = cut_out_serial_id++;
+    new_data->ino_id = iso_counter_next_ino(&cut_out_serial_id, 1);
     new_data->offset = data->offset;
     new_data->size = data->size;
     new_data->pos = 0;
@@ -569,7 +570,7 @@ int iso_cut_out_stream_new(IsoFileSource *src, off_t offset, off_t size,
 
     /* get the id numbers */
     data->dev_id = (dev_t) 0;
-    data->ino_id = cut_out_serial_id++;
+    data->ino_id = iso_counter_next_ino(&cut_out_serial_id, 1);
 
     str->refcount = 1;
     str->data = data;
@@ -728,7 +729,7 @@ int mem_clone_stream(IsoStream *old_stream, IsoStream **new_stream,
     }
     new_data->buf = new_buf;
     new_data->offset = -1;
-    new_data->ino_id = mem_serial_id++;
+    new_data->ino_id = iso_counter_next_ino(&mem_serial_id, 1);
     new_data->size = data->size;
 
     stream->data = new_data;
@@ -785,7 +786,7 @@ int iso_memory_stream_new(unsigned char *buf, size_t size, IsoStream **stream)
     data->buf = buf;
     data->size = size;
     data->offset = -1;
-    data->ino_id = mem_serial_id++;
+    data->ino_id = iso_counter_next_ino(&mem_serial_id, 1);
 
     str->refcount = 1;
     str->data = data;
@@ -1012,6 +1013,9 @@ struct iso_streamcmprank {
 
 static struct iso_streamcmprank *streamcmpranks = NULL;
 
+/* Image productions in several threads may compare streams concurrently */
+static pthread_mutex_t streamcmpranks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static
 int iso_get_streamcmprank(int (*cmp_func)(IsoStream *s1, IsoStream *s2),
                           int flag)
@@ -1019,6 +1023,7 @@ int iso_get_streamcmprank(int (*cmp_func)(IsoStream *s1, IsoStream *s2),
     int idx;
     struct iso_streamcmprank *cpr, *last_cpr = NULL;
 
+    pthread_mutex_lock(&streamcmpranks_mutex);
     idx = 0;
     for (cpr = streamcmpranks; cpr != NULL; cpr = cpr->next) {
         if (cpr->cmp_func == cmp_func)
@@ -1027,17 +1032,21 @@ int iso_get_streamcmprank(int (*cmp_func)(IsoStream *s1, IsoStream *s2),
         last_cpr = cpr;
     }
     if (cpr != NULL)
-        return idx;
-    LIBISO_ALLOC_MEM_VOID(cpr, struct iso_streamcmprank, 1);
+        goto ex;
+    cpr = calloc(1, sizeof(struct iso_streamcmprank));
+    if (cpr == NULL) {
+        idx = -1;
+        goto ex;
+    }
     cpr->cmp_func = cmp_func;
     cpr->next = NULL;
     if (last_cpr != NULL)
         last_cpr->next = cpr;
     if (streamcmpranks == NULL)
         streamcmpranks = cpr;
-    return idx;
 ex:;
-    return -1;
+    pthread_mutex_unlock(&streamcmpranks_mutex);
+    return idx;
 }
 
 static
@@ -1055,11 +1064,13 @@ int iso_stream_destroy_cmpranks(int flag)
 {
     struct iso_streamcmprank *cpr, *next;
 
+    pthread_mutex_lock(&streamcmpranks_mutex);
     for (cpr = streamcmpranks; cpr != NULL; cpr = next) {
         next = cpr->next;
         LIBISO_FREE_MEM(cpr);
     }
     streamcmpranks = NULL;
+    pthread_mutex_unlock(&streamcmpranks_mutex);
     return ISO_SUCCESS;
 }
 
@@ -1342,3 +1353,52 @@ int iso_stream_clone_filter_common(IsoStream *old_stream,
     return ISO_SUCCESS;
 }
 
+
+int iso_stream_concurrent_ok(IsoStream *stream, void **resource, int flag)
+{
+    static char filter_types[][5] = {"ziso", "osiz", "gzip", "pizg"};
+    static int num_filter_types = 4;
+    IsoStream *input_stream;
+    IsoFilesystem *fs;
+    IsoFileSource *src;
+    int i;
+
+    *resource = NULL;
+
+    /* Only the filters of libisofs are known to keep their state in their
+       stream data. External filters are excluded because a concurrent
+       fork() would let a child process inherit the pipes of other filters.
+    */
+    while (1) {
+        input_stream = iso_stream_get_input_stream(stream, 0);
+        if (input_stream == NULL || input_stream == stream)
+    break;
+        for (i = 0; i < num_filter_types; i++)
+            if (strncmp(stream->class->type, filter_types[i], 4) == 0)
+        break;
+        if (i >= num_filter_types)
+            return 0;
+        stream = input_stream;
+    }
+
+    if (stream->class == &mem_stream_class) {
+        *resource = stream;
+        return 1;
+    }
+    if (stream->class != &fsrc_stream_class &&
+        stream->class != &cut_out_stream_class)
+        return 0;
+
+    /* Streams from an imported ISO image share the IsoDataSource, which
+       needs not to be safe for concurrent use.
+    */
+    if (stream->class == &fsrc_stream_class)
+        src = ((FSrcStreamData *) stream->data)->src;
+    else
+        src = ((struct cut_out_stream *) stream->data)->src;
+    fs = iso_file_source_get_filesystem(src);
+    if (fs == NULL || fs->get_id(fs) != ISO_LOCAL_FS_ID)
+        return 0;
+    *resource = src;
+    return 1;
+}
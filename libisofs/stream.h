@@ -96,6 +96,18 @@ int iso_stream_read_buffer(IsoStream *stream, char *buf, size_t count,
 int iso_stream_make_md5(IsoStream *stream, char md5[16], int flag);
 
 
+/**
+ * Inquire whether a stream and its chain of input streams may be opened and
+ * read by one thread while other threads read other streams.
+ * @param resource  Returns a pointer which identifies the most original
+ *                  data source of the chain. Streams which return the same
+ *                  resource must not be read concurrently.
+ * @param flag      Submit 0 for now.
+ * @return          1= concurrent reading is safe, 0= not known to be safe
+ */
+int iso_stream_concurrent_ok(IsoStream *stream, void **resource, int flag);
+
+
 /**
  * Create a clone of the input stream of old_stream and a roughly initialized
  * clone of old_stream which has the same class and refcount 1. Its data
@@ -1742,7 +1742,7 @@ static int iso_write_gpt(Ecma119Image *t, uint32_t img_blocks, uint8_t *buf)
     struct iso_gpt_partition_request *req;
     uint8_t gpt_name[72];
     static uint8_t zero_uuid[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-    static uint8_t *type_guid;
+    uint8_t *type_guid;
     static uint64_t gpt_flags = (((uint64_t) 1) << 60) | 1;
 
     if (t->gpt_req_count == 0)
@@ -2569,36 +2569,6 @@ static void swap_uuid(void *u_pt)
 #endif /* Libisofs_with_uuid_generatE */
 
 
-/* CRC-32 as of GPT and Ethernet.
-   Parameters are deduced from a table driven implementation in isohybrid.c
-*/
-uint32_t iso_crc32_gpt(unsigned char *data, int count, int flag)
-{   
-    unsigned int acc, top, result = 0;
-    long int i;
-
-    /* Chosen so that the CRC of 0 bytes of input is 0x00000000 */
-    acc = 0x46af6449;
-
-    /* Process data bits and flush numerator by 32 zero bits */
-    for (i = 0; i < count * 8 + 32; i++) {
-        top = acc & 0x80000000;
-        acc = (acc << 1);
-        if (i < count * 8)
-            /* The least significant bits of input bytes get processed first */
-            acc |= ((data[i / 8] >> (i % 8)) & 1);
-        if (top)
-            /* Division by the generating polynomial */
-            acc ^= 0x04c11db7;
-    }
-    /* Mirror residue bits */
-    for (i = 0; i < 32; i++)
-        if (acc & (1 << i))
-            result |= 1 << (31 - i);
-    /* Return bit complement */
-    return result ^ 0xffffffff;
-}
-
 void iso_mark_guid_version_4(uint8_t *u)
 {
     /* Mark as UUID version 4. RFC 4122 says u[6], but UEFI prescribes
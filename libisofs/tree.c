@@ -68,7 +68,10 @@ int iso_tree_add_new_dir(IsoDir *parent, const char *name, IsoDir **dir)
     }
 
     /* find place where to insert and check if it exists */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -154,7 +157,10 @@ int iso_tree_add_new_symlink(IsoDir *parent, const char *name,
     }
 
     /* find place where to insert */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -260,7 +266,10 @@ int iso_tree_add_new_special(IsoDir *parent, const char *name, mode_t mode,
     }
 
     /* find place where to insert */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -348,7 +357,10 @@ int iso_tree_add_new_file(IsoDir *parent, const char *name, IsoStream *stream,
     }
 
     /* find place where to insert */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -468,6 +480,20 @@ int iso_tree_get_ignore_special(IsoImage *image)
     return image->ignore_special;
 }
 
+int iso_tree_set_ingest_threads(IsoImage *image, int num_threads)
+{
+    if (num_threads < 0 || num_threads > ISO_MAX_INGEST_THREADS) {
+        return ISO_WRONG_ARG_VALUE;
+    }
+    image->ingest_threads = num_threads;
+    return ISO_SUCCESS;
+}
+
+int iso_tree_get_ingest_threads(IsoImage *image)
+{
+    return image->ingest_threads;
+}
+
 /**
  * Set a callback function that libisofs will call for each file that is
  * added to the given image by a recursive addition function. This includes
@@ -487,6 +513,295 @@ void iso_tree_set_report_callback(IsoImage *image,
     image->report = report;
 }
 
+/*
+ * Compiled excludes.
+ *
+ * iso_tree_check_excludes() has to find out whether
+ * fnmatch(FNM_PERIOD|FNM_PATHNAME) matches an absolute exclude with the whole
+ * path, or a relative exclude with the path or with one of the tails of the
+ * path which begin after a '/'.
+ * Instead of trying all excludes on all tails, they get sorted into groups:
+ *
+ * - Excludes without wildcards match only by equality. They are kept in
+ *   sorted arrays and looked up by bsearch().
+ * - Relative excludes of the form "*tail", where tail has no wildcards, no
+ *   slash, but a dot, can only match the last component of the path.
+ *   They are sorted by the text after the last dot of tail, so that the
+ *   extension of the last component leads to the candidates.
+ * - All other excludes are tried by fnmatch(). With FNM_PATHNAME each '/'
+ *   of the string has to be matched by a '/' of the pattern. So if a pattern
+ *   has no bracket expression, its number of '/' determines the only path
+ *   tail, resp. the only kind of absolute path, which it can match.
+ */
+
+struct iso_exclude_glob
+{
+    char *pattern;
+    int absolute;
+
+    /* Number of '/' in pattern, -1 if it may match any number */
+    int slashes;
+};
+
+struct iso_exclude_matcher
+{
+    /* Absolute excludes without wildcards */
+    char **abs_lit;
+    size_t n_abs_lit;
+
+    /* Relative excludes without wildcards */
+    char **rel_lit;
+    size_t n_rel_lit;
+
+    /* Relative excludes "*tail", sorted by excl_ext_cmp() */
+    char **ext;
+    size_t n_ext;
+
+    struct iso_exclude_glob *globs;
+    size_t n_globs;
+};
+
+static
+int excl_str_cmp(const void *v1, const void *v2)
+{
+    return strcmp(*((char **) v1), *((char **) v2));
+}
+
+/* Compare the text from the last dot on */
+static
+int excl_ext_cmp(const void *v1, const void *v2)
+{
+    return strcmp(strrchr(*((char **) v1), '.'), strrchr(*((char **) v2), '.'));
+}
+
+/* Insert into a sorted array which has room for one more element */
+static
+void excl_insert_sorted(char **array, size_t *count, char *item,
+                        int (*cmp)(const void *, const void *))
+{
+    size_t lo = 0, hi = *count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cmp(&item, array + mid) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    memmove(array + lo + 1, array + lo, (*count - lo) * sizeof(char *));
+    array[lo] = item;
+    (*count)++;
+}
+
+void iso_exclude_matcher_destroy(struct iso_exclude_matcher **matcher)
+{
+    struct iso_exclude_matcher *m = *matcher;
+
+    if (m == NULL)
+        return;
+    LIBISO_FREE_MEM(m->abs_lit);
+    LIBISO_FREE_MEM(m->rel_lit);
+    LIBISO_FREE_MEM(m->ext);
+    LIBISO_FREE_MEM(m->globs);
+    LIBISO_FREE_MEM(m);
+    *matcher = NULL;
+}
+
+/* Make room for one more element in an array of the matcher */
+static
+int excl_grow(void **array, size_t count, size_t elem_size)
+{
+    void *new_array;
+
+    new_array = realloc(*array, (count + 1) * elem_size);
+    if (new_array == NULL)
+        return ISO_OUT_OF_MEM;
+    *array = new_array;
+    return ISO_SUCCESS;
+}
+
+/* Add an exclude to the matcher. The pattern is not copied. */
+static
+int excl_matcher_add(struct iso_exclude_matcher *m, char *pattern)
+{
+    int ret, has_wildcards, has_bracket, slashes = 0;
+    char *cpt, *tail;
+    struct iso_exclude_glob *glob;
+
+    has_wildcards = (strpbrk(pattern, "*?[\\") != NULL);
+    has_bracket = (strchr(pattern, '[') != NULL);
+    for (cpt = pattern; *cpt; cpt++)
+        if (*cpt == '/')
+            slashes++;
+
+    if (!has_wildcards) {
+        if (pattern[0] == '/') {
+            ret = excl_grow((void **) &(m->abs_lit), m->n_abs_lit,
+                            sizeof(char *));
+            if (ret < 0)
+                return ret;
+            excl_insert_sorted(m->abs_lit, &(m->n_abs_lit), pattern,
+                               excl_str_cmp);
+        } else {
+            ret = excl_grow((void **) &(m->rel_lit), m->n_rel_lit,
+                            sizeof(char *));
+            if (ret < 0)
+                return ret;
+            excl_insert_sorted(m->rel_lit, &(m->n_rel_lit), pattern,
+                               excl_str_cmp);
+        }
+        return ISO_SUCCESS;
+    }
+    tail = pattern + 1;
+    if (pattern[0] == '*' && strpbrk(tail, "*?[\\/") == NULL &&
+        strchr(tail, '.') != NULL) {
+        ret = excl_grow((void **) &(m->ext), m->n_ext, sizeof(char *));
+        if (ret < 0)
+            return ret;
+        excl_insert_sorted(m->ext, &(m->n_ext), pattern, excl_ext_cmp);
+        return ISO_SUCCESS;
+    }
+    ret = excl_grow((void **) &(m->globs), m->n_globs,
+                    sizeof(struct iso_exclude_glob));
+    if (ret < 0)
+        return ret;
+    glob = m->globs + m->n_globs;
+    glob->pattern = pattern;
+    glob->absolute = (pattern[0] == '/');
+    glob->slashes = has_bracket ? -1 : slashes;
+    m->n_globs++;
+    return ISO_SUCCESS;
+}
+
+/* Compile all excludes of the image anew.
+   On failure the image is left without matcher, so that
+   iso_tree_check_excludes() tries the excludes one by one.
+*/
+static
+int excl_matcher_rebuild(IsoImage *image)
+{
+    int ret, i;
+    struct iso_exclude_matcher *m;
+
+    iso_exclude_matcher_destroy(&(image->exclude_matcher));
+    if (image->nexcludes <= 0)
+        return ISO_SUCCESS;
+    m = calloc(1, sizeof(struct iso_exclude_matcher));
+    if (m == NULL)
+        return ISO_OUT_OF_MEM;
+    for (i = 0; i < image->nexcludes; i++) {
+        if (image->excludes[i] == NULL)
+    continue;
+        ret = excl_matcher_add(m, image->excludes[i]);
+        if (ret < 0) {
+            iso_exclude_matcher_destroy(&m);
+            return ret;
+        }
+    }
+    image->exclude_matcher = m;
+    return ISO_SUCCESS;
+}
+
+#define ISO_EXCL_STATIC_TAILS 64
+
+/* @return 1 if path matches an exclude, 0 if not, <0 on error */
+static
+int excl_matcher_match(struct iso_exclude_matcher *m, const char *path)
+{
+    int ret = 0, path_slashes = 0, ntails, i;
+    const char *cpt, *last, *dot, *static_tails[ISO_EXCL_STATIC_TAILS];
+    const char **tails = static_tails;
+    char **found;
+    size_t lo, hi, mid, len, tail_len;
+    struct iso_exclude_glob *glob;
+
+    if (m->n_abs_lit > 0 &&
+        bsearch(&path, m->abs_lit, m->n_abs_lit, sizeof(char *),
+                excl_str_cmp) != NULL)
+        return 1;
+
+    /* The tails which the relative excludes get compared with:
+       path + 1 and each text after a '/' which comes after path[0].
+       The tail at index i has ntails - 1 - i slashes.
+    */
+    for (cpt = path; *cpt; cpt++)
+        if (*cpt == '/')
+            path_slashes++;
+    if (path[0] == 0)
+        goto absolute_globs;
+    ntails = path_slashes - (path[0] == '/') + 1;
+    if (ntails > ISO_EXCL_STATIC_TAILS) {
+        tails = calloc(ntails, sizeof(char *));
+        if (tails == NULL)
+            return ISO_OUT_OF_MEM;
+    }
+    tails[0] = path + 1;
+    i = 1;
+    for (cpt = path + 1; *cpt; cpt++)
+        if (*cpt == '/')
+            tails[i++] = cpt + 1;
+    last = tails[ntails - 1];
+
+    if (m->n_rel_lit > 0) {
+        for (i = 0; i < ntails; i++) {
+            if (bsearch(tails + i, m->rel_lit, m->n_rel_lit, sizeof(char *),
+                        excl_str_cmp) != NULL)
+                {ret = 1; goto ex;}
+        }
+    }
+
+    /* A leading period cannot be matched by '*' */
+    if (m->n_ext > 0 && last[0] != '.' && (dot = strrchr(last, '.')) != NULL) {
+        lo = 0;
+        hi = m->n_ext;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (strcmp(strrchr(m->ext[mid], '.'), dot) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        len = strlen(last);
+        for (found = m->ext + lo; found < m->ext + m->n_ext; found++) {
+            if (strcmp(strrchr(*found, '.'), dot) != 0)
+        break;
+            tail_len = strlen(*found + 1);
+            if (tail_len <= len && !strcmp(last + len - tail_len, *found + 1))
+                {ret = 1; goto ex;}
+        }
+    }
+
+    for (glob = m->globs; glob < m->globs + m->n_globs; glob++) {
+        if (glob->absolute)
+    continue;
+        if (glob->slashes >= 0) {
+            if (glob->slashes < ntails &&
+                !fnmatch(glob->pattern, tails[ntails - 1 - glob->slashes],
+                         FNM_PERIOD|FNM_PATHNAME))
+                {ret = 1; goto ex;}
+    continue;
+        }
+        for (i = 0; i < ntails; i++)
+            if (!fnmatch(glob->pattern, tails[i], FNM_PERIOD|FNM_PATHNAME))
+                {ret = 1; goto ex;}
+    }
+
+absolute_globs:;
+    for (glob = m->globs; glob < m->globs + m->n_globs; glob++) {
+        if (!glob->absolute)
+    continue;
+        if (glob->slashes >= 0 && glob->slashes != path_slashes)
+    continue;
+        if (!fnmatch(glob->pattern, path, FNM_PERIOD|FNM_PATHNAME))
+            {ret = 1; goto ex;}
+    }
+    ret = 0;
+ex:;
+    if (tails != static_tails)
+        free((char *) tails);
+    return ret;
+}
+
 /**
  * Add a excluded path. These are paths that won't never added to image,
  * and will be excluded even when adding recursively its parent directory.
@@ -515,6 +830,13 @@ int iso_tree_add_exclude(IsoImage *image, const char *path)
     if (image->excludes[image->nexcludes - 1] == NULL) {
         return ISO_OUT_OF_MEM;
     }
+    if (image->exclude_matcher == NULL && image->nexcludes == 1)
+        image->exclude_matcher = calloc(1, sizeof(struct iso_exclude_matcher));
+    if (image->exclude_matcher != NULL) {
+        if (excl_matcher_add(image->exclude_matcher,
+                             image->excludes[image->nexcludes - 1]) < 0)
+            iso_exclude_matcher_destroy(&(image->exclude_matcher));
+    }
     return ISO_SUCCESS;
 }
 
@@ -543,6 +865,7 @@ int iso_tree_remove_exclude(IsoImage *image, const char *path)
             }
             image->excludes = realloc(image->excludes, image->nexcludes * 
                                       sizeof(void*));
+            excl_matcher_rebuild(image);
             return ISO_SUCCESS;
         }
     }
@@ -574,6 +897,8 @@ int iso_tree_add_node_builder(IsoImage *image, IsoDir *parent,
 
     /* find place where to insert */
     result = iso_dir_exists(parent, namept, &pos);
+    if (result < 0)
+        goto ex;
     if (result) {
         /* a node with same name already exists */
         result = ISO_NODE_NAME_NOT_UNIQUE; goto ex;
@@ -642,6 +967,8 @@ int iso_tree_add_new_node(IsoImage *image, IsoDir *parent, const char *name,
 
     /* find place where to insert */
     result = iso_dir_exists(parent, namept, &pos);
+    if (result < 0)
+        return result;
     if (result) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
@@ -700,6 +1027,8 @@ int iso_tree_add_new_cut_out_node(IsoImage *image, IsoDir *parent,
 
     /* find place where to insert */
     result = iso_dir_exists(parent, namept, &pos);
+    if (result < 0)
+        return result;
     if (result) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
@@ -761,11 +1090,15 @@ int iso_tree_add_new_cut_out_node(IsoImage *image, IsoDir *parent,
     return iso_dir_insert(parent, (IsoNode*)new, pos, ISO_REPLACE_NEVER);
 }
 
-static
-int check_excludes(IsoImage *image, const char *path)
+int iso_tree_check_excludes(IsoImage *image, const char *path, int flag)
 {
-    int i;
+    int i, ret;
 
+    if (image->exclude_matcher != NULL && !(flag & 1)) {
+        ret = excl_matcher_match(image->exclude_matcher, path);
+        if (ret >= 0)
+            return ret;
+    }
     for (i = 0; i < image->nexcludes; ++i) {
         char *exclude = image->excludes[i];
         if (exclude[0] == '/') {
@@ -1052,7 +1385,7 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
             goto dir_rec_continue;
         }
 
-        if (check_excludes(image, path)) {
+        if (iso_tree_check_excludes(image, path, 0)) {
             iso_msg_debug(image->id, "Skipping excluded file %s", path);
             skip = 1;
         } else if (check_hidden(image, name)) {
@@ -1071,6 +1404,8 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
 
         /* find place where to insert */
         ret = iso_dir_exists(parent, name, &pos);
+        if (ret < 0)
+            goto ex;
         if (ret) {
             /* Resolve name collision
                e.g. caused by fs_image.c:make_hopefully_unique_name() 
@@ -1122,13 +1457,17 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
             iso_msg_debug(image->id, "Added file %s", path);
         }
 
-        /* finally, if the node is a directory we need to recurse */
+        /* finally, if the node is a directory we need to recurse,
+           unless a lazy image import wants to load it later */
         if (new->type == LIBISO_DIR && S_ISDIR(info.st_mode)) {
-            ret = iso_add_dir_src_rec(image, (IsoDir*)new, file);
+            ret = iso_image_lazy_dir(image, (IsoDir*)new, file);
+            if (ret == 0)
+                ret = iso_add_dir_src_rec(image, (IsoDir*)new, file);
         }
 
 dir_rec_continue:;
         free(path);
+        iso_lfs_prefetch_drop(file);
         iso_file_source_unref(file);
         
         /* check for error severity to decide what to do */
@@ -1147,12 +1486,24 @@ ex:;
     return ret;
 }
 
+/* Tells the prefetcher which files iso_add_dir_src_rec() will skip */
+static
+int check_prefetch_skip(void *handle, char *path, char *name,
+                        struct stat *info)
+{
+    IsoImage *image = handle;
+
+    return (iso_tree_check_excludes(image, path, 0) ||
+            check_hidden(image, name) || check_special(image, info->st_mode));
+}
+
 int iso_tree_add_dir_rec(IsoImage *image, IsoDir *parent, const char *dir)
 {
     int result;
     struct stat info;
     IsoFilesystem *fs;
     IsoFileSource *file;
+    struct iso_lfs_prefetcher *pf = NULL;
 
     if (image == NULL || parent == NULL || dir == NULL) {
         return ISO_NULL_POINTER;
@@ -1175,7 +1526,21 @@ int iso_tree_add_dir_rec(IsoImage *image, IsoDir *parent, const char *dir)
         iso_file_source_unref(file);
         return ISO_FILE_IS_NOT_DIR;
     }
+    if (image->ingest_threads > 1) {
+        result = iso_lfs_prefetcher_new(file, image->ingest_threads,
+                                        image->follow_symlinks,
+                                        1 | (image->builder_ignore_acl << 1) |
+                                            (image->builder_ignore_ea << 2) |
+                                            (image->builder_take_all_ea << 3),
+                                        check_prefetch_skip, image, &pf, 0);
+        if (result < 0) {
+            iso_file_source_unref(file);
+            return result;
+        }
+    }
     result = iso_add_dir_src_rec(image, parent, file);
+    iso_lfs_prefetch_drop(file);
+    iso_lfs_prefetcher_destroy(&pf, 0);
     iso_file_source_unref(file);
     return result;
 }
@@ -1281,11 +1646,13 @@ ex:;
     return path;
 }
 
-/* Note: No reference is taken to the found node.
+/* Search by walking the tree.
    @param flag bit0= recursion
 */
-int iso_tree_get_node_of_block(IsoImage *image, IsoDir *dir, uint32_t block,
-                               IsoNode **found, uint32_t *next_above, int flag)
+static
+int iso_tree_walk_node_of_block(IsoImage *image, IsoDir *dir, uint32_t block,
+                                IsoNode **found, uint32_t *next_above,
+                                int flag)
 {
     int ret, section_count, i;
     IsoDirIter *iter = NULL;
@@ -1321,8 +1688,8 @@ int iso_tree_get_node_of_block(IsoImage *image, IsoDir *dir, uint32_t block,
             free(sections); sections = NULL;
         } else if (ISO_NODE_IS_DIR(node)) {
             subdir = (IsoDir *) node;
-            ret = iso_tree_get_node_of_block(image, subdir, block, found, &na,
-                                             1);
+            ret = iso_tree_walk_node_of_block(image, subdir, block, found,
+                                              &na, 1);
             if (ret != 0)
                 goto ex;
         }
@@ -1340,6 +1707,227 @@ ex:
 }
 
 
+
+/*
+ * Index of the data file extents of imported files, sorted by start block.
+ * It gets built with the first search and is rebuilt when the tree was
+ * changed since.
+ */
+
+struct iso_block_extent {
+    uint32_t block;
+    uint32_t nblocks;
+
+    /* Position in the order of iso_tree_walk_node_of_block(). If extents
+       overlap, the node which comes first in the tree is reported. */
+    size_t seq;
+
+    IsoNode *node;
+};
+
+struct iso_block_index {
+    /* The indexed tree. A reference is held, so that the address cannot
+       be reused by a new root. */
+    IsoDir *root;
+
+    /* root->tree_changes when the index was built */
+    unsigned int tree_changes;
+
+    size_t count;
+    size_t size;
+    struct iso_block_extent *extents;
+
+    /* max_end[i] is the highest end block of extents[0] to extents[i] */
+    uint64_t *max_end;
+};
+
+void iso_tree_block_index_destroy(struct iso_block_index **index)
+{
+    if (*index == NULL)
+        return;
+    if ((*index)->extents != NULL)
+        free((*index)->extents);
+    if ((*index)->max_end != NULL)
+        free((*index)->max_end);
+    if ((*index)->root != NULL)
+        iso_node_unref((IsoNode *) (*index)->root);
+    iso_dir_watch_changes(0);
+    free(*index);
+    *index = NULL;
+}
+
+static
+int iso_block_index_collect(struct iso_block_index *index, IsoDir *dir)
+{
+    int ret, section_count, i;
+    IsoNode *node;
+    struct iso_file_section *sections = NULL;
+    struct iso_block_extent *new_extents;
+
+    for (node = dir->children; node != NULL; node = node->next) {
+        if (ISO_NODE_IS_FILE(node)) {
+            ret = iso_file_get_old_image_sections((IsoFile *) node,
+                                                  &section_count,
+                                                  &sections, 0);
+            if (ret <= 0)
+    continue;
+            if (index->count + section_count > index->size) {
+                index->size = 2 * index->size + section_count;
+                new_extents = realloc(index->extents, index->size *
+                                      sizeof(struct iso_block_extent));
+                if (new_extents == NULL) {
+                    free(sections);
+                    return ISO_OUT_OF_MEM;
+                }
+                index->extents = new_extents;
+            }
+            for (i = 0; i < section_count; i++) {
+                index->extents[index->count].block = sections[i].block;
+                index->extents[index->count].nblocks =
+                           (((off_t) sections[i].size) + 2047) / 2048;
+                index->extents[index->count].seq = index->count;
+                index->extents[index->count].node = node;
+                index->count++;
+            }
+            if (sections != NULL)
+                free(sections);
+            sections = NULL;
+        } else if (ISO_NODE_IS_DIR(node)) {
+            ret = iso_block_index_collect(index, (IsoDir *) node);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return ISO_SUCCESS;
+}
+
+static
+int iso_block_extent_cmp(const void *a, const void *b)
+{
+    const struct iso_block_extent *e1 = a, *e2 = b;
+
+    if (e1->block != e2->block)
+        return e1->block < e2->block ? -1 : 1;
+    if (e1->seq != e2->seq)
+        return e1->seq < e2->seq ? -1 : 1;
+    return 0;
+}
+
+static
+int iso_block_index_build(IsoImage *image, struct iso_block_index **index)
+{
+    int ret;
+    size_t i;
+    uint64_t end;
+    struct iso_block_index *o;
+
+    o = calloc(1, sizeof(struct iso_block_index));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    iso_dir_watch_changes(1);
+    o->root = image->root;
+    iso_node_ref((IsoNode *) o->root);
+    o->tree_changes = o->root->tree_changes;
+    ret = iso_block_index_collect(o, image->root);
+    if (ret < 0)
+        goto ex;
+    if (o->count > 0) {
+        qsort(o->extents, o->count, sizeof(struct iso_block_extent),
+              iso_block_extent_cmp);
+        o->max_end = calloc(o->count, sizeof(uint64_t));
+        if (o->max_end == NULL) {
+            ret = ISO_OUT_OF_MEM;
+            goto ex;
+        }
+        for (i = 0; i < o->count; i++) {
+            end = ((uint64_t) o->extents[i].block) + o->extents[i].nblocks;
+            if (i > 0 && o->max_end[i - 1] > end)
+                end = o->max_end[i - 1];
+            o->max_end[i] = end;
+        }
+    }
+    *index = o;
+    o = NULL;
+    ret = ISO_SUCCESS;
+ex:;
+    iso_tree_block_index_destroy(&o);
+    return ret;
+}
+
+static
+int iso_block_index_lookup(struct iso_block_index *index, uint32_t block,
+                           IsoNode **found, uint32_t *next_above)
+{
+    size_t lo, hi, mid, i, best = 0;
+    int has_best = 0;
+    struct iso_block_extent *e;
+
+    /* hi = number of extents which start at or before block */
+    lo = 0;
+    hi = index->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index->extents[mid].block <= block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    hi = lo;
+
+    /* Only the extents up to the last one with max_end above block can
+       contain block */
+    for (i = hi; i > 0 && index->max_end[i - 1] > block; i--) {
+        e = index->extents + (i - 1);
+        if (block - e->block >= e->nblocks)
+    continue;
+        if (!has_best || e->seq < index->extents[best].seq)
+            best = i - 1;
+        has_best = 1;
+    }
+    if (has_best) {
+        *found = index->extents[best].node;
+        return 1;
+    }
+    if (next_above != NULL)
+        *next_above = hi < index->count ? index->extents[hi].block : 0;
+    return 0;
+}
+
+/* Note: No reference is taken to the found node.
+   @param dir  NULL = search the whole tree of image by the block index
+               which gets built or refreshed if needed.
+   @param flag bit0= recursion
+*/
+int iso_tree_get_node_of_block(IsoImage *image, IsoDir *dir, uint32_t block,
+                               IsoNode **found, uint32_t *next_above, int flag)
+{
+    int ret;
+    struct iso_block_index *index;
+
+    if (dir != NULL || (flag & 1))
+        return iso_tree_walk_node_of_block(image, dir, block, found,
+                                           next_above, flag);
+
+    /* The index has to cover the files of not yet loaded directories */
+    ret = iso_image_load_lazy_dirs(image, 1);
+    if (ret < 0)
+        return ret;
+
+    index = image->block_index;
+    if (index != NULL && (index->root != image->root ||
+                          index->tree_changes != image->root->tree_changes))
+        iso_tree_block_index_destroy(&(image->block_index));
+    if (image->block_index == NULL) {
+        ret = iso_block_index_build(image, &(image->block_index));
+        if (ret < 0)
+            return iso_tree_walk_node_of_block(image, dir, block, found,
+                                               next_above, flag);
+    }
+    return iso_block_index_lookup(image->block_index, block, found,
+                                  next_above);
+}
+
+
 /* ------------------------- tree cloning ------------------------------ */
 
 static
@@ -1627,6 +2215,9 @@ int iso_tree_resolve_symlink(IsoImage *img, IsoSymlink *sym, IsoNode **res,
         }
 
         /* Search node in cur_dir */
+        ret = iso_dir_load_lazy(cur_dir, 0);
+        if (ret < 0)
+            return ret;
         for (n = cur_dir->children; n != NULL; n = n->next)
             if (strncmp(dest_start, n->name, comp_len) == 0 &&
                 strlen(n->name) == comp_len)
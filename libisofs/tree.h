@@ -20,8 +20,32 @@
 int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir);
 
 
+/**
+ * Dispose the compiled form of the excludes of an image.
+ */
+void iso_exclude_matcher_destroy(struct iso_exclude_matcher **matcher);
+
+/**
+ * Find out whether path matches one of the excludes of the image.
+ *
+ * @param flag
+ *      bit0= do not use the compiled matcher but try each exclude by
+ *            fnmatch()
+ * @return
+ *      1 path is excluded, 0 not
+ */
+int iso_tree_check_excludes(IsoImage *image, const char *path, int flag);
+
+
+struct iso_block_index;
+
 int iso_tree_get_node_of_block(IsoImage *image, IsoDir *dir, uint32_t block,
                               IsoNode **found, uint32_t *next_above, int flag);
+
+/**
+ * Dispose the index which iso_tree_get_node_of_block() keeps in the image.
+ */
+void iso_tree_block_index_destroy(struct iso_block_index **index);
  
 
 #endif /*LIBISO_IMAGE_TREE_H_*/
@@ -29,6 +29,7 @@
 #include <iconv.h>
 #include <locale.h>
 #include <langinfo.h>
+#include <pthread.h>
 
 #include <unistd.h>
 
@@ -1633,7 +1634,7 @@ void iso_datetime_7(unsigned char *buf, time_t t, int always_gmt)
 void iso_datetime_17(unsigned char *buf, time_t t, int always_gmt)
 {
     static int tzsetup = 0;
-    static int tzoffset;
+    int tzoffset;
     struct tm tm;
 
     if (t == (time_t) - 1) {
@@ -1704,12 +1705,17 @@ void iso_datetime_17(unsigned char *buf, time_t t, int always_gmt)
 */
 #define Libisofs_use_putenV yes
 
+/* The environment variable TZ is shared by all threads */
+static pthread_mutex_t env_timegm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static
 time_t env_timegm(struct tm *tm)
 {
     time_t ret;
     char *tz;
 
+    pthread_mutex_lock(&env_timegm_mutex);
+
 #ifdef Libisofs_use_putenV
 
     static char unset_name[] = {"TZ"};
@@ -1739,6 +1745,7 @@ time_t env_timegm(struct tm *tm)
 
 #endif /* ! Libisofs_use_putenV */
 
+    pthread_mutex_unlock(&env_timegm_mutex);
     return ret;
 }
 
@@ -2510,3 +2517,449 @@ int iso_nowtime(time_t *now, int flag)
     return 2;
 }
 
+
+
+/* ------------------------------------------------------------------------- */
+
+/* Work distribution of iso_run_parallel() */
+struct iso_parallel_run {
+    size_t count;
+    size_t chunk;
+    int (*func)(void *ctx, size_t idx);
+    void *ctx;
+
+    pthread_mutex_t mutex;
+    size_t next;
+    /* Lowest index which failed, or count */
+    size_t err_idx;
+    int err;
+};
+
+static
+void *iso_parallel_worker(void *arg)
+{
+    struct iso_parallel_run *run = arg;
+    size_t i, start, end;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&run->mutex);
+        start = run->next;
+        if (start >= run->count || start > run->err_idx) {
+            pthread_mutex_unlock(&run->mutex);
+    break;
+        }
+        end = start + run->chunk;
+        if (end > run->count)
+            end = run->count;
+        run->next = end;
+        pthread_mutex_unlock(&run->mutex);
+
+        for (i = start; i < end; i++) {
+            ret = run->func(run->ctx, i);
+            if (ret >= 0)
+        continue;
+            pthread_mutex_lock(&run->mutex);
+            if (i < run->err_idx) {
+                run->err_idx = i;
+                run->err = ret;
+            }
+            pthread_mutex_unlock(&run->mutex);
+        break;
+        }
+    }
+    return NULL;
+}
+
+int iso_run_parallel(int nthreads, size_t count, size_t chunk,
+                     int (*func)(void *ctx, size_t idx), void *ctx)
+{
+    struct iso_parallel_run run;
+    pthread_t *threads = NULL;
+    int ret, i, started = 0;
+    size_t idx;
+
+    if (chunk < 1)
+        chunk = 1;
+    if (nthreads > 1 && (size_t) nthreads > (count + chunk - 1) / chunk)
+        nthreads = (count + chunk - 1) / chunk;
+    if (nthreads <= 1) {
+        for (idx = 0; idx < count; idx++) {
+            ret = func(ctx, idx);
+            if (ret < 0)
+                return ret;
+        }
+        return ISO_SUCCESS;
+    }
+
+    run.count = count;
+    run.chunk = chunk;
+    run.func = func;
+    run.ctx = ctx;
+    run.next = 0;
+    run.err_idx = count;
+    run.err = ISO_SUCCESS;
+    pthread_mutex_init(&run.mutex, NULL);
+
+    /* The calling thread is the first worker */
+    threads = calloc(nthreads - 1, sizeof(pthread_t));
+    if (threads != NULL) {
+        for (i = 0; i < nthreads - 1; i++) {
+            if (pthread_create(&(threads[i]), NULL, iso_parallel_worker,
+                               &run) != 0)
+        break;
+            started++;
+        }
+    }
+    iso_parallel_worker(&run);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (threads != NULL)
+        free(threads);
+    pthread_mutex_destroy(&run.mutex);
+    return run.err;
+}
+
+
+/* ------------------------------------------------------------------------- */
+
+/* Default size of the memory pieces of struct iso_arena */
+#define ISO_ARENA_CHUNK_SIZE (256 * 1024)
+
+/* Alignment of the objects in struct iso_arena */
+#define ISO_ARENA_ALIGN 16
+
+struct iso_arena_chunk {
+    struct iso_arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+
+/* The data start after the chunk header */
+#define ISO_ARENA_HEAD_SIZE \
+        (((sizeof(struct iso_arena_chunk) + ISO_ARENA_ALIGN - 1) / \
+          ISO_ARENA_ALIGN) * ISO_ARENA_ALIGN)
+#define ISO_ARENA_DATA(chunk) (((uint8_t *) (chunk)) + ISO_ARENA_HEAD_SIZE)
+
+struct iso_arena {
+    struct iso_arena_chunk *chunks;
+    size_t chunk_size;
+    pthread_mutex_t mutex;
+};
+
+int iso_arena_new(struct iso_arena **arena, size_t chunk_size, int flag)
+{
+    struct iso_arena *o;
+
+    o = calloc(1, sizeof(struct iso_arena));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    o->chunks = NULL;
+    o->chunk_size = chunk_size > 0 ? chunk_size : ISO_ARENA_CHUNK_SIZE;
+    pthread_mutex_init(&o->mutex, NULL);
+    *arena = o;
+    return ISO_SUCCESS;
+}
+
+static
+struct iso_arena_chunk *iso_arena_chunk_new(size_t size)
+{
+    struct iso_arena_chunk *chunk;
+
+    chunk = calloc(1, ISO_ARENA_HEAD_SIZE + size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void *iso_arena_alloc(struct iso_arena *arena, size_t size)
+{
+    struct iso_arena_chunk *chunk;
+    void *pt = NULL;
+
+    size = ((size + ISO_ARENA_ALIGN - 1) / ISO_ARENA_ALIGN) * ISO_ARENA_ALIGN;
+    if (size == 0)
+        size = ISO_ARENA_ALIGN;
+
+    pthread_mutex_lock(&arena->mutex);
+    chunk = arena->chunks;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        if (size > arena->chunk_size / 4) {
+            /* Large objects get a chunk of their own, which does not
+               replace the current chunk */
+            chunk = iso_arena_chunk_new(size);
+            if (chunk == NULL)
+                goto ex;
+            if (arena->chunks != NULL) {
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+            } else {
+                arena->chunks = chunk;
+            }
+        } else {
+            chunk = iso_arena_chunk_new(arena->chunk_size);
+            if (chunk == NULL)
+                goto ex;
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    pt = ISO_ARENA_DATA(chunk) + chunk->used;
+    chunk->used += size;
+ex:;
+    pthread_mutex_unlock(&arena->mutex);
+    return pt;
+}
+
+void *iso_arena_memdup(struct iso_arena *arena, const void *data,
+                       size_t size)
+{
+    void *pt;
+
+    pt = iso_arena_alloc(arena, size);
+    if (pt != NULL && size > 0)
+        memcpy(pt, data, size);
+    return pt;
+}
+
+char *iso_arena_strdup(struct iso_arena *arena, const char *str)
+{
+    return (char *) iso_arena_memdup(arena, str, strlen(str) + 1);
+}
+
+void iso_arena_destroy(struct iso_arena **arena)
+{
+    struct iso_arena_chunk *chunk, *next;
+
+    if (*arena == NULL)
+        return;
+    for (chunk = (*arena)->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    pthread_mutex_destroy(&((*arena)->mutex));
+    free(*arena);
+    *arena = NULL;
+}
+
+
+/* Initial number of hash slots of struct iso_intern_pool */
+#define ISO_INTERN_POOL_SLOTS 1024
+
+struct iso_intern_entry {
+    struct iso_intern_entry *next;
+    size_t size;
+    size_t refs;
+    unsigned int hash;
+};
+
+/* The data start after the entry header */
+#define ISO_INTERN_HEAD_SIZE \
+        (((sizeof(struct iso_intern_entry) + 7) / 8) * 8)
+#define ISO_INTERN_DATA(entry) (((uint8_t *) (entry)) + ISO_INTERN_HEAD_SIZE)
+
+struct iso_intern_pool {
+    struct iso_intern_entry **slots;
+    size_t cap;
+    size_t count;
+    pthread_mutex_t mutex;
+};
+
+int iso_intern_pool_new(struct iso_intern_pool **pool, int flag)
+{
+    struct iso_intern_pool *o;
+
+    o = calloc(1, sizeof(struct iso_intern_pool));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    o->slots = calloc(ISO_INTERN_POOL_SLOTS, sizeof(struct iso_intern_entry *));
+    if (o->slots == NULL) {
+        free(o);
+        return ISO_OUT_OF_MEM;
+    }
+    o->cap = ISO_INTERN_POOL_SLOTS;
+    o->count = 0;
+    pthread_mutex_init(&o->mutex, NULL);
+    *pool = o;
+    return ISO_SUCCESS;
+}
+
+static
+unsigned int iso_intern_hash(const void *data, size_t size)
+{
+    size_t i;
+    const uint8_t *p = data;
+    unsigned int h = 2166136261u;
+
+    for (i = 0; i < size; i++)
+        h = (h ^ p[i]) * 16777619;
+    return h;
+}
+
+/* Double the number of slots. Failure is not fatal, the chains just get
+   longer.
+*/
+static
+void iso_intern_pool_grow(struct iso_intern_pool *pool)
+{
+    struct iso_intern_entry **slots, *entry, *next;
+    size_t i, cap;
+
+    cap = pool->cap * 2;
+    slots = calloc(cap, sizeof(struct iso_intern_entry *));
+    if (slots == NULL)
+        return;
+    for (i = 0; i < pool->cap; i++) {
+        for (entry = pool->slots[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            entry->next = slots[entry->hash % cap];
+            slots[entry->hash % cap] = entry;
+        }
+    }
+    free(pool->slots);
+    pool->slots = slots;
+    pool->cap = cap;
+}
+
+void *iso_intern_pool_get(struct iso_intern_pool *pool, const void *data,
+                          size_t size)
+{
+    struct iso_intern_entry *entry;
+    unsigned int hash;
+    void *pt = NULL;
+
+    hash = iso_intern_hash(data, size);
+    pthread_mutex_lock(&pool->mutex);
+    for (entry = pool->slots[hash % pool->cap]; entry != NULL;
+         entry = entry->next) {
+        if (entry->hash == hash && entry->size == size &&
+            memcmp(ISO_INTERN_DATA(entry), data, size) == 0) {
+            entry->refs++;
+            pt = ISO_INTERN_DATA(entry);
+            goto ex;
+        }
+    }
+    entry = malloc(ISO_INTERN_HEAD_SIZE + size);
+    if (entry == NULL)
+        goto ex;
+    entry->size = size;
+    entry->refs = 1;
+    entry->hash = hash;
+    memcpy(ISO_INTERN_DATA(entry), data, size);
+    entry->next = pool->slots[hash % pool->cap];
+    pool->slots[hash % pool->cap] = entry;
+    pool->count++;
+    if (pool->count > pool->cap)
+        iso_intern_pool_grow(pool);
+    pt = ISO_INTERN_DATA(entry);
+ex:;
+    pthread_mutex_unlock(&pool->mutex);
+    return pt;
+}
+
+int iso_intern_pool_release(struct iso_intern_pool *pool, void *pt,
+                            size_t size, int flag)
+{
+    struct iso_intern_entry *entry, **prev;
+    unsigned int hash;
+    int ret = 0;
+
+    hash = iso_intern_hash(pt, size);
+    pthread_mutex_lock(&pool->mutex);
+    for (prev = &(pool->slots[hash % pool->cap]); *prev != NULL;
+         prev = &((*prev)->next)) {
+        entry = *prev;
+        if (ISO_INTERN_DATA(entry) != pt)
+    continue;
+        if (flag & 1) {
+            entry->refs++;
+        } else if (--(entry->refs) == 0) {
+            *prev = entry->next;
+            pool->count--;
+            free(entry);
+        }
+        ret = 1;
+    break;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return ret;
+}
+
+size_t iso_intern_pool_count(struct iso_intern_pool *pool)
+{
+    size_t count;
+
+    pthread_mutex_lock(&pool->mutex);
+    count = pool->count;
+    pthread_mutex_unlock(&pool->mutex);
+    return count;
+}
+
+void iso_intern_pool_destroy(struct iso_intern_pool **pool)
+{
+    struct iso_intern_entry *entry, *next;
+    size_t i;
+
+    if (*pool == NULL)
+        return;
+    for (i = 0; i < (*pool)->cap; i++) {
+        for (entry = (*pool)->slots[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+    }
+    free((*pool)->slots);
+    pthread_mutex_destroy(&((*pool)->mutex));
+    free(*pool);
+    *pool = NULL;
+}
+
+
+/* ------------------------- Process wide counters ------------------------- */
+
+static pthread_mutex_t iso_counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ino_t iso_counter_next_ino(ino_t *counter, int flag)
+{
+    ino_t value;
+
+    pthread_mutex_lock(&iso_counter_mutex);
+    value = (*counter)++;
+    pthread_mutex_unlock(&iso_counter_mutex);
+    return (flag & 1) ? value : value + 1;
+}
+
+unsigned int iso_counter_next_uint(unsigned int *counter, int flag)
+{
+    unsigned int value;
+
+    pthread_mutex_lock(&iso_counter_mutex);
+    value = (*counter)++;
+    pthread_mutex_unlock(&iso_counter_mutex);
+    return (flag & 1) ? value : value + 1;
+}
+
+int iso_counter_next_int(int *counter, int flag)
+{
+    int value;
+
+    pthread_mutex_lock(&iso_counter_mutex);
+    value = (*counter)++;
+    pthread_mutex_unlock(&iso_counter_mutex);
+    return (flag & 1) ? value : value + 1;
+}
+
+off_t iso_counter_add_off(off_t *counter, off_t incr)
+{
+    off_t value;
+
+    pthread_mutex_lock(&iso_counter_mutex);
+    *counter += incr;
+    if (*counter < 0)
+        *counter = 0;
+    value = *counter;
+    pthread_mutex_unlock(&iso_counter_mutex);
+    return value;
+}
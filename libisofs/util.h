@@ -653,6 +653,90 @@ int iso_clone_mgtd_mem(char *in, char **out, size_t size);
 */
 off_t iso_scanf_io_size(char *text, int flag);
 
+/** Call func(ctx, idx) for idx = 0 to count - 1 by the calling thread and
+    up to nthreads - 1 additional threads. The indice get handed out in
+    ascending order, in chunks of the given size. If no additional thread
+    can be created, then the calling thread does all the work.
+    @return ISO_SUCCESS or the error of the lowest idx for which func
+            failed. After a failure, func is not called for higher indice
+            which were not handed out yet. So the return value is the same
+            as with a single thread.
+*/
+int iso_run_parallel(int nthreads, size_t count, size_t chunk,
+                     int (*func)(void *ctx, size_t idx), void *ctx);
+
+/* Memory from which many small objects get carved, and which gets disposed
+   as a whole. Used for the transient trees of an image production run.
+   The objects are zeroed and aligned for any basic type. They cannot be
+   freed one by one.
+   The arena may be used by several threads.
+*/
+struct iso_arena;
+
+/* @param chunk_size  Size of the memory pieces which get obtained by
+                      malloc(). 0 = default
+*/
+int iso_arena_new(struct iso_arena **arena, size_t chunk_size, int flag);
+
+void *iso_arena_alloc(struct iso_arena *arena, size_t size);
+
+/* Copy size bytes into the arena */
+void *iso_arena_memdup(struct iso_arena *arena, const void *data,
+                       size_t size);
+
+char *iso_arena_strdup(struct iso_arena *arena, const char *str);
+
+/* Dispose the arena with all objects which were carved from it.
+   *arena gets set to NULL.
+*/
+void iso_arena_destroy(struct iso_arena **arena);
+
+/* Counters which are shared by all images and threads of the process,
+   like the id numbers of streams. Their changes are serialized.
+   @param flag bit0= return the value before incrementing
+   @return the value after incrementing, resp. before with bit0
+*/
+ino_t iso_counter_next_ino(ino_t *counter, int flag);
+unsigned int iso_counter_next_uint(unsigned int *counter, int flag);
+int iso_counter_next_int(int *counter, int flag);
+
+/* Add incr to a shared reference count, which is kept from becoming negative.
+   @return the new value
+*/
+off_t iso_counter_add_off(off_t *counter, off_t incr);
+
+/* Reference counted set of byte strings. Equal content gets stored only
+   once and is shared by all holders.
+   The pool may be used by several threads.
+*/
+struct iso_intern_pool;
+
+int iso_intern_pool_new(struct iso_intern_pool **pool, int flag);
+
+/* Obtain a shared copy of size bytes at data. Its reference count gets
+   incremented.
+   @return  the shared copy, or NULL if out of memory
+*/
+void *iso_intern_pool_get(struct iso_intern_pool *pool, const void *data,
+                          size_t size);
+
+/* Inquire whether pt is a shared copy from the pool and eventually
+   decrement its reference count. The copy gets freed when the count
+   reaches 0.
+   @param flag  bit0= increment the reference count instead
+   @return  1= pt belongs to the pool, 0= pt is not from the pool
+*/
+int iso_intern_pool_release(struct iso_intern_pool *pool, void *pt,
+                            size_t size, int flag);
+
+/* Number of distinct strings in the pool */
+size_t iso_intern_pool_count(struct iso_intern_pool *pool);
+
+/* Dispose the pool. All shared copies get freed, regardless of their
+   reference count. *pool gets set to NULL.
+*/
+void iso_intern_pool_destroy(struct iso_intern_pool **pool);
+
 /* ------------------------------------------------------------------------- */
 
 
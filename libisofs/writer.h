@@ -39,6 +39,74 @@ struct Iso_Image_Writer
  */
 int iso_write(Ecma119Image *target, void *buf, size_t count);
 
+/**
+ * Obtain memory of the output buffer where the next count bytes of image
+ * data may be put directly. Submit them by iso_write_commit() instead of
+ * calling iso_write().
+ *
+ * It is implemented in ecma119.c
+ *
+ * @return
+ *      1 on success, 2 no contiguous memory available: use iso_write(),
+ *      < 0 error
+ */
+int iso_write_reserve(Ecma119Image *target, size_t count, void **data);
+
+/**
+ * Submit count bytes which were put into the memory obtained by
+ * iso_write_reserve().
+ *
+ * @return
+ *      1 on success, < 0 error
+ */
+int iso_write_commit(Ecma119Image *target, size_t count);
+
+/**
+ * Memory into which the records of a directory get rendered ahead of
+ * writing them by iso_write().
+ */
+struct iso_render_out
+{
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+
+    /* Set if more than size bytes were submitted */
+    int overflow;
+};
+
+/**
+ * Like iso_write() if out is NULL. Else append the data to out->buf.
+ *
+ * It is implemented in ecma119.c
+ *
+ * @return
+ *      1 on success, < 0 error
+ */
+int iso_write_render(Ecma119Image *target, struct iso_render_out *out,
+                     void *buf, size_t count);
+
+/**
+ * Write the blocks of count directories which were already placed by
+ * compute_data_blocks(). Directory idx occupies the blocks from blocks[idx]
+ * to blocks[idx + 1] - 1. So blocks has to have count + 1 elements.
+ * render(ctx, idx, out) has to submit all bytes of directory idx by
+ * iso_write_render(). It gets called with out == NULL for writing directly
+ * to the image. If opts->tree_threads is larger than 1, then render() gets
+ * called concurrently with distinct out memory, and the writer thread
+ * only streams the finished blocks. render() must then not alter data
+ * which are shared between directories.
+ *
+ * It is implemented in ecma119.c
+ *
+ * @return
+ *      1 on success, < 0 error
+ */
+int iso_render_dirs(Ecma119Image *target, size_t count, uint32_t *blocks,
+                    int (*render)(void *ctx, size_t idx,
+                                  struct iso_render_out *out),
+                    void *ctx);
+
 int ecma119_writer_create(Ecma119Image *target);
 
 #endif /*LIBISO_IMAGE_WRITER_H_*/